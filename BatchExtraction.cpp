@@ -0,0 +1,544 @@
+/* BatchExtraction.cpp */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <FL/Fl_Shared_Image.H>
+#include <FL/filename.H>
+#include "BatchExtraction.h"
+#include "ExtractionCache.h"
+#include "FeatureFile.h"
+#include "CompressedFeatureFile.h"
+#include "ThreadPool.h"
+#include "features.h"
+
+void convertToFloatImage(CByteImage &byteImage, CFloatImage &floatImage);
+
+const char *batchStageNames[BATCH_STAGES] = { "decode", "gray", "detect", "describe", "write" };
+
+// Extensions of the image files listed in a directory.
+static const char *imageExtensions[] = { ".jpg", ".jpeg", ".png", ".ppm", ".pgm", ".pbm", ".bmp", ".gif", ".tga", ".xpm", NULL };
+
+// Default settings: two threads for each I/O stage, and one per hardware
+// thread for detection and description.
+BatchExtractionOptions::BatchExtractionOptions() {
+    featureType = 1;
+    descriptorType = 1;
+    format = 0;
+    threads[BATCH_STAGE_DECODE] = 2;
+    threads[BATCH_STAGE_GRAY] = 2;
+    threads[BATCH_STAGE_DETECT] = 0;
+    threads[BATCH_STAGE_DESCRIBE] = 0;
+    threads[BATCH_STAGE_WRITE] = 2;
+    queueDepth = 0;
+    cache = NULL;
+}
+
+// Save a feature set in one of the feature file formats.
+bool saveFeatures(const char *name, const FeatureSet &features, int format) {
+    switch (format) {
+    case 0: return features.save(name);
+    case 1: return saveFeatureFile(name, features);
+    case 2: return saveCompressedFeatureFile(name, features, 8);
+    case 3: return saveCompressedFeatureFile(name, features, 4);
+    default: return false;
+    }
+}
+
+// Seconds on a steady clock.
+static double now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The directory part of a file name, ending with a separator, or empty.
+static string directoryOf(const char *name) {
+    return string(name, fl_filename_name(name) - name);
+}
+
+// Whether a file name is absolute.
+static bool isAbsolute(const string &name) {
+    return (!name.empty() && ((name[0] == '/') || (name[0] == '\\'))) ||
+        ((name.size() > 1) && (name[1] == ':'));
+}
+
+// Whether a file name has the extension of an image file.
+static bool isImageName(const char *name) {
+    string ext = fl_filename_ext(name);
+
+    for (unsigned int i=0; i<ext.size(); i++) {
+        ext[i] = tolower(ext[i]);
+    }
+
+    for (int i=0; imageExtensions[i] != NULL; i++) {
+        if (ext == imageExtensions[i]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// List the images of a batch.
+bool listBatchImages(const char *input, vector<string> &images) {
+    images.clear();
+
+    if (fl_filename_isdir(input)) {
+        string dir = input;
+
+        if ((dir[dir.size()-1] != '/') && (dir[dir.size()-1] != '\\')) {
+            dir += '/';
+        }
+
+        dirent **list;
+        int n = fl_filename_list(dir.c_str(), &list);
+
+        if (n < 0) {
+            return false;
+        }
+
+        for (int i=0; i<n; i++) {
+            string name = dir + list[i]->d_name;
+
+            if (isImageName(list[i]->d_name) && !fl_filename_isdir(name.c_str())) {
+                images.push_back(name);
+            }
+        }
+
+        fl_filename_free_list(&list, n);
+        return true;
+    }
+
+    ifstream f(input);
+
+    if (!f.is_open()) {
+        return false;
+    }
+
+    // Names are relative to the list, as in a database file, unless they
+    // are absolute.
+    string dir = directoryOf(input);
+    string line;
+
+    while (getline(f, line)) {
+        istringstream words(line);
+        string name;
+
+        if (!(words >> name) || (name[0] == '#')) {
+            continue;
+        }
+
+        images.push_back(isAbsolute(name) ? name : dir + name);
+    }
+
+    return true;
+}
+
+// Name feature files after their images.  Images with the same name in
+// different directories get their index appended.
+void nameFeatureFiles(const vector<string> &images, const string &dir, int format, vector<string> &featureFiles) {
+    const char *extension = (format == 0) ? ".f" : ".fset";
+    set<string> used;
+
+    featureFiles.resize(images.size());
+
+    for (unsigned int i=0; i<images.size(); i++) {
+        const char *base = fl_filename_name(images[i].c_str());
+        string name(base, fl_filename_ext(base) - base);
+
+        if (!used.insert(name).second) {
+            name += "-" + to_string(i);
+            used.insert(name);
+        }
+
+        featureFiles[i] = dir + name + extension;
+    }
+}
+
+// Fl_Shared_Image keeps a process-wide list of the images it has read,
+// so it is only used under this lock.
+static mutex sharedImageLock;
+
+// Decode an image file into a color image, as LoadImageFile does.  The
+// shared image is released once converted, so a batch doesn't keep
+// every image it has read.
+static bool decodeImage(const string &name, CFloatImage &image) {
+    Fl_Shared_Image *flImage;
+
+    {
+        lock_guard<mutex> guard(sharedImageLock);
+        flImage = Fl_Shared_Image::get(name.c_str());
+    }
+
+    if (flImage == NULL) {
+        CByteImage byteImage;
+
+        try {
+            ReadFile(byteImage, name.c_str());
+        }
+        catch (CError &) {
+            return false;
+        }
+
+        CShape sh = byteImage.Shape();
+
+        if (sh.width * sh.height == 0) {
+            return false;
+        }
+
+        sh.nBands = 3;
+        image = CFloatImage(sh);
+        convertToFloatImage(byteImage, image);
+
+        return true;
+    }
+
+    CShape sh(flImage->w(), flImage->h(), 3);
+    image = CFloatImage(sh);
+
+    bool converted = convertImage(flImage, image);
+
+    {
+        lock_guard<mutex> guard(sharedImageLock);
+        flImage->release();
+    }
+
+    return converted;
+}
+
+// An image on its way through the pipeline.
+struct BatchItem {
+    int index;
+    CFloatImage image;
+    CFloatImage grayImage;
+    FeatureSet features;
+
+    // Extraction cache key, and whether the features came from the cache.
+    string key;
+    bool cached;
+
+    BatchItem(int index) : index(index), cached(false) {}
+};
+
+// A bounded queue between two stages.  push waits while the queue is
+// full and pop while it is empty; once closed, pop drains the queue and
+// then fails.
+class StageQueue {
+private:
+    deque< shared_ptr<BatchItem> > items;
+    size_t capacity;
+    bool closed;
+
+    mutex lock;
+    condition_variable notFull;
+    condition_variable notEmpty;
+
+public:
+    StageQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    void push(const shared_ptr<BatchItem> &item) {
+        unique_lock<mutex> guard(lock);
+
+        while (items.size() >= capacity) {
+            notFull.wait(guard);
+        }
+
+        items.push_back(item);
+        notEmpty.notify_one();
+    }
+
+    bool pop(shared_ptr<BatchItem> &item) {
+        unique_lock<mutex> guard(lock);
+
+        while (items.empty() && !closed) {
+            notEmpty.wait(guard);
+        }
+
+        if (items.empty()) {
+            return false;
+        }
+
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        unique_lock<mutex> guard(lock);
+        closed = true;
+        notEmpty.notify_all();
+    }
+};
+
+// The shared state of a batch extraction.  queues[s] feeds stage s; the
+// decode stage takes its images from the list instead.
+struct BatchPipeline {
+    const vector<string> &images;
+    const vector<string> &featureFiles;
+    const BatchExtractionOptions &options;
+    vector<char> &done;
+
+    shared_ptr<StageQueue> queues[BATCH_STAGES];
+    atomic<int> next;
+    atomic<int> running[BATCH_STAGES];
+    atomic<long long> cached;
+    atomic<long long> failed;
+
+    mutex statsLock;
+    BatchExtractionStats &stats;
+
+    BatchPipeline(const vector<string> &images, const vector<string> &featureFiles, const BatchExtractionOptions &options, vector<char> &done, BatchExtractionStats &stats) :
+        images(images), featureFiles(featureFiles), options(options), done(done), next(0), cached(0), failed(0), stats(stats) {}
+};
+
+// Run one stage on an image.  Returns false if the image failed, which
+// takes it out of the pipeline.
+static bool runBatchStep(BatchPipeline &p, int stage, BatchItem &item) {
+    const BatchExtractionOptions &o = p.options;
+    const string &name = p.images[item.index];
+
+    switch (stage) {
+    case BATCH_STAGE_DECODE:
+        if (!decodeImage(name, item.image)) {
+            printf("couldn't load image %s\n", name.c_str());
+            return false;
+        }
+
+        if (o.cache != NULL) {
+            item.key = o.cache->key(item.image, o.featureType, o.descriptorType);
+            item.cached = o.cache->get(item.key, item.features);
+
+            if (item.cached) {
+                item.image = CFloatImage();
+                p.cached++;
+            }
+        }
+
+        return true;
+
+    case BATCH_STAGE_GRAY:
+        item.grayImage = ConvertToGray(item.image);
+        return true;
+
+    case BATCH_STAGE_DETECT:
+        if (!detectFeatures(item.image, item.grayImage, item.features, o.featureType)) {
+            printf("couldn't detect features in %s\n", name.c_str());
+            return false;
+        }
+
+        return true;
+
+    case BATCH_STAGE_DESCRIBE:
+        if (!describeFeatures(item.image, item.grayImage, item.features, o.descriptorType)) {
+            printf("couldn't describe features of %s\n", name.c_str());
+            return false;
+        }
+
+        // Only the features go on to be written.
+        item.image = CFloatImage();
+        item.grayImage = CFloatImage();
+        return true;
+
+    case BATCH_STAGE_WRITE:
+        if (!saveFeatures(p.featureFiles[item.index].c_str(), item.features, o.format)) {
+            printf("couldn't write features to %s\n", p.featureFiles[item.index].c_str());
+            return false;
+        }
+
+        if ((o.cache != NULL) && !item.cached && !o.cache->put(item.key, item.features)) {
+            printf("couldn't write features to the extraction cache\n");
+        }
+
+        p.done[item.index] = 1;
+        return true;
+    }
+
+    return false;
+}
+
+// Run the loop of one thread of a stage: take an image, work on it and
+// pass it on, until the stage's input is exhausted.  Images found in
+// the extraction cache skip from decoding straight to writing.  The
+// last thread of a stage to finish closes the queue of the next.
+static void runBatchStage(BatchPipeline &p, int stage) {
+    long long images = 0;
+    double busy = 0;
+
+    while (true) {
+        shared_ptr<BatchItem> item;
+
+        if (stage == BATCH_STAGE_DECODE) {
+            int i = p.next++;
+
+            if (i >= (int) p.images.size()) {
+                break;
+            }
+
+            item.reset(new BatchItem(i));
+        }
+        else if (!p.queues[stage]->pop(item)) {
+            break;
+        }
+
+        double start = now();
+        bool success = runBatchStep(p, stage, *item);
+        busy += now() - start;
+        images++;
+
+        if (!success) {
+            p.failed++;
+        }
+        else if (stage + 1 < BATCH_STAGES) {
+            p.queues[item->cached ? (int) BATCH_STAGE_WRITE : stage + 1]->push(item);
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(p.statsLock);
+        p.stats.stages[stage].images += images;
+        p.stats.stages[stage].busySeconds += busy;
+    }
+
+    if ((--p.running[stage] == 0) && (stage + 1 < BATCH_STAGES)) {
+        p.queues[stage + 1]->close();
+    }
+}
+
+// Compute the features of a list of images and write them to their
+// feature files.
+bool extractFeaturesBatch(const vector<string> &images, const vector<string> &featureFiles, const BatchExtractionOptions &options, vector<char> &done, BatchExtractionStats &stats) {
+    done.assign(images.size(), 0);
+    stats = BatchExtractionStats();
+
+    BatchPipeline p(images, featureFiles, options, done, stats);
+    int hardware = max((int) thread::hardware_concurrency(), 1);
+    int total = 0;
+    int most = 1;
+
+    for (int s=0; s<BATCH_STAGES; s++) {
+        int threads = (options.threads[s] > 0) ? options.threads[s] : hardware;
+
+        stats.stages[s].threads = threads;
+        p.running[s] = threads;
+        total += threads;
+        most = max(most, threads);
+    }
+
+    size_t depth = (options.queueDepth > 0) ? options.queueDepth : 2 * most;
+
+    for (int s=1; s<BATCH_STAGES; s++) {
+        p.queues[s].reset(new StageQueue(depth));
+    }
+
+    double start = now();
+
+    // Stage threads block on the queues, so each gets a thread of its
+    // own rather than sharing the process-wide pool.  The pool waits for
+    // all of them before it is destroyed.
+    {
+        ThreadPool pool(total);
+
+        for (int s=0; s<BATCH_STAGES; s++) {
+            for (int t=0; t<stats.stages[s].threads; t++) {
+                pool.run([&p, s]() { runBatchStage(p, s); });
+            }
+        }
+    }
+
+    stats.seconds = now() - start;
+    stats.cached = p.cached;
+    stats.failed = p.failed;
+    stats.written = count(done.begin(), done.end(), 1);
+
+    return stats.failed == 0;
+}
+
+// Split a file name into its directories and name, resolving "." and
+// "..".
+static void splitPath(const string &name, vector<string> &parts) {
+    string part;
+
+    parts.clear();
+
+    for (unsigned int i=0; i<=name.size(); i++) {
+        if ((i < name.size()) && (name[i] != '/') && (name[i] != '\\')) {
+            part += name[i];
+            continue;
+        }
+
+        if (part == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+        }
+        else if (!part.empty() && (part != ".")) {
+            parts.push_back(part);
+        }
+
+        part.clear();
+    }
+}
+
+// Make a file name relative to a directory.
+static string relativePath(const string &name, const string &dir) {
+    char absoluteName[FL_PATH_MAX];
+    char absoluteDir[FL_PATH_MAX];
+
+    fl_filename_absolute(absoluteName, sizeof(absoluteName), name.c_str());
+    fl_filename_absolute(absoluteDir, sizeof(absoluteDir), dir.empty() ? "." : dir.c_str());
+
+    vector<string> nameParts, dirParts;
+    splitPath(absoluteName, nameParts);
+    splitPath(absoluteDir, dirParts);
+
+    unsigned int common = 0;
+
+    while ((common + 1 < nameParts.size()) && (common < dirParts.size()) && (nameParts[common] == dirParts[common])) {
+        common++;
+    }
+
+    string relative;
+
+    for (unsigned int i=common; i<dirParts.size(); i++) {
+        relative += "../";
+    }
+
+    for (unsigned int i=common; i<nameParts.size(); i++) {
+        relative += nameParts[i];
+
+        if (i + 1 < nameParts.size()) {
+            relative += '/';
+        }
+    }
+
+    return relative;
+}
+
+// Write a database file listing the images whose features were written.
+bool saveBatchDatabase(const char *name, const vector<string> &images, const vector<string> &featureFiles, const vector<char> &done) {
+    string dir = directoryOf(name);
+    ofstream f(name);
+
+    if (!f.is_open()) {
+        return false;
+    }
+
+    for (unsigned int i=0; i<images.size(); i++) {
+        if (done[i]) {
+            f << relativePath(images[i], dir) << " " << relativePath(featureFiles[i], dir) << "\n";
+        }
+    }
+
+    f.close();
+    return !f.fail();
+}
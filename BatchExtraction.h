@@ -0,0 +1,98 @@
+#ifndef BATCHEXTRACTION_H
+#define BATCHEXTRACTION_H
+
+#include <string>
+#include <vector>
+#include "FeatureSet.h"
+
+class ExtractionCache;
+
+// Stages of the batch extraction pipeline, in order.
+enum {
+	BATCH_STAGE_DECODE = 0,
+	BATCH_STAGE_GRAY,
+	BATCH_STAGE_DETECT,
+	BATCH_STAGE_DESCRIBE,
+	BATCH_STAGE_WRITE,
+	BATCH_STAGES
+};
+
+// Settings of a batch extraction.
+struct BatchExtractionOptions {
+	int featureType;
+	int descriptorType;
+
+	// Format of the feature files, as for saveFeatures.
+	int format;
+
+	// Threads of each stage.  Zero means one per hardware thread.
+	int threads[BATCH_STAGES];
+
+	// Most images waiting between two stages, which bounds the memory
+	// taken by decoded images.  Zero means twice the most threads of
+	// any stage.
+	int queueDepth;
+
+	// Cache of extracted features, or NULL.  Images found in it skip
+	// straight from decoding to writing.
+	ExtractionCache *cache;
+
+	BatchExtractionOptions();
+};
+
+// What one stage of a batch extraction did.
+struct BatchStageStats {
+	int threads;
+	long long images;
+
+	// Time spent working, summed over the threads of the stage, in
+	// seconds.  Time spent waiting on the queues isn't counted.
+	double busySeconds;
+
+	BatchStageStats() : threads(0), images(0), busySeconds(0) {}
+};
+
+// What a batch extraction did.
+struct BatchExtractionStats {
+	BatchStageStats stages[BATCH_STAGES];
+
+	long long written;
+	long long cached;
+	long long failed;
+
+	// Time the whole batch took, in seconds.
+	double seconds;
+
+	BatchExtractionStats() : written(0), cached(0), failed(0), seconds(0) {}
+};
+
+// Names of the stages, for reports.
+extern const char *batchStageNames[BATCH_STAGES];
+
+// Save a feature set in one of the feature file formats: 0 for text, 1
+// for binary, 2 for compressed with 8-bit descriptors and 3 for
+// compressed with 4-bit descriptors.
+bool saveFeatures(const char *name, const FeatureSet &features, int format);
+
+// List the images of a batch: the image files in a directory, in name
+// order, or the first name on each line of a list file, relative to
+// the directory of the list.  A database file can serve as the list.
+bool listBatchImages(const char *input, vector<string> &images);
+
+// Name feature files for a list of images in a directory, after the
+// image file names, keeping them unique.
+void nameFeatureFiles(const vector<string> &images, const string &dir, int format, vector<string> &featureFiles);
+
+// Compute the features of a list of images and write them to their
+// feature files.  Images go through a pipeline of stages (decode,
+// grayscale conversion, detection, description and writing), each with
+// its own threads and joined by bounded queues, so reading and writing
+// files overlaps with the computation.  done[i] is set for each image
+// whose features were written.  Returns false if any image failed.
+bool extractFeaturesBatch(const vector<string> &images, const vector<string> &featureFiles, const BatchExtractionOptions &options, vector<char> &done, BatchExtractionStats &stats);
+
+// Write a database file listing the images whose features were written,
+// with their names made relative to the directory of the database file.
+bool saveBatchDatabase(const char *name, const vector<string> &images, const vector<string> &featureFiles, const vector<char> &done);
+
+#endif
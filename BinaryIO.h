@@ -0,0 +1,48 @@
+#ifndef BINARYIO_H
+#define BINARYIO_H
+
+#include <stdio.h>
+#include <vector>
+
+using namespace std;
+
+// Write a vector to a binary file, preceded by its length.
+template <class T>
+inline void writeVector(FILE *f, const vector<T> &v) {
+	int n = v.size();
+	fwrite(&n, sizeof(int), 1, f);
+
+	if (n > 0) {
+		fwrite(&v[0], sizeof(T), n, f);
+	}
+}
+
+// Read a vector written by writeVector.  The length is checked against
+// what is left of the file before the vector is resized, so a corrupt
+// length can't make it allocate more than the file holds.
+template <class T>
+inline bool readVector(FILE *f, vector<T> &v) {
+	int n;
+
+	if ((fread(&n, sizeof(int), 1, f) != 1) || (n < 0)) {
+		return false;
+	}
+
+	long here = ftell(f);
+
+	if ((here < 0) || (fseek(f, 0, SEEK_END) != 0)) {
+		return false;
+	}
+
+	long end = ftell(f);
+
+	if ((fseek(f, here, SEEK_SET) != 0) || (end < here) || ((unsigned long long) n * sizeof(T) > (unsigned long long) (end - here))) {
+		return false;
+	}
+
+	v.resize(n);
+
+	return (n == 0) || ((int) fread(&v[0], sizeof(T), n, f) == n);
+}
+
+#endif
@@ -0,0 +1,450 @@
+/* CompressedFeatureFile.cpp */
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "CompressedFeatureFile.h"
+
+static const char compressedMagic[4] = { 'F', 'C', 'M', 'P' };
+static const unsigned int compressedVersion = 1;
+
+// Largest varint encoding of a 32-bit value.
+static const int maxVarintBytes = 5;
+
+// Largest keypoint encoding: four varints, an angle and a scale.
+static const int maxKeypointBytes = 4 * maxVarintBytes + 2 * sizeof(float);
+
+// Smallest keypoint encoding, with one byte per varint.
+static const int minKeypointBytes = 4 + 2 * sizeof(float);
+
+// Bytes in a row of descriptor codes.
+static size_t codeRowBytes(unsigned int dim, unsigned int bits) {
+    return ((size_t) dim * bits + 7) / 8;
+}
+
+// Compute the 32-bit FNV-1a hash of a block of bytes, continuing from
+// a previous hash.
+static unsigned int fnv1a(const void *data, size_t n, unsigned int hash) {
+    const unsigned char *p = (const unsigned char *) data;
+
+    for (size_t i=0; i<n; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Compute the checksum of a file header and its quantization parameters.
+static unsigned int headerChecksum(const CompressedFeatureHeader &h, const vector<float> &offset, const vector<float> &step) {
+    CompressedFeatureHeader c = h;
+    c.checksum = 0;
+
+    unsigned int hash = fnv1a(&c, sizeof(c), 2166136261u);
+
+    if (!offset.empty()) {
+        hash = fnv1a(&offset[0], offset.size() * sizeof(float), hash);
+        hash = fnv1a(&step[0], step.size() * sizeof(float), hash);
+    }
+
+    return hash;
+}
+
+// Map signed values to unsigned ones so that small magnitudes of either
+// sign have short varints.
+static unsigned int zigzag(int v) {
+    return ((unsigned int) v << 1) ^ (unsigned int) (v >> 31);
+}
+
+static int unzigzag(unsigned int v) {
+    return (int) (v >> 1) ^ -(int) (v & 1);
+}
+
+// Append a varint, seven bits per byte, low bits first.
+static void putVarint(vector<unsigned char> &out, unsigned int v) {
+    while (v >= 0x80) {
+        out.push_back((unsigned char) (v | 0x80));
+        v >>= 7;
+    }
+
+    out.push_back((unsigned char) v);
+}
+
+// Read a varint, failing at the end of the buffer.
+static bool getVarint(const unsigned char *&p, const unsigned char *end, unsigned int &v) {
+    v = 0;
+
+    for (int shift=0; (shift < 7 * maxVarintBytes) && (p < end); shift+=7) {
+        unsigned char b = *p++;
+        v |= (unsigned int) (b & 0x7f) << shift;
+
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Append a float.
+static void putFloat(vector<unsigned char> &out, float v) {
+    size_t n = out.size();
+    out.resize(n + sizeof(float));
+    memcpy(&out[n], &v, sizeof(float));
+}
+
+// Dequantize rows of descriptor codes.  With AVX2, eight codes at a time
+// are widened to floats; the scalar loop finishes each row.
+void decodeDescriptors(const unsigned char *codes, int n, int dim, int bits, const float *offset, const float *step, float *rows, int stride) {
+    size_t rowBytes = codeRowBytes(dim, bits);
+
+    for (int i=0; i<n; i++) {
+        const unsigned char *c = codes + i * rowBytes;
+        float *r = rows + (size_t) i * stride;
+        int j = 0;
+
+#ifdef __AVX2__
+        if (bits == 8) {
+            for (; j+8<=dim; j+=8) {
+                __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (c + j))));
+                _mm256_storeu_ps(r + j, _mm256_add_ps(_mm256_loadu_ps(offset + j), _mm256_mul_ps(_mm256_loadu_ps(step + j), v)));
+            }
+        }
+        else {
+            const __m128i low = _mm_set1_epi8(15);
+
+            for (; j+8<=dim; j+=8) {
+                int packed;
+                memcpy(&packed, c + j / 2, sizeof(int));
+
+                __m128i x = _mm_cvtsi32_si128(packed);
+                __m128i nibbles = _mm_unpacklo_epi8(_mm_and_si128(x, low), _mm_and_si128(_mm_srli_epi16(x, 4), low));
+                __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(nibbles));
+                _mm256_storeu_ps(r + j, _mm256_add_ps(_mm256_loadu_ps(offset + j), _mm256_mul_ps(_mm256_loadu_ps(step + j), v)));
+            }
+        }
+#endif
+
+        for (; j<dim; j++) {
+            int code = (bits == 8) ? c[j] : ((c[j >> 1] >> ((j & 1) * 4)) & 15);
+            r[j] = offset[j] + step[j] * code;
+        }
+
+        for (; j<stride; j++) {
+            r[j] = 0.0f;
+        }
+    }
+}
+
+// Get the size of an open file, leaving its position as it was.
+static unsigned long long fileBytes(FILE *file) {
+    long position = ftell(file);
+    fseek(file, 0, SEEK_END);
+    long end = ftell(file);
+    fseek(file, position, SEEK_SET);
+
+    return (end > 0) ? end : 0;
+}
+
+// Create a closed reader.
+CompressedFeatureReader::CompressedFeatureReader() {
+    file = NULL;
+    memset(&header, 0, sizeof(header));
+    blocksRead = 0;
+}
+
+// Close the file.
+CompressedFeatureReader::~CompressedFeatureReader() {
+    close();
+}
+
+// Open a compressed feature file and read its header and quantization
+// parameters.
+bool CompressedFeatureReader::open(const char *name) {
+    close();
+
+    file = fopen(name, "rb");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    CompressedFeatureHeader h;
+
+    if ((fread(&h, sizeof(h), 1, file) != 1) || (memcmp(h.magic, compressedMagic, 4) != 0) ||
+        (h.version != compressedVersion) || ((h.bits != 8) && (h.bits != 4)) || (h.blockSize == 0) ||
+        ((unsigned long long) h.blocks * h.blockSize < h.count)) {
+        close();
+        return false;
+    }
+
+    // The counts are checked against the size of the file before any
+    // memory is set aside for them: the file must hold the quantization
+    // parameters, a header for each block, and for each feature at least
+    // a row of codes and the smallest keypoint encoding.
+    unsigned long long bytes = fileBytes(file);
+    unsigned long long featureBytes = codeRowBytes(h.dim, h.bits) + minKeypointBytes;
+
+    if ((bytes < sizeof(h) + 2ULL * h.dim * sizeof(float) + (unsigned long long) h.blocks * sizeof(CompressedBlockHeader)) ||
+        ((h.count > 0) && (bytes / h.count < featureBytes))) {
+        close();
+        return false;
+    }
+
+    offset.resize(h.dim);
+    step.resize(h.dim);
+
+    if ((h.dim > 0) && ((fread(&offset[0], sizeof(float), h.dim, file) != h.dim) ||
+        (fread(&step[0], sizeof(float), h.dim, file) != h.dim))) {
+        close();
+        return false;
+    }
+
+    if (headerChecksum(h, offset, step) != h.checksum) {
+        close();
+        return false;
+    }
+
+    header = h;
+    blocksRead = 0;
+    return true;
+}
+
+// Close the file.
+void CompressedFeatureReader::close() {
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    blocksRead = 0;
+}
+
+// Decode the next block and append its features.  The block is checked
+// against its checksum before anything is decoded.
+bool CompressedFeatureReader::read_block(FeatureSet &features) {
+    if ((file == NULL) || at_end()) {
+        return false;
+    }
+
+    CompressedBlockHeader b;
+    size_t rowBytes = codeRowBytes(header.dim, header.bits);
+
+    if ((fread(&b, sizeof(b), 1, file) != 1) || (b.count > header.blockSize) ||
+        (b.codeBytes != b.count * rowBytes) || (b.keypointBytes > b.count * (size_t) maxKeypointBytes)) {
+        return false;
+    }
+
+    block.resize((size_t) b.keypointBytes + b.codeBytes);
+
+    if (!block.empty() && ((fread(&block[0], 1, block.size(), file) != block.size()) ||
+        (fnv1a(&block[0], block.size(), 2166136261u) != b.checksum))) {
+        return false;
+    }
+
+    blocksRead++;
+
+    if (b.count == 0) {
+        return true;
+    }
+
+    // Decode the descriptors of the whole block at once.
+    rows.resize((size_t) b.count * header.dim + 1);
+    decodeDescriptors(&block[b.keypointBytes], b.count, header.dim, header.bits, offset.empty() ? NULL : &offset[0],
+        step.empty() ? NULL : &step[0], &rows[0], header.dim);
+
+    const unsigned char *p = &block[0];
+    const unsigned char *end = p + b.keypointBytes;
+    size_t first = features.size();
+    int id = 0, type = 0, x = 0, y = 0;
+
+    features.resize(first + b.count);
+
+    for (unsigned int i=0; i<b.count; i++) {
+        Feature &f = features[first + i];
+        unsigned int v[4];
+        float angle, scale;
+
+        if (!getVarint(p, end, v[0]) || !getVarint(p, end, v[1]) || !getVarint(p, end, v[2]) ||
+            !getVarint(p, end, v[3]) || (end - p < (ptrdiff_t) (2 * sizeof(float)))) {
+            features.resize(first);
+            return false;
+        }
+
+        memcpy(&angle, p, sizeof(float));
+        memcpy(&scale, p + sizeof(float), sizeof(float));
+        p += 2 * sizeof(float);
+
+        id += unzigzag(v[0]);
+        type += unzigzag(v[1]);
+        x += unzigzag(v[2]);
+        y += unzigzag(v[3]);
+
+        f.id = id;
+        f.type = type;
+        f.x = x;
+        f.y = y;
+        f.angleRadians = angle;
+        f.scale = scale;
+
+        const float *r = &rows[(size_t) i * header.dim];
+        f.data.assign(r, r + header.dim);
+    }
+
+    return true;
+}
+
+// Decode every remaining block into a feature set.
+bool CompressedFeatureReader::read_features(FeatureSet &features) {
+    features.clear();
+    features.reserve(size());
+
+    while (!at_end()) {
+        if (!read_block(features)) {
+            return false;
+        }
+    }
+
+    return (int) features.size() == size();
+}
+
+// Check whether a file starts with the compressed feature file magic.
+bool isCompressedFeatureFile(const char *name) {
+    FILE *f = fopen(name, "rb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    char magic[4];
+    bool ok = (fread(magic, 1, 4, f) == 4) && (memcmp(magic, compressedMagic, 4) == 0);
+
+    fclose(f);
+    return ok;
+}
+
+// Save a feature set as a compressed feature file.  Each dimension is
+// quantized uniformly between its smallest and largest value in the set,
+// so the error of an element is at most half a step.
+bool saveCompressedFeatureFile(const char *name, const FeatureSet &features, int bits, int blockSize) {
+    unsigned int count = features.size();
+    unsigned int dim = features.empty() ? 0 : features[0].data.size();
+
+    if (((bits != 8) && (bits != 4)) || (blockSize < 1)) {
+        return false;
+    }
+
+    for (unsigned int i=0; i<count; i++) {
+        if (features[i].data.size() != dim) {
+            return false;
+        }
+    }
+
+    // The range of each dimension.
+    vector<double> lo(dim, 0.0), hi(dim, 0.0);
+
+    for (unsigned int i=0; i<count; i++) {
+        const vector<double> &d = features[i].data;
+
+        for (unsigned int j=0; j<dim; j++) {
+            lo[j] = (i == 0) ? d[j] : min(lo[j], d[j]);
+            hi[j] = (i == 0) ? d[j] : max(hi[j], d[j]);
+        }
+    }
+
+    int levels = (1 << bits) - 1;
+    vector<float> offset(dim), step(dim);
+
+    for (unsigned int j=0; j<dim; j++) {
+        offset[j] = (float) lo[j];
+        step[j] = (float) ((hi[j] - lo[j]) / levels);
+    }
+
+    CompressedFeatureHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, compressedMagic, 4);
+    h.version = compressedVersion;
+    h.count = count;
+    h.dim = dim;
+    h.bits = bits;
+    h.blockSize = blockSize;
+    h.blocks = (count + blockSize - 1) / blockSize;
+    h.checksum = headerChecksum(h, offset, step);
+
+    FILE *f = fopen(name, "wb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    fwrite(&h, sizeof(h), 1, f);
+
+    if (dim > 0) {
+        fwrite(&offset[0], sizeof(float), dim, f);
+        fwrite(&step[0], sizeof(float), dim, f);
+    }
+
+    size_t rowBytes = codeRowBytes(dim, bits);
+    vector<unsigned char> keypoints, codes;
+
+    for (unsigned int start=0; start<count; start+=blockSize) {
+        unsigned int n = min(count - start, (unsigned int) blockSize);
+        int id = 0, type = 0, x = 0, y = 0;
+
+        keypoints.clear();
+        codes.assign(n * rowBytes, 0);
+
+        for (unsigned int i=0; i<n; i++) {
+            const Feature &g = features[start + i];
+
+            putVarint(keypoints, zigzag(g.id - id));
+            putVarint(keypoints, zigzag(g.type - type));
+            putVarint(keypoints, zigzag(g.x - x));
+            putVarint(keypoints, zigzag(g.y - y));
+            putFloat(keypoints, (float) g.angleRadians);
+            putFloat(keypoints, (float) g.scale);
+
+            id = g.id;
+            type = g.type;
+            x = g.x;
+            y = g.y;
+
+            unsigned char *c = &codes[i * rowBytes];
+
+            for (unsigned int j=0; j<dim; j++) {
+                double q = (step[j] > 0) ? floor((g.data[j] - offset[j]) / step[j] + 0.5) : 0.0;
+                int code = (int) max(0.0, min((double) levels, q));
+
+                if (bits == 8) {
+                    c[j] = (unsigned char) code;
+                }
+                else {
+                    c[j >> 1] |= (unsigned char) (code << ((j & 1) * 4));
+                }
+            }
+        }
+
+        CompressedBlockHeader b;
+        b.count = n;
+        b.keypointBytes = keypoints.size();
+        b.codeBytes = codes.size();
+        b.checksum = fnv1a(&keypoints[0], keypoints.size(), 2166136261u);
+
+        if (!codes.empty()) {
+            b.checksum = fnv1a(&codes[0], codes.size(), b.checksum);
+        }
+
+        fwrite(&b, sizeof(b), 1, f);
+        fwrite(&keypoints[0], 1, keypoints.size(), f);
+
+        if (!codes.empty()) {
+            fwrite(&codes[0], 1, codes.size(), f);
+        }
+    }
+
+    bool ok = !ferror(f);
+    return (fclose(f) == 0) && ok;
+}
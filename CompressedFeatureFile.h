@@ -0,0 +1,108 @@
+#ifndef COMPRESSEDFEATUREFILE_H
+#define COMPRESSEDFEATUREFILE_H
+
+#include <stdio.h>
+#include "FeatureSet.h"
+
+// The header of a compressed feature file.  It is followed by the
+// quantization offset and step of each descriptor dimension, as float32
+// arrays, and then by the blocks of features.  All values are in the
+// byte order of the machine that wrote the file.
+struct CompressedFeatureHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int count;
+	unsigned int dim;
+
+	// Bits per descriptor element, 8 or 4.
+	unsigned int bits;
+
+	// Features per block, and number of blocks.
+	unsigned int blockSize;
+	unsigned int blocks;
+
+	// Checksum of the header and the quantization parameters.
+	unsigned int checksum;
+};
+
+// The header of a block of a compressed feature file.  The keypoints of
+// the block come first, each written as varints: the zigzag encoded
+// differences of its id, type, x and y from those of the previous
+// feature of the block, followed by its angle and scale as float32.
+// The descriptor codes follow, one row of (dim * bits + 7) / 8 bytes per
+// feature, with two 4-bit codes per byte, low nibble first.  Blocks
+// start from zero, so each can be decoded on its own.
+struct CompressedBlockHeader
+{
+	unsigned int count;
+	unsigned int keypointBytes;
+	unsigned int codeBytes;
+
+	// Checksum of the keypoints and codes.
+	unsigned int checksum;
+};
+
+// The CompressedFeatureReader class reads a compressed feature file one
+// block at a time, so a file can be decoded as it streams in without
+// holding more than a block in memory.  A block whose checksum doesn't
+// match is reported as an error.
+class CompressedFeatureReader {
+private:
+	FILE *file;
+	CompressedFeatureHeader header;
+	vector<float> offset;
+	vector<float> step;
+	unsigned int blocksRead;
+
+	// The block being decoded, and its decoded descriptors.
+	vector<unsigned char> block;
+	vector<float> rows;
+
+public:
+	// Create a closed reader.
+	CompressedFeatureReader();
+
+	// Close the file.
+	~CompressedFeatureReader();
+
+	// Open a compressed feature file and read its header.
+	bool open(const char *name);
+
+	// Close the file.
+	void close();
+
+	// Number of features, descriptor length and bits per element.
+	int size() const { return header.count; }
+	int dim() const { return header.dim; }
+	int bits() const { return header.bits; }
+
+	// Whether every block has been read.
+	bool at_end() const { return blocksRead >= header.blocks; }
+
+	// Decode the next block and append its features.
+	bool read_block(FeatureSet &features);
+
+	// Decode every remaining block into a feature set.
+	bool read_features(FeatureSet &features);
+
+private:
+	// Readers can't be copied.
+	CompressedFeatureReader(const CompressedFeatureReader &);
+	CompressedFeatureReader &operator=(const CompressedFeatureReader &);
+};
+
+// Check whether a file starts with the compressed feature file magic.
+bool isCompressedFeatureFile(const char *name);
+
+// Save a feature set as a compressed feature file, quantizing the
+// descriptors to 8 or 4 bits per element between the smallest and
+// largest value of each dimension in the set.  The descriptors must all
+// have the same length.
+bool saveCompressedFeatureFile(const char *name, const FeatureSet &features, int bits = 8, int blockSize = 256);
+
+// Dequantize n rows of descriptor codes into float32 rows of stride
+// elements: element j is offset[j] + step[j] * code.
+void decodeDescriptors(const unsigned char *codes, int n, int dim, int bits, const float *offset, const float *step, float *rows, int stride);
+
+#endif
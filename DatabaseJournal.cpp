@@ -0,0 +1,382 @@
+/* DatabaseJournal.cpp */
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <string.h>
+#include "DatabaseJournal.h"
+
+static const char journalMagic[4] = { 'D', 'B', 'J', '1' };
+static const unsigned int journalVersion = 1;
+
+// Words in a record header: type, index, name length, feature count,
+// descriptor length and checksum.
+static const int recordWords = 6;
+
+// Largest record payload accepted when reading, as a guard against
+// reading garbage lengths.
+static const unsigned long long maxPayload = 1ULL << 31;
+
+// Size in bytes of one encoded feature.
+static size_t featureBytes(unsigned int dim) {
+    return 4 * sizeof(int) + 2 * sizeof(float) + dim * sizeof(float);
+}
+
+// Compute the 32-bit FNV-1a hash of a block of bytes, continuing from
+// a previous hash.
+static unsigned int fnv1a(const void *data, size_t n, unsigned int hash) {
+    const unsigned char *p = (const unsigned char *) data;
+
+    for (size_t i=0; i<n; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Compute the checksum of a record from its header and payload.
+static unsigned int checksum(const unsigned int *header, const vector<char> &payload) {
+    unsigned int hash = fnv1a(header, (recordWords - 1) * sizeof(unsigned int), 2166136261u);
+    return payload.empty() ? hash : fnv1a(&payload[0], payload.size(), hash);
+}
+
+// Cut a file down to a size.
+static bool truncateFile(const char *name, long size) {
+#ifdef _WIN32
+    int fd = _open(name, _O_RDWR | _O_BINARY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = (_chsize(fd, size) == 0);
+    _close(fd);
+    return ok;
+#else
+    return truncate(name, size) == 0;
+#endif
+}
+
+// Flush a file and wait until its contents are on the disk.
+static bool syncFile(FILE *file) {
+    if ((fflush(file) != 0) || ferror(file)) {
+        return false;
+    }
+
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Wait until the entries of the directory holding a file are on the
+// disk, so that a file renamed into it stays renamed.  Windows can't
+// sync a directory, so that succeeds without doing anything.
+static bool syncDirectory(const char *name) {
+#ifdef _WIN32
+    return true;
+#else
+    const char *slash = strrchr(name, '/');
+    string dir = (slash == NULL) ? string(".") : string(name, slash - name + 1);
+    int fd = open(dir.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = (fsync(fd) == 0);
+    ::close(fd);
+    return ok;
+#endif
+}
+
+// Returned by readHeader for a file that isn't a journal.
+static const unsigned int badHeader = ~0u;
+
+// Read the header of a journal, returning the generation it applies to,
+// or badHeader.
+static unsigned int readHeader(FILE *file) {
+    char magic[4];
+    unsigned int header[3];
+
+    if ((fread(magic, 1, 4, file) != 4) || (memcmp(magic, journalMagic, 4) != 0) ||
+        (fread(header, sizeof(unsigned int), 3, file) != 3) || (header[0] != journalVersion)) {
+        return badHeader;
+    }
+
+    return header[1];
+}
+
+// Read records from the current position of a journal until the end or
+// the first record that is short or fails its checksum.  Returns the
+// offset just past the last good record.
+static long readRecords(FILE *file, vector<JournalRecord> &records) {
+    long good = ftell(file);
+    vector<char> payload;
+
+    while (true) {
+        unsigned int r[recordWords];
+
+        if (fread(r, sizeof(unsigned int), recordWords, file) != (size_t) recordWords) {
+            break;
+        }
+
+        unsigned long long size = r[2] + (unsigned long long) r[3] * featureBytes(r[4]);
+
+        if (size > maxPayload) {
+            break;
+        }
+
+        payload.resize((size_t) size);
+
+        if ((size > 0) && (fread(&payload[0], 1, (size_t) size, file) != size)) {
+            break;
+        }
+
+        if (checksum(r, payload) != r[recordWords-1]) {
+            break;
+        }
+
+        JournalRecord record;
+        const char *p = payload.empty() ? NULL : &payload[0];
+
+        record.type = (int) r[0];
+        record.index = (int) r[1];
+        record.name.assign(p, r[2]);
+        p += r[2];
+
+        record.features.resize(r[3]);
+
+        for (unsigned int i=0; i<r[3]; i++) {
+            Feature &f = record.features[i];
+            int ints[4];
+            float floats[2];
+
+            memcpy(ints, p, sizeof(ints));
+            memcpy(floats, p + sizeof(ints), sizeof(floats));
+            p += sizeof(ints) + sizeof(floats);
+
+            f.id = ints[0];
+            f.type = ints[1];
+            f.x = ints[2];
+            f.y = ints[3];
+            f.angleRadians = floats[0];
+            f.scale = floats[1];
+            f.data.resize(r[4]);
+
+            for (unsigned int j=0; j<r[4]; j++) {
+                float v;
+                memcpy(&v, p, sizeof(float));
+                p += sizeof(float);
+                f.data[j] = v;
+            }
+        }
+
+        records.push_back(record);
+        good = ftell(file);
+    }
+
+    return good;
+}
+
+// Create a closed journal.
+DatabaseJournal::DatabaseJournal() {
+    file = NULL;
+    base = 0;
+}
+
+// Close the journal.
+DatabaseJournal::~DatabaseJournal() {
+    close();
+}
+
+// Open or create a journal, and read the records that apply to the
+// given generation.  Reading stops at the first record that is short or
+// fails its checksum, and the file is cut off there.
+bool DatabaseJournal::open(const char *name, unsigned int generation, vector<JournalRecord> &records) {
+    close();
+    records.clear();
+
+    fileName = name;
+    file = fopen(name, "r+b");
+
+    if (file == NULL) {
+        return reset(generation);
+    }
+
+    unsigned int header = readHeader(file);
+
+    // The changes of an older generation are already compacted, and
+    // those of a newer one belong to another database.
+    if ((header != badHeader) && (header < generation)) {
+        return reset(generation);
+    }
+    else if (header != generation) {
+        close();
+        return false;
+    }
+
+    base = generation;
+
+    long good = readRecords(file, records);
+
+    // Cut off a torn record so that new records follow the good ones.
+    fseek(file, 0, SEEK_END);
+
+    if (ftell(file) != good) {
+        return cut(good);
+    }
+
+    return true;
+}
+
+// Read the records of a journal that apply to the given generation,
+// without changing the file, so a journal can be read while another
+// process appends to it.  A missing journal, or one of an older
+// generation, has no records; a record still being written is left out.
+bool DatabaseJournal::read(const char *name, unsigned int generation, vector<JournalRecord> &records) {
+    records.clear();
+
+    FILE *file = fopen(name, "rb");
+
+    if (file == NULL) {
+        return true;
+    }
+
+    unsigned int header = readHeader(file);
+    bool ok = (header != badHeader) && (header <= generation);
+
+    if (ok && (header == generation)) {
+        readRecords(file, records);
+    }
+
+    fclose(file);
+    return ok;
+}
+
+// Close the journal.
+void DatabaseJournal::close() {
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+// Append a record and flush it to the disk.  The descriptors of a
+// record must all have the same length.
+bool DatabaseJournal::append(const JournalRecord &record) {
+    if (file == NULL) {
+        return false;
+    }
+
+    const FeatureSet &features = record.features;
+    unsigned int dim = features.empty() ? 0 : features[0].data.size();
+    unsigned int r[recordWords];
+
+    r[0] = record.type;
+    r[1] = record.index;
+    r[2] = record.name.size();
+    r[3] = features.size();
+    r[4] = dim;
+
+    vector<char> payload(r[2] + r[3] * featureBytes(dim));
+    char *p = payload.empty() ? NULL : &payload[0];
+
+    if (r[2] > 0) {
+        memcpy(p, record.name.data(), r[2]);
+        p += r[2];
+    }
+
+    for (unsigned int i=0; i<features.size(); i++) {
+        const Feature &f = features[i];
+        int ints[4] = { f.id, f.type, f.x, f.y };
+        float floats[2] = { (float) f.angleRadians, (float) f.scale };
+
+        if (f.data.size() != dim) {
+            return false;
+        }
+
+        memcpy(p, ints, sizeof(ints));
+        memcpy(p + sizeof(ints), floats, sizeof(floats));
+        p += sizeof(ints) + sizeof(floats);
+
+        for (unsigned int j=0; j<dim; j++) {
+            float v = (float) f.data[j];
+            memcpy(p, &v, sizeof(float));
+            p += sizeof(float);
+        }
+    }
+
+    r[recordWords-1] = checksum(r, payload);
+
+    // A record that isn't wholly written and synced is cut off again, so
+    // that it can't hide the records appended after it.  If that fails
+    // too, the journal is closed and later appends fail.
+    long start = ftell(file);
+
+    if ((start < 0) || (fwrite(r, sizeof(unsigned int), recordWords, file) != (size_t) recordWords) ||
+        (!payload.empty() && (fwrite(&payload[0], 1, payload.size(), file) != payload.size())) ||
+        !syncFile(file)) {
+        if (start >= 0) {
+            cut(start);
+        }
+        else {
+            close();
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+// Empty the journal and start it over for a new generation.  The new
+// journal is written under a temporary name, synced and renamed over the
+// old one, so a crash leaves either the old journal or the new one, and
+// never a file without a header.
+bool DatabaseJournal::reset(unsigned int generation) {
+    close();
+
+    string tempName = fileName + ".tmp";
+    FILE *temp = fopen(tempName.c_str(), "wb");
+
+    if (temp == NULL) {
+        return false;
+    }
+
+    unsigned int header[3] = { journalVersion, generation, 0 };
+
+    bool ok = (fwrite(journalMagic, 1, 4, temp) == 4) && (fwrite(header, sizeof(unsigned int), 3, temp) == 3) &&
+        syncFile(temp);
+
+    if ((fclose(temp) != 0) || !ok || (rename(tempName.c_str(), fileName.c_str()) != 0)) {
+        remove(tempName.c_str());
+        return false;
+    }
+
+    if (!syncDirectory(fileName.c_str()) || ((file = fopen(fileName.c_str(), "r+b")) == NULL)) {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    base = generation;
+    return true;
+}
+
+// Cut the journal down to a size and reopen it at the end.  The journal
+// is left closed if this fails.
+bool DatabaseJournal::cut(long size) {
+    close();
+
+    if (!truncateFile(fileName.c_str(), size) || ((file = fopen(fileName.c_str(), "r+b")) == NULL)) {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    return true;
+}
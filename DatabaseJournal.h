@@ -0,0 +1,78 @@
+#ifndef DATABASEJOURNAL_H
+#define DATABASEJOURNAL_H
+
+#include <stdio.h>
+#include <string>
+#include "FeatureSet.h"
+
+// Kinds of journal records.
+enum {
+	JOURNAL_ADD = 1,
+	JOURNAL_REMOVE = 2,
+	JOURNAL_REPLACE = 3
+};
+
+// A JournalRecord is one change to a database: an image added with its
+// features, an item removed, or the features of an item replaced.  For
+// a replacement the old item is removed and the new features are added
+// as a new item with the same name.
+struct JournalRecord {
+	int type;
+	int index;
+	string name;
+	FeatureSet features;
+};
+
+// The DatabaseJournal class is an append-only file of changes made to a
+// database since it was last compacted.  The header holds the
+// generation of the packed database the changes apply to; a journal
+// left over from an older generation has already been compacted and is
+// discarded, and one from a newer generation is refused.  Every record
+// carries a checksum, so a record torn by a crash is detected and cut
+// off when the journal is reopened.
+class DatabaseJournal {
+private:
+	FILE *file;
+	string fileName;
+	unsigned int base;
+
+public:
+	// Create a closed journal.
+	DatabaseJournal();
+
+	// Close the journal.
+	~DatabaseJournal();
+
+	// Open or create a journal for a database of the given generation,
+	// reading the records that apply to it.
+	bool open(const char *name, unsigned int generation, vector<JournalRecord> &records);
+
+	// Close the journal.
+	void close();
+
+	// Read the records of a journal that apply to a database of the
+	// given generation, without opening it for changes.  A journal that
+	// doesn't exist has no records.
+	static bool read(const char *name, unsigned int generation, vector<JournalRecord> &records);
+
+	// Append a record and flush it to the disk.  If this fails, the
+	// part of the record written is cut off again.
+	bool append(const JournalRecord &record);
+
+	// Empty the journal and start it over for a new generation,
+	// replacing the file at once.
+	bool reset(unsigned int generation);
+
+	// Generation of the database the journal applies to.
+	unsigned int generation() const { return base; }
+
+private:
+	// Cut the journal down to a size and reopen it at the end.
+	bool cut(long size);
+
+	// Journals can't be copied.
+	DatabaseJournal(const DatabaseJournal &);
+	DatabaseJournal &operator=(const DatabaseJournal &);
+};
+
+#endif
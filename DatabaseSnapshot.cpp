@@ -0,0 +1,69 @@
+/* DatabaseSnapshot.cpp */
+
+#include "DatabaseSnapshot.h"
+
+// Create an empty active database.
+ActiveDatabase::ActiveDatabase() : published(0), busy(false) {
+}
+
+// Wait for a background load to finish.
+ActiveDatabase::~ActiveDatabase() {
+    wait();
+}
+
+// Wait for a background load to finish.  This must not race with
+// publish_async, which replaces the loader thread.
+void ActiveDatabase::wait() {
+    if (loader.joinable()) {
+        loader.join();
+    }
+}
+
+// The active snapshot.  The reference is taken atomically, so it is
+// safe against a concurrent publish, and it keeps the snapshot alive
+// for as long as the caller holds it.
+shared_ptr<const DatabaseSnapshot> ActiveDatabase::acquire() const {
+    return atomic_load(&current);
+}
+
+// Make a snapshot the active one.  Readers holding the old snapshot
+// carry on with it; it is freed by whichever of them finishes last.
+unsigned int ActiveDatabase::publish(const shared_ptr<DatabaseSnapshot> &snapshot) {
+    lock_guard<mutex> guard(publishing);
+
+    snapshot->version = ++published;
+    atomic_store(&current, shared_ptr<const DatabaseSnapshot>(snapshot));
+
+    return snapshot->version;
+}
+
+// Build and publish a snapshot on a background thread.  The thread of
+// the previous load, which has finished, is joined first.
+bool ActiveDatabase::publish_async(const function<bool(DatabaseSnapshot &)> &build, const function<void(bool)> &done) {
+    bool idle = false;
+
+    if (!busy.compare_exchange_strong(idle, true)) {
+        return false;
+    }
+
+    if (loader.joinable()) {
+        loader.join();
+    }
+
+    loader = thread([this, build, done]() {
+        shared_ptr<DatabaseSnapshot> snapshot(new DatabaseSnapshot());
+        bool ok = build(*snapshot);
+
+        if (ok) {
+            publish(snapshot);
+        }
+
+        if (done) {
+            done(ok);
+        }
+
+        busy = false;
+    });
+
+    return true;
+}
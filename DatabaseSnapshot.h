@@ -0,0 +1,82 @@
+#ifndef DATABASESNAPSHOT_H
+#define DATABASESNAPSHOT_H
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include "ImageDatabase.h"
+
+class DescriptorMatrix;
+
+// A DatabaseSnapshot is a loaded database together with what queries
+// derive from it.  A snapshot is never changed once it is published, so
+// any number of queries may read it at once without locking.
+struct DatabaseSnapshot {
+	ImageDatabase db;
+
+	// Database index of each item, when the snapshot holds only some of
+	// the items of a database file.
+	vector<int> global;
+
+	// Concatenated descriptors of the database, or NULL.
+	shared_ptr<DescriptorMatrix> matrix;
+
+	// Number of the publication, counting from 1, or 0 if the snapshot
+	// hasn't been published.
+	unsigned int version;
+
+	DatabaseSnapshot() : version(0) {}
+};
+
+// The ActiveDatabase class holds the snapshot that queries currently
+// read, in the manner of read-copy-update.  A query takes a reference
+// to the active snapshot and uses it until it is done; publishing a new
+// snapshot is a single pointer swap, so queries never wait for a new
+// database to load and never see one that is half loaded.  A replaced
+// snapshot is freed when the last query holding it lets go.  A new
+// snapshot can be built on a background thread while the old one keeps
+// answering queries.
+class ActiveDatabase {
+private:
+	shared_ptr<const DatabaseSnapshot> current;
+	unsigned int published;
+
+	// Held by publishers only, never by readers.
+	mutex publishing;
+
+	thread loader;
+	atomic<bool> busy;
+
+public:
+	// Create an empty active database.
+	ActiveDatabase();
+
+	// Wait for a background load to finish.
+	~ActiveDatabase();
+
+	// The active snapshot, or NULL if none has been published.
+	shared_ptr<const DatabaseSnapshot> acquire() const;
+
+	// Make a snapshot the active one, returning its version.
+	unsigned int publish(const shared_ptr<DatabaseSnapshot> &snapshot);
+
+	// Build a snapshot on a background thread and publish it if build
+	// succeeds.  done, if given, is called on that thread with the
+	// outcome.  Returns false if a background load is already running.
+	bool publish_async(const function<bool(DatabaseSnapshot &)> &build, const function<void(bool)> &done = nullptr);
+
+	// Whether a background load is running.
+	bool loading() const { return busy; }
+
+	// Wait for a background load, if any, to finish.
+	void wait();
+
+private:
+	// Active databases can't be copied.
+	ActiveDatabase(const ActiveDatabase &);
+	ActiveDatabase &operator=(const ActiveDatabase &);
+};
+
+#endif
@@ -0,0 +1,144 @@
+/* DescriptorIndex.cpp */
+
+#include <stdio.h>
+#include "DescriptorIndex.h"
+#include "PQIndex.h"
+#include "LSHIndex.h"
+
+// Add every item of a database to the index.
+bool DescriptorIndex::add_database(const ImageDatabase &db) {
+    FeatureSet temp;
+
+    for (unsigned int i=0; i<db.size(); i++) {
+        if (db[i].removed) {
+            continue;
+        }
+        else if (!db[i].features.empty()) {
+            add(i, db[i].features);
+        }
+        else if (db.load_item_features(i, temp)) {
+            add(i, temp);
+        }
+        else {
+            printf("couldn't load features for %s\n", db[i].name.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Mark an item as removed.
+void DescriptorIndex::remove(int item) {
+    if (item < 0) {
+        return;
+    }
+
+    if (item >= (int) removed.size()) {
+        removed.resize(item + 1, 0);
+    }
+
+    if (!removed[item]) {
+        removed[item] = 1;
+        numRemoved++;
+    }
+}
+
+// Drop the features of the removed items, keeping the numbers of the
+// others.
+void DescriptorIndex::purge() {
+    if (numRemoved == 0) {
+        return;
+    }
+
+    vector<int> map(removed.size());
+
+    for (unsigned int i=0; i<map.size(); i++) {
+        map[i] = removed[i] ? -1 : (int) i;
+    }
+
+    remap(map);
+}
+
+// Draw a uniform sample of descriptors from a database by reservoir
+// sampling.  Features whose length differs from the first one are
+// skipped.
+bool sampleDescriptors(const ImageDatabase &db, int maxSamples, vector<float> &samples, int &dim) {
+    FeatureSet temp;
+    unsigned int seed = 54321;
+    int seen = 0;
+
+    samples.clear();
+    dim = 0;
+
+    for (unsigned int i=0; i<db.size(); i++) {
+        const FeatureSet *features = &db[i].features;
+
+        if (db[i].removed) {
+            continue;
+        }
+
+        if (features->empty()) {
+            if (!db.load_item_features(i, temp)) {
+                printf("couldn't load features for %s\n", db[i].name.c_str());
+                return false;
+            }
+
+            features = &temp;
+        }
+
+        for (unsigned int j=0; j<features->size(); j++) {
+            const vector<double> &x = (*features)[j].data;
+
+            if (dim == 0) {
+                dim = x.size();
+            }
+
+            if ((dim == 0) || ((int) x.size() != dim)) {
+                continue;
+            }
+
+            int slot = seen;
+
+            if (seen >= maxSamples) {
+                seed = seed * 1664525u + 1013904223u;
+                slot = (seed >> 8) % (seen + 1);
+            }
+
+            if (slot < maxSamples) {
+                if (slot == (int) samples.size() / dim) {
+                    samples.resize(samples.size() + dim);
+                }
+
+                for (int k=0; k<dim; k++) {
+                    samples[slot*dim + k] = (float) x[k];
+                }
+            }
+
+            seen++;
+        }
+    }
+
+    return !samples.empty();
+}
+
+// Load an index file of any supported type.
+DescriptorIndex *loadDescriptorIndex(const char *name) {
+    PQIndex *pq = new PQIndex();
+
+    if (pq->load(name)) {
+        return pq;
+    }
+
+    delete pq;
+
+    LSHIndex *lsh = new LSHIndex();
+
+    if (lsh->load(name)) {
+        return lsh;
+    }
+
+    delete lsh;
+
+    return NULL;
+}
@@ -0,0 +1,71 @@
+#ifndef DESCRIPTORINDEX_H
+#define DESCRIPTORINDEX_H
+
+#include "ImageDatabase.h"
+
+// An IndexCandidate is a database feature returned by an index lookup.
+// It stores the database item the feature belongs to, the feature ID,
+// and the (approximate) distance to the query descriptor.
+struct IndexCandidate {
+	int item;
+	int id;
+	double distance;
+};
+
+// The DescriptorIndex class is the interface shared by the approximate
+// nearest neighbour indices that generate candidates for performQuery.
+class DescriptorIndex {
+protected:
+	// Items marked as removed, and how many there are.
+	vector<char> removed;
+	int numRemoved;
+
+public:
+	DescriptorIndex() { numRemoved = 0; }
+	virtual ~DescriptorIndex() {}
+
+	// Add the features of a database item to the index.
+	virtual void add(int item, const FeatureSet &features) = 0;
+
+	// Find (up to) the k nearest database features to a descriptor,
+	// sorted by increasing distance.
+	virtual void search(const vector<double> &descriptor, int k, vector<IndexCandidate> &candidates) const = 0;
+
+	// Save the index to a file.  Removals are not saved, so purge the
+	// index first.
+	virtual bool save(const char *name) const = 0;
+
+	// Renumber the items: the features of item i now belong to item
+	// map[i], and those of items mapped to -1, or marked as removed,
+	// are dropped.  Items past the end of the map keep their numbers.
+	virtual void remap(const vector<int> &map) = 0;
+
+	// Remove the features of a database item.  They are only marked as
+	// removed, and skipped by searches, until the next remap or purge.
+	void remove(int item);
+
+	// Whether an item is marked as removed.
+	bool is_removed(int item) const { return (item < (int) removed.size()) && removed[item]; }
+
+	// Drop the features of the removed items for good.
+	void purge();
+
+protected:
+	// New number of an item under a remap, or -1 if it is dropped.
+	int remapped(const vector<int> &map, int item) const {
+		return is_removed(item) ? -1 : ((item < (int) map.size()) ? map[item] : item);
+	}
+
+	// Add every item of a database, loading the features of items that
+	// are not resident one at a time.
+	bool add_database(const ImageDatabase &db);
+};
+
+// Draw a uniform random sample of at most maxSamples descriptors from a
+// database.  The descriptor length is returned in dim.
+bool sampleDescriptors(const ImageDatabase &db, int maxSamples, vector<float> &samples, int &dim);
+
+// Load an index file of any supported type.  Returns NULL on failure.
+DescriptorIndex *loadDescriptorIndex(const char *name);
+
+#endif
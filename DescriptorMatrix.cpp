@@ -0,0 +1,276 @@
+/* DescriptorMatrix.cpp */
+
+#include <stdio.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+#include "DescriptorMatrix.h"
+#include "PackedDatabase.h"
+
+// Create an empty matrix.
+DescriptorMatrix::DescriptorMatrix() {
+    rows = 0;
+    dim = 0;
+    stride = 0;
+    external = NULL;
+}
+
+// Copy the descriptors of a feature set.
+bool DescriptorMatrix::build(const FeatureSet &features) {
+    int d = features.empty() ? 0 : features[0].data.size();
+
+    for (unsigned int i=0; i<features.size(); i++) {
+        if ((int) features[i].data.size() != d) {
+            allocate(0, 0);
+            return false;
+        }
+    }
+
+    allocate(features.size(), d);
+    offsets.clear();
+
+    for (int i=0; i<rows; i++) {
+        set_row(i, features[i]);
+    }
+
+    return true;
+}
+
+// Concatenate the descriptors of several feature sets.
+bool DescriptorMatrix::build(const vector<FeatureSet> &sets) {
+    int n = 0;
+    int d = -1;
+
+    for (unsigned int i=0; i<sets.size(); i++) {
+        for (unsigned int j=0; j<sets[i].size(); j++) {
+            if (d < 0) {
+                d = sets[i][j].data.size();
+            }
+
+            if ((int) sets[i][j].data.size() != d) {
+                allocate(0, 0);
+                return false;
+            }
+        }
+
+        n += sets[i].size();
+    }
+
+    allocate(n, (d < 0) ? 0 : d);
+    offsets.resize(sets.size() + 1);
+    offsets[0] = 0;
+
+    for (unsigned int i=0; i<sets.size(); i++) {
+        offsets[i+1] = offsets[i] + sets[i].size();
+
+        for (unsigned int j=0; j<sets[i].size(); j++) {
+            set_row(offsets[i] + j, sets[i][j]);
+        }
+    }
+
+    return true;
+}
+
+// Concatenate the descriptors of every database item.  A packed
+// database is viewed in place instead.
+bool DescriptorMatrix::build(const ImageDatabase &db) {
+    vector<int> counts(db.size());
+    FeatureSet temp;
+    int n = 0;
+    int d = -1;
+
+    if (db.is_packed_view()) {
+        return db.packed->get_matrix(*this);
+    }
+
+    // Count the rows and check the descriptor lengths.  Items that are
+    // not resident have to be read twice, but are never all in memory.
+    for (unsigned int i=0; i<db.size(); i++) {
+        const FeatureSet *features = &db[i].features;
+
+        if (features->empty() && db.has_feature_source(i)) {
+            if (!db.load_item_features(i, temp)) {
+                printf("couldn't load features for %s\n", db[i].name.c_str());
+                return false;
+            }
+
+            features = &temp;
+        }
+
+        for (unsigned int j=0; j<features->size(); j++) {
+            if (d < 0) {
+                d = (*features)[j].data.size();
+            }
+
+            if ((int) (*features)[j].data.size() != d) {
+                allocate(0, 0);
+                return false;
+            }
+        }
+
+        counts[i] = features->size();
+        n += counts[i];
+    }
+
+    allocate(n, (d < 0) ? 0 : d);
+    offsets.resize(db.size() + 1);
+    offsets[0] = 0;
+
+    for (unsigned int i=0; i<db.size(); i++) {
+        const FeatureSet *features = &db[i].features;
+
+        if (db[i].removed) {
+            removed.resize(db.size(), 0);
+            removed[i] = 1;
+        }
+
+        if (features->empty() && (counts[i] > 0)) {
+            if (!db.load_item_features(i, temp) || ((int) temp.size() != counts[i])) {
+                allocate(0, 0);
+                return false;
+            }
+
+            features = &temp;
+        }
+
+        offsets[i+1] = offsets[i] + counts[i];
+
+        for (int j=0; j<counts[i]; j++) {
+            set_row(offsets[i] + j, (*features)[j]);
+        }
+    }
+
+    return true;
+}
+
+// View rows stored elsewhere without copying them.
+bool DescriptorMatrix::view(const float *data, int rows, int dim, int stride, const int *ids) {
+    if ((rows < 0) || (dim < 0) || (stride < dim) || ((stride & 7) != 0) || ((rows > 0) && (data == NULL))) {
+        return false;
+    }
+
+    this->rows = rows;
+    this->dim = dim;
+    this->stride = stride;
+
+    storage.assign(8, 0.0f);
+    external = (rows > 0) ? data : NULL;
+    offsets.clear();
+    removed.clear();
+
+    if (ids != NULL) {
+        this->ids.assign(ids, ids + rows);
+    }
+    else {
+        this->ids.assign(rows, 0);
+    }
+
+    return true;
+}
+
+// Set the shape and allocate zeroed storage.
+void DescriptorMatrix::allocate(int rows, int dim) {
+    this->rows = rows;
+    this->dim = dim;
+    this->stride = (dim + 7) & ~7;
+
+    storage.assign((size_t) rows * stride + 8, 0.0f);
+    external = NULL;
+    ids.assign(rows, 0);
+    removed.clear();
+}
+
+// Copy a feature's descriptor into a row.
+void DescriptorMatrix::set_row(int i, const Feature &f) {
+    float *r = &storage[(size_t) i * stride];
+
+    for (int j=0; j<dim; j++) {
+        r[j] = (float) f.data[j];
+    }
+
+    ids[i] = f.id;
+}
+
+#ifdef __AVX__
+// Add up the eight lanes of a register.
+static float horizontalSum(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+// Compute a block of squared distances.  Each row of b is loaded once
+// and compared against four rows of a at a time, so the block of a
+// stays in cache while b streams through.
+void squaredDistanceBlock(const DescriptorMatrix &a, int a0, int a1, const DescriptorMatrix &b, int b0, int b1, float *out, int ld) {
+    int stride = a.stride;
+
+    for (int j=b0; j<b1; j++) {
+        const float *y = b.row(j);
+        float *o = out + (j - b0);
+        int i = a0;
+
+        for (; i+4<=a1; i+=4) {
+            const float *x0 = a.row(i);
+            const float *x1 = x0 + stride;
+            const float *x2 = x1 + stride;
+            const float *x3 = x2 + stride;
+
+#ifdef __AVX__
+            __m256 s0 = _mm256_setzero_ps();
+            __m256 s1 = _mm256_setzero_ps();
+            __m256 s2 = _mm256_setzero_ps();
+            __m256 s3 = _mm256_setzero_ps();
+
+            for (int k=0; k<stride; k+=8) {
+                __m256 v = _mm256_loadu_ps(y + k);
+                __m256 t0 = _mm256_sub_ps(_mm256_loadu_ps(x0 + k), v);
+                __m256 t1 = _mm256_sub_ps(_mm256_loadu_ps(x1 + k), v);
+                __m256 t2 = _mm256_sub_ps(_mm256_loadu_ps(x2 + k), v);
+                __m256 t3 = _mm256_sub_ps(_mm256_loadu_ps(x3 + k), v);
+                s0 = _mm256_add_ps(s0, _mm256_mul_ps(t0, t0));
+                s1 = _mm256_add_ps(s1, _mm256_mul_ps(t1, t1));
+                s2 = _mm256_add_ps(s2, _mm256_mul_ps(t2, t2));
+                s3 = _mm256_add_ps(s3, _mm256_mul_ps(t3, t3));
+            }
+
+            o[(i-a0)*ld] = horizontalSum(s0);
+            o[(i-a0+1)*ld] = horizontalSum(s1);
+            o[(i-a0+2)*ld] = horizontalSum(s2);
+            o[(i-a0+3)*ld] = horizontalSum(s3);
+#else
+            float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+            for (int k=0; k<stride; k++) {
+                float t0 = x0[k] - y[k];
+                float t1 = x1[k] - y[k];
+                float t2 = x2[k] - y[k];
+                float t3 = x3[k] - y[k];
+                s0 += t0 * t0;
+                s1 += t1 * t1;
+                s2 += t2 * t2;
+                s3 += t3 * t3;
+            }
+
+            o[(i-a0)*ld] = s0;
+            o[(i-a0+1)*ld] = s1;
+            o[(i-a0+2)*ld] = s2;
+            o[(i-a0+3)*ld] = s3;
+#endif
+        }
+
+        for (; i<a1; i++) {
+            const float *x = a.row(i);
+            float s = 0;
+
+            for (int k=0; k<stride; k++) {
+                float t = x[k] - y[k];
+                s += t * t;
+            }
+
+            o[(i-a0)*ld] = s;
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef DESCRIPTORMATRIX_H
+#define DESCRIPTORMATRIX_H
+
+#include "ImageDatabase.h"
+
+// The DescriptorMatrix class stores the descriptors of one feature set,
+// or of a whole database, as the rows of one contiguous float matrix.
+// Rows are padded with zeros to a multiple of 8 floats so that distance
+// kernels can process them in full SIMD registers.  For a database,
+// the rows of item i are [offsets[i], offsets[i+1]).  A matrix can also
+// be a view of rows stored elsewhere, such as in a mapped file.
+class DescriptorMatrix {
+public:
+	int rows;
+	int dim;
+	int stride;
+
+	// Feature ID of each row.
+	vector<int> ids;
+
+	// Row range of each database item (items()+1 entries).
+	vector<int> offsets;
+
+	// Whether each database item has been removed, or empty if none
+	// has.  A removed item keeps its empty row range, so the item
+	// numbers still match the database, but is never ranked.
+	vector<char> removed;
+
+private:
+	vector<float> storage;
+
+	// Rows of a view, or NULL if the rows are in storage.
+	const float *external;
+
+public:
+	// Create an empty matrix.
+	DescriptorMatrix();
+
+	// Copy the descriptors of a feature set.  Fails if the descriptors
+	// don't all have the same length.
+	bool build(const FeatureSet &features);
+
+	// Concatenate the descriptors of several feature sets, with the
+	// rows of set i at [offsets[i], offsets[i+1]).
+	bool build(const vector<FeatureSet> &sets);
+
+	// Concatenate the descriptors of every database item.  Items
+	// without resident features are loaded from their feature files.
+	bool build(const ImageDatabase &db);
+
+	// View rows stored elsewhere without copying them.  The stride
+	// must be a multiple of 8, with zero padding after each row, and
+	// the rows must outlive the matrix.
+	bool view(const float *data, int rows, int dim, int stride, const int *ids);
+
+	// Number of database items.
+	int items() const { return offsets.empty() ? 0 : (int) offsets.size() - 1; }
+
+	// Whether a database item has been removed.
+	bool is_removed(int item) const { return !removed.empty() && removed[item]; }
+
+	// Pointer to a row.
+	const float *row(int i) const { return ((external != NULL) ? external : &storage[0]) + (size_t) i * stride; }
+
+	// Set the shape and allocate zeroed storage, so that the rows can
+	// be filled in place through mutable_row.
+	void allocate(int rows, int dim);
+
+	// Pointer to a row that can be written.  Views can't be written.
+	float *mutable_row(int i) { return &storage[(size_t) i * stride]; }
+
+private:
+	// Copy a feature's descriptor into a row.
+	void set_row(int i, const Feature &f);
+};
+
+// Compute the squared distances between rows [a0, a1) of a and rows
+// [b0, b1) of b.  The distance between rows i and j is written to
+// out[(i-a0)*ld + (j-b0)].  Both matrices must have the same stride.
+void squaredDistanceBlock(const DescriptorMatrix &a, int a0, int a1, const DescriptorMatrix &b, int b0, int b1, float *out, int ld);
+
+#endif
@@ -0,0 +1,272 @@
+/* ExtractionCache.cpp */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+#include <FL/filename.H>
+#include "ExtractionCache.h"
+#include "FeatureFile.h"
+#include "features.h"
+
+// Extension of cached feature files.
+static const char cacheExtension[] = ".fset";
+
+// Rotate a 64-bit value left.
+static unsigned long long rotl(unsigned long long v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+// Mix a 64-bit word into a hash lane.
+static unsigned long long mix(unsigned long long lane, unsigned long long word) {
+    lane = (lane ^ word) * 0x9E3779B97F4A7C15ULL;
+    return lane ^ (lane >> 29);
+}
+
+// Hash the pixels of an image.  Each row is read as 64-bit words spread
+// over four independent lanes, so the hash runs at memory speed, and
+// the lanes are folded together at the end.  The shape is hashed too,
+// so images whose pixels happen to line up don't collide.
+unsigned long long hashImage(CFloatImage &image) {
+    CShape sh = image.Shape();
+    unsigned long long lanes[4] = { (unsigned long long) sh.width, (unsigned long long) sh.height,
+        (unsigned long long) sh.nBands, 0x243F6A8885A308D3ULL };
+    size_t n = (size_t) sh.width * sh.nBands * sizeof(float);
+
+    for (int y=0; (y<sh.height) && (n>0); y++) {
+        const unsigned char *row = (const unsigned char *) &image.Pixel(0, y, 0);
+        size_t i = 0;
+
+        for (; i+32<=n; i+=32) {
+            unsigned long long w[4];
+            memcpy(w, row + i, sizeof(w));
+
+            lanes[0] = mix(lanes[0], w[0]);
+            lanes[1] = mix(lanes[1], w[1]);
+            lanes[2] = mix(lanes[2], w[2]);
+            lanes[3] = mix(lanes[3], w[3]);
+        }
+
+        for (; i<n; i+=4) {
+            unsigned int w;
+            memcpy(&w, row + i, sizeof(w));
+            lanes[0] = mix(lanes[0], w);
+        }
+    }
+
+    unsigned long long h = lanes[0];
+
+    for (int l=1; l<4; l++) {
+        h = mix(h, rotl(lanes[l], 17 * l));
+    }
+
+    // Finish as MurmurHash3 does, so every input bit affects every
+    // output bit.
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// Size and modification time of a file.  Returns false if it doesn't
+// exist.
+static bool fileInfo(const string &name, unsigned long long &size, double &time) {
+    struct stat s;
+
+    if (stat(name.c_str(), &s) != 0) {
+        return false;
+    }
+
+    size = s.st_size;
+    time = (double) s.st_mtime;
+
+#ifdef __linux__
+    // Files written within the same second are still told apart.
+    time += s.st_mtim.tv_nsec * 1e-9;
+#endif
+
+    return true;
+}
+
+// Use a directory as a cache.
+ExtractionCache::ExtractionCache(const string &dir, unsigned long long budget) : hits(0), misses(0) {
+    this->dir = dir;
+    this->budget = budget;
+    bytes = 0;
+
+    if (!this->dir.empty() && (this->dir[this->dir.size()-1] != '/') && (this->dir[this->dir.size()-1] != '\\')) {
+        this->dir += '/';
+    }
+
+    if (budget > 0) {
+        trim();
+    }
+}
+
+// Key of the features of an image extracted with the given settings:
+// the pixel hash, the detector and descriptor types, and the version of
+// the extraction code.
+string ExtractionCache::key(CFloatImage &image, int featureType, int descriptorType) const {
+    char k[64];
+    sprintf(k, "%016llx-f%d-d%d-v%u", hashImage(image), featureType, descriptorType, featureExtractionVersion);
+    return k;
+}
+
+// Load the features stored under a key.  A hit touches the file, so that
+// it is the last to be removed.
+bool ExtractionCache::get(const string &key, FeatureSet &features) {
+    string name = file_name(key);
+    FeatureFile file;
+
+    if (!file.open(name.c_str())) {
+        misses++;
+        return false;
+    }
+
+    file.get_features(features);
+    file.close();
+
+    utime(name.c_str(), NULL);
+    hits++;
+    return true;
+}
+
+// Store features under a key.  The descriptors are kept in double
+// precision, so a hit gives the same descriptors as extracting again.
+bool ExtractionCache::put(const string &key, const FeatureSet &features) {
+    static atomic<int> counter(0);
+
+    string name = file_name(key);
+    char suffix[64];
+
+#ifdef _WIN32
+    sprintf(suffix, ".%d-%d.tmp", (int) _getpid(), (int) counter++);
+#else
+    sprintf(suffix, ".%d-%d.tmp", (int) getpid(), (int) counter++);
+#endif
+
+    string tempName = name + suffix;
+
+    if (!saveFeatureFile(tempName.c_str(), features, FEATURE_DTYPE_FLOAT64)) {
+        remove(tempName.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    // Windows won't rename over an existing file.
+    remove(name.c_str());
+#endif
+
+    if (rename(tempName.c_str(), name.c_str()) != 0) {
+        remove(tempName.c_str());
+        return false;
+    }
+
+    unsigned long long size;
+    double time;
+
+    if ((budget > 0) && fileInfo(name, size, time)) {
+        bool over;
+
+        {
+            lock_guard<mutex> guard(lock);
+            bytes += size;
+            over = (bytes > budget);
+        }
+
+        if (over) {
+            trim();
+        }
+    }
+
+    return true;
+}
+
+// Remove the least recently used files until the cache fits in its
+// budget.  The directory is listed afresh, since other processes may
+// share it.
+void ExtractionCache::trim() {
+    lock_guard<mutex> guard(lock);
+
+    dirent **list;
+    int n = fl_filename_list(dir.empty() ? "." : dir.c_str(), &list);
+
+    if (n < 0) {
+        return;
+    }
+
+    vector< pair<double, string> > files;
+    size_t extension = strlen(cacheExtension);
+
+    bytes = 0;
+
+    for (int i=0; i<n; i++) {
+        string entry = list[i]->d_name;
+        unsigned long long size;
+        double time;
+
+        if ((entry.size() > extension) && (entry.compare(entry.size() - extension, extension, cacheExtension) == 0) &&
+            fileInfo(dir + entry, size, time)) {
+            files.push_back(make_pair(time, entry));
+            bytes += size;
+        }
+    }
+
+    fl_filename_free_list(&list, n);
+
+    if ((budget == 0) || (bytes <= budget)) {
+        return;
+    }
+
+    sort(files.begin(), files.end());
+
+    for (unsigned int i=0; (i<files.size()) && (bytes > budget); i++) {
+        string name = dir + files[i].second;
+        unsigned long long size;
+        double time;
+
+        if (fileInfo(name, size, time) && (remove(name.c_str()) == 0)) {
+            bytes -= min(size, bytes);
+        }
+    }
+}
+
+// File name of a key.
+string ExtractionCache::file_name(const string &key) const {
+    return dir + key + cacheExtension;
+}
+
+// Compute the features of an image through an extraction cache.  Only
+// successful extractions are stored.
+bool computeFeaturesCached(CFloatImage &image, FeatureSet &features, int featureType, int descriptorType, ExtractionCache *cache) {
+    if (cache == NULL) {
+        return computeFeatures(image, features, featureType, descriptorType);
+    }
+
+    string key = cache->key(image, featureType, descriptorType);
+
+    if (cache->get(key, features)) {
+        return true;
+    }
+
+    if (!computeFeatures(image, features, featureType, descriptorType)) {
+        return false;
+    }
+
+    if (!cache->put(key, features)) {
+        printf("couldn't write features to the extraction cache\n");
+    }
+
+    return true;
+}
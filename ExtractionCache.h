@@ -0,0 +1,75 @@
+#ifndef EXTRACTIONCACHE_H
+#define EXTRACTIONCACHE_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include "ImageLib/ImageLib.h"
+#include "FeatureSet.h"
+
+// Version of the feature detectors and descriptors.  Change it whenever
+// they, or their parameters, change, so that features extracted by the
+// old code are no longer found in an extraction cache.
+const unsigned int featureExtractionVersion = 1;
+
+// The ExtractionCache class keeps computed features in a directory of
+// binary feature files, named by a hash of the image pixels and the
+// extraction settings.  The same image extracted with the same settings
+// always finds the same file, whatever its file name was.  Files are
+// written under a temporary name and renamed, so readers and other
+// processes never see a partial file.  If the cache has a size budget,
+// the least recently used files are removed to stay within it; a hit
+// marks its file as used by updating its modification time.
+class ExtractionCache {
+private:
+	string dir;
+	unsigned long long budget;
+
+	// Estimated size of the files in the cache.
+	unsigned long long bytes;
+
+	atomic<long long> hits;
+	atomic<long long> misses;
+
+	mutex lock;
+
+public:
+	// Use a directory, which must exist, as a cache holding at most
+	// budget bytes, or any amount if the budget is zero.
+	ExtractionCache(const string &dir, unsigned long long budget = 0);
+
+	// Key of the features of an image extracted with the given settings.
+	string key(CFloatImage &image, int featureType, int descriptorType) const;
+
+	// Load the features stored under a key.  Returns false on a miss.
+	bool get(const string &key, FeatureSet &features);
+
+	// Store features under a key.
+	bool put(const string &key, const FeatureSet &features);
+
+	// Remove the least recently used files until the cache fits in its
+	// budget.
+	void trim();
+
+	// Number of hits and misses so far.
+	long long hit_count() const { return hits; }
+	long long miss_count() const { return misses; }
+
+private:
+	// File name of a key.
+	string file_name(const string &key) const;
+
+	// Caches can't be copied.
+	ExtractionCache(const ExtractionCache &);
+	ExtractionCache &operator=(const ExtractionCache &);
+};
+
+// Hash the pixels of an image.
+unsigned long long hashImage(CFloatImage &image);
+
+// Compute the features of an image through an extraction cache.  On a
+// hit the detectors aren't run at all.  A NULL cache computes them as
+// computeFeatures does.
+bool computeFeaturesCached(CFloatImage &image, FeatureSet &features, int featureType, int descriptorType, ExtractionCache *cache);
+
+#endif
@@ -0,0 +1,241 @@
+/* FeatureFile.cpp */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "FeatureFile.h"
+#include "DescriptorMatrix.h"
+
+static const char featureMagic[4] = { 'F', 'S', 'E', 'T' };
+static const unsigned int featureVersion = 1;
+
+// Alignment of every section.
+static const unsigned long long sectionAlignment = 32;
+
+// Size in bytes of one descriptor element.
+static size_t elementSize(int dtype) {
+    return (dtype == FEATURE_DTYPE_FLOAT64) ? sizeof(double) : sizeof(float);
+}
+
+// Round an offset up to the section alignment.
+static unsigned long long align(unsigned long long offset) {
+    return (offset + sectionAlignment - 1) & ~(sectionAlignment - 1);
+}
+
+// Fill in the shape and section offsets of a header.
+static void layout(FeatureFileHeader &h, unsigned int count, unsigned int dim, unsigned int dtype) {
+    memcpy(h.magic, featureMagic, 4);
+    h.version = featureVersion;
+    h.count = count;
+    h.dim = dim;
+    h.dtype = dtype;
+    h.flags = FEATURE_FLAG_PADDED;
+    h.stride = (dim + 7) & ~7;
+    h.reserved = 0;
+
+    unsigned long long offset = align(sizeof(FeatureFileHeader));
+
+    for (int s=0; s<FEATURE_SECTION_DESCRIPTORS; s++) {
+        h.offsets[s] = offset;
+        offset = align(offset + 4ULL * count);
+    }
+
+    h.offsets[FEATURE_SECTION_DESCRIPTORS] = offset;
+    h.fileSize = offset + (unsigned long long) count * h.stride * elementSize(dtype);
+}
+
+// Create a closed file.
+FeatureFile::FeatureFile() {
+    header = NULL;
+}
+
+// Map a binary feature file and check that its header describes the
+// layout this version writes and fits in the file.
+bool FeatureFile::open(const char *name) {
+    close();
+
+    if (!file.open(name) || (file.size() < sizeof(FeatureFileHeader))) {
+        file.close();
+        return false;
+    }
+
+    const FeatureFileHeader *h = (const FeatureFileHeader *) file.data();
+    FeatureFileHeader expected;
+
+    if ((memcmp(h->magic, featureMagic, 4) != 0) || (h->version != featureVersion) ||
+        ((h->dtype != FEATURE_DTYPE_FLOAT32) && (h->dtype != FEATURE_DTYPE_FLOAT64))) {
+        file.close();
+        return false;
+    }
+
+    layout(expected, h->count, h->dim, h->dtype);
+
+    if ((h->stride != expected.stride) || (h->fileSize != expected.fileSize) || (h->fileSize > file.size()) ||
+        (memcmp(h->offsets, expected.offsets, sizeof(expected.offsets)) != 0)) {
+        file.close();
+        return false;
+    }
+
+    header = h;
+    return true;
+}
+
+// Unmap the file.
+void FeatureFile::close() {
+    file.close();
+    header = NULL;
+}
+
+// Copy one feature.
+void FeatureFile::get_feature(int i, Feature &f) const {
+    f.id = ids()[i];
+    f.type = types()[i];
+    f.x = xs()[i];
+    f.y = ys()[i];
+    f.angleRadians = angles()[i];
+    f.scale = scales()[i];
+
+    if (dtype() == FEATURE_DTYPE_FLOAT64) {
+        const double *r = (const double *) descriptors() + (size_t) i * stride();
+        f.data.assign(r, r + dim());
+    }
+    else {
+        const float *r = (const float *) descriptors() + (size_t) i * stride();
+        f.data.assign(r, r + dim());
+    }
+}
+
+// Copy all the features into a feature set.
+void FeatureFile::get_features(FeatureSet &features) const {
+    features.clear();
+    features.resize(size());
+
+    for (int i=0; i<size(); i++) {
+        get_feature(i, features[i]);
+    }
+}
+
+// View the descriptors as a matrix without copying them.
+bool FeatureFile::get_matrix(DescriptorMatrix &matrix) const {
+    if ((header == NULL) || (dtype() != FEATURE_DTYPE_FLOAT32) || !(header->flags & FEATURE_FLAG_PADDED)) {
+        return false;
+    }
+
+    return matrix.view((const float *) descriptors(), size(), dim(), stride(), ids());
+}
+
+// Check whether a file starts with the binary feature file magic.
+bool isFeatureFile(const char *name) {
+    FILE *f = fopen(name, "rb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    char magic[4];
+    bool ok = (fread(magic, 1, 4, f) == 4) && (memcmp(magic, featureMagic, 4) == 0);
+
+    fclose(f);
+    return ok;
+}
+
+// Write zeros up to a file offset.
+static void pad(FILE *f, unsigned long long &offset, unsigned long long target) {
+    static const char zeros[sectionAlignment] = { 0 };
+
+    while (offset < target) {
+        size_t n = (size_t) min(target - offset, sectionAlignment);
+        fwrite(zeros, 1, n, f);
+        offset += n;
+    }
+}
+
+// Save a feature set as a binary feature file.
+bool saveFeatureFile(const char *name, const FeatureSet &features, int dtype) {
+    unsigned int count = features.size();
+    unsigned int dim = features.empty() ? 0 : features[0].data.size();
+
+    for (unsigned int i=0; i<count; i++) {
+        if (features[i].data.size() != dim) {
+            return false;
+        }
+    }
+
+    if ((dtype != FEATURE_DTYPE_FLOAT32) && (dtype != FEATURE_DTYPE_FLOAT64)) {
+        return false;
+    }
+
+    FILE *f = fopen(name, "wb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    FeatureFileHeader h;
+    memset(&h, 0, sizeof(h));
+    layout(h, count, dim, dtype);
+
+    unsigned long long offset = sizeof(h);
+    fwrite(&h, sizeof(h), 1, f);
+
+    // The keypoint arrays.
+    vector<int> ints(count);
+    vector<float> floats(count);
+
+    for (int s=0; s<FEATURE_SECTION_DESCRIPTORS; s++) {
+        pad(f, offset, h.offsets[s]);
+
+        for (unsigned int i=0; i<count; i++) {
+            const Feature &g = features[i];
+
+            switch (s) {
+            case FEATURE_SECTION_IDS: ints[i] = g.id; break;
+            case FEATURE_SECTION_TYPES: ints[i] = g.type; break;
+            case FEATURE_SECTION_X: ints[i] = g.x; break;
+            case FEATURE_SECTION_Y: ints[i] = g.y; break;
+            case FEATURE_SECTION_ANGLES: floats[i] = (float) g.angleRadians; break;
+            case FEATURE_SECTION_SCALES: floats[i] = (float) g.scale; break;
+            }
+        }
+
+        if (count > 0) {
+            if (s < FEATURE_SECTION_ANGLES) {
+                fwrite(&ints[0], sizeof(int), count, f);
+            }
+            else {
+                fwrite(&floats[0], sizeof(float), count, f);
+            }
+        }
+
+        offset += 4ULL * count;
+    }
+
+    // The descriptor rows, padded to the stride.
+    pad(f, offset, h.offsets[FEATURE_SECTION_DESCRIPTORS]);
+
+    vector<float> row32(h.stride, 0.0f);
+    vector<double> row64(h.stride, 0.0);
+
+    for (unsigned int i=0; i<count; i++) {
+        const vector<double> &d = features[i].data;
+
+        if (h.stride == 0) {
+            break;
+        }
+
+        if (dtype == FEATURE_DTYPE_FLOAT64) {
+            copy(d.begin(), d.end(), row64.begin());
+            fwrite(&row64[0], sizeof(double), h.stride, f);
+        }
+        else {
+            for (unsigned int j=0; j<dim; j++) {
+                row32[j] = (float) d[j];
+            }
+
+            fwrite(&row32[0], sizeof(float), h.stride, f);
+        }
+    }
+
+    bool ok = !ferror(f);
+    return (fclose(f) == 0) && ok;
+}
@@ -0,0 +1,113 @@
+#ifndef FEATUREFILE_H
+#define FEATUREFILE_H
+
+#include "FeatureSet.h"
+#include "MappedFile.h"
+
+class DescriptorMatrix;
+
+// Descriptor element types of binary feature files.
+enum {
+	FEATURE_DTYPE_FLOAT32 = 0,
+	FEATURE_DTYPE_FLOAT64 = 1
+};
+
+// Header flags of binary feature files.
+enum {
+	// Each descriptor row is padded with zeros to a multiple of 8
+	// elements, so float32 rows can be used as DescriptorMatrix rows.
+	FEATURE_FLAG_PADDED = 1
+};
+
+// Sections of a binary feature file, in file order.
+enum {
+	FEATURE_SECTION_IDS = 0,
+	FEATURE_SECTION_TYPES,
+	FEATURE_SECTION_X,
+	FEATURE_SECTION_Y,
+	FEATURE_SECTION_ANGLES,
+	FEATURE_SECTION_SCALES,
+	FEATURE_SECTION_DESCRIPTORS,
+	FEATURE_SECTIONS
+};
+
+// The header of a binary feature file.  The keypoint attributes are
+// stored as separate arrays (ids, types, x and y as int32, angles and
+// scales as float32), followed by one contiguous block of descriptor
+// rows of stride elements each.  Every section starts on a 32-byte
+// boundary, at the offset given in the header.  All values are in the
+// byte order of the machine that wrote the file.
+struct FeatureFileHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int count;
+	unsigned int dim;
+	unsigned int dtype;
+	unsigned int flags;
+	unsigned int stride;
+	unsigned int reserved;
+	unsigned long long offsets[FEATURE_SECTIONS];
+	unsigned long long fileSize;
+};
+
+// The FeatureFile class is a read-only view of a binary feature file
+// mapped into memory.  The keypoint arrays and descriptors are read in
+// place, without parsing or copying.
+class FeatureFile {
+private:
+	MappedFile file;
+	const FeatureFileHeader *header;
+
+public:
+	// Create a closed file.
+	FeatureFile();
+
+	// Map a binary feature file and check its header.
+	bool open(const char *name);
+
+	// Unmap the file.
+	void close();
+
+	// Number of features.
+	int size() const { return (header != NULL) ? header->count : 0; }
+
+	// Descriptor length, row stride and element type.
+	int dim() const { return header->dim; }
+	int stride() const { return header->stride; }
+	int dtype() const { return header->dtype; }
+
+	// Keypoint arrays.
+	const int *ids() const { return (const int *) section(FEATURE_SECTION_IDS); }
+	const int *types() const { return (const int *) section(FEATURE_SECTION_TYPES); }
+	const int *xs() const { return (const int *) section(FEATURE_SECTION_X); }
+	const int *ys() const { return (const int *) section(FEATURE_SECTION_Y); }
+	const float *angles() const { return (const float *) section(FEATURE_SECTION_ANGLES); }
+	const float *scales() const { return (const float *) section(FEATURE_SECTION_SCALES); }
+
+	// Descriptor block.
+	const void *descriptors() const { return section(FEATURE_SECTION_DESCRIPTORS); }
+
+	// Copy one feature.
+	void get_feature(int i, Feature &f) const;
+
+	// Copy all the features into a feature set.
+	void get_features(FeatureSet &features) const;
+
+	// View the descriptors as a matrix without copying them.  Only
+	// padded float32 files can be viewed.
+	bool get_matrix(DescriptorMatrix &matrix) const;
+
+private:
+	// Start of a section.
+	const void *section(int s) const { return file.data() + header->offsets[s]; }
+};
+
+// Check whether a file starts with the binary feature file magic.
+bool isFeatureFile(const char *name);
+
+// Save a feature set as a binary feature file.  The descriptors must all
+// have the same length.
+bool saveFeatureFile(const char *name, const FeatureSet &features, int dtype = FEATURE_DTYPE_FLOAT32);
+
+#endif
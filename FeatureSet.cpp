@@ -5,6 +5,9 @@
 
 #include <FL/fl_draw.H>
 #include "FeatureSet.h"
+#include "FeatureFile.h"
+#include "CompressedFeatureFile.h"
+#include "SiftFile.h"
 
 static int iround(double x) {
     if (x < 0.0) {
@@ -16,6 +19,8 @@ static int iround(double x) {
 
 // Create a feature.
 Feature::Feature() {
+    angleRadians = 0;
+    scale = 1;
     selected = false;
 }
 
@@ -76,11 +81,9 @@ void Feature::read_sift(istream &is) {
 
     double xSub;
     double ySub;
-    double scale;
-    double rotation;
 
     // Read the feature location, scale, and orientation.
-    is >> xSub >> ySub >> scale >> rotation;
+    is >> xSub >> ySub >> scale >> angleRadians;
 
     // They give row first, then column.
     x = (int) (ySub + 0.5);
@@ -135,47 +138,36 @@ istream &operator>>(istream &is, Feature &f) {
 FeatureSet::FeatureSet() {
 }
 
-// Load a feature set from a file.
+// Load a feature set from a file.  Binary feature files are recognized
+// by their magic number and copied straight from the mapped file, and
+// compressed feature files are decoded block by block.
 bool FeatureSet::load(const char *name) {
     int n;
 
     // Clear the currently loaded features.
     clear();
 
-    // Open the file.
-    ifstream f(name);
-
-    if (!f.is_open()) {
-        return false;
-    }
-
-    // Read the total number of features.
-    f >> n;
-
-    // Resize the vector of features.
-    resize(n);
+    if (isFeatureFile(name)) {
+        FeatureFile file;
 
-    // Read each of the features.
-    iterator i = begin();
+        if (!file.open(name)) {
+            return false;
+        }
 
-    while (i != end()) {
-        f >> (*i);
-        i++;
+        file.get_features(*this);
+        return true;
     }
 
-    // Close the file.
-    f.close();
-
-    return true;
-}
+    if (isCompressedFeatureFile(name)) {
+        CompressedFeatureReader file;
 
-// Load a SIFT feature set.
-bool FeatureSet::load_sift(const char *name) {
-    int n;
-    int m;
+        if (!file.open(name) || !file.read_features(*this)) {
+            clear();
+            return false;
+        }
 
-    // Clear the currently loaded features.
-    clear();
+        return true;
+    }
 
     // Open the file.
     ifstream f(name);
@@ -187,27 +179,15 @@ bool FeatureSet::load_sift(const char *name) {
     // Read the total number of features.
     f >> n;
 
-    // Read the length of each feature.  It better be 128.
-    f >> m;
-
-    if (m != 128) {
-        f.close();
-        return false;
-    }
-
     // Resize the vector of features.
     resize(n);
 
     // Read each of the features.
     iterator i = begin();
-    int id = 1;
 
     while (i != end()) {
-        (*i).read_sift(f);
-        (*i).id = id;
-
+        f >> (*i);
         i++;
-        id++;
     }
 
     // Close the file.
@@ -216,6 +196,11 @@ bool FeatureSet::load_sift(const char *name) {
     return true;
 }
 
+// Load a SIFT feature set.
+bool FeatureSet::load_sift(const char *name) {
+    return parseSiftFile(name, this, NULL);
+}
+
 // Save a feature set to file.
 bool FeatureSet::save(const char *name) const {
     // Open the file.
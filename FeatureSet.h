@@ -26,6 +26,9 @@ public:
 	int y;
     double angleRadians;
 
+	// Detection scale, 1 for single-scale detectors.
+	double scale;
+
 	vector<double> data;
 
 	bool selected;
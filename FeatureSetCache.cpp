@@ -0,0 +1,170 @@
+/* FeatureSetCache.cpp */
+
+#include "FeatureSetCache.h"
+#include "ImageDatabase.h"
+
+// Most items that may be loading at once.  Prefetches beyond this are
+// dropped, so a long candidate list can't queue up unbounded work.
+static const int maxLoading = 16;
+
+// Create a cache.
+FeatureSetCache::FeatureSetCache(size_t budget, int ioThreads) : io(max(ioThreads, 1)) {
+    this->budget = budget;
+    bytes = 0;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+    prefetches = 0;
+}
+
+// Get the features of a database item, loading them on a miss.  If
+// another thread is already loading the item, wait for it.  A get that
+// waits counts as a hit, since the load was someone else's miss.
+shared_ptr<const FeatureSet> FeatureSetCache::get(const ImageDatabase &db, int index) {
+    unique_lock<mutex> guard(lock);
+
+    while (true) {
+        unordered_map<int, Entry>::iterator e = entries.find(index);
+
+        if (e != entries.end()) {
+            order.splice(order.begin(), order, e->second.position);
+            hits++;
+            return e->second.features;
+        }
+
+        if (loading.count(index) == 0) {
+            break;
+        }
+
+        loaded.wait(guard);
+    }
+
+    // Not cached, and not being loaded, or a load we waited for failed.
+    misses++;
+    loading.insert(index);
+    guard.unlock();
+
+    shared_ptr<const FeatureSet> features = load(db.item_loader(index));
+
+    guard.lock();
+    loading.erase(index);
+
+    if (features) {
+        insert(index, features);
+    }
+
+    loaded.notify_all();
+    return features;
+}
+
+// Start loading items that aren't cached in the background.
+void FeatureSetCache::prefetch(const ImageDatabase &db, const int *items, int n) {
+    for (int i=0; i<n; i++) {
+        int index = items[i];
+
+        if (!db[index].features.empty() || !db.has_feature_source(index)) {
+            continue;
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+
+            if ((entries.count(index) > 0) || (loading.count(index) > 0) || ((int) loading.size() >= maxLoading)) {
+                continue;
+            }
+
+            loading.insert(index);
+            prefetches++;
+        }
+
+        // The loader doesn't refer to the database, so the task is safe
+        // even if the database goes away first.
+        function<bool(FeatureSet &)> loader = db.item_loader(index);
+
+        io.run([this, loader, index]() {
+            shared_ptr<const FeatureSet> features = load(loader);
+            lock_guard<mutex> guard(lock);
+
+            loading.erase(index);
+
+            if (features) {
+                insert(index, features);
+            }
+
+            loaded.notify_all();
+        });
+    }
+}
+
+// Drop every cached item.
+void FeatureSetCache::clear() {
+    lock_guard<mutex> guard(lock);
+
+    entries.clear();
+    order.clear();
+    bytes = 0;
+}
+
+// Get the counters.
+FeatureSetCacheStats FeatureSetCache::stats() const {
+    lock_guard<mutex> guard(lock);
+    FeatureSetCacheStats s;
+
+    s.hits = hits;
+    s.misses = misses;
+    s.evictions = evictions;
+    s.prefetches = prefetches;
+    s.bytes = bytes;
+    s.items = entries.size();
+
+    return s;
+}
+
+// Add a loaded item and evict the least recently used items until the
+// cache fits in its budget.  The new item is always kept, even if it is
+// larger than the budget on its own.
+void FeatureSetCache::insert(int index, const shared_ptr<const FeatureSet> &features) {
+    if (entries.count(index) > 0) {
+        return;
+    }
+
+    order.push_front(index);
+
+    Entry &e = entries[index];
+    e.features = features;
+    e.bytes = featureSetBytes(*features);
+    e.position = order.begin();
+    bytes += e.bytes;
+
+    while ((bytes > budget) && (order.size() > 1)) {
+        unordered_map<int, Entry>::iterator victim = entries.find(order.back());
+
+        bytes -= victim->second.bytes;
+        entries.erase(victim);
+        order.pop_back();
+        evictions++;
+    }
+}
+
+// Load an item.
+shared_ptr<const FeatureSet> FeatureSetCache::load(const function<bool(FeatureSet &)> &loader) {
+    shared_ptr<FeatureSet> features(new FeatureSet());
+
+    if (!loader(*features)) {
+        return shared_ptr<const FeatureSet>();
+    }
+
+    return features;
+}
+
+// Estimate the memory used by a feature set: the features themselves
+// and the descriptor storage they own.
+size_t featureSetBytes(const FeatureSet &features) {
+    size_t n = sizeof(FeatureSet) + features.capacity() * sizeof(Feature);
+
+    for (unsigned int i=0; i<features.size(); i++) {
+        n += features[i].data.capacity() * sizeof(double);
+    }
+
+    return n;
+}
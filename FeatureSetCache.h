@@ -0,0 +1,95 @@
+#ifndef FEATURESETCACHE_H
+#define FEATURESETCACHE_H
+
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include "ThreadPool.h"
+#include "FeatureSet.h"
+
+class ImageDatabase;
+
+// Counters of a feature set cache.
+struct FeatureSetCacheStats
+{
+	long long hits;
+	long long misses;
+	long long evictions;
+	long long prefetches;
+
+	// Bytes and number of feature sets held.
+	size_t bytes;
+	int items;
+};
+
+// The FeatureSetCache class keeps the most recently used feature sets of
+// a database in memory, within a byte budget.  Feature sets are handed
+// out as shared pointers, so one that is evicted while in use stays
+// valid until it is released.  Items can be prefetched on a small pool
+// of I/O threads, and a get for an item that is being loaded waits for
+// that load instead of starting another.
+class FeatureSetCache {
+private:
+	struct Entry {
+		shared_ptr<const FeatureSet> features;
+		size_t bytes;
+		list<int>::iterator position;
+	};
+
+	size_t budget;
+	size_t bytes;
+
+	// Cached items, and their order of use, most recent first.
+	unordered_map<int, Entry> entries;
+	list<int> order;
+
+	// Items being loaded.
+	set<int> loading;
+
+	long long hits;
+	long long misses;
+	long long evictions;
+	long long prefetches;
+
+	mutable mutex lock;
+	condition_variable loaded;
+
+	// Declared last so that it is destroyed first, finishing the
+	// prefetches while the rest of the cache still exists.
+	ThreadPool io;
+
+public:
+	// Create a cache holding at most budget bytes of feature sets.
+	FeatureSetCache(size_t budget, int ioThreads = 2);
+
+	// Get the features of a database item, loading them on a miss.
+	// Returns NULL if they can't be loaded.
+	shared_ptr<const FeatureSet> get(const ImageDatabase &db, int index);
+
+	// Start loading items that aren't cached in the background.
+	void prefetch(const ImageDatabase &db, const int *items, int n);
+
+	// Drop every cached item.  The counters are kept.
+	void clear();
+
+	// Get the counters.
+	FeatureSetCacheStats stats() const;
+
+	// Byte budget.
+	size_t capacity() const { return budget; }
+
+private:
+	// Add a loaded item and evict the least recently used items until
+	// the cache fits in its budget.  Called with the lock held.
+	void insert(int index, const shared_ptr<const FeatureSet> &features);
+
+	// Load an item.  Returns NULL if it can't be loaded.
+	static shared_ptr<const FeatureSet> load(const function<bool(FeatureSet &)> &loader);
+};
+
+// Estimate the memory used by a feature set.
+size_t featureSetBytes(const FeatureSet &features);
+
+#endif
@@ -3,17 +3,25 @@
 #include <FL/Fl_Shared_Image.H>
 #include <FL/fl_ask.H>
 #include "features.h"
+#include "DescriptorMatrix.h"
+#include "DatabaseSnapshot.h"
+#include "QueryResultCache.h"
 #include "FeaturesUI.h"
 #include "FeaturesDoc.h"
 
+// Bytes of query results kept by a document.
+static const size_t resultCacheBudget = 16 << 20;
+
 // Create a new document.
 FeaturesDoc::FeaturesDoc() {
     queryImage = NULL;
     queryFeatures = NULL;
 
-    db = NULL;
+    database = new ActiveDatabase();
+    resultCache = new QueryResultCache(resultCacheBudget);
 
     resultImage = NULL;
+    resultFeatures = NULL;
 
     ui = NULL;
 
@@ -96,38 +104,47 @@ void FeaturesDoc::load_query_features(const char *name, bool sift) {
     ui->refresh();
 }
 
-// Load an image database.
+// Load an image database.  The new database is loaded into a snapshot
+// of its own and only replaces the current one once it has loaded, so
+// a database that fails to load leaves the current one in place.
 void FeaturesDoc::load_image_database(const char *name, bool sift) {
-    ui->set_images(queryImage, NULL);
-    ui->set_features(queryFeatures, NULL);
+    shared_ptr<DatabaseSnapshot> loaded(new DatabaseSnapshot());
+
+    // Load the database, with the changes journaled since it was last
+    // compacted.
+    if (!loaded->db.load(name, sift) || !loaded->db.replay_journal(ImageDatabase::journal_name(name).c_str())) {
+        fl_alert("couldn't load database");
+        return;
+    }
+
+    // Concatenate the descriptors so queries take a single pass.
+    loaded->matrix.reset(new DescriptorMatrix());
 
-    // Delete the current database.
-    if (db != NULL) {
-        delete db;
-        db = NULL;
+    if (!loaded->matrix->build(loaded->db)) {
+        loaded->matrix.reset();
     }
 
+    ui->set_images(queryImage, NULL);
+    ui->set_features(queryFeatures, NULL);
+
     // Delete the current result image.
     if (resultImage != NULL) {
         resultImage->release();
         resultImage = NULL;
     }
 
-    db = new ImageDatabase();
-
-    // Load the database.
-    if (!db->load(name, sift)) {
-        delete db;
-        db = NULL;
-
-        fl_alert("couldn't load database");
-    }
+    database->publish(loaded);
+    resultCache->clear();
 
     ui->refresh();
 }
 
-// Perform a query on the loaded database.
+// Perform a query on the loaded database.  The query holds the current
+// database snapshot until it is done, and the result is kept so the same
+// query on the same database is answered at once.
 void FeaturesDoc::perform_query() {
+    shared_ptr<const DatabaseSnapshot> snapshot = database->acquire();
+
     ui->set_images(queryImage, NULL);
     ui->set_features(queryFeatures, NULL);
 
@@ -137,7 +154,7 @@ void FeaturesDoc::perform_query() {
     else if (queryFeatures == NULL) {
         fl_alert("no query features loaded");
     }
-    else if (db == NULL) {
+    else if (snapshot == NULL) {
         fl_alert("no image database loaded");
     }
     else {
@@ -148,14 +165,30 @@ void FeaturesDoc::perform_query() {
             fl_alert("no features selected");
         }
         else {
-            int index;
-            vector<FeatureMatch> matches;
-            double score;
+            const ImageDatabase &db = snapshot->db;
+            int type = ui->get_match_type();
+            unsigned long long key = QueryResultCache::key(selectedFeatures, type, 1, 0, true, snapshot->version);
+            vector<QueryResult> results;
+
+            MatchOptions options;
+            options.matrix = snapshot->matrix.get();
+
+            if (!resultCache->get(key, results, NULL)) {
+                if (performQuery(selectedFeatures, db, results, 1, type, &options)) {
+                    resultCache->put(key, results, NULL);
+                }
+                else {
+                    results.clear();
+                }
+            }
 
-            if (!performQuery(selectedFeatures, *db, index, matches, score, ui->get_match_type())) {
+            if (results.empty()) {
                 fl_alert("query failed");
             }
             else {
+                int index = results[0].index;
+                const vector<FeatureMatch> &matches = results[0].matches;
+
                 // Delete the current result image.
                 if (resultImage != NULL) {
                     resultImage->release();
@@ -163,19 +196,31 @@ void FeaturesDoc::perform_query() {
                 }
 
                 // Load the image.
-                resultImage = Fl_Shared_Image::get((*db)[index].name.c_str());
+                resultImage = Fl_Shared_Image::get(db[index].name.c_str());
 
                 if (resultImage == NULL) {
                     fl_alert("couldn't load result image file");
                 }
                 else {
-                    (*db)[index].features.deselect_all();
+                    // Copy the result features, loading them if they
+                    // aren't resident.
+                    if (resultFeatures != NULL) {
+                        delete resultFeatures;
+                    }
+
+                    resultFeatures = new FeatureSet(db[index].features);
+
+                    if (resultFeatures->empty()) {
+                        db.load_item_features(index, *resultFeatures);
+                    }
+
+                    resultFeatures->deselect_all();
                     (*queryFeatures).deselect_all();
 
                     // Select the matched features.
                     for (unsigned int i=0; i<matches.size(); i++) {
                         (*queryFeatures)[matches[i].id1-1].selected = true;
-                        (*db)[index].features[matches[i].id2-1].selected = true;
+                        (*resultFeatures)[matches[i].id2-1].selected = true;
                     }
 
                     // Update the UI.
@@ -187,7 +232,7 @@ void FeaturesDoc::perform_query() {
                     }
 					
                     ui->set_images(queryImage, resultImage);
-                    ui->set_features(queryFeatures, &((*db)[index].features));
+                    ui->set_features(queryFeatures, resultFeatures);
                 }
             }
         }
@@ -3,7 +3,8 @@
 
 class Fl_Shared_Image;
 class FeatureSet;
-class ImageDatabase;
+class ActiveDatabase;
+class QueryResultCache;
 class FeaturesUI;
 
 // The FeaturesDoc class controls the functionality of the project, and
@@ -14,10 +15,19 @@ private:
 	Fl_Shared_Image *queryImage;
 	FeatureSet *queryFeatures;
 
-	ImageDatabase *db;
+	// The database queries are performed on.
+	ActiveDatabase *database;
+
+	// Results of recent queries, so that repeating a query with the
+	// same selected features doesn't match the database again.
+	QueryResultCache *resultCache;
 
 	Fl_Shared_Image *resultImage;
 
+	// Features of the result image, copied from the database so their
+	// selection can be shown.
+	FeatureSet *resultFeatures;
+
 	int matchType;
 
 public:
@@ -1,14 +1,36 @@
 /* FeaturesMain.cpp */
 
 #include <assert.h>
+#include <time.h>
+#include <signal.h>
+#include <chrono>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 #include <fstream>
 #include <FL/Fl.H>
 #include <FL/Fl_Shared_Image.H>
+#include <FL/filename.H>
 #include "features.h"
+#include "PQIndex.h"
+#include "LSHIndex.h"
+#include "DescriptorMatrix.h"
+#include "MatchPlanner.h"
+#include "FeatureFile.h"
+#include "CompressedFeatureFile.h"
+#include "ExtractionCache.h"
+#include "BatchExtraction.h"
+#include "PackedDatabase.h"
+#include "FeatureSetCache.h"
+#include "QueryToken.h"
+#include "QueryServer.h"
+#include "ShardedDatabase.h"
 #include "FeaturesUI.h"
 #include "FeaturesDoc.h"
 
+#define PI 3.14159265358979323846
 
 
 FeaturesUI *ui;
@@ -75,10 +97,11 @@ bool LoadImageFile(const char *filename, CFloatImage &image)
     }
 }
 
-// Compute the features for a single image.
+// Compute the features for a single image, through an extraction cache
+// if a cache directory is given.
 int mainComputeFeatures(int argc, char **argv) {
-    if ((argc < 4) || (argc > 6)) {
-        printf("usage: %s computeFeatures imagefile featurefile [featuretype] [descriptortype]\n", argv[0]);
+    if ((argc < 4) || (argc > 8)) {
+        printf("usage: %s computeFeatures imagefile featurefile [featuretype] [descriptortype] [binary] [cachedir]\n", argv[0]);
 
         return -1;
     }
@@ -95,6 +118,9 @@ int mainComputeFeatures(int argc, char **argv) {
         dtype = atoi(argv[5]);
     }
 
+    // Write a text feature file by default.
+    int format = (argc > 6) ? atoi(argv[6]) : 0;
+
     CFloatImage floatQueryImage;
     bool success = LoadImageFile(argv[2], floatQueryImage);
 
@@ -105,18 +131,157 @@ int mainComputeFeatures(int argc, char **argv) {
 
     // Compute the image features.
     FeatureSet features;
-    computeFeatures(floatQueryImage, features, ftype, dtype);
+    shared_ptr<ExtractionCache> cache;
+
+    if (argc > 7) {
+        cache.reset(new ExtractionCache(argv[7]));
+    }
+
+    computeFeaturesCached(floatQueryImage, features, ftype, dtype, cache.get());
 
     // Save the image features.
-    features.save(argv[3]);
+    saveFeatures(argv[3], features, format);
+
+    return 0;
+}
+
+// Compute the features of a batch of images, the image files in a
+// directory or those named in a list file, and write a database file
+// for them.  The feature files are written next to the database file.
+// The images go through a pipeline of decoding, grayscale conversion,
+// detection, description and writing, each stage with its own threads,
+// so one process keeps the cores and the disk busy over the whole batch.
+int mainComputeFeaturesBatch(int argc, char **argv) {
+    if ((argc < 4) || (argc > 9)) {
+        printf("usage: %s computeFeaturesBatch (imagedir | listfile) databasefile [featuretype] [descriptortype] [binary] [cachedir] [threads]\n", argv[0]);
+        return -1;
+    }
+
+    BatchExtractionOptions options;
+
+    if (argc > 4) {
+        options.featureType = atoi(argv[4]);
+    }
+
+    if (argc > 5) {
+        options.descriptorType = atoi(argv[5]);
+    }
+
+    if (argc > 6) {
+        options.format = atoi(argv[6]);
+    }
+
+    // Check the format now rather than failing every image of the batch.
+    if ((options.format < 0) || (options.format > 3)) {
+        printf("invalid feature file format %d, expected 0 to 3\n", options.format);
+        return -1;
+    }
+
+    // A cache directory of "-" skips the cache, so the thread count can
+    // still be given.
+    shared_ptr<ExtractionCache> cache;
+
+    if ((argc > 7) && (strcmp(argv[7], "-") != 0)) {
+        cache.reset(new ExtractionCache(argv[7]));
+        options.cache = cache.get();
+    }
+
+    // The thread count applies to the detection and description stages.
+    if (argc > 8) {
+        options.threads[BATCH_STAGE_DETECT] = atoi(argv[8]);
+        options.threads[BATCH_STAGE_DESCRIBE] = atoi(argv[8]);
+    }
+
+    vector<string> images;
+
+    if (!listBatchImages(argv[2], images)) {
+        printf("couldn't list images in %s\n", argv[2]);
+        return -1;
+    }
+
+    if (images.empty()) {
+        printf("no images in %s\n", argv[2]);
+        return -1;
+    }
+
+    vector<string> featureFiles;
+    nameFeatureFiles(images, string(argv[3], fl_filename_name(argv[3]) - argv[3]), options.format, featureFiles);
+
+    printf("computing features for %d images\n", (int) images.size());
+
+    vector<char> done;
+    BatchExtractionStats stats;
+    bool success = extractFeaturesBatch(images, featureFiles, options, done, stats);
+
+    if (!saveBatchDatabase(argv[3], images, featureFiles, done)) {
+        printf("couldn't write database file %s\n", argv[3]);
+        return -1;
+    }
+
+    printf("%lld images written (%lld from the extraction cache), %lld failed, in %.2f s: %.1f images/s\n",
+           stats.written, stats.cached, stats.failed, stats.seconds, (stats.seconds > 0) ? stats.written / stats.seconds : 0.0);
+
+    // The capacity of a stage is the rate it would reach if its threads
+    // never waited, so the stage with the lowest capacity is the one
+    // holding the pipeline back.
+    for (int s=0; s<BATCH_STAGES; s++) {
+        const BatchStageStats &stage = stats.stages[s];
+        double capacity = (stage.busySeconds > 0) ? stage.images * stage.threads / stage.busySeconds : 0;
+        double busy = (stats.seconds > 0) ? 100 * stage.busySeconds / (stage.threads * stats.seconds) : 0;
+
+        printf("%-8s %3d threads %7lld images %9.2f s busy %5.1f%% %9.1f images/s %9.1f images/s capacity\n",
+               batchStageNames[s], stage.threads, stage.images, stage.busySeconds, busy,
+               (stats.seconds > 0) ? stage.images / stats.seconds : 0.0, capacity);
+    }
+
+    return success ? 0 : -1;
+}
+
+// Convert a feature file between the text, binary and compressed
+// formats.  The input format is detected from the file.
+int mainConvertFeatures(int argc, char **argv) {
+    if ((argc < 4) || (argc > 6)) {
+        printf("usage: %s convertFeatures infile outfile [binary] [sift]\n", argv[0]);
+        return -1;
+    }
+
+    int format = (argc > 4) ? atoi(argv[4]) : 0;
+    bool sift = (argc > 5) && (atoi(argv[5]) != 0);
+
+    FeatureSet f;
+
+    if (((!sift) && (!f.load(argv[2]))) || ((sift) && (!f.load_sift(argv[2])))) {
+        printf("couldn't load feature file %s\n", argv[2]);
+        return -1;
+    }
+
+    if (!saveFeatures(argv[3], f, format)) {
+        printf("couldn't save feature file %s\n", argv[3]);
+        return -1;
+    }
 
     return 0;
 }
 
+
+// Print the plan the matcher chose, and the predicted cost of each if
+// the plan was chosen by them.
+static void reportMatchPlan(const FeatureSet &f1, const FeatureSet &f2, int type, const MatchOptions &options) {
+    MatchPlan plan = planMatch(f1.size(), f2.size(), f1.empty() ? 0 : f1[0].data.size(), type, &options);
+
+    if (plan.cost[MATCH_PLAN_BRUTE] > 0) {
+        printf("match plan: %s (brute %g s, blocked %g s, ann %g s)\n", matchPlanName(plan.plan),
+               plan.cost[MATCH_PLAN_BRUTE], plan.cost[MATCH_PLAN_BLOCKED], plan.cost[MATCH_PLAN_ANN]);
+    }
+    else {
+        printf("match plan: %s\n", matchPlanName(plan.plan));
+    }
+}
+
 // Match the features of one image to another, the output file matches to a file
 int mainMatchFeatures(int argc, char **argv) {
-    if ((argc < 6) || (argc > 7)) {
-        printf("usage: %s matchFeatures featurefile1 featurefile2 threshold matchfile [matchtype]\n", argv[0]);
+    if ((argc < 6) || (argc > 8)) {
+        printf("usage: %s matchFeatures featurefile1 featurefile2 threshold matchfile [matchtype] [plan]\n", argv[0]);
         return -1;
     }
 
@@ -127,6 +292,14 @@ int mainMatchFeatures(int argc, char **argv) {
         type = atoi(argv[6]);
     }
 
+    // Let the planner choose the matching plan unless one is given
+    // (0 auto, 1 brute force, 2 blocked, 3 LSH).
+    MatchOptions options;
+
+    if (argc > 7) {
+        options.plan = atoi(argv[7]);
+    }
+
     FeatureSet f1;
     FeatureSet f2;
 
@@ -146,11 +319,13 @@ int mainMatchFeatures(int argc, char **argv) {
     double totalScore;
 
     // Compute the match.
-    if (!matchFeatures(f1, f2, matches, totalScore, type)) {
+    if (!matchFeatures(f1, f2, matches, totalScore, type, &options)) {
         printf("matching failed, probably due to invalid match type\n");
         return -1;
     }
 
+    reportMatchPlan(f1, f2, type, options);
+
     // Output the matches 
     const char *matchFile = argv[5];
     FILE *f = fopen(matchFile, "w");
@@ -179,8 +354,8 @@ int mainMatchFeatures(int argc, char **argv) {
 
 // Match the features of one image to another, the output file matches to a file
 int mainMatchSIFTFeatures(int argc, char **argv) {
-    if ((argc < 6) || (argc > 7)) {
-        printf("usage: %s matchFeatures featurefile1 featurefile2 threshold matchfile [matchtype]\n", argv[0]);
+    if ((argc < 6) || (argc > 8)) {
+        printf("usage: %s matchFeatures featurefile1 featurefile2 threshold matchfile [matchtype] [plan]\n", argv[0]);
         return -1;
     }
 
@@ -191,6 +366,14 @@ int mainMatchSIFTFeatures(int argc, char **argv) {
         type = atoi(argv[6]);
     }
 
+    // Let the planner choose the matching plan unless one is given
+    // (0 auto, 1 brute force, 2 blocked, 3 LSH).
+    MatchOptions options;
+
+    if (argc > 7) {
+        options.plan = atoi(argv[7]);
+    }
+
     FeatureSet f1;
     FeatureSet f2;
 
@@ -210,11 +393,13 @@ int mainMatchSIFTFeatures(int argc, char **argv) {
     double totalScore;
 
     // Compute the match.
-    if (!matchFeatures(f1, f2, matches, totalScore, type)) {
+    if (!matchFeatures(f1, f2, matches, totalScore, type, &options)) {
         printf("matching failed, probably due to invalid match type\n");
         return -1;
     }
 
+    reportMatchPlan(f1, f2, type, options);
+
     // Output the matches 
     const char *matchFile = argv[5];
     FILE *f = fopen(matchFile, "w");
@@ -244,8 +429,8 @@ int mainMatchSIFTFeatures(int argc, char **argv) {
 // Match the features of one image to another, then compare the match
 // with a ground truth homography.
 int mainTestMatch(int argc, char **argv) {
-    if ((argc < 5) || (argc > 6)) {
-        printf("usage: %s testMatch featurefile1 featurefile2 homographyfile [matchtype]\n", argv[0]);
+    if ((argc < 5) || (argc > 7)) {
+        printf("usage: %s testMatch featurefile1 featurefile2 homographyfile [matchtype] [radius]\n", argv[0]);
 
         return -1;
     }
@@ -257,6 +442,9 @@ int mainTestMatch(int argc, char **argv) {
         type = atoi(argv[5]);
     }
 
+    // Guide the matching with the homography if a search radius is given.
+    double radius = (argc > 6) ? atof(argv[6]) : 0;
+
     FeatureSet f1;
     FeatureSet f2;
 
@@ -287,8 +475,15 @@ int mainTestMatch(int argc, char **argv) {
     vector<FeatureMatch> matches;
     double totalScore;
 
+    MatchOptions options;
+
+    if (radius > 0) {
+        options.homography = h;
+        options.searchRadius = radius;
+    }
+
     // Compute the match.
-    if (!matchFeatures(f1, f2, matches, totalScore, type)) {
+    if (!matchFeatures(f1, f2, matches, totalScore, type, &options)) {
         printf("matching failed, probably due to invalid match type\n");
         return -1;
     }
@@ -303,11 +498,50 @@ int mainTestMatch(int argc, char **argv) {
     return 0;
 }
 
+// Compute the AUC of a match against a ground truth homography.
+static double matchAUC(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double h[9]) {
+    vector<bool> isMatch;
+    double maxDistance=0;
+
+    addRocData(f1,f2,matches,h,isMatch,5,maxDistance);
+
+    vector<double> thresholdList;
+
+    for (int i=0;i<102;i++) {
+        thresholdList.push_back(maxDistance/100.0*i);
+    }
+
+    vector<ROCPoint> results=computeRocCurve(matches,isMatch,thresholdList);
+    return computeAUC(results);
+}
+
+// Report what orientation and scale pruning gains and loses against
+// unpruned matching: the matching time, the number of matches and the
+// AUC.
+static void reportPruning(const FeatureSet &f1, const FeatureSet &f2, double h[9], int type, const MatchOptions &options) {
+    MatchOptions unpruned = options;
+    unpruned.orientationTolerance = 0;
+    unpruned.scaleTolerance = 0;
+
+    vector<FeatureMatch> matches[2];
+    double seconds[2];
+    double totalScore;
+
+    for (int i=0; i<2; i++) {
+        clock_t start = clock();
+        matchFeatures(f1, f2, matches[i], totalScore, type, (i == 0) ? &unpruned : &options);
+        seconds[i] = (double) (clock() - start) / CLOCKS_PER_SEC;
+    }
+
+    printf("unpruned: %f s, %d matches, AUC %f\n", seconds[0], (int) matches[0].size(), matchAUC(f1, f2, matches[0], h));
+    printf("pruned:   %f s, %d matches, AUC %f\n", seconds[1], (int) matches[1].size(), matchAUC(f1, f2, matches[1], h));
+}
+
 // Match the features of one image to another, then compare the match
 // with a ground truth homography. Compute the ROC points for various thresholds.
 int mainRocTestMatch(int argc, char **argv) {
-    if ((argc < 7) || (argc > 8)) {
-        printf("usage: %s roc featurefile1 featurefile2 homographyfile [matchtype] rocfilename aucfilename\n", argv[0]);
+    if ((argc < 7) || (argc > 11)) {
+        printf("usage: %s roc featurefile1 featurefile2 homographyfile [matchtype] rocfilename aucfilename [radius [angletolerance [scaletolerance]]]\n", argv[0]);
 
         return -1;
     }
@@ -318,12 +552,24 @@ int mainRocTestMatch(int argc, char **argv) {
     const char* filename;
     const char* aucfilename;
 
-    if (argc == 8) {
+    // Guide the matching with the homography if a search radius is given.
+    double radius = 0;
+
+    if (argc >= 8) {
         type = atoi(argv[5]);
         filename=argv[6];
         aucfilename=argv[7];
     }
 
+    if (argc >= 9) {
+        radius = atof(argv[8]);
+    }
+
+    // Prune the candidates by orientation (in degrees) and scale if
+    // tolerances are given.
+    double angleTolerance = (argc >= 10) ? atof(argv[9]) * PI / 180 : 0;
+    double scaleTolerance = (argc >= 11) ? atof(argv[10]) : 0;
+
     if (argc==7)
 	{
             filename=argv[5];
@@ -363,12 +609,26 @@ int mainRocTestMatch(int argc, char **argv) {
     double totalScore;
     double maxDistance=0;
 
+    MatchOptions options;
+
+    if (radius > 0) {
+        options.homography = h;
+        options.searchRadius = radius;
+    }
+
+    options.orientationTolerance = angleTolerance;
+    options.scaleTolerance = scaleTolerance;
+
     // Compute the match.
-    if (!matchFeatures(f1, f2, matches, totalScore, type)) {
+    if (!matchFeatures(f1, f2, matches, totalScore, type, &options)) {
         printf("matching failed, probably due to invalid match type\n");
         return -1;
     }
 
+    if ((angleTolerance > 0) || (scaleTolerance > 0)) {
+        reportPruning(f1, f2, h, type, options);
+    }
+
     //double d = evaluateMatch(f1, f2, matches, h);
     addRocData(f1,f2,matches,h,isMatch,5,maxDistance);
 
@@ -397,8 +657,8 @@ int mainRocTestMatch(int argc, char **argv) {
 // Match the SIFT features of one image to another, then compare the
 // match with a ground truth homography.
 int mainTestSIFTMatch(int argc, char **argv) {
-    if ((argc < 5) || (argc > 6)) {
-        printf("usage: %s testSIFTMatch featurefile1 featurefile2 homographyfile [matchtype]\n", argv[0]);
+    if ((argc < 5) || (argc > 7)) {
+        printf("usage: %s testSIFTMatch featurefile1 featurefile2 homographyfile [matchtype] [radius]\n", argv[0]);
 
         return -1;
     }
@@ -410,6 +670,9 @@ int mainTestSIFTMatch(int argc, char **argv) {
         type = atoi(argv[5]);
     }
 
+    // Guide the matching with the homography if a search radius is given.
+    double radius = (argc > 6) ? atof(argv[6]) : 0;
+
     FeatureSet f1;
     FeatureSet f2;
 
@@ -440,8 +703,15 @@ int mainTestSIFTMatch(int argc, char **argv) {
     vector<FeatureMatch> matches;
     double totalScore;
 
+    MatchOptions options;
+
+    if (radius > 0) {
+        options.homography = h;
+        options.searchRadius = radius;
+    }
+
     // Compute the match.
-    if (!matchFeatures(f1, f2, matches, totalScore, type)) {
+    if (!matchFeatures(f1, f2, matches, totalScore, type, &options)) {
         printf("matching failed, probably due to invalid match type\n");
         return -1;
     }
@@ -459,8 +729,8 @@ int mainTestSIFTMatch(int argc, char **argv) {
 // Match the SIFT features of one image to another, then compare the
 // match with a ground truth homography.  Compute the ROC points for various thresholds.
 int mainRocTestSIFTMatch(int argc, char **argv) {
-    if ((argc < 7) || (argc > 8)) {
-        printf("usage: %s rocSIFT featurefile1 featurefile2 homographyfile [matchtype] rocfilename aucfilename\n", argv[0]);
+    if ((argc < 7) || (argc > 11)) {
+        printf("usage: %s rocSIFT featurefile1 featurefile2 homographyfile [matchtype] rocfilename aucfilename [radius [angletolerance [scaletolerance]]]\n", argv[0]);
 
         return -1;
     }
@@ -470,12 +740,24 @@ int mainRocTestSIFTMatch(int argc, char **argv) {
     const char* filename;
     const char* aucfilename;
 
-    if (argc == 8) {
+    // Guide the matching with the homography if a search radius is given.
+    double radius = 0;
+
+    if (argc >= 8) {
         type = atoi(argv[5]);
         filename=argv[6];
         aucfilename=argv[7];
     }
 
+    if (argc >= 9) {
+        radius = atof(argv[8]);
+    }
+
+    // Prune the candidates by orientation (in degrees) and scale if
+    // tolerances are given.
+    double angleTolerance = (argc >= 10) ? atof(argv[9]) * PI / 180 : 0;
+    double scaleTolerance = (argc >= 11) ? atof(argv[10]) : 0;
+
     if (argc==7)
 	{
             filename=argv[5];
@@ -514,12 +796,26 @@ int mainRocTestSIFTMatch(int argc, char **argv) {
     double maxDistance=0.0;
     double totalScore;
 
+    MatchOptions options;
+
+    if (radius > 0) {
+        options.homography = h;
+        options.searchRadius = radius;
+    }
+
+    options.orientationTolerance = angleTolerance;
+    options.scaleTolerance = scaleTolerance;
+
     // Compute the match.
-    if (!matchFeatures(f1, f2, matches, totalScore, type)) {
+    if (!matchFeatures(f1, f2, matches, totalScore, type, &options)) {
         printf("matching failed, probably due to invalid match type\n");
         return -1;
     }
 
+    if ((angleTolerance > 0) || (scaleTolerance > 0)) {
+        reportPruning(f1, f2, h, type, options);
+    }
+
     //double d = evaluateMatch(f1, f2, matches, h);
     addRocData(f1,f2,matches,h,isMatch,5,maxDistance);
 
@@ -551,10 +847,12 @@ int mainRocTestSIFTMatch(int argc, char **argv) {
 
 // Compute the features of all the images in one of the benchmark sets,
 // then match the first image in the set with all of the others,
-// comparing the resulting match with the ground truth homography.
+// comparing the resulting match with the ground truth homography.  With
+// a cache directory, features extracted by an earlier run with the same
+// settings are loaded instead of computed again.
 int mainBenchmark(int argc, char **argv) {
-    if ((argc != 3) && (argc != 6)) {
-        printf("usage: %s benchmark imagedir [featuretype descriptortype matchtype]\n", argv[0]);
+    if ((argc != 3) && ((argc < 6) || (argc > 9))) {
+        printf("usage: %s benchmark imagedir [featuretype descriptortype matchtype [radius [cachedir [cachemb]]]]\n", argv[0]);
         return -1;
     }
 
@@ -562,7 +860,21 @@ int mainBenchmark(int argc, char **argv) {
     int descriptorType = 1;
     int matchType = 1;
 
-    if (argc == 6) {
+    // Guide the matching with the ground truth homography if a search
+    // radius is given.
+    double radius = 0;
+
+    if (argc >= 7) {
+        radius = atof(argv[6]);
+    }
+
+    shared_ptr<ExtractionCache> cache;
+
+    if (argc >= 8) {
+        cache.reset(new ExtractionCache(argv[7], (unsigned long long) ((argc > 8) ? atof(argv[8]) * 1048576 : 0)));
+    }
+
+    if (argc >= 6) {
         featureType = atoi(argv[3]);
         descriptorType =  atoi(argv[4]);
         matchType = atoi(argv[5]);
@@ -606,7 +918,11 @@ int mainBenchmark(int argc, char **argv) {
 
         // Compute the image features.
         printf("computing features for image %d\n", i+1);
-        computeFeatures(floatImage, features[i], featureType, descriptorType);
+        computeFeaturesCached(floatImage, features[i], featureType, descriptorType, cache.get());
+    }
+
+    if (cache) {
+        printf("extraction cache: %lld hits, %lld misses\n", cache->hit_count(), cache->miss_count());
     }
 
     string homographyFile;
@@ -642,10 +958,16 @@ int mainBenchmark(int argc, char **argv) {
 
         matches.clear();
         double totalScore;
+        MatchOptions options;
+
+        if (radius > 0) {
+            options.homography = h;
+            options.searchRadius = radius;
+        }
 
         // Compute the match.
         printf("matching image 1 with image %d\n", i+1);
-        if (!matchFeatures(features[0], features[i], matches, totalScore, matchType)) {
+        if (!matchFeatures(features[0], features[i], matches, totalScore, matchType, &options)) {
             printf("matching failed, probably due to invalid match type\n");
             return -1;
         }
@@ -672,89 +994,981 @@ int mainBenchmark(int argc, char **argv) {
 }
 
 
-void saveRocFile(const char* filename,vector<double> &thresholdList,vector<ROCPoint> &results)
-{
-    FILE *stream = fopen(filename, "wt");
-    if (stream == 0)
-        throw CError("saveRoc: could not open %s", filename);
+// Apply the changes that updateDatabase journaled for a database since
+// it was last compacted, so that they can be queried at once.
+static bool replayJournal(ImageDatabase &db, const char *databaseName) {
+    string name = ImageDatabase::journal_name(databaseName);
 
-    // Write out the numbers
+    if (!db.replay_journal(name.c_str())) {
+        printf("couldn't read journal %s\n", name.c_str());
+        return false;
+    }
 
-    fprintf(stream,"Threshold\tFP Rate\tTP Rate\n");
-    for (int i = 0; i < (int) results.size(); i++)
-	{
-            fprintf(stream,"%lf\t%lf\t%lf\n",thresholdList[i],results[i].falseRate,results[i].trueRate);
+    return true;
+}
 
-	}
+// Query a database and print the k best matching images in order.  With
+// a deadline, the query stops after that many milliseconds of matching
+// and prints the best images found so far.
+int mainQuery(int argc, char **argv) {
+    if ((argc < 4) || (argc > 9)) {
+        printf("usage: %s query databasefile featurefile [matchtype] [k] [sift] [verify] [deadlinems]\n", argv[0]);
+        return -1;
+    }
 
-    if (fclose(stream))
-        throw CError("saveRoc: error closing file", filename);
-}
+    int type = (argc > 4) ? atoi(argv[4]) : 1;
+    int k = (argc > 5) ? atoi(argv[5]) : 10;
+    bool sift = (argc > 6) && (atoi(argv[6]) != 0);
 
-void saveAUCFile(const char* filename,vector<double> &thresholdList,vector<ROCPoint> &results)
-{
-    double auc;
-    FILE *stream = fopen(filename, "wt");
-    if (stream == 0)
-        throw CError("saveAUC: could not open %s", filename);
+    MatchOptions options;
+    options.verifyTop = (argc > 7) ? atoi(argv[7]) : 0;
 
-    auc=computeAUC(results);
-    fprintf(stream,"%lf\n",auc);
-    if (fclose(stream))
-        throw CError("saveAUC: error closing file", filename);
-}
+    QueryToken token;
 
-int main(int argc, char **argv) {
-    // This lets us load various image formats.
-    fl_register_images();
+    if (argc > 8) {
+        options.token = &token;
+    }
 
-    if (argc > 1) {
-        if (strcmp(argv[1], "computeFeatures") == 0) {
-            return mainComputeFeatures(argc, argv);
-        }
-        else if (strcmp(argv[1], "matchFeatures") == 0) {
-            return mainMatchFeatures(argc, argv);
-        }
-        else if (strcmp(argv[1], "matchSIFTFeatures") == 0) {
-            return mainMatchSIFTFeatures(argc, argv);
-        }
-        else if (strcmp(argv[1], "testMatch") == 0) {
-            return mainTestMatch(argc, argv);
-        }
-        else if (strcmp(argv[1], "testSIFTMatch") == 0) {
-            return mainTestSIFTMatch(argc, argv);
+    ImageDatabase db;
+
+    db.cacheSift = sift && (atoi(argv[6]) == 2);
+
+    if (!db.load(argv[2], sift) || !replayJournal(db, argv[2])) {
+        printf("couldn't load database %s\n", argv[2]);
+        return -1;
+    }
+
+    FeatureSet f;
+
+    if (((!sift) && (!f.load(argv[3]))) || ((sift) && (!f.load_sift(argv[3])))) {
+        printf("couldn't load feature file %s\n", argv[3]);
+        return -1;
+    }
+
+    vector<QueryResult> results;
+
+    if (argc > 8) {
+        token.set_timeout(atof(argv[8]));
+    }
+
+    if (!performQuery(f, db, results, k, type, &options)) {
+        printf("query failed\n");
+        return -1;
+    }
+
+    if (token.partial()) {
+        printf("out of time, results are partial\n");
+    }
+
+    for (unsigned int i=0; i<results.size(); i++) {
+        if (results[i].inliers >= 0) {
+            printf("%d %s %f %d\n", i+1, db[results[i].index].name.c_str(), results[i].score, results[i].inliers);
         }
-        else if (strcmp(argv[1], "benchmark") == 0) {
-            return mainBenchmark(argc, argv);
+        else {
+            printf("%d %s %f\n", i+1, db[results[i].index].name.c_str(), results[i].score);
         }
-        else if (strcmp(argv[1], "rocSIFT") == 0)
-            {
-                //return saveRoc(argc,argv);
-                mainRocTestSIFTMatch(argc,argv);
-            }
-        else if (strcmp(argv[1], "roc") == 0)
-            {
-                //return saveRoc(argc,argv);
-                mainRocTestMatch(argc,argv);
+    }
+
+    return 0;
+}
+
+// Query a database with every feature file listed in a query file, one
+// name per line.  The queries are run in batches that share each pass
+// over the database, and the ranked results of each query are written
+// to the output file as the query name followed by one line per image.
+int mainBatchQuery(int argc, char **argv) {
+    if ((argc < 5) || (argc > 9)) {
+        printf("usage: %s batchQuery databasefile queryfile outfile [matchtype] [k] [sift] [batchsize]\n", argv[0]);
+        return -1;
+    }
+
+    int type = (argc > 5) ? atoi(argv[5]) : 1;
+    int k = (argc > 6) ? atoi(argv[6]) : 10;
+    bool sift = (argc > 7) && (atoi(argv[7]) != 0);
+    int batchSize = (argc > 8) ? atoi(argv[8]) : 256;
+
+    if (batchSize < 1) {
+        batchSize = 1;
+    }
+
+    ImageDatabase db;
+
+    db.cacheSift = sift && (atoi(argv[7]) == 2);
+
+    if (!db.load(argv[2], sift, false) || !replayJournal(db, argv[2])) {
+        printf("couldn't load database %s\n", argv[2]);
+        return -1;
+    }
+
+    DescriptorMatrix matrix;
+
+    if (!matrix.build(db)) {
+        printf("couldn't build descriptor matrix for %s\n", argv[2]);
+        return -1;
+    }
+
+    ifstream is(argv[3]);
+
+    if (!is.is_open()) {
+        printf("couldn't open query file %s\n", argv[3]);
+        return -1;
+    }
+
+    vector<string> names;
+    string name;
+
+    while (is >> name) {
+        names.push_back(name);
+    }
+
+    FILE *f = fopen(argv[4], "w");
+
+    if (f == NULL) {
+        printf("couldn't open output file %s\n", argv[4]);
+        return -1;
+    }
+
+    for (unsigned int b=0; b<names.size(); b+=batchSize) {
+        unsigned int e = min((unsigned int) names.size(), b + batchSize);
+        vector<FeatureSet> queries(e - b);
+
+        for (unsigned int i=b; i<e; i++) {
+            FeatureSet &q = queries[i-b];
+
+            if (((!sift) && (!q.load(names[i].c_str()))) || ((sift) && (!q.load_sift(names[i].c_str())))) {
+                printf("couldn't load feature file %s\n", names[i].c_str());
+                q.clear();
             }
+        }
 
-        else {
-            printf("usage:\n");
-            printf("\t%s\n", argv[0]);
-            printf("\t%s computeFeatures imagefile featurefile [featuretype]\n", argv[0]);
-            printf("\t%s matchFeatures featurefile1 featurefile2 threshold matchfile [matchtype]\n", argv[0]);
-            printf("\t%s matchSIFTFeatures featurefile1 featurefile2 threshold matchfile [matchtype]\n", argv[0]);
-            // printf("\t%s testMatch featurefile1 featurefile2 homographyfile [matchtype]\n", argv[0]);
-            // printf("\t%s testSIFTMatch featurefile1 featurefile2 homographyfile [matchtype]\n", argv[0]);
-            // printf("\t%s benchmark imagedir [featuretype matchtype]\n", argv[0]);
-            printf("\t%s rocSIFT featurefile1 featurefile2 homographyfile [matchtype] rocfilename aucfilename\n", argv[0]);
-            printf("\t%s roc featurefile1 featurefile2 homographyfile [matchtype] rocfilename aucfilename\n", argv[0]);
+        vector< vector<QueryResult> > results;
 
+        if (!performBatchQuery(queries, matrix, results, k, type)) {
+            printf("batch query failed, probably due to invalid match type\n");
+            fclose(f);
             return -1;
         }
-    }
-    else {
-        // Use the GUI.
+
+        for (unsigned int i=b; i<e; i++) {
+            const vector<QueryResult> &r = results[i-b];
+
+            fprintf(f, "%s %d\n", names[i].c_str(), (int) r.size());
+
+            for (unsigned int j=0; j<r.size(); j++) {
+                fprintf(f, "%d %s %lf\n", j+1, db[r[j].index].name.c_str(), r[j].score);
+            }
+        }
+
+        printf("processed %d of %d queries\n", e, (int) names.size());
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+// Pack the features of a database into a single file that can be
+// loaded in place of the database file.  The feature files are read one
+// at a time, so the database does not have to fit in memory.
+int mainBuildDatabase(int argc, char **argv) {
+    if ((argc < 4) || (argc > 5)) {
+        printf("usage: %s buildDatabase databasefile packedfile [sift]\n", argv[0]);
+        return -1;
+    }
+
+    bool sift = (argc > 4) && (atoi(argv[4]) != 0);
+
+    ImageDatabase db;
+
+    db.cacheSift = sift && (atoi(argv[4]) == 2);
+
+    if (!db.load(argv[2], sift, false)) {
+        printf("couldn't load database %s\n", argv[2]);
+        return -1;
+    }
+
+    if (!savePackedDatabase(argv[3], db)) {
+        printf("couldn't save packed database %s\n", argv[3]);
+        return -1;
+    }
+
+    PackedDatabase packed;
+
+    if (!packed.open(argv[3])) {
+        printf("couldn't open packed database %s\n", argv[3]);
+        return -1;
+    }
+
+    printf("packed %d features of %d images\n", packed.features(), packed.items());
+
+    return 0;
+}
+
+// Change a database through its journal: add an image, remove one,
+// replace its features, or compact the database and journal into a
+// packed database file.  The journal file is created if it doesn't
+// exist.  Queries see the changes before compaction only through the
+// journal named after the database file, which a journal file of "-"
+// selects.  Compaction is only done when asked for.  For compaction,
+// an index built over the database before the journal's changes can be
+// given; the changes are applied to it and it is renumbered and saved
+// along with the packed database.
+int mainUpdateDatabase(int argc, char **argv) {
+    string op = (argc > 4) ? argv[4] : "";
+    bool ok = ((op == "add") && (argc == 7)) || ((op == "remove") && (argc == 6)) ||
+        ((op == "replace") && (argc == 7)) || ((op == "compact") && ((argc == 6) || (argc == 7)));
+
+    if (!ok) {
+        printf("usage: %s updateDatabase databasefile (journalfile | -) add name featurefile\n", argv[0]);
+        printf("       %s updateDatabase databasefile (journalfile | -) remove name\n", argv[0]);
+        printf("       %s updateDatabase databasefile (journalfile | -) replace name featurefile\n", argv[0]);
+        printf("       %s updateDatabase databasefile (journalfile | -) compact packedfile [indexfile]\n", argv[0]);
+        return -1;
+    }
+
+    ImageDatabase db;
+
+    if (!db.load(argv[2], false, false)) {
+        printf("couldn't load database %s\n", argv[2]);
+        return -1;
+    }
+
+    DescriptorIndex *index = NULL;
+
+    if ((op == "compact") && (argc == 7)) {
+        index = loadDescriptorIndex(argv[6]);
+
+        if (index == NULL) {
+            printf("couldn't load index file %s\n", argv[6]);
+            return -1;
+        }
+
+        db.attach_index(index);
+    }
+
+    // Queries read the journal named after the database, which "-"
+    // stands for.
+    string journalName = (strcmp(argv[3], "-") == 0) ? ImageDatabase::journal_name(argv[2]) : argv[3];
+
+    if (!db.open_journal(journalName.c_str())) {
+        printf("couldn't open journal %s\n", journalName.c_str());
+        delete index;
+        return -1;
+    }
+
+    FeatureSet f;
+
+    if (((op == "add") || (op == "replace")) && !f.load(argv[6])) {
+        printf("couldn't load feature file %s\n", argv[6]);
+        return -1;
+    }
+
+    if (op == "add") {
+        int i = db.add_item(argv[5], f);
+
+        if (i < 0) {
+            printf("couldn't add %s\n", argv[5]);
+            return -1;
+        }
+
+        printf("added %s as item %d\n", argv[5], i);
+    }
+    else if ((op == "remove") || (op == "replace")) {
+        int i = db.find_item(argv[5]);
+
+        if (i < 0) {
+            printf("no item named %s\n", argv[5]);
+            return -1;
+        }
+
+        if (op == "remove") {
+            if (!db.remove_item(i)) {
+                printf("couldn't remove %s\n", argv[5]);
+                return -1;
+            }
+
+            printf("removed item %d\n", i);
+        }
+        else {
+            int j = db.replace_item(i, f);
+
+            if (j < 0) {
+                printf("couldn't replace %s\n", argv[5]);
+                return -1;
+            }
+
+            printf("replaced item %d with item %d\n", i, j);
+        }
+    }
+    else {
+        if (!db.compact(argv[5])) {
+            printf("couldn't compact database into %s\n", argv[5]);
+            delete index;
+            return -1;
+        }
+
+        printf("compacted %d images into %s (generation %u)\n", (int) db.size(), argv[5], db.generation());
+
+        // The changes are in the packed database now, and its queries
+        // read a journal named after it.
+        string packedJournal = ImageDatabase::journal_name(argv[5]);
+
+        if ((strcmp(argv[3], "-") == 0) && (packedJournal != journalName)) {
+            if (!db.open_journal(packedJournal.c_str())) {
+                printf("couldn't open journal %s\n", packedJournal.c_str());
+                delete index;
+                return -1;
+            }
+
+            remove(journalName.c_str());
+        }
+
+        if (index != NULL) {
+            bool saved = index->save(argv[6]);
+            delete index;
+
+            if (!saved) {
+                printf("couldn't save index file %s\n", argv[6]);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Build a compressed IVF-PQ index over the descriptors of a database.
+// The feature files are read one at a time, so the database does not
+// have to fit in memory.
+int mainBuildIndex(int argc, char **argv) {
+    if ((argc < 4) || (argc > 7)) {
+        printf("usage: %s buildIndex databasefile indexfile [sift] [lists] [subspaces]\n", argv[0]);
+        return -1;
+    }
+
+    bool sift = (argc > 4) && (atoi(argv[4]) != 0);
+    int numLists = (argc > 5) ? atoi(argv[5]) : 256;
+    int numSubspaces = (argc > 6) ? atoi(argv[6]) : 16;
+
+    ImageDatabase db;
+
+    db.cacheSift = sift && (atoi(argv[4]) == 2);
+
+    if (!db.load(argv[2], sift, false)) {
+        printf("couldn't load database %s\n", argv[2]);
+        return -1;
+    }
+
+    PQIndex index;
+
+    printf("building index over %d images\n", (int) db.size());
+
+    if (!index.build(db, numLists, numSubspaces, 100000)) {
+        printf("couldn't build index\n");
+        return -1;
+    }
+
+    if (!index.save(argv[3])) {
+        printf("couldn't save index file %s\n", argv[3]);
+        return -1;
+    }
+
+    printf("indexed %d features\n", index.size());
+
+    return 0;
+}
+
+// Build a multi-probe LSH index over the descriptors of a database.
+int mainBuildLSHIndex(int argc, char **argv) {
+    if ((argc < 4) || (argc > 7)) {
+        printf("usage: %s buildLSHIndex databasefile indexfile [sift] [tables] [keybits]\n", argv[0]);
+        return -1;
+    }
+
+    bool sift = (argc > 4) && (atoi(argv[4]) != 0);
+    int numTables = (argc > 5) ? atoi(argv[5]) : 8;
+    int keyBits = (argc > 6) ? atoi(argv[6]) : 16;
+
+    ImageDatabase db;
+
+    db.cacheSift = sift && (atoi(argv[4]) == 2);
+
+    if (!db.load(argv[2], sift, false)) {
+        printf("couldn't load database %s\n", argv[2]);
+        return -1;
+    }
+
+    LSHIndex index;
+
+    printf("building index over %d images\n", (int) db.size());
+
+    if (!index.build(db, numTables, keyBits, 100000)) {
+        printf("couldn't build index\n");
+        return -1;
+    }
+
+    if (!index.save(argv[3])) {
+        printf("couldn't save index file %s\n", argv[3]);
+        return -1;
+    }
+
+    printf("indexed %d features\n", index.size());
+
+    return 0;
+}
+
+// Query a database through an IVF-PQ or LSH index.  The shortlisted
+// images are re-ranked with their full descriptors, loaded from disk.
+int mainIndexQuery(int argc, char **argv) {
+    if ((argc < 5) || (argc > 9)) {
+        printf("usage: %s indexQuery databasefile indexfile featurefile [matchtype] [sift] [rerank] [cachemb]\n", argv[0]);
+        return -1;
+    }
+
+    int type = (argc > 5) ? atoi(argv[5]) : 1;
+    bool sift = (argc > 6) && (atoi(argv[6]) != 0);
+
+    ImageDatabase db;
+
+    db.cacheSift = sift && (atoi(argv[6]) == 2);
+
+    if (argc > 8) {
+        db.use_cache((size_t) (atof(argv[8]) * 1048576));
+    }
+
+    if (!db.load(argv[2], sift, false)) {
+        printf("couldn't load database %s\n", argv[2]);
+        return -1;
+    }
+
+    FeatureSet f;
+
+    if (((!sift) && (!f.load(argv[4]))) || ((sift) && (!f.load_sift(argv[4])))) {
+        printf("couldn't load feature file %s\n", argv[4]);
+        return -1;
+    }
+
+    DescriptorIndex *index = loadDescriptorIndex(argv[3]);
+
+    if (index == NULL) {
+        printf("couldn't load index file %s\n", argv[3]);
+        return -1;
+    }
+
+    // The index covers the compacted database; the journaled changes
+    // are applied to it along with the database.
+    db.attach_index(index);
+
+    if (!replayJournal(db, argv[2])) {
+        delete index;
+        return -1;
+    }
+
+    MatchOptions options;
+    options.index = index;
+    options.rerank = (argc <= 7) || (atoi(argv[7]) != 0);
+
+    int bestIndex;
+    vector<FeatureMatch> matches;
+    double score;
+
+    bool success = performQuery(f, db, bestIndex, matches, score, type, &options);
+    delete index;
+
+    if (!success) {
+        printf("query failed\n");
+        return -1;
+    }
+
+    printf("%s %f\n", db[bestIndex].name.c_str(), score);
+
+    if (db.cache) {
+        FeatureSetCacheStats s = db.cache->stats();
+        printf("cache: %lld hits, %lld misses, %lld evictions, %lld prefetches, %d items in %.1f MB\n",
+            s.hits, s.misses, s.evictions, s.prefetches, s.items, s.bytes / 1048576.0);
+    }
+
+    return 0;
+}
+
+
+// Serve one shard of a database, or the whole database, to a
+// coordinator over a socket.  The address is a Unix socket path or a
+// TCP host:port.
+int mainServeShard(int argc, char **argv) {
+    if ((argc < 4) || (argc > 7)) {
+        printf("usage: %s serveShard databasefile address [shard] [shards] [sift]\n", argv[0]);
+        return -1;
+    }
+
+    int shard = (argc > 4) ? atoi(argv[4]) : 0;
+    int shards = (argc > 5) ? atoi(argv[5]) : 1;
+    bool sift = (argc > 6) && (atoi(argv[6]) != 0);
+
+    QueryServer server;
+
+    if (!server.load(argv[2], sift, shard, shards)) {
+        printf("couldn't load shard %d of %d of database %s\n", shard, shards, argv[2]);
+        return -1;
+    }
+
+    printf("serving %d images on %s\n", (int) server.snapshot()->db.size(), argv[3]);
+
+    if (!server.serve(argv[3])) {
+        printf("couldn't listen on %s\n", argv[3]);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Start a query server for each shard of a database as a local child
+// process, listening on a Unix socket named after the shard.  The
+// servers stop when the coordinator sends them a shutdown message.
+static bool startLocalShards(const char *databaseName, bool sift, int shards, vector<string> &addresses, vector<int> &children) {
+#ifndef _WIN32
+    for (int i=0; i<shards; i++) {
+        char address[256];
+        sprintf(address, "/tmp/features-%d-%d.sock", (int) getpid(), i);
+        addresses.push_back(address);
+        unlink(address);
+
+        fflush(stdout);
+        pid_t child = fork();
+
+        if (child < 0) {
+            return false;
+        }
+        else if (child == 0) {
+            QueryServer server;
+            server.allow_shutdown(true);
+
+            bool ok = server.load(databaseName, sift, i, shards) && server.serve(address);
+            unlink(address);
+            _exit(ok ? 0 : 1);
+        }
+
+        children.push_back(child);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Query a database split into shards served by query servers, and
+// print the merged results.  The shards are either a comma separated
+// list of server addresses, or local:n to start n local servers for
+// the run.  Shards that fail or don't answer within the timeout are
+// left out, and the results are reported as partial.
+int mainShardedQuery(int argc, char **argv) {
+    if ((argc < 5) || (argc > 9)) {
+        printf("usage: %s shardedQuery databasefile featurefile (addresses | local:n) [matchtype] [k] [sift] [timeoutms]\n", argv[0]);
+        return -1;
+    }
+
+    int type = (argc > 5) ? atoi(argv[5]) : 1;
+    int k = (argc > 6) ? atoi(argv[6]) : 10;
+    bool sift = (argc > 7) && (atoi(argv[7]) != 0);
+    int timeout = (argc > 8) ? atoi(argv[8]) : 5000;
+
+    // Children are forked first, before this process starts any threads.
+    vector<string> addresses;
+    vector<int> children;
+    string shardList = argv[4];
+
+    if (shardList.compare(0, 6, "local:") == 0) {
+        if (!startLocalShards(argv[2], sift, max(atoi(argv[4] + 6), 1), addresses, children)) {
+            printf("couldn't start local shards\n");
+            return -1;
+        }
+    }
+    else {
+        size_t start = 0;
+
+        while (start <= shardList.size()) {
+            size_t end = shardList.find(',', start);
+
+            if (end == string::npos) {
+                end = shardList.size();
+            }
+
+            if (end > start) {
+                addresses.push_back(shardList.substr(start, end - start));
+            }
+
+            start = end + 1;
+        }
+    }
+
+    ImageDatabase db;
+
+    if (!db.load(argv[2], sift, false) || !replayJournal(db, argv[2])) {
+        printf("couldn't load database %s\n", argv[2]);
+        return -1;
+    }
+
+    QueryRequest request;
+    request.k = k;
+    request.matchType = type;
+
+    if (((!sift) && (!request.features.load(argv[3]))) || ((sift) && (!request.features.load_sift(argv[3])))) {
+        printf("couldn't load feature file %s\n", argv[3]);
+        return -1;
+    }
+
+    ShardedDatabase shards;
+
+    for (unsigned int i=0; i<addresses.size(); i++) {
+        shards.add_shard(addresses[i]);
+    }
+
+    // Local shards take a while to load, so wait for them to come up.
+    if (!children.empty()) {
+        time_t giveUp = time(NULL) + 600;
+
+        while ((shards.connect(100) < shards.shards()) && (time(NULL) < giveUp)) {
+#ifndef _WIN32
+            if (waitpid(-1, NULL, WNOHANG) > 0) {
+                printf("a local shard failed to start\n");
+                break;
+            }
+
+            usleep(50000);
+#endif
+        }
+    }
+
+    vector<QueryResult> results;
+    int answered = shards.query(request, results, timeout);
+
+    printf("%d of %d shards answered%s\n", answered, shards.shards(), (answered < shards.shards()) ? ", results are partial" : "");
+
+    for (unsigned int i=0; i<results.size(); i++) {
+        int index = results[i].index;
+        const char *name = ((index >= 0) && (index < (int) db.size())) ? db[index].name.c_str() : "?";
+
+        printf("%d %s %f\n", i+1, name, results[i].score);
+    }
+
+    if (!children.empty()) {
+        shards.shutdown();
+
+#ifndef _WIN32
+        for (unsigned int i=0; i<children.size(); i++) {
+            waitpid(children[i], NULL, 0);
+        }
+#endif
+    }
+
+    return (answered > 0) ? 0 : -1;
+}
+
+// The server run by mainServe, stopped by an interrupt.
+static QueryServer *runningServer = NULL;
+
+static void stopServer(int) {
+    if (runningServer != NULL) {
+        runningServer->stop();
+    }
+}
+
+// Reload the database of the running server, after a new build of it
+// has been written.
+static void reloadServer(int) {
+    if (runningServer != NULL) {
+        runningServer->request_reload();
+    }
+}
+
+// Load a database once and answer queries for it over a socket until
+// interrupted.  Features extracted from query images can be kept in a
+// cache directory, given as - for none.  Queries arriving within
+// windowms of each other are answered together, up to maxbatch at a
+// time; at most maxqueue wait, and with a latency target, queries that
+// can't be answered within targetms are turned away.  The results of
+// recent queries can be kept, so repeated queries are answered without
+// matching.  A hangup signal reloads the database file in the
+// background and swaps it in without interrupting the queries being
+// answered.
+int mainServe(int argc, char **argv) {
+    if ((argc < 4) || (argc > 12)) {
+        printf("usage: %s serve databasefile address [sift] [cachemb] [extractcachedir] [maxbatch] [windowms] [maxqueue] [targetms] [resultcachemb]\n", argv[0]);
+        return -1;
+    }
+
+    bool sift = (argc > 4) && (atoi(argv[4]) != 0);
+
+    QueryServer server;
+
+    if (argc > 5) {
+        server.use_cache((size_t) (atof(argv[5]) * 1048576));
+    }
+
+    if ((argc > 6) && (strcmp(argv[6], "-") != 0)) {
+        server.use_extraction_cache(argv[6]);
+    }
+
+    BatchOptions batching;
+
+    if (argc > 7) {
+        batching.maxBatch = atoi(argv[7]);
+    }
+
+    if (argc > 8) {
+        batching.windowMs = atoi(argv[8]);
+    }
+
+    if (argc > 9) {
+        batching.maxQueue = atoi(argv[9]);
+    }
+
+    if (argc > 10) {
+        batching.latencyTargetMs = atoi(argv[10]);
+    }
+
+    server.use_batching(batching);
+
+    if ((argc > 11) && (atof(argv[11]) > 0)) {
+        server.use_result_cache((size_t) (atof(argv[11]) * 1048576));
+    }
+
+    if (!server.load(argv[2], sift)) {
+        printf("couldn't load database %s\n", argv[2]);
+        return -1;
+    }
+
+    runningServer = &server;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+#ifdef SIGHUP
+    signal(SIGHUP, reloadServer);
+#endif
+
+    printf("serving %d images on %s\n", (int) server.snapshot()->db.size(), argv[3]);
+    fflush(stdout);
+
+    bool ok = server.serve(argv[3]);
+    runningServer = NULL;
+
+    if (!ok) {
+        printf("couldn't listen on %s\n", argv[3]);
+        return -1;
+    }
+
+    QueryServerStats stats = server.statistics();
+    printf("answered %lld queries (%lld from the result cache) in %lld batches, turned away %lld, dropped %lld late\n",
+        stats.answered, stats.cached, stats.batches, stats.rejected, stats.expired);
+
+    return 0;
+}
+
+// Send a query to a server started by serve and print the ranked
+// results.  The query is a feature file, a SIFT key file, or an image
+// whose features the server extracts.  The server can be given a
+// deadline, after which it sends the best results it has.
+int mainQueryServer(int argc, char **argv) {
+    if ((argc < 4) || (argc > 10)) {
+        printf("usage: %s queryServer address file [matchtype] [k] [input] [featuretype] [descriptortype] [deadlinems]\n", argv[0]);
+        printf("\tinput: 0 for a feature file, 1 for a SIFT key file, 2 for an image\n");
+        return -1;
+    }
+
+    QueryRequest request;
+    request.matchType = (argc > 4) ? atoi(argv[4]) : 1;
+    request.k = (argc > 5) ? atoi(argv[5]) : 10;
+    request.names = true;
+    request.deadlineMs = (argc > 9) ? atoi(argv[9]) : 0;
+
+    int input = (argc > 6) ? atoi(argv[6]) : 0;
+
+    if (input == 2) {
+        request.featureType = (argc > 7) ? atoi(argv[7]) : 1;
+        request.descriptorType = (argc > 8) ? atoi(argv[8]) : 1;
+
+        if (!LoadImageFile(argv[3], request.image)) {
+            printf("couldn't load image %s\n", argv[3]);
+            return -1;
+        }
+    }
+    else if (((input == 0) && !request.features.load(argv[3])) || ((input == 1) && !request.features.load_sift(argv[3]))) {
+        printf("couldn't load feature file %s\n", argv[3]);
+        return -1;
+    }
+
+    int socket = connectSocket(argv[2], 5000);
+
+    if (socket < 0) {
+        printf("couldn't connect to %s\n", argv[2]);
+        return -1;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<QueryResult> results;
+    vector<string> names;
+    bool partial = false;
+
+    bool ok = remoteQuery(socket, request, results, &names, -1, &partial);
+    closeSocket(socket);
+
+    if (!ok) {
+        printf("query failed\n");
+        return -1;
+    }
+
+    if (partial) {
+        printf("out of time, results are partial\n");
+    }
+
+    for (unsigned int i=0; i<results.size(); i++) {
+        printf("%d %s %f\n", i+1, (i < names.size()) ? names[i].c_str() : "?", results[i].score);
+    }
+
+    printf("answered in %.1f ms\n", chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    return 0;
+}
+
+
+void saveRocFile(const char* filename,vector<double> &thresholdList,vector<ROCPoint> &results)
+{
+    FILE *stream = fopen(filename, "wt");
+    if (stream == 0)
+        throw CError("saveRoc: could not open %s", filename);
+
+    // Write out the numbers
+
+    fprintf(stream,"Threshold\tFP Rate\tTP Rate\n");
+    for (int i = 0; i < (int) results.size(); i++)
+	{
+            fprintf(stream,"%lf\t%lf\t%lf\n",thresholdList[i],results[i].falseRate,results[i].trueRate);
+
+	}
+
+    if (fclose(stream))
+        throw CError("saveRoc: error closing file", filename);
+}
+
+void saveAUCFile(const char* filename,vector<double> &thresholdList,vector<ROCPoint> &results)
+{
+    double auc;
+    FILE *stream = fopen(filename, "wt");
+    if (stream == 0)
+        throw CError("saveAUC: could not open %s", filename);
+
+    auc=computeAUC(results);
+    fprintf(stream,"%lf\n",auc);
+    if (fclose(stream))
+        throw CError("saveAUC: error closing file", filename);
+}
+
+int main(int argc, char **argv) {
+    // This lets us load various image formats.
+    fl_register_images();
+
+    if (argc > 1) {
+        if (strcmp(argv[1], "computeFeatures") == 0) {
+            return mainComputeFeatures(argc, argv);
+        }
+        else if (strcmp(argv[1], "computeFeaturesBatch") == 0) {
+            return mainComputeFeaturesBatch(argc, argv);
+        }
+        else if (strcmp(argv[1], "convertFeatures") == 0) {
+            return mainConvertFeatures(argc, argv);
+        }
+        else if (strcmp(argv[1], "matchFeatures") == 0) {
+            return mainMatchFeatures(argc, argv);
+        }
+        else if (strcmp(argv[1], "matchSIFTFeatures") == 0) {
+            return mainMatchSIFTFeatures(argc, argv);
+        }
+        else if (strcmp(argv[1], "testMatch") == 0) {
+            return mainTestMatch(argc, argv);
+        }
+        else if (strcmp(argv[1], "testSIFTMatch") == 0) {
+            return mainTestSIFTMatch(argc, argv);
+        }
+        else if (strcmp(argv[1], "benchmark") == 0) {
+            return mainBenchmark(argc, argv);
+        }
+        else if (strcmp(argv[1], "query") == 0) {
+            return mainQuery(argc, argv);
+        }
+        else if (strcmp(argv[1], "batchQuery") == 0) {
+            return mainBatchQuery(argc, argv);
+        }
+        else if (strcmp(argv[1], "buildDatabase") == 0) {
+            return mainBuildDatabase(argc, argv);
+        }
+        else if (strcmp(argv[1], "updateDatabase") == 0) {
+            return mainUpdateDatabase(argc, argv);
+        }
+        else if (strcmp(argv[1], "buildIndex") == 0) {
+            return mainBuildIndex(argc, argv);
+        }
+        else if (strcmp(argv[1], "buildLSHIndex") == 0) {
+            return mainBuildLSHIndex(argc, argv);
+        }
+        else if (strcmp(argv[1], "indexQuery") == 0) {
+            return mainIndexQuery(argc, argv);
+        }
+        else if (strcmp(argv[1], "serveShard") == 0) {
+            return mainServeShard(argc, argv);
+        }
+        else if (strcmp(argv[1], "shardedQuery") == 0) {
+            return mainShardedQuery(argc, argv);
+        }
+        else if (strcmp(argv[1], "serve") == 0) {
+            return mainServe(argc, argv);
+        }
+        else if (strcmp(argv[1], "queryServer") == 0) {
+            return mainQueryServer(argc, argv);
+        }
+        else if (strcmp(argv[1], "rocSIFT") == 0)
+            {
+                //return saveRoc(argc,argv);
+                mainRocTestSIFTMatch(argc,argv);
+            }
+        else if (strcmp(argv[1], "roc") == 0)
+            {
+                //return saveRoc(argc,argv);
+                mainRocTestMatch(argc,argv);
+            }
+
+        else {
+            printf("usage:\n");
+            printf("\t%s\n", argv[0]);
+            printf("\t%s computeFeatures imagefile featurefile [featuretype] [descriptortype] [binary] [cachedir]\n", argv[0]);
+            printf("\t%s computeFeaturesBatch (imagedir | listfile) databasefile [featuretype] [descriptortype] [binary] [cachedir] [threads]\n", argv[0]);
+            printf("\t%s convertFeatures infile outfile [binary] [sift]\n", argv[0]);
+            printf("\t%s matchFeatures featurefile1 featurefile2 threshold matchfile [matchtype] [plan]\n", argv[0]);
+            printf("\t%s matchSIFTFeatures featurefile1 featurefile2 threshold matchfile [matchtype] [plan]\n", argv[0]);
+            // printf("\t%s testMatch featurefile1 featurefile2 homographyfile [matchtype]\n", argv[0]);
+            // printf("\t%s testSIFTMatch featurefile1 featurefile2 homographyfile [matchtype]\n", argv[0]);
+            // printf("\t%s benchmark imagedir [featuretype matchtype]\n", argv[0]);
+            printf("\t%s rocSIFT featurefile1 featurefile2 homographyfile [matchtype] rocfilename aucfilename [radius [angletolerance [scaletolerance]]]\n", argv[0]);
+            printf("\t%s roc featurefile1 featurefile2 homographyfile [matchtype] rocfilename aucfilename [radius [angletolerance [scaletolerance]]]\n", argv[0]);
+            printf("\t%s query databasefile featurefile [matchtype] [k] [sift] [verify] [deadlinems]\n", argv[0]);
+            printf("\t%s batchQuery databasefile queryfile outfile [matchtype] [k] [sift] [batchsize]\n", argv[0]);
+            printf("\t%s buildDatabase databasefile packedfile [sift]\n", argv[0]);
+            printf("\t%s updateDatabase databasefile (journalfile | -) (add name featurefile | remove name | replace name featurefile | compact packedfile [indexfile])\n", argv[0]);
+            printf("\t%s buildIndex databasefile indexfile [sift] [lists] [subspaces]\n", argv[0]);
+            printf("\t%s buildLSHIndex databasefile indexfile [sift] [tables] [keybits]\n", argv[0]);
+            printf("\t%s indexQuery databasefile indexfile featurefile [matchtype] [sift] [rerank] [cachemb]\n", argv[0]);
+            printf("\t%s serveShard databasefile address [shard] [shards] [sift]\n", argv[0]);
+            printf("\t%s shardedQuery databasefile featurefile (addresses | local:n) [matchtype] [k] [sift] [timeoutms]\n", argv[0]);
+            printf("\t%s serve databasefile address [sift] [cachemb] [extractcachedir] [maxbatch] [windowms] [maxqueue] [targetms] [resultcachemb]\n", argv[0]);
+            printf("\t%s queryServer address file [matchtype] [k] [input] [featuretype] [descriptortype] [deadlinems]\n", argv[0]);
+            printf("\n\tsift: 1 to read SIFT key files, 2 to also cache them as binary feature files\n");
+            printf("\tbinary: 0 for text, 1 for binary, 2 or 3 for compressed with 8 or 4-bit descriptors\n");
+
+            return -1;
+        }
+    }
+    else {
+        // Use the GUI, which still writes the Harris image for debugging.
+        dumpHarrisImage = true;
+
         doc = new FeaturesDoc();
         ui = new FeaturesUI();
 
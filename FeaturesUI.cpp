@@ -172,6 +172,16 @@ void FeaturesUI::cb_match_algorithm_2(Fl_Menu_ *o, void *v) {
 	who_am_i(o)->doc->set_match_algorithm(2);
 }
 
+// Called when the user selects "Algorithm 3".
+void FeaturesUI::cb_match_algorithm_3(Fl_Menu_ *o, void *v) {
+	who_am_i(o)->doc->set_match_algorithm(3);
+}
+
+// Called when the user selects "Algorithm 4".
+void FeaturesUI::cb_match_algorithm_4(Fl_Menu_ *o, void *v) {
+	who_am_i(o)->doc->set_match_algorithm(4);
+}
+
 // Called when the user clicks the "About" menu item.
 void FeaturesUI::cb_about(Fl_Menu_ *o, void *v) {
 	fl_message("Project 2 Features UI");
@@ -200,6 +210,8 @@ Fl_Menu_Item FeaturesUI::menuItems[] = {
 		{"&Select Match Algorithm", 0, 0, 0, FL_SUBMENU},
 			{"&Algorithm 1", 0, (Fl_Callback *)FeaturesUI::cb_match_algorithm_1},
 			{"&Algorithm 2", 0, (Fl_Callback *)FeaturesUI::cb_match_algorithm_2},
+			{"&Algorithm 3", 0, (Fl_Callback *)FeaturesUI::cb_match_algorithm_3},
+			{"&Algorithm 4", 0, (Fl_Callback *)FeaturesUI::cb_match_algorithm_4},
 			{0},
 		{"&Toggle Features", 0, (Fl_Callback *)FeaturesUI::cb_toggle_features},
 		{0},
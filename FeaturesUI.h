@@ -62,6 +62,8 @@ private:
 	static void cb_perform_query(Fl_Menu_ *o, void *v);
 	static void cb_match_algorithm_1(Fl_Menu_ *o, void *v);
 	static void cb_match_algorithm_2(Fl_Menu_ *o, void *v);
+	static void cb_match_algorithm_3(Fl_Menu_ *o, void *v);
+	static void cb_match_algorithm_4(Fl_Menu_ *o, void *v);
 	static void cb_about(Fl_Menu_ *o, void *v);
 
 	// Here is the array of menu items.
@@ -0,0 +1,424 @@
+/* Homography.cpp */
+
+#include <math.h>
+#include <algorithm>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+#include "Homography.h"
+
+// Number of correspondences in a minimal sample.
+static const int sampleSize = 4;
+
+// Default estimation settings.
+HomographyOptions::HomographyOptions() {
+    inlierThreshold = 5.0;
+    confidence = 0.99;
+    maxIterations = 1000;
+}
+
+// A small linear congruential generator, so that estimates are
+// repeatable from run to run.
+static unsigned int nextRandom(unsigned int &state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// Transform a batch of points by homography.
+void applyHomography(const double h[9], const float *x, const float *y, int n, float *xNew, float *yNew) {
+    int i = 0;
+
+#ifdef __AVX__
+    __m256 h0 = _mm256_set1_ps((float) h[0]), h1 = _mm256_set1_ps((float) h[1]), h2 = _mm256_set1_ps((float) h[2]);
+    __m256 h3 = _mm256_set1_ps((float) h[3]), h4 = _mm256_set1_ps((float) h[4]), h5 = _mm256_set1_ps((float) h[5]);
+    __m256 h6 = _mm256_set1_ps((float) h[6]), h7 = _mm256_set1_ps((float) h[7]), h8 = _mm256_set1_ps((float) h[8]);
+
+    for (; i+8<=n; i+=8) {
+        __m256 px = _mm256_loadu_ps(x + i);
+        __m256 py = _mm256_loadu_ps(y + i);
+        __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h0, px), _mm256_mul_ps(h1, py)), h2);
+        __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h3, px), _mm256_mul_ps(h4, py)), h5);
+        __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h6, px), _mm256_mul_ps(h7, py)), h8);
+
+        _mm256_storeu_ps(xNew + i, _mm256_div_ps(u, w));
+        _mm256_storeu_ps(yNew + i, _mm256_div_ps(v, w));
+    }
+#endif
+
+    for (; i<n; i++) {
+        double d = h[6]*x[i] + h[7]*y[i] + h[8];
+
+        xNew[i] = (float) ((h[0]*x[i] + h[1]*y[i] + h[2]) / d);
+        yNew[i] = (float) ((h[3]*x[i] + h[4]*y[i] + h[5]) / d);
+    }
+}
+
+// Count the inliers of a homography.  The reprojection error is tested
+// as |(u, v) - w (x2, y2)|^2 <= t^2 w^2, which avoids the division, and
+// points mapped behind the camera (w <= 0) are outliers.
+int countInliers(const double h[9], const float *x1, const float *y1, const float *x2, const float *y2, int n, double threshold, unsigned char *mask) {
+    float t2 = (float) (threshold * threshold);
+    int count = 0;
+    int i = 0;
+
+#ifdef __AVX__
+    __m256 h0 = _mm256_set1_ps((float) h[0]), h1 = _mm256_set1_ps((float) h[1]), h2 = _mm256_set1_ps((float) h[2]);
+    __m256 h3 = _mm256_set1_ps((float) h[3]), h4 = _mm256_set1_ps((float) h[4]), h5 = _mm256_set1_ps((float) h[5]);
+    __m256 h6 = _mm256_set1_ps((float) h[6]), h7 = _mm256_set1_ps((float) h[7]), h8 = _mm256_set1_ps((float) h[8]);
+    __m256 limit = _mm256_set1_ps(t2);
+    __m256 zero = _mm256_setzero_ps();
+
+    for (; i+8<=n; i+=8) {
+        __m256 px = _mm256_loadu_ps(x1 + i);
+        __m256 py = _mm256_loadu_ps(y1 + i);
+        __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h0, px), _mm256_mul_ps(h1, py)), h2);
+        __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h3, px), _mm256_mul_ps(h4, py)), h5);
+        __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h6, px), _mm256_mul_ps(h7, py)), h8);
+        __m256 du = _mm256_sub_ps(u, _mm256_mul_ps(_mm256_loadu_ps(x2 + i), w));
+        __m256 dv = _mm256_sub_ps(v, _mm256_mul_ps(_mm256_loadu_ps(y2 + i), w));
+        __m256 e = _mm256_add_ps(_mm256_mul_ps(du, du), _mm256_mul_ps(dv, dv));
+        __m256 in = _mm256_and_ps(_mm256_cmp_ps(e, _mm256_mul_ps(limit, _mm256_mul_ps(w, w)), _CMP_LE_OQ),
+                                  _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+        int bits = _mm256_movemask_ps(in);
+
+        if (mask != NULL) {
+            for (int j=0; j<8; j++) {
+                mask[i+j] = (bits >> j) & 1;
+            }
+        }
+
+        while (bits != 0) {
+            bits &= bits - 1;
+            count++;
+        }
+    }
+#endif
+
+    for (; i<n; i++) {
+        float u = (float) h[0]*x1[i] + (float) h[1]*y1[i] + (float) h[2];
+        float v = (float) h[3]*x1[i] + (float) h[4]*y1[i] + (float) h[5];
+        float w = (float) h[6]*x1[i] + (float) h[7]*y1[i] + (float) h[8];
+        float du = u - x2[i]*w;
+        float dv = v - y2[i]*w;
+        bool in = (w > 0) && (du*du + dv*dv <= t2*w*w);
+
+        if (mask != NULL) {
+            mask[i] = in;
+        }
+
+        count += in;
+    }
+
+    return count;
+}
+
+// Find the similarity transform that moves the centroid of the listed
+// points to the origin and scales their mean distance from it to
+// sqrt(2).  It is returned as (scale, cx, cy).
+static void normalization(const float *x, const float *y, const int *idx, int n, double t[3]) {
+    double cx = 0, cy = 0, d = 0;
+
+    for (int i=0; i<n; i++) {
+        cx += x[idx[i]];
+        cy += y[idx[i]];
+    }
+
+    cx /= n;
+    cy /= n;
+
+    for (int i=0; i<n; i++) {
+        d += sqrt((x[idx[i]] - cx)*(x[idx[i]] - cx) + (y[idx[i]] - cy)*(y[idx[i]] - cy));
+    }
+
+    t[0] = (d > 0) ? sqrt(2.0) * n / d : 1.0;
+    t[1] = cx;
+    t[2] = cy;
+}
+
+// Solve the n x n system a x = b in place by Gaussian elimination with
+// partial pivoting.  The solution is left in b.
+static bool solve(double *a, double *b, int n) {
+    for (int c=0; c<n; c++) {
+        int p = c;
+
+        for (int r=c+1; r<n; r++) {
+            if (fabs(a[r*n + c]) > fabs(a[p*n + c])) {
+                p = r;
+            }
+        }
+
+        if (fabs(a[p*n + c]) < 1e-12) {
+            return false;
+        }
+
+        if (p != c) {
+            for (int j=0; j<n; j++) {
+                swap(a[p*n + j], a[c*n + j]);
+            }
+
+            swap(b[p], b[c]);
+        }
+
+        for (int r=c+1; r<n; r++) {
+            double f = a[r*n + c] / a[c*n + c];
+
+            for (int j=c; j<n; j++) {
+                a[r*n + j] -= f * a[c*n + j];
+            }
+
+            b[r] -= f * b[c];
+        }
+    }
+
+    for (int c=n-1; c>=0; c--) {
+        for (int j=c+1; j<n; j++) {
+            b[c] -= a[c*n + j] * b[j];
+        }
+
+        b[c] /= a[c*n + c];
+    }
+
+    return true;
+}
+
+// Fit a homography by least squares.  Both point sets are normalized
+// first, the eight unknowns (with h[8] fixed to 1) are found from the
+// normal equations, and the normalization is then undone.
+bool fitHomography(const float *x1, const float *y1, const float *x2, const float *y2, const int *idx, int n, double h[9]) {
+    if (n < sampleSize) {
+        return false;
+    }
+
+    double t1[3], t2[3];
+    normalization(x1, y1, idx, n, t1);
+    normalization(x2, y2, idx, n, t2);
+
+    double ata[64] = { 0 };
+    double atb[8] = { 0 };
+
+    for (int i=0; i<n; i++) {
+        double x = (x1[idx[i]] - t1[1]) * t1[0];
+        double y = (y1[idx[i]] - t1[2]) * t1[0];
+        double u = (x2[idx[i]] - t2[1]) * t2[0];
+        double v = (y2[idx[i]] - t2[2]) * t2[0];
+
+        double r0[8] = { x, y, 1, 0, 0, 0, -u*x, -u*y };
+        double r1[8] = { 0, 0, 0, x, y, 1, -v*x, -v*y };
+
+        for (int j=0; j<8; j++) {
+            for (int k=0; k<8; k++) {
+                ata[j*8 + k] += r0[j]*r0[k] + r1[j]*r1[k];
+            }
+
+            atb[j] += r0[j]*u + r1[j]*v;
+        }
+    }
+
+    if (!solve(ata, atb, 8)) {
+        return false;
+    }
+
+    // h = T2^-1 hn T1, where T = [s 0 -s cx; 0 s -s cy; 0 0 1].
+    double hn[9] = { atb[0], atb[1], atb[2], atb[3], atb[4], atb[5], atb[6], atb[7], 1 };
+    double a[9];
+
+    for (int r=0; r<3; r++) {
+        a[r*3 + 0] = hn[r*3 + 0] * t1[0];
+        a[r*3 + 1] = hn[r*3 + 1] * t1[0];
+        a[r*3 + 2] = hn[r*3 + 2] - t1[0] * (hn[r*3 + 0]*t1[1] + hn[r*3 + 1]*t1[2]);
+    }
+
+    for (int c=0; c<3; c++) {
+        h[0*3 + c] = a[0*3 + c] / t2[0] + t2[1] * a[2*3 + c];
+        h[1*3 + c] = a[1*3 + c] / t2[0] + t2[2] * a[2*3 + c];
+        h[2*3 + c] = a[2*3 + c];
+    }
+
+    if (fabs(h[8]) > 1e-12) {
+        for (int i=0; i<9; i++) {
+            h[i] /= h[8];
+        }
+    }
+
+    return true;
+}
+
+// Check whether three points are (nearly) collinear.
+static bool collinear(const float *x, const float *y, int a, int b, int c) {
+    double cross = (x[b] - x[a]) * (y[c] - y[a]) - (y[b] - y[a]) * (x[c] - x[a]);
+    return fabs(cross) < 1.0;
+}
+
+// Check a minimal sample for degeneracy in either image.
+static bool degenerateSample(const float *x1, const float *y1, const float *x2, const float *y2, const int *s) {
+    for (int i=0; i<sampleSize; i++) {
+        int a = s[(i+1) % sampleSize];
+        int b = s[(i+2) % sampleSize];
+        int c = s[(i+3) % sampleSize];
+
+        if (collinear(x1, y1, a, b, c) || collinear(x2, y2, a, b, c)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Estimate a homography by PROSAC.  The matches are sorted by score,
+// and the samples are drawn from a pool of the best matches that grows
+// on the schedule of Chum and Matas, so good models are usually found
+// among the first few samples.  Each model is scored against every
+// correspondence with countInliers, and sampling stops as soon as the
+// best inlier ratio so far makes a better model unlikely.  The best
+// model is finally refitted to all of its inliers.
+int estimateHomography(const FeatureSet &f1, const FeatureSet &f2, const vector<FeatureMatch> &matches, double h[9], vector<bool> *inliers, const HomographyOptions &options) {
+    if (inliers != NULL) {
+        inliers->assign(matches.size(), false);
+    }
+
+    // Gather the valid correspondences, best first.
+    vector< pair<double, int> > order;
+
+    for (unsigned int i=0; i<matches.size(); i++) {
+        int id1 = matches[i].id1;
+        int id2 = matches[i].id2;
+
+        if ((id1 >= 1) && (id1 <= (int) f1.size()) && (id2 >= 1) && (id2 <= (int) f2.size())) {
+            order.push_back(make_pair(-matches[i].score, i));
+        }
+    }
+
+    int n = order.size();
+
+    if (n < sampleSize) {
+        return 0;
+    }
+
+    stable_sort(order.begin(), order.end());
+
+    vector<float> x1(n), y1(n), x2(n), y2(n);
+
+    for (int i=0; i<n; i++) {
+        const FeatureMatch &m = matches[order[i].second];
+
+        x1[i] = (float) f1[m.id1-1].x;
+        y1[i] = (float) f1[m.id1-1].y;
+        x2[i] = (float) f2[m.id2-1].x;
+        y2[i] = (float) f2[m.id2-1].y;
+    }
+
+    // PROSAC growth function: tn is the expected number of samples
+    // drawn from the best n matches among maxIterations samples, and
+    // tnPrime is the iteration at which the pool grows past n.
+    int maxIterations = max(options.maxIterations, 1);
+    double tn = maxIterations;
+
+    for (int i=0; i<sampleSize; i++) {
+        tn *= (double) (sampleSize - i) / (n - i);
+    }
+
+    int pool = sampleSize;
+    int tnPrime = 1;
+    double limit = maxIterations;
+    double logFailure = log(1.0 - min(max(options.confidence, 0.0), 0.999999));
+
+    unsigned int seed = 13579;
+    int best = 0;
+    double model[9];
+    int s[sampleSize];
+
+    for (int t=1; (t<=maxIterations) && (t<=limit); t++) {
+        while ((t > tnPrime) && (pool < n)) {
+            double next = tn * (pool + 1) / (pool + 1 - sampleSize);
+            tnPrime += (int) ceil(next - tn);
+            tn = next;
+            pool++;
+        }
+
+        // Draw the sample.  Until the pool is fully explored, it always
+        // includes the newest (worst) match of the pool.
+        int drawn = 0;
+
+        if (t <= tnPrime) {
+            s[drawn++] = pool - 1;
+        }
+
+        while (drawn < sampleSize) {
+            int r = nextRandom(seed) % ((t <= tnPrime) ? pool - 1 : pool);
+            bool repeated = false;
+
+            for (int j=0; j<drawn; j++) {
+                repeated = repeated || (s[j] == r);
+            }
+
+            if (!repeated) {
+                s[drawn++] = r;
+            }
+        }
+
+        if (degenerateSample(&x1[0], &y1[0], &x2[0], &y2[0], s) ||
+            !fitHomography(&x1[0], &y1[0], &x2[0], &y2[0], s, sampleSize, model)) {
+            continue;
+        }
+
+        int count = countInliers(model, &x1[0], &y1[0], &x2[0], &y2[0], n, options.inlierThreshold, NULL);
+
+        if (count > best) {
+            best = count;
+
+            for (int i=0; i<9; i++) {
+                h[i] = model[i];
+            }
+
+            // Adaptive stopping: the number of samples needed to draw an
+            // all-inlier sample with the requested confidence.
+            double w = (double) best / n;
+            double p = pow(w, sampleSize);
+
+            if (p >= 1.0) {
+                limit = 0;
+            }
+            else if (p > 0) {
+                limit = min(limit, logFailure / log(1.0 - p));
+            }
+        }
+    }
+
+    if (best < sampleSize) {
+        return 0;
+    }
+
+    // Refit to all the inliers and keep the refit if it is no worse.
+    vector<unsigned char> mask(n);
+    countInliers(h, &x1[0], &y1[0], &x2[0], &y2[0], n, options.inlierThreshold, &mask[0]);
+
+    vector<int> idx;
+
+    for (int i=0; i<n; i++) {
+        if (mask[i]) {
+            idx.push_back(i);
+        }
+    }
+
+    if (fitHomography(&x1[0], &y1[0], &x2[0], &y2[0], &idx[0], idx.size(), model)) {
+        int count = countInliers(model, &x1[0], &y1[0], &x2[0], &y2[0], n, options.inlierThreshold, NULL);
+
+        if (count >= best) {
+            best = count;
+
+            for (int i=0; i<9; i++) {
+                h[i] = model[i];
+            }
+        }
+    }
+
+    if (inliers != NULL) {
+        countInliers(h, &x1[0], &y1[0], &x2[0], &y2[0], n, options.inlierThreshold, &mask[0]);
+
+        for (int i=0; i<n; i++) {
+            (*inliers)[order[i].second] = (mask[i] != 0);
+        }
+    }
+
+    return best;
+}
@@ -0,0 +1,39 @@
+#ifndef HOMOGRAPHY_H
+#define HOMOGRAPHY_H
+
+#include "FeatureSet.h"
+
+// HomographyOptions holds the settings of robust homography estimation.
+struct HomographyOptions
+{
+	// Largest reprojection error of an inlier, in pixels.
+	double inlierThreshold;
+
+	// Probability of having drawn an all-inlier sample before stopping.
+	double confidence;
+
+	// Largest number of samples drawn.
+	int maxIterations;
+
+	HomographyOptions();
+};
+
+// Transform a batch of points by homography.
+void applyHomography(const double h[9], const float *x, const float *y, int n, float *xNew, float *yNew);
+
+// Count the correspondences (x1, y1) -> (x2, y2) that a homography maps
+// to within threshold pixels.  If mask is not NULL, it is set to 1 for
+// inliers and 0 for outliers.
+int countInliers(const double h[9], const float *x1, const float *y1, const float *x2, const float *y2, int n, double threshold, unsigned char *mask);
+
+// Fit a homography to the correspondences listed in idx by least
+// squares.  At least four are needed.
+bool fitHomography(const float *x1, const float *y1, const float *x2, const float *y2, const int *idx, int n, double h[9]);
+
+// Estimate the homography from f1 to f2 supported by the most matches,
+// using PROSAC.  Returns the number of inliers, or 0 if no homography
+// was found.  If inliers is not NULL, it is set to whether each match
+// is an inlier.
+int estimateHomography(const FeatureSet &f1, const FeatureSet &f2, const vector<FeatureMatch> &matches, double h[9], vector<bool> *inliers, const HomographyOptions &options);
+
+#endif
@@ -1,22 +1,65 @@
+#include <stdio.h>
 #include <fstream>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include <FL/filename.H>
 #include "ImageDatabase.h"
+#include "ThreadPool.h"
+#include "PackedDatabase.h"
+#include "SiftFile.h"
+#include "FeatureSetCache.h"
+#include "DatabaseJournal.h"
+#include "DescriptorIndex.h"
 
 // Create a database.
 ImageDatabase::ImageDatabase() {
+    sift = false;
+    cacheSift = false;
+    ioThreads = 0;
 }
 
 // Load a database from file.  The database file contains a list of
 // image file names and feature file names.  Each image file name is
 // followed by the corresponding feature file name.  The file names in
 // the database must be relative to the database path or it won't work.
-// I apologize for this annoyance.
-bool ImageDatabase::load(const char *name, bool sift) {
-    DatabaseItem d;
-    string s;
-	
+// I apologize for this annoyance.  If loadFeatures is false, the
+// feature files are not read; load_item_features can fetch them later.
+// Otherwise the whole list is read first, and the feature files are
+// then loaded straight into their items on a pool of I/O threads.
+// A packed database file is recognized by its magic and mapped instead.
+bool ImageDatabase::load(const char *name, bool sift, bool loadFeatures) {
     // Clear all entries from the database.
     clear();
+    failures.clear();
+    this->sift = sift;
+    packed.reset();
+    journal.reset();
+
+    // Start a fresh cache, since the item indices are about to change.
+    if (cache) {
+        use_cache(cache->capacity());
+    }
+
+    if (isPackedDatabase(name)) {
+        shared_ptr<PackedDatabase> p(new PackedDatabase());
+
+        if (!p->open(name)) {
+            return false;
+        }
+
+        resize(p->items());
+
+        for (int i=0; i<p->items(); i++) {
+            (*this)[i].name = p->item_name(i);
+        }
+
+        packed = p;
+        return true;
+    }
 
     // Open the file.
     ifstream f(name);
@@ -34,31 +77,375 @@ bool ImageDatabase::load(const char *name, bool sift) {
         dir += (*c);
     }
 
-    while (f.peek() != EOF) {
-        // Read the image name.
-        f >> d.name;
-        d.name = dir + d.name;
+    // Read the image and feature file names.
+    string imageName;
+    string featureName;
+
+    while (f >> imageName >> featureName) {
+        push_back(DatabaseItem());
+        back().name = dir + imageName;
+        back().featureFile = dir + featureName;
+    }
+
+    f.close();
+
+    if (!loadFeatures) {
+        return true;
+    }
+
+    // Load the feature files.
+    int threads = ioThreads;
+
+    if (threads <= 0) {
+        threads = 2 * max((int) thread::hardware_concurrency(), 1);
+    }
+
+    threads = max(min(threads, (int) size()), 1);
+
+    // The calling thread takes part, so the pool needs one thread less.
+    vector<char> loaded(size(), 0);
+    ThreadPool pool(max(threads - 1, 1));
+
+    pool.parallel_for(size(), [&](int i) {
+        DatabaseItem &d = (*this)[i];
+
+        if (sift) {
+            loaded[i] = loadSiftFeatures(d.featureFile.c_str(), d.features, cacheSift);
+        }
+        else {
+            loaded[i] = d.features.load(d.featureFile.c_str());
+        }
+    }, threads);
+
+    // Report the items that failed, and move the others down over them.
+    unsigned int kept = 0;
+
+    for (unsigned int i=0; i<size(); i++) {
+        if (!loaded[i]) {
+            printf("couldn't load features for %s from %s\n", (*this)[i].name.c_str(), (*this)[i].featureFile.c_str());
+            failures.push_back((*this)[i].featureFile);
+            continue;
+        }
+
+        if (kept != i) {
+            (*this)[kept] = move((*this)[i]);
+        }
+
+        kept++;
+    }
+
+    resize(kept);
+    return true;
+}
+
+// Load the features of a database item from its feature file or from
+// the packed database.
+bool ImageDatabase::load_item_features(int index, FeatureSet &features) const {
+    return item_loader(index)(features);
+}
+
+// Whether the features of an item can be loaded when they are not
+// resident.
+bool ImageDatabase::has_feature_source(int index) const {
+    if ((*this)[index].removed) {
+        return false;
+    }
+
+    return (packed && (index < packed->items())) || !(*this)[index].featureFile.empty();
+}
+
+// Get a function that loads the features of an item.
+function<bool(FeatureSet &)> ImageDatabase::item_loader(int index) const {
+    if (packed && (index < packed->items())) {
+        shared_ptr<PackedDatabase> p = packed;
+
+        return [p, index](FeatureSet &features) -> bool {
+            p->get_item_features(index, features);
+            return true;
+        };
+    }
 
-        // Read the feature file name.
-        f >> s;
-        s = dir + s;
+    string file = (*this)[index].featureFile;
+    bool s = sift;
+    bool c = cacheSift;
 
-        // This really shouldn't be necessary.  I'm not sure what's
-        // going on.
-        if (f.peek() == EOF) {
-            break;
+    return [file, s, c](FeatureSet &features) -> bool {
+        if (s) {
+            return loadSiftFeatures(file.c_str(), features, c);
+        }
+        else {
+            return features.load(file.c_str());
         }
+    };
+}
+
+// Read features that are not resident through an LRU cache.
+void ImageDatabase::use_cache(size_t budget) {
+    if (budget > 0) {
+        cache.reset(new FeatureSetCache(budget));
+    }
+    else {
+        cache.reset();
+    }
+}
+
+// Name of the journal that the commands keep for a database file.
+string ImageDatabase::journal_name(const string &name) {
+    return name + ".journal";
+}
+
+// Apply the changes in a journal without keeping it open, so that later
+// changes aren't journaled.
+bool ImageDatabase::replay_journal(const char *name) {
+    vector<JournalRecord> records;
+
+    if (!DatabaseJournal::read(name, generation(), records)) {
+        return false;
+    }
+
+    for (unsigned int i=0; i<records.size(); i++) {
+        if (!apply(records[i])) {
+            printf("journal %s doesn't match the database at record %d\n", name, i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Open an append-only journal of changes to the database.
+bool ImageDatabase::open_journal(const char *name) {
+    shared_ptr<DatabaseJournal> j(new DatabaseJournal());
+    vector<JournalRecord> records;
 
-        // Load the features from file.
-        if (((!sift) && (!d.features.load(s.c_str()))) || ((sift) && (!d.features.load_sift(s.c_str())))) {
-            clear();
-            f.close();
+    journal.reset();
+
+    if (!j->open(name, generation(), records)) {
+        return false;
+    }
+
+    for (unsigned int i=0; i<records.size(); i++) {
+        if (!apply(records[i])) {
+            printf("journal %s doesn't match the database at record %d\n", name, i);
             return false;
         }
+    }
+
+    journal = j;
+    return true;
+}
 
-        push_back(d);
+// Keep an index up to date with later changes.
+void ImageDatabase::attach_index(DescriptorIndex *index) {
+    indices.push_back(index);
+}
+
+// Add an image and its features.
+int ImageDatabase::add_item(const string &name, const FeatureSet &features) {
+    JournalRecord record;
+    record.type = JOURNAL_ADD;
+    record.index = size();
+    record.name = name;
+    record.features = features;
+
+    if ((journal && !journal->append(record)) || !apply(record)) {
+        return -1;
+    }
+
+    return size() - 1;
+}
+
+// Remove an item.
+bool ImageDatabase::remove_item(int index) {
+    if ((index < 0) || (index >= (int) size()) || (*this)[index].removed) {
+        return false;
+    }
+
+    JournalRecord record;
+    record.type = JOURNAL_REMOVE;
+    record.index = index;
+
+    return (!journal || journal->append(record)) && apply(record);
+}
+
+// Replace the features of an item.
+int ImageDatabase::replace_item(int index, const FeatureSet &features) {
+    if ((index < 0) || (index >= (int) size()) || (*this)[index].removed) {
+        return -1;
+    }
+
+    JournalRecord record;
+    record.type = JOURNAL_REPLACE;
+    record.index = index;
+    record.name = (*this)[index].name;
+    record.features = features;
+
+    if ((journal && !journal->append(record)) || !apply(record)) {
+        return -1;
+    }
+
+    return size() - 1;
+}
+
+// Find the live item with a name.
+int ImageDatabase::find_item(const string &name) const {
+    for (unsigned int i=0; i<size(); i++) {
+        if (!(*this)[i].removed && ((*this)[i].name == name)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Apply a change.  Additions are checked against the current size, so
+// a journal replayed onto the wrong database is caught.
+bool ImageDatabase::apply(const JournalRecord &record) {
+    int index = record.index;
+
+    if ((record.type == JOURNAL_REMOVE) || (record.type == JOURNAL_REPLACE)) {
+        if ((index < 0) || (index >= (int) size()) || (*this)[index].removed) {
+            return false;
+        }
+
+        DatabaseItem &d = (*this)[index];
+        d.removed = true;
+        d.features.clear();
+        d.features.shrink_to_fit();
+
+        for (unsigned int i=0; i<indices.size(); i++) {
+            indices[i]->remove(index);
+        }
+    }
+
+    if ((record.type == JOURNAL_ADD) || (record.type == JOURNAL_REPLACE)) {
+        if ((record.type == JOURNAL_ADD) && (index != (int) size())) {
+            return false;
+        }
+
+        push_back(DatabaseItem());
+        back().name = record.name;
+        back().features = record.features;
+
+        for (unsigned int i=0; i<indices.size(); i++) {
+            indices[i]->add(size() - 1, record.features);
+        }
+    }
+
+    return (record.type >= JOURNAL_ADD) && (record.type <= JOURNAL_REPLACE);
+}
+
+// Wait until the contents of a file are on the disk.
+static bool syncFile(const char *name) {
+#ifdef _WIN32
+    int fd = _open(name, _O_RDWR | _O_BINARY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = (_commit(fd) == 0);
+    _close(fd);
+    return ok;
+#else
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = (fsync(fd) == 0);
+    close(fd);
+    return ok;
+#endif
+}
+
+// Wait until the entries of a directory are on the disk.  Windows can't
+// sync a directory, so that succeeds without doing anything.
+static bool syncDirectory(const char *name) {
+#ifdef _WIN32
+    (void) name;
+    return true;
+#else
+    return syncFile(name);
+#endif
+}
+
+// Compact the database into a packed database file.  The file is
+// written under a temporary name, synced to the disk and renamed, and
+// the journal is only emptied once the rename is on the disk too, so a
+// crash at any point leaves either the old database and its journal or
+// the new one; a journal left behind by a crash after the rename has
+// the old generation and is discarded.
+bool ImageDatabase::compact(const char *name, vector<int> *map) {
+    unsigned int next = generation() + 1;
+    string tempName = string(name) + ".tmp";
+    string dir(name, fl_filename_name(name) - name);
+
+    if (!savePackedDatabase(tempName.c_str(), *this, next) || !syncFile(tempName.c_str())) {
+        remove(tempName.c_str());
+        return false;
+    }
+
+    if (rename(tempName.c_str(), name) != 0) {
+        remove(tempName.c_str());
+        return false;
+    }
+
+    if (!syncDirectory(dir.empty() ? "." : dir.c_str())) {
+        return false;
+    }
+
+    vector<int> m(size(), -1);
+    int kept = 0;
+
+    for (unsigned int i=0; i<size(); i++) {
+        if (!(*this)[i].removed) {
+            m[i] = kept++;
+        }
+    }
+
+    shared_ptr<DatabaseJournal> j = journal;
+
+    if (!load(name, sift, false)) {
+        return false;
+    }
+
+    for (unsigned int i=0; i<indices.size(); i++) {
+        indices[i]->remap(m);
+    }
+
+    if (map != NULL) {
+        *map = m;
+    }
+
+    if (j) {
+        if (!j->reset(next)) {
+            return false;
+        }
+
+        journal = j;
+    }
+
+    return true;
+}
+
+// Number of compactions that produced the database.
+unsigned int ImageDatabase::generation() const {
+    return packed ? packed->generation() : 0;
+}
+
+// Whether every item is read straight from the packed database.
+bool ImageDatabase::is_packed_view() const {
+    if (!packed || (packed->items() != (int) size())) {
+        return false;
+    }
+
+    for (unsigned int i=0; i<size(); i++) {
+        if ((*this)[i].removed) {
+            return false;
+        }
     }
 
-    f.close();
     return true;
 }
@@ -2,23 +2,145 @@
 #define IMAGEDATABASE_H
 
 #include <string>
+#include <memory>
+#include <functional>
 #include "FeatureSet.h"
 
+class PackedDatabase;
+class FeatureSetCache;
+class DatabaseJournal;
+class DescriptorIndex;
+struct JournalRecord;
+
 // A DatabaseItem holds the name of an image, and the corresponding
-// feature set.  The images themselves are not stored in memory.
+// feature set.  The images themselves are not stored in memory.  The
+// feature file name is kept so that the features can be reloaded when
+// they are not resident.  A removed item stays in place as a tombstone,
+// so the indices of the others don't change, until the database is
+// compacted.
 struct DatabaseItem {
 	string name;
+	string featureFile;
 	FeatureSet features;
+	bool removed;
+
+	DatabaseItem() { removed = false; }
 };
 
 // The ImageDatabase class is a vector of database items.
 class ImageDatabase : public vector<DatabaseItem> {
+public:
+	// Whether the feature files are in SIFT format.
+	bool sift;
+
+	// Whether SIFT key files are read through binary cache files,
+	// which are written next to them on first load.
+	bool cacheSift;
+
+	// The packed database file the features are read from, if the
+	// database was loaded from one.  It is shared by copies of the
+	// database and unmapped when the last copy goes away.
+	shared_ptr<PackedDatabase> packed;
+
+	// The cache that features which are not resident are read through,
+	// or NULL to read them from disk on every use.
+	shared_ptr<FeatureSetCache> cache;
+
+	// Number of threads reading feature files during load.  Zero means
+	// twice the number of hardware threads, since the reads mostly wait
+	// on the disk.
+	int ioThreads;
+
+	// Feature files that couldn't be read by the last load.  Their
+	// items are left out of the database.
+	vector<string> failures;
+
+private:
+	// The journal that changes are written to, if one is open.
+	shared_ptr<DatabaseJournal> journal;
+
+	// Indices kept up to date with the changes.
+	vector<DescriptorIndex *> indices;
+
 public:
 	// Create a new database.
 	ImageDatabase();
 
-	// Load a database from file.
-	bool load(const char *name, bool sift);
+	// Load a database from file.  If loadFeatures is false, only the
+	// image and feature file names are read.  Otherwise the feature
+	// files are read in parallel, and items whose files can't be read
+	// are reported and left out rather than failing the load.  A packed
+	// database file is mapped and its features are always left on disk.
+	bool load(const char *name, bool sift, bool loadFeatures = true);
+
+	// Load the features of a database item from its feature file or
+	// from the packed database.
+	bool load_item_features(int index, FeatureSet &features) const;
+
+	// Whether the features of an item can be loaded when they are not
+	// resident.
+	bool has_feature_source(int index) const;
+
+	// Get a function that loads the features of an item.  It doesn't
+	// refer to the database, so it can outlive it.
+	function<bool(FeatureSet &)> item_loader(int index) const;
+
+	// Read features that are not resident through an LRU cache holding
+	// at most budget bytes.  A budget of zero turns the cache off.
+	void use_cache(size_t budget);
+
+	// Open an append-only journal of changes to the database, creating
+	// it if it doesn't exist.  The changes already in the journal are
+	// applied first, unless they belong to an older generation of the
+	// database.  Later changes are written to the journal before they
+	// are applied.
+	bool open_journal(const char *name);
+
+	// Apply the changes in a journal, if it exists, without opening it
+	// for further changes.  This is how readers of a database see the
+	// changes made by another process since the last compaction.
+	bool replay_journal(const char *name);
+
+	// Name of the journal kept for a database file: its name with
+	// .journal appended.
+	static string journal_name(const string &name);
+
+	// Keep an index up to date with later changes.  The index must
+	// already hold the current items.
+	void attach_index(DescriptorIndex *index);
+
+	// Add an image and its features.  Returns the index of the new
+	// item, or -1 if the change couldn't be journaled.
+	int add_item(const string &name, const FeatureSet &features);
+
+	// Remove an item.
+	bool remove_item(int index);
+
+	// Replace the features of an item.  The old item is removed and
+	// the image is added again as a new item, whose index is returned,
+	// or -1 on failure.
+	int replace_item(int index, const FeatureSet &features);
+
+	// Find the live item with a name.  Returns -1 if there is none.
+	int find_item(const string &name) const;
+
+	// Write the live items to a packed database file of the next
+	// generation, load it in place of the current database and empty
+	// the journal.  The attached indices are renumbered to match, and
+	// map, if not NULL, receives the new index of each old item, or -1
+	// for removed items.
+	bool compact(const char *name, vector<int> *map = NULL);
+
+	// Number of compactions that produced the database.
+	unsigned int generation() const;
+
+	// Whether every item is read straight from the packed database,
+	// with nothing added or removed since it was loaded.
+	bool is_packed_view() const;
+
+private:
+	// Apply a change to the items and the attached indices.
+	bool apply(const JournalRecord &record);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,421 @@
+/* LSHIndex.cpp */
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "BinaryIO.h"
+#include "LSHIndex.h"
+
+// Largest supported key width.  Each table has 2^keyBits bucket heads.
+static const int maxKeyBits = 24;
+
+// Count the set bits of a word.
+static int popcount64(unsigned long long x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+
+    while (x != 0) {
+        x &= x - 1;
+        n++;
+    }
+
+    return n;
+#endif
+}
+
+// A perturbation set for multi-probe LSH: a set of key bits to flip,
+// given as increasing positions in the list of bits sorted by how close
+// the query is to their thresholds, and its score (smaller is likelier).
+struct Perturbation {
+    float score;
+    vector<int> bits;
+
+    bool operator<(const Perturbation &p) const { return score > p.score; }
+};
+
+// Create an empty index.
+LSHIndex::LSHIndex() {
+    probes = 8;
+    dim = 0;
+    numWords = 0;
+    numTables = 0;
+    keyBits = 0;
+}
+
+// Train on a sample of the database, then add every database item.
+bool LSHIndex::build(const ImageDatabase &db, int numTables, int keyBits, int maxSamples) {
+    vector<float> samples;
+    int d;
+
+    if (!sampleDescriptors(db, maxSamples, samples, d)) {
+        return false;
+    }
+
+    if (!train(samples, d, numTables, keyBits)) {
+        return false;
+    }
+
+    return add_database(db);
+}
+
+// Choose the binarization thresholds and the key bits of each table.
+// The threshold of each dimension is its mean over the sample, which
+// splits the values roughly in half.
+bool LSHIndex::train(const vector<float> &samples, int dim, int numTables, int keyBits) {
+    if ((dim <= 0) || (numTables <= 0) || (keyBits <= 0) || samples.empty()) {
+        return false;
+    }
+
+    int n = samples.size() / dim;
+
+    this->dim = dim;
+    this->numWords = (dim + 63) / 64;
+    this->numTables = numTables;
+    this->keyBits = min(min(keyBits, dim), maxKeyBits);
+
+    thresholds.assign(dim, 0.0f);
+
+    for (int i=0; i<n; i++) {
+        for (int j=0; j<dim; j++) {
+            thresholds[j] += samples[i*dim + j];
+        }
+    }
+
+    for (int j=0; j<dim; j++) {
+        thresholds[j] /= n;
+    }
+
+    // Each table keys on a different random subset of the dimensions.
+    unsigned int seed = 24680;
+    vector<int> perm(dim);
+
+    keyDims.resize(numTables * this->keyBits);
+
+    for (int t=0; t<numTables; t++) {
+        for (int j=0; j<dim; j++) {
+            perm[j] = j;
+        }
+
+        for (int b=0; b<this->keyBits; b++) {
+            seed = seed * 1664525u + 1013904223u;
+            int r = b + (seed >> 8) % (dim - b);
+            swap(perm[b], perm[r]);
+            keyDims[t*this->keyBits + b] = perm[b];
+        }
+    }
+
+    heads.assign(numTables << this->keyBits, -1);
+    next.clear();
+    codes.clear();
+    items.clear();
+    ids.clear();
+
+    return true;
+}
+
+// Add the features of a database item to the index.
+void LSHIndex::add(int item, const FeatureSet &features) {
+    for (unsigned int i=0; i<features.size(); i++) {
+        const Feature &f = features[i];
+
+        if ((int) f.data.size() != dim) {
+            continue;
+        }
+
+        int e = items.size();
+
+        codes.resize(codes.size() + numWords);
+        binarize(f.data, &codes[e * numWords]);
+
+        items.push_back(item);
+        ids.push_back(f.id);
+        next.resize(next.size() + numTables);
+
+        // Push the entry onto the front of its bucket in every table.
+        for (int t=0; t<numTables; t++) {
+            int &head = heads[(t << keyBits) + key(t, &codes[e * numWords])];
+            next[e*numTables + t] = head;
+            head = e;
+        }
+    }
+}
+
+// Find the k nearest database features to a descriptor.  Each table is
+// probed at the query key, then at the keys obtained by flipping the
+// bits whose dimensions lie closest to their thresholds, in order of
+// increasing total margin.
+void LSHIndex::search(const vector<double> &descriptor, int k, vector<IndexCandidate> &candidates) const {
+    candidates.clear();
+
+    if (((int) descriptor.size() != dim) || items.empty() || (k <= 0)) {
+        return;
+    }
+
+    vector<unsigned long long> code(numWords);
+    binarize(descriptor, &code[0]);
+
+    vector<int> found;
+    vector< pair<float, int> > margins(keyBits);
+    vector<Perturbation> heap;
+
+    for (int t=0; t<numTables; t++) {
+        int base = key(t, &code[0]);
+        const int *bucket = &heads[t << keyBits];
+
+        // Visit the query bucket.
+        for (int e=bucket[base]; e>=0; e=next[e*numTables + t]) {
+            found.push_back(e);
+        }
+
+        if (probes <= 0) {
+            continue;
+        }
+
+        // Sort the key bits by the distance of the query to each
+        // threshold.
+        for (int b=0; b<keyBits; b++) {
+            int d = keyDims[t*keyBits + b];
+            margins[b] = make_pair((float) fabs(descriptor[d] - thresholds[d]), b);
+        }
+
+        sort(margins.begin(), margins.end());
+
+        // Generate the perturbation sets in order of increasing score,
+        // using the shift and expand operations of multi-probe LSH.
+        heap.clear();
+
+        Perturbation p;
+        p.bits.push_back(0);
+        p.score = margins[0].first * margins[0].first;
+        heap.push_back(p);
+
+        for (int probe=0; (probe<probes) && !heap.empty(); probe++) {
+            pop_heap(heap.begin(), heap.end());
+            Perturbation a = heap.back();
+            heap.pop_back();
+
+            int flipped = base;
+
+            for (unsigned int i=0; i<a.bits.size(); i++) {
+                flipped ^= 1 << margins[a.bits[i]].second;
+            }
+
+            for (int e=bucket[flipped]; e>=0; e=next[e*numTables + t]) {
+                found.push_back(e);
+            }
+
+            int last = a.bits.back();
+
+            if (last + 1 < keyBits) {
+                float z0 = margins[last].first;
+                float z1 = margins[last+1].first;
+
+                Perturbation shifted = a;
+                shifted.bits.back() = last + 1;
+                shifted.score = a.score - z0*z0 + z1*z1;
+                heap.push_back(shifted);
+                push_heap(heap.begin(), heap.end());
+
+                Perturbation expanded = a;
+                expanded.bits.push_back(last + 1);
+                expanded.score = a.score + z1*z1;
+                heap.push_back(expanded);
+                push_heap(heap.begin(), heap.end());
+            }
+        }
+    }
+
+    sort(found.begin(), found.end());
+    found.erase(unique(found.begin(), found.end()), found.end());
+
+    if (numRemoved > 0) {
+        unsigned int kept = 0;
+
+        for (unsigned int i=0; i<found.size(); i++) {
+            if (!is_removed(items[found[i]])) {
+                found[kept++] = found[i];
+            }
+        }
+
+        found.resize(kept);
+    }
+
+    // Rank the candidates by Hamming distance.
+    vector< pair<int, int> > ranked(found.size());
+
+    for (unsigned int i=0; i<found.size(); i++) {
+        const unsigned long long *c = &codes[found[i] * numWords];
+        int d = 0;
+
+        for (int w=0; w<numWords; w++) {
+            d += popcount64(c[w] ^ code[w]);
+        }
+
+        ranked[i] = make_pair(d, found[i]);
+    }
+
+    int n = min(k, (int) ranked.size());
+    partial_sort(ranked.begin(), ranked.begin() + n, ranked.end());
+
+    candidates.resize(n);
+
+    for (int i=0; i<n; i++) {
+        candidates[i].item = items[ranked[i].second];
+        candidates[i].id = ids[ranked[i].second];
+        candidates[i].distance = ranked[i].first;
+    }
+}
+
+// Renumber the items.  The surviving entries are packed down in order
+// and pushed onto their buckets again in the order they were added, so
+// the chains are the same as if only they had been added.
+void LSHIndex::remap(const vector<int> &map) {
+    int n = items.size();
+    int kept = 0;
+
+    for (int e=0; e<n; e++) {
+        int item = remapped(map, items[e]);
+
+        if (item < 0) {
+            continue;
+        }
+
+        copy(codes.begin() + (size_t) e * numWords, codes.begin() + (size_t) (e + 1) * numWords, codes.begin() + (size_t) kept * numWords);
+        items[kept] = item;
+        ids[kept] = ids[e];
+        kept++;
+    }
+
+    codes.resize((size_t) kept * numWords);
+    items.resize(kept);
+    ids.resize(kept);
+
+    heads.assign(numTables << keyBits, -1);
+    next.resize((size_t) kept * numTables);
+
+    for (int e=0; e<kept; e++) {
+        for (int t=0; t<numTables; t++) {
+            int &head = heads[(t << keyBits) + key(t, &codes[e * numWords])];
+            next[e*numTables + t] = head;
+            head = e;
+        }
+    }
+
+    removed.clear();
+    numRemoved = 0;
+}
+
+// Compute the binary code of a descriptor.
+void LSHIndex::binarize(const vector<double> &descriptor, unsigned long long *code) const {
+    for (int w=0; w<numWords; w++) {
+        code[w] = 0;
+    }
+
+    for (int j=0; j<dim; j++) {
+        if (descriptor[j] > thresholds[j]) {
+            code[j >> 6] |= 1ULL << (j & 63);
+        }
+    }
+}
+
+// Compute the key of a binary code in a table.
+int LSHIndex::key(int table, const unsigned long long *code) const {
+    const int *d = &keyDims[table * keyBits];
+    int k = 0;
+
+    for (int b=0; b<keyBits; b++) {
+        k |= (int) ((code[d[b] >> 6] >> (d[b] & 63)) & 1) << b;
+    }
+
+    return k;
+}
+
+static const char lshMagic[4] = { 'L', 'S', 'H', '1' };
+
+// Save the index to a file.
+bool LSHIndex::save(const char *name) const {
+    FILE *f = fopen(name, "wb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    int header[3] = { dim, numTables, keyBits };
+
+    fwrite(lshMagic, 1, 4, f);
+    fwrite(header, sizeof(int), 3, f);
+    writeVector(f, thresholds);
+    writeVector(f, keyDims);
+    writeVector(f, heads);
+    writeVector(f, next);
+    writeVector(f, codes);
+    writeVector(f, items);
+    writeVector(f, ids);
+
+    return (fclose(f) == 0);
+}
+
+// Load the index from a file.
+bool LSHIndex::load(const char *name) {
+    FILE *f = fopen(name, "rb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    char magic[4];
+    int header[3];
+    bool ok = (fread(magic, 1, 4, f) == 4) && (memcmp(magic, lshMagic, 4) == 0) &&
+        (fread(header, sizeof(int), 3, f) == 3) && (header[0] > 0) && (header[1] > 0) &&
+        (header[2] > 0) && (header[2] <= maxKeyBits);
+
+    if (ok) {
+        dim = header[0];
+        numWords = (dim + 63) / 64;
+        numTables = header[1];
+        keyBits = header[2];
+
+        ok = readVector(f, thresholds) && readVector(f, keyDims) && readVector(f, heads) &&
+            readVector(f, next) && readVector(f, codes) && readVector(f, items) && readVector(f, ids) &&
+            ((int) thresholds.size() == dim) && ((long long) keyDims.size() == (long long) numTables * keyBits) &&
+            ((long long) heads.size() == ((long long) numTables << keyBits)) &&
+            (next.size() == items.size() * numTables) && (codes.size() == items.size() * numWords) &&
+            (ids.size() == items.size());
+    }
+
+    fclose(f);
+
+    // The key bits index the descriptor, and the links index the
+    // entries, so they are checked before a search follows them.  An
+    // entry is always pushed in front of older ones, so a link that
+    // doesn't lead to an older entry would make a chain loop.
+    int entries = items.size();
+
+    for (unsigned int i=0; (i<keyDims.size()) && ok; i++) {
+        ok = (keyDims[i] >= 0) && (keyDims[i] < dim);
+    }
+
+    for (unsigned int i=0; (i<heads.size()) && ok; i++) {
+        ok = (heads[i] >= -1) && (heads[i] < entries);
+    }
+
+    for (unsigned int i=0; (i<next.size()) && ok; i++) {
+        ok = (next[i] >= -1) && (next[i] < (int) (i / numTables));
+    }
+
+    if (!ok) {
+        thresholds.clear();
+        keyDims.clear();
+        heads.clear();
+        next.clear();
+        codes.clear();
+        items.clear();
+        ids.clear();
+        dim = 0;
+    }
+
+    return ok;
+}
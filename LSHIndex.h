@@ -0,0 +1,85 @@
+#ifndef LSHINDEX_H
+#define LSHINDEX_H
+
+#include "DescriptorIndex.h"
+
+// The LSHIndex class is a multi-probe locality-sensitive hashing index
+// over Hamming-space descriptors.  Real-valued descriptors are turned
+// into bit strings by thresholding each dimension (binary descriptors
+// stored as 0/1 values work unchanged), and each hash table keys on a
+// random subset of those bits.  Searches also visit the buckets whose
+// keys differ from the query key in the bits most likely to have
+// flipped, so few tables are needed for good recall.
+//
+// The buckets are stored in flat arrays: each table has an array of
+// bucket heads, and each entry has one "next" link per table.  Adding
+// a descriptor is therefore a constant-time push, and new database
+// items can be added at any time without a rebuild.
+//
+// The distances returned by search are Hamming distances.
+class LSHIndex : public DescriptorIndex {
+public:
+	// Number of extra buckets probed per table.
+	int probes;
+
+private:
+	int dim;
+	int numWords;
+	int numTables;
+	int keyBits;
+
+	// Threshold used to binarize each dimension.
+	vector<float> thresholds;
+
+	// Descriptor dimension used for each key bit of each table.
+	vector<int> keyDims;
+
+	// Bucket heads (numTables x 2^keyBits) and the per-table links of
+	// each entry (numEntries x numTables).  -1 ends a chain.
+	vector<int> heads;
+	vector<int> next;
+
+	// Binary codes (numEntries x numWords) and entry owners.
+	vector<unsigned long long> codes;
+	vector<int> items;
+	vector<int> ids;
+
+public:
+	// Create an empty index.
+	LSHIndex();
+
+	// Train on a sample of at most maxSamples database descriptors,
+	// then add every database item.
+	bool build(const ImageDatabase &db, int numTables, int keyBits, int maxSamples);
+
+	// Choose the binarization thresholds from a set of descriptors
+	// (n x dim) and the key bits of each table.
+	bool train(const vector<float> &samples, int dim, int numTables, int keyBits);
+
+	// Add the features of a database item to the index.
+	void add(int item, const FeatureSet &features);
+
+	// Find the k nearest database features to a descriptor.
+	void search(const vector<double> &descriptor, int k, vector<IndexCandidate> &candidates) const;
+
+	// Renumber the items, dropping removed ones, and relink the buckets.
+	void remap(const vector<int> &map);
+
+	// Number of descriptors stored in the index.
+	int size() const { return items.size(); }
+
+	// Save the index to a file.
+	bool save(const char *name) const;
+
+	// Load the index from a file.
+	bool load(const char *name);
+
+private:
+	// Compute the binary code of a descriptor.
+	void binarize(const vector<double> &descriptor, unsigned long long *code) const;
+
+	// Compute the key of a binary code in a table.
+	int key(int table, const unsigned long long *code) const;
+};
+
+#endif
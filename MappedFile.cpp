@@ -0,0 +1,128 @@
+/* MappedFile.cpp */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "MappedFile.h"
+
+// Create an unmapped file.
+MappedFile::MappedFile() {
+    base = NULL;
+    length = 0;
+
+#ifdef _WIN32
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+#endif
+}
+
+// Unmap the file.
+MappedFile::~MappedFile() {
+    close();
+}
+
+#ifdef _WIN32
+
+// Map a file, unmapping any file already mapped.
+bool MappedFile::open(const char *name) {
+    close();
+
+    file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+
+    if (!GetFileSizeEx(file, &size) || (size.QuadPart == 0)) {
+        close();
+        return false;
+    }
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (mapping == NULL) {
+        close();
+        return false;
+    }
+
+    base = (const char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (base == NULL) {
+        close();
+        return false;
+    }
+
+    length = (size_t) size.QuadPart;
+    return true;
+}
+
+// Unmap the file.
+void MappedFile::close() {
+    if (base != NULL) {
+        UnmapViewOfFile(base);
+    }
+
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    base = NULL;
+    length = 0;
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+}
+
+#else
+
+// Map a file, unmapping any file already mapped.  The descriptor can be
+// closed once the mapping exists.
+bool MappedFile::open(const char *name) {
+    close();
+
+    int fd = ::open(name, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+        ::close(fd);
+        return false;
+    }
+
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (p == MAP_FAILED) {
+        return false;
+    }
+
+    base = (const char *) p;
+    length = st.st_size;
+    return true;
+}
+
+// Unmap the file.
+void MappedFile::close() {
+    if (base != NULL) {
+        munmap((void *) base, length);
+    }
+
+    base = NULL;
+    length = 0;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+
+// The MappedFile class maps a whole file read-only into memory.  The
+// mapping lasts until the file is closed or the object is destroyed.
+class MappedFile {
+private:
+	const char *base;
+	size_t length;
+
+#ifdef _WIN32
+	void *file;
+	void *mapping;
+#endif
+
+public:
+	// Create an unmapped file.
+	MappedFile();
+
+	// Unmap the file.
+	~MappedFile();
+
+	// Map a file, unmapping any file already mapped.
+	bool open(const char *name);
+
+	// Unmap the file.
+	void close();
+
+	// Start of the mapped file, or NULL.
+	const char *data() const { return base; }
+
+	// Size of the mapped file in bytes.
+	size_t size() const { return length; }
+
+private:
+	// Mappings can't be copied.
+	MappedFile(const MappedFile &);
+	MappedFile &operator=(const MappedFile &);
+};
+
+#endif
@@ -0,0 +1,239 @@
+/* MatchPlanner.cpp */
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include "MatchPlanner.h"
+#include "DescriptorMatrix.h"
+#include "LSHIndex.h"
+#include "ThreadPool.h"
+
+// Descriptor length used by the micro-benchmark.
+static const int benchmarkDim = 64;
+
+// Number of times each benchmark is repeated.  The fastest run is kept,
+// which filters out page faults and preemption.
+static const int benchmarkRuns = 3;
+
+// Rows of f1 handled by one blocked matching task.  This matches the
+// query block of blockedMatchFeatures.
+static const int blockedTaskRows = 32;
+
+// Fewer feature pairs than this are always matched by the scalar loop.
+// Such matches are cheap anyway, and this keeps their scores in double
+// precision, as they were before blocked matching.
+static const double scalarPairs = 128.0 * 128;
+
+static MatchCostModel costModel;
+static once_flag costModelOnce;
+
+// Get the time in seconds from an arbitrary start.
+static double now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Make a feature set of random descriptors.
+static void randomFeatures(int count, int dim, unsigned int seed, FeatureSet &features) {
+    features.resize(count);
+
+    for (int i=0; i<count; i++) {
+        features[i].id = i + 1;
+        features[i].data.resize(dim);
+
+        for (int j=0; j<dim; j++) {
+            seed = seed * 1664525u + 1013904223u;
+            features[i].data[j] = (seed >> 8) / 16777216.0;
+        }
+    }
+}
+
+// Estimate the work of one LSH query against n indexed descriptors:
+// generating the probes, visiting the expected number of candidates in
+// the probed buckets and ranking them by Hamming distance.
+static double annQueryWork(int n, int dim, const MatchOptions &options) {
+    int keyBits = min(min(options.lshKeyBits, dim), 24);
+    double probed = options.lshTables * (options.lshProbes + 1.0);
+    double candidates = min((double) n, probed * n / (double) (1 << keyBits));
+
+    return probed * keyBits + candidates * ((dim + 63) / 64 + 1);
+}
+
+// Measure the cost model.  Blocked matching is timed at two sizes on
+// one thread to separate its fixed cost from its cost per distance
+// element, and the LSH costs are timed on an index over random
+// descriptors using the default LSH settings.
+static void calibrate() {
+    FeatureSet a, b;
+    vector<FeatureMatch> matches;
+    double score;
+    double t;
+
+    // Scalar matching.
+    randomFeatures(64, benchmarkDim, 1, a);
+    randomFeatures(64, benchmarkDim, 2, b);
+    t = 1e100;
+
+    for (int r=0; r<benchmarkRuns; r++) {
+        double start = now();
+        ssdMatchFeatures(a, b, matches, score);
+        t = min(t, now() - start);
+    }
+
+    costModel.brute = t / (64.0 * 64 * benchmarkDim);
+
+    // Packing.
+    randomFeatures(256, benchmarkDim, 3, a);
+    randomFeatures(256, benchmarkDim, 4, b);
+    t = 1e100;
+
+    for (int r=0; r<benchmarkRuns; r++) {
+        DescriptorMatrix ma, mb;
+        double start = now();
+        ma.build(a);
+        mb.build(b);
+        t = min(t, now() - start);
+    }
+
+    costModel.pack = t / (512.0 * benchmarkDim);
+
+    // Blocked matching, large then small.
+    double tLarge = 1e100;
+
+    for (int r=0; r<benchmarkRuns; r++) {
+        double start = now();
+        blockedMatchFeatures(a, b, matches, score, 1, 1);
+        tLarge = min(tLarge, now() - start);
+    }
+
+    randomFeatures(8, benchmarkDim, 5, a);
+    randomFeatures(8, benchmarkDim, 6, b);
+    double tSmall = 1e100;
+
+    for (int r=0; r<benchmarkRuns; r++) {
+        double start = now();
+        blockedMatchFeatures(a, b, matches, score, 1, 1);
+        tSmall = min(tSmall, now() - start);
+    }
+
+    double work = (256.0 * 256 - 8.0 * 8) * benchmarkDim;
+    costModel.blocked = max(tLarge - tSmall - costModel.pack * (512 - 16) * benchmarkDim, 1e-3 * tLarge) / work;
+    costModel.blockedSetup = max(tSmall - costModel.blocked * 64 * benchmarkDim - costModel.pack * 16 * benchmarkDim, 0.0);
+
+    // LSH.
+    MatchOptions options;
+    int n = 4096;
+    int m = 256;
+
+    randomFeatures(n, benchmarkDim, 7, b);
+    randomFeatures(m, benchmarkDim, 8, a);
+
+    vector<float> samples;
+
+    for (int j=0; j<n; j++) {
+        samples.insert(samples.end(), b[j].data.begin(), b[j].data.end());
+    }
+
+    LSHIndex index;
+    index.probes = options.lshProbes;
+
+    double start = now();
+    index.train(samples, benchmarkDim, options.lshTables, options.lshKeyBits);
+    index.add(0, b);
+    costModel.annBuild = (now() - start) / ((double) n * benchmarkDim);
+
+    vector<IndexCandidate> candidates;
+    t = 1e100;
+
+    for (int r=0; r<benchmarkRuns; r++) {
+        start = now();
+
+        for (int i=0; i<m; i++) {
+            index.search(a[i].data, options.neighbours, candidates);
+        }
+
+        t = min(t, now() - start);
+    }
+
+    costModel.annQuery = t / (m * annQueryWork(n, benchmarkDim, options));
+}
+
+// Get the cost model, running the micro-benchmark on first use.
+const MatchCostModel &matchCostModel() {
+    call_once(costModelOnce, calibrate);
+    return costModel;
+}
+
+// Choose how to match two feature sets from the predicted cost of each
+// plan:
+//   brute:   m n d scalar distance elements;
+//   blocked: packing (m + n) d elements, plus m n d SIMD distance
+//            elements spread over the threads that have rows to do;
+//   ann:     building an index over n d elements, plus m queries, each
+//            re-ranking its neighbours with the scalar distance.
+// A forced plan, the LSH backend and small matches need no prediction,
+// so they return before the cost model is measured, with no costs.
+MatchPlan planMatch(int m, int n, int dim, int matchType, const MatchOptions *options) {
+    MatchOptions defaults;
+    const MatchOptions &o = (options != NULL) ? *options : defaults;
+
+    MatchPlan plan;
+    plan.plan = MATCH_PLAN_BRUTE;
+
+    for (int i=0; i<4; i++) {
+        plan.cost[i] = 0;
+    }
+
+    if ((matchType != 1) && (matchType != 2)) {
+        return plan;
+    }
+
+    if ((o.plan > MATCH_PLAN_AUTO) && (o.plan <= MATCH_PLAN_ANN)) {
+        plan.plan = o.plan;
+        return plan;
+    }
+
+    if (o.backend == MATCH_BACKEND_LSH) {
+        plan.plan = MATCH_PLAN_ANN;
+        return plan;
+    }
+
+    if ((double) m * n < scalarPairs) {
+        return plan;
+    }
+
+    const MatchCostModel &c = matchCostModel();
+    int threads = (o.numThreads > 0) ? o.numThreads : ThreadPool::shared().size() + 1;
+    int tasks = max((m + blockedTaskRows - 1) / blockedTaskRows, 1);
+    double pairs = (double) m * n * dim;
+
+    plan.cost[MATCH_PLAN_BRUTE] = c.brute * pairs;
+    plan.cost[MATCH_PLAN_BLOCKED] = c.blockedSetup + c.pack * (m + n) * dim + c.blocked * pairs / min(threads, tasks);
+    plan.cost[MATCH_PLAN_ANN] = c.annBuild * n * dim +
+        m * (c.annQuery * annQueryWork(n, dim, o) + c.brute * o.neighbours * dim);
+
+    if (plan.cost[MATCH_PLAN_BLOCKED] < plan.cost[plan.plan]) {
+        plan.plan = MATCH_PLAN_BLOCKED;
+    }
+
+    if (o.approximate && (plan.cost[MATCH_PLAN_ANN] < plan.cost[plan.plan])) {
+        plan.plan = MATCH_PLAN_ANN;
+    }
+
+    return plan;
+}
+
+// Get the name of a plan.
+const char *matchPlanName(int plan) {
+    switch (plan) {
+    case MATCH_PLAN_AUTO:
+        return "auto";
+    case MATCH_PLAN_BRUTE:
+        return "brute";
+    case MATCH_PLAN_BLOCKED:
+        return "blocked";
+    case MATCH_PLAN_ANN:
+        return "ann";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef MATCHPLANNER_H
+#define MATCHPLANNER_H
+
+#include "features.h"
+
+// Per-operation costs of the matching backends, in seconds, measured by
+// a short micro-benchmark the first time a plan is made.
+struct MatchCostModel
+{
+	// Scalar distance, per query feature, database feature and
+	// descriptor element.
+	double brute;
+
+	// Blocked SIMD distance, per query feature, database feature and
+	// descriptor element, on one thread.
+	double blocked;
+
+	// Packing descriptors into matrices, per descriptor element, and
+	// the fixed cost of a blocked match.
+	double pack;
+	double blockedSetup;
+
+	// Adding a descriptor to an LSH index, per descriptor element, and
+	// an LSH query, per unit of query work (see planMatch).
+	double annBuild;
+	double annQuery;
+};
+
+// A MatchPlan is the strategy chosen for one matchFeatures call, with
+// the predicted cost, in seconds, of each strategy (indexed by plan;
+// cost[MATCH_PLAN_AUTO] is unused).
+struct MatchPlan
+{
+	int plan;
+	double cost[4];
+};
+
+// Get the cost model, running the micro-benchmark on first use.
+const MatchCostModel &matchCostModel();
+
+// Choose how to match m query features against n features with
+// descriptors of length dim.  The plan named by options->plan is used
+// if there is one, and the LSH backend always uses the LSH plan; small
+// matches use the brute force plan.  Otherwise the cheapest predicted
+// plan is chosen, considering the approximate LSH plan only if
+// options->approximate is set.  The costs are left at zero unless they
+// were predicted.  Only ssd and ratio matching have a choice of plans.
+MatchPlan planMatch(int m, int n, int dim, int matchType, const MatchOptions *options);
+
+// Get the name of a plan.
+const char *matchPlanName(int plan);
+
+#endif
@@ -0,0 +1,498 @@
+/* PQIndex.cpp */
+
+#include <stdio.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "BinaryIO.h"
+#include "PQIndex.h"
+
+// Number of k-means iterations used when training the quantizers.
+static const int trainIterations = 10;
+
+// A small linear congruential generator, so that training is
+// repeatable from run to run.
+static unsigned int nextRandom(unsigned int &state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// Compute the squared distance between two float vectors.
+static float squaredDistance(const float *a, const float *b, int n) {
+    float d = 0;
+
+    for (int i=0; i<n; i++) {
+        float t = a[i] - b[i];
+        d += t * t;
+    }
+
+    return d;
+}
+
+// Cluster n vectors of length dim into k centroids with Lloyd's
+// algorithm.  If there are fewer vectors than centroids, the extra
+// centroids are copies of existing vectors.
+static void kmeans(const float *data, int n, int dim, int k, float *centroids) {
+    unsigned int seed = 12345;
+
+    // Initialize the centroids with randomly chosen vectors.
+    for (int c=0; c<k; c++) {
+        int i = (c < n) ? (int) (nextRandom(seed) % n) : c % n;
+        memcpy(centroids + c*dim, data + i*dim, dim * sizeof(float));
+    }
+
+    if (n <= k) {
+        for (int c=0; c<n; c++) {
+            memcpy(centroids + c*dim, data + c*dim, dim * sizeof(float));
+        }
+
+        return;
+    }
+
+    vector<int> assign(n);
+    vector<double> sums(k * dim);
+    vector<int> counts(k);
+
+    for (int iter=0; iter<trainIterations; iter++) {
+        // Assign each vector to its nearest centroid.
+        for (int i=0; i<n; i++) {
+            float dBest = FLT_MAX;
+            int cBest = 0;
+
+            for (int c=0; c<k; c++) {
+                float d = squaredDistance(data + i*dim, centroids + c*dim, dim);
+
+                if (d < dBest) {
+                    dBest = d;
+                    cBest = c;
+                }
+            }
+
+            assign[i] = cBest;
+        }
+
+        // Move each centroid to the mean of its vectors.
+        fill(sums.begin(), sums.end(), 0.0);
+        fill(counts.begin(), counts.end(), 0);
+
+        for (int i=0; i<n; i++) {
+            double *s = &sums[assign[i] * dim];
+
+            for (int j=0; j<dim; j++) {
+                s[j] += data[i*dim + j];
+            }
+
+            counts[assign[i]]++;
+        }
+
+        for (int c=0; c<k; c++) {
+            if (counts[c] == 0) {
+                // Reseed empty clusters with a random vector.
+                int i = nextRandom(seed) % n;
+                memcpy(centroids + c*dim, data + i*dim, dim * sizeof(float));
+                continue;
+            }
+
+            for (int j=0; j<dim; j++) {
+                centroids[c*dim + j] = (float) (sums[c*dim + j] / counts[c]);
+            }
+        }
+    }
+}
+
+// Sum the lookup table entries for n codes of m bytes each.  With AVX2,
+// eight codes are scanned at once by gathering their bytes and the
+// corresponding table entries.
+static void scanCodes(const unsigned char *codes, int n, int m, const float *lut, float *out) {
+    int i = 0;
+
+#ifdef __AVX2__
+    const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(m));
+    const __m256i mask = _mm256_set1_epi32(0xff);
+
+    // The byte gathers read 4 bytes, so stop while 3 bytes remain past
+    // the last code of the block.
+    for (; (i + 8) * m + 3 <= n * m; i += 8) {
+        const unsigned char *block = codes + i*m;
+        __m256 sum = _mm256_setzero_ps();
+
+        for (int s=0; s<m; s++) {
+            __m256i c = _mm256_and_si256(_mm256_i32gather_epi32((const int *) (block + s), offsets, 1), mask);
+            sum = _mm256_add_ps(sum, _mm256_i32gather_ps(lut + s*256, c, 4));
+        }
+
+        _mm256_storeu_ps(out + i, sum);
+    }
+#endif
+
+    for (; i<n; i++) {
+        const unsigned char *code = codes + i*m;
+        float sum = 0;
+
+        for (int s=0; s<m; s++) {
+            sum += lut[s*256 + code[s]];
+        }
+
+        out[i] = sum;
+    }
+}
+
+// Create an empty index.
+PQIndex::PQIndex() {
+    probes = 8;
+    dim = 0;
+    numLists = 0;
+    numSubspaces = 0;
+}
+
+// Train the quantizers on a sample of the database, then add every
+// database item.
+bool PQIndex::build(const ImageDatabase &db, int numLists, int numSubspaces, int maxSamples) {
+    vector<float> samples;
+    int d;
+
+    if (!sampleDescriptors(db, maxSamples, samples, d)) {
+        return false;
+    }
+
+    if (!train(samples, d, numLists, numSubspaces)) {
+        return false;
+    }
+
+    return add_database(db);
+}
+
+// Train the coarse quantizer and the subspace codebooks.
+bool PQIndex::train(const vector<float> &samples, int dim, int numLists, int numSubspaces) {
+    if ((dim <= 0) || (numLists <= 0) || (numSubspaces <= 0) || (numSubspaces > dim) || samples.empty()) {
+        return false;
+    }
+
+    int n = samples.size() / dim;
+
+    this->dim = dim;
+    this->numLists = numLists;
+    this->numSubspaces = numSubspaces;
+
+    // Split the dimensions as evenly as possible among the subspaces.
+    subStart.resize(numSubspaces + 1);
+
+    for (int m=0; m<=numSubspaces; m++) {
+        subStart[m] = (m * dim) / numSubspaces;
+    }
+
+    // Train the coarse quantizer.
+    coarse.resize(numLists * dim);
+    kmeans(&samples[0], n, dim, numLists, &coarse[0]);
+
+    // Compute the residuals from the coarse centroids.
+    vector<float> residuals(samples.size());
+
+    for (int i=0; i<n; i++) {
+        int l = nearest_list(&samples[i*dim]);
+
+        for (int j=0; j<dim; j++) {
+            residuals[i*dim + j] = samples[i*dim + j] - coarse[l*dim + j];
+        }
+    }
+
+    // Train a 256-entry codebook for each subspace of the residuals.
+    codebooks.resize(256 * dim);
+
+    for (int m=0; m<numSubspaces; m++) {
+        int len = sub_size(m);
+        vector<float> sub(n * len);
+
+        for (int i=0; i<n; i++) {
+            memcpy(&sub[i*len], &residuals[i*dim + subStart[m]], len * sizeof(float));
+        }
+
+        kmeans(&sub[0], n, len, 256, &codebooks[codebook_offset(m)]);
+    }
+
+    lists.clear();
+    lists.resize(numLists);
+
+    return true;
+}
+
+// Add the features of a database item to the index.
+void PQIndex::add(int item, const FeatureSet &features) {
+    vector<float> x(dim);
+    vector<unsigned char> code(numSubspaces);
+
+    for (unsigned int i=0; i<features.size(); i++) {
+        const Feature &f = features[i];
+
+        if ((int) f.data.size() != dim) {
+            continue;
+        }
+
+        for (int j=0; j<dim; j++) {
+            x[j] = (float) f.data[j];
+        }
+
+        int l = nearest_list(&x[0]);
+
+        for (int j=0; j<dim; j++) {
+            x[j] -= coarse[l*dim + j];
+        }
+
+        encode(&x[0], &code[0]);
+
+        InvertedList &list = lists[l];
+        list.codes.insert(list.codes.end(), code.begin(), code.end());
+        list.items.push_back(item);
+        list.ids.push_back(f.id);
+    }
+}
+
+// Find the k nearest database features to a descriptor.  The closest
+// inverted lists are scanned with asymmetric distances, keeping the
+// best k entries in a max-heap.
+void PQIndex::search(const vector<double> &descriptor, int k, vector<IndexCandidate> &candidates) const {
+    candidates.clear();
+
+    if (((int) descriptor.size() != dim) || lists.empty() || (k <= 0)) {
+        return;
+    }
+
+    vector<float> x(dim);
+
+    for (int j=0; j<dim; j++) {
+        x[j] = (float) descriptor[j];
+    }
+
+    // Rank the inverted lists by distance to the query.
+    vector< pair<float, int> > order(numLists);
+
+    for (int l=0; l<numLists; l++) {
+        order[l] = make_pair(squaredDistance(&x[0], &coarse[l*dim], dim), l);
+    }
+
+    int numProbes = min(max(probes, 1), numLists);
+    partial_sort(order.begin(), order.begin() + numProbes, order.end());
+
+    vector<float> residual(dim);
+    vector<float> lut(numSubspaces * 256);
+    vector<float> dist;
+
+    // Max-heap of (distance, (list, entry)).
+    vector< pair<float, pair<int, int> > > heap;
+
+    for (int p=0; p<numProbes; p++) {
+        int l = order[p].second;
+        const InvertedList &list = lists[l];
+        int n = list.items.size();
+
+        if (n == 0) {
+            continue;
+        }
+
+        for (int j=0; j<dim; j++) {
+            residual[j] = x[j] - coarse[l*dim + j];
+        }
+
+        // Build the table of distances from the residual to every
+        // codebook entry of every subspace.
+        for (int m=0; m<numSubspaces; m++) {
+            int len = sub_size(m);
+            const float *book = &codebooks[codebook_offset(m)];
+
+            for (int c=0; c<256; c++) {
+                lut[m*256 + c] = squaredDistance(&residual[subStart[m]], book + c*len, len);
+            }
+        }
+
+        dist.resize(n);
+        scanCodes(&list.codes[0], n, numSubspaces, &lut[0], &dist[0]);
+
+        for (int i=0; i<n; i++) {
+            if ((numRemoved > 0) && is_removed(list.items[i])) {
+                continue;
+            }
+
+            if ((int) heap.size() < k) {
+                heap.push_back(make_pair(dist[i], make_pair(l, i)));
+                push_heap(heap.begin(), heap.end());
+            }
+            else if (dist[i] < heap.front().first) {
+                pop_heap(heap.begin(), heap.end());
+                heap.back() = make_pair(dist[i], make_pair(l, i));
+                push_heap(heap.begin(), heap.end());
+            }
+        }
+    }
+
+    sort_heap(heap.begin(), heap.end());
+    candidates.resize(heap.size());
+
+    for (unsigned int i=0; i<heap.size(); i++) {
+        const InvertedList &list = lists[heap[i].second.first];
+        int e = heap[i].second.second;
+
+        candidates[i].item = list.items[e];
+        candidates[i].id = list.ids[e];
+        candidates[i].distance = sqrt((double) max(heap[i].first, 0.0f));
+    }
+}
+
+// Renumber the items, compacting each inverted list in place.
+void PQIndex::remap(const vector<int> &map) {
+    for (unsigned int l=0; l<lists.size(); l++) {
+        InvertedList &list = lists[l];
+        int n = list.items.size();
+        int kept = 0;
+
+        for (int i=0; i<n; i++) {
+            int item = remapped(map, list.items[i]);
+
+            if (item < 0) {
+                continue;
+            }
+
+            copy(list.codes.begin() + (size_t) i * numSubspaces, list.codes.begin() + (size_t) (i + 1) * numSubspaces,
+                list.codes.begin() + (size_t) kept * numSubspaces);
+            list.items[kept] = item;
+            list.ids[kept] = list.ids[i];
+            kept++;
+        }
+
+        list.codes.resize((size_t) kept * numSubspaces);
+        list.items.resize(kept);
+        list.ids.resize(kept);
+    }
+
+    removed.clear();
+    numRemoved = 0;
+}
+
+// Number of descriptors stored in the index.
+int PQIndex::size() const {
+    int n = 0;
+
+    for (unsigned int l=0; l<lists.size(); l++) {
+        n += lists[l].items.size();
+    }
+
+    return n;
+}
+
+// Find the nearest coarse centroid to a descriptor.
+int PQIndex::nearest_list(const float *x) const {
+    float dBest = FLT_MAX;
+    int lBest = 0;
+
+    for (int l=0; l<numLists; l++) {
+        float d = squaredDistance(x, &coarse[l*dim], dim);
+
+        if (d < dBest) {
+            dBest = d;
+            lBest = l;
+        }
+    }
+
+    return lBest;
+}
+
+// Compute the PQ code of a residual vector.
+void PQIndex::encode(const float *residual, unsigned char *code) const {
+    for (int m=0; m<numSubspaces; m++) {
+        int len = sub_size(m);
+        const float *book = &codebooks[codebook_offset(m)];
+        float dBest = FLT_MAX;
+        int cBest = 0;
+
+        for (int c=0; c<256; c++) {
+            float d = squaredDistance(residual + subStart[m], book + c*len, len);
+
+            if (d < dBest) {
+                dBest = d;
+                cBest = c;
+            }
+        }
+
+        code[m] = (unsigned char) cBest;
+    }
+}
+
+static const char pqMagic[4] = { 'P', 'Q', 'I', '1' };
+
+// Save the index to a file.
+bool PQIndex::save(const char *name) const {
+    FILE *f = fopen(name, "wb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    int header[3] = { dim, numLists, numSubspaces };
+
+    fwrite(pqMagic, 1, 4, f);
+    fwrite(header, sizeof(int), 3, f);
+    writeVector(f, subStart);
+    writeVector(f, coarse);
+    writeVector(f, codebooks);
+
+    for (int l=0; l<numLists; l++) {
+        writeVector(f, lists[l].codes);
+        writeVector(f, lists[l].items);
+        writeVector(f, lists[l].ids);
+    }
+
+    return (fclose(f) == 0);
+}
+
+// Load the index from a file.
+bool PQIndex::load(const char *name) {
+    FILE *f = fopen(name, "rb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    char magic[4];
+    int header[3];
+    bool ok = (fread(magic, 1, 4, f) == 4) && (memcmp(magic, pqMagic, 4) == 0) &&
+        (fread(header, sizeof(int), 3, f) == 3) && (header[0] > 0) && (header[1] > 0) && (header[2] > 0);
+
+    if (ok) {
+        dim = header[0];
+        numLists = header[1];
+        numSubspaces = header[2];
+
+        ok = readVector(f, subStart) && readVector(f, coarse) && readVector(f, codebooks) &&
+            ((int) subStart.size() == numSubspaces + 1) && ((long long) coarse.size() == (long long) numLists * dim) &&
+            ((long long) codebooks.size() == 256LL * dim);
+    }
+
+    // The subspaces must split the descriptor in order, since they
+    // index the codebooks.
+    for (int m=0; (m<numSubspaces) && ok; m++) {
+        ok = (subStart[0] == 0) && (subStart[m] < subStart[m+1]) && (subStart[numSubspaces] == dim);
+    }
+
+    if (ok) {
+        lists.clear();
+        lists.resize(numLists);
+
+        for (int l=0; (l<numLists) && ok; l++) {
+            ok = readVector(f, lists[l].codes) && readVector(f, lists[l].items) && readVector(f, lists[l].ids) &&
+                (lists[l].codes.size() == lists[l].items.size() * numSubspaces) &&
+                (lists[l].ids.size() == lists[l].items.size());
+        }
+    }
+
+    fclose(f);
+
+    if (!ok) {
+        lists.clear();
+        numLists = 0;
+    }
+
+    return ok;
+}
@@ -0,0 +1,86 @@
+#ifndef PQINDEX_H
+#define PQINDEX_H
+
+#include "DescriptorIndex.h"
+
+// The PQIndex class is an inverted file with product quantization
+// (IVF-PQ).  A coarse quantizer assigns each descriptor to one of a
+// number of inverted lists, and the residual from the list centroid is
+// stored as a short code of one byte per subspace.  A 128-D SIFT
+// descriptor therefore takes 8 or 16 bytes instead of 1 KB.  Searches
+// use asymmetric distances: the query is kept exact and compared to
+// the codes through per-subspace lookup tables.
+class PQIndex : public DescriptorIndex {
+public:
+	// Number of inverted lists visited per search.
+	int probes;
+
+private:
+	// An inverted list stores the codes of the descriptors assigned to
+	// one coarse centroid, along with their item and feature IDs.
+	struct InvertedList {
+		vector<unsigned char> codes;
+		vector<int> items;
+		vector<int> ids;
+	};
+
+	int dim;
+	int numLists;
+	int numSubspaces;
+
+	// First dimension of each subspace (numSubspaces+1 entries).
+	vector<int> subStart;
+
+	// Coarse centroids (numLists x dim) and the subspace codebooks
+	// (256 centroids per subspace, stored subspace by subspace).
+	vector<float> coarse;
+	vector<float> codebooks;
+
+	vector<InvertedList> lists;
+
+public:
+	// Create an empty index.
+	PQIndex();
+
+	// Train the quantizers on a sample of at most maxSamples database
+	// descriptors, then add every database item.  Items without
+	// resident features are loaded from their feature files one at a
+	// time, so the full database never has to fit in memory.
+	bool build(const ImageDatabase &db, int numLists, int numSubspaces, int maxSamples);
+
+	// Train the quantizers on a set of descriptors (n x dim).
+	bool train(const vector<float> &samples, int dim, int numLists, int numSubspaces);
+
+	// Add the features of a database item to the index.
+	void add(int item, const FeatureSet &features);
+
+	// Find the k nearest database features to a descriptor.
+	void search(const vector<double> &descriptor, int k, vector<IndexCandidate> &candidates) const;
+
+	// Renumber the items, dropping removed ones.
+	void remap(const vector<int> &map);
+
+	// Number of descriptors stored in the index.
+	int size() const;
+
+	// Save the index to a file.
+	bool save(const char *name) const;
+
+	// Load the index from a file.
+	bool load(const char *name);
+
+private:
+	// Size of the subspace codebook for subspace m.
+	int sub_size(int m) const { return subStart[m+1] - subStart[m]; }
+
+	// Offset of the codebook of subspace m.
+	int codebook_offset(int m) const { return 256 * subStart[m]; }
+
+	// Find the nearest coarse centroid to a descriptor.
+	int nearest_list(const float *x) const;
+
+	// Compute the PQ code of a residual vector.
+	void encode(const float *residual, unsigned char *code) const;
+};
+
+#endif
@@ -0,0 +1,318 @@
+/* PackedDatabase.cpp */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "PackedDatabase.h"
+#include "ImageDatabase.h"
+#include "DescriptorMatrix.h"
+
+static const char packedMagic[4] = { 'P', 'D', 'B', '1' };
+static const unsigned int packedVersion = 1;
+
+// Alignment of every section.
+static const unsigned long long sectionAlignment = 64;
+
+// Round an offset up to the section alignment.
+static unsigned long long align(unsigned long long offset) {
+    return (offset + sectionAlignment - 1) & ~(sectionAlignment - 1);
+}
+
+// Fill in the shape and section offsets of a header.
+static void layout(PackedDatabaseHeader &h, unsigned int items, unsigned int features, unsigned int dim, unsigned int nameBytes, unsigned int generation) {
+    memcpy(h.magic, packedMagic, 4);
+    h.version = packedVersion;
+    h.items = items;
+    h.features = features;
+    h.dim = dim;
+    h.stride = (dim + 7) & ~7;
+    h.nameBytes = nameBytes;
+    h.generation = generation;
+
+    h.descriptors = align(sizeof(PackedDatabaseHeader));
+    h.itemOffsets = align(h.descriptors + 4ULL * features * h.stride);
+
+    unsigned long long offset = align(h.itemOffsets + 4ULL * ((unsigned long long) items + 1));
+
+    for (int s=0; s<FEATURE_SECTION_DESCRIPTORS; s++) {
+        h.keypoints[s] = offset;
+        offset = align(offset + 4ULL * features);
+    }
+
+    h.nameOffsets = offset;
+    h.names = align(h.nameOffsets + 4ULL * ((unsigned long long) items + 1));
+    h.fileSize = h.names + nameBytes;
+}
+
+// Create a closed database.
+PackedDatabase::PackedDatabase() {
+    header = NULL;
+}
+
+// Map a packed database file and check that its header describes the
+// layout this version writes, and that its tables are consistent.
+bool PackedDatabase::open(const char *name) {
+    close();
+
+    if (!file.open(name) || (file.size() < sizeof(PackedDatabaseHeader))) {
+        file.close();
+        return false;
+    }
+
+    const PackedDatabaseHeader *h = (const PackedDatabaseHeader *) file.data();
+    PackedDatabaseHeader expected;
+
+    if ((memcmp(h->magic, packedMagic, 4) != 0) || (h->version != packedVersion)) {
+        file.close();
+        return false;
+    }
+
+    layout(expected, h->items, h->features, h->dim, h->nameBytes, h->generation);
+
+    // The stride wraps to zero for a huge dim, and the descriptor block
+    // is the only section whose size could overflow 64 bits, so both are
+    // checked before the layout is trusted.  The file size then bounds
+    // the end of every section.
+    bool ok = (expected.stride >= h->dim) &&
+        ((h->features == 0) || (expected.stride <= file.size() / 4 / h->features)) &&
+        (h->stride == expected.stride) && (h->fileSize == expected.fileSize) && (h->fileSize <= file.size()) &&
+        (h->descriptors == expected.descriptors) && (h->itemOffsets == expected.itemOffsets) &&
+        (memcmp(h->keypoints, expected.keypoints, sizeof(expected.keypoints)) == 0) &&
+        (h->nameOffsets == expected.nameOffsets) && (h->names == expected.names);
+
+    if (ok) {
+        const unsigned int *items = (const unsigned int *) (file.data() + h->itemOffsets);
+        const unsigned int *names = (const unsigned int *) (file.data() + h->nameOffsets);
+
+        ok = (items[0] == 0) && (items[h->items] == h->features) && (names[0] == 0) && (names[h->items] <= h->nameBytes);
+
+        for (unsigned int i=0; ok && (i<h->items); i++) {
+            ok = (items[i] <= items[i+1]) && (names[i] < names[i+1]);
+        }
+
+        ok = ok && ((h->items == 0) || (file.data()[h->names + h->nameBytes - 1] == '\0'));
+    }
+
+    if (!ok) {
+        file.close();
+        return false;
+    }
+
+    header = h;
+    return true;
+}
+
+// Unmap the file.
+void PackedDatabase::close() {
+    file.close();
+    header = NULL;
+}
+
+// Name of an item.
+const char *PackedDatabase::item_name(int i) const {
+    const unsigned int *offsets = (const unsigned int *) at(header->nameOffsets);
+    return at(header->names) + offsets[i];
+}
+
+// Copy the features of an item.
+void PackedDatabase::get_item_features(int i, FeatureSet &features) const {
+    int begin = item_begin(i);
+    int n = item_end(i) - begin;
+
+    const int *ids = (const int *) at(header->keypoints[FEATURE_SECTION_IDS]);
+    const int *types = (const int *) at(header->keypoints[FEATURE_SECTION_TYPES]);
+    const int *xs = (const int *) at(header->keypoints[FEATURE_SECTION_X]);
+    const int *ys = (const int *) at(header->keypoints[FEATURE_SECTION_Y]);
+    const float *angles = (const float *) at(header->keypoints[FEATURE_SECTION_ANGLES]);
+    const float *scales = (const float *) at(header->keypoints[FEATURE_SECTION_SCALES]);
+    const float *rows = (const float *) at(header->descriptors);
+
+    features.clear();
+    features.resize(n);
+
+    for (int j=0; j<n; j++) {
+        Feature &f = features[j];
+        int r = begin + j;
+        const float *d = rows + (size_t) r * header->stride;
+
+        f.id = ids[r];
+        f.type = types[r];
+        f.x = xs[r];
+        f.y = ys[r];
+        f.angleRadians = angles[r];
+        f.scale = scales[r];
+        f.data.assign(d, d + header->dim);
+    }
+}
+
+// View the descriptors of every item as a matrix without copying them.
+bool PackedDatabase::get_matrix(DescriptorMatrix &matrix) const {
+    if (header == NULL) {
+        return false;
+    }
+
+    const float *rows = (const float *) at(header->descriptors);
+    const int *ids = (const int *) at(header->keypoints[FEATURE_SECTION_IDS]);
+
+    if (!matrix.view(rows, header->features, header->dim, header->stride, ids)) {
+        return false;
+    }
+
+    matrix.offsets.assign(itemOffsets(), itemOffsets() + header->items + 1);
+    return true;
+}
+
+// Check whether a file starts with the packed database magic.
+bool isPackedDatabase(const char *name) {
+    FILE *f = fopen(name, "rb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    char magic[4];
+    bool ok = (fread(magic, 1, 4, f) == 4) && (memcmp(magic, packedMagic, 4) == 0);
+
+    fclose(f);
+    return ok;
+}
+
+// Write zeros up to a file offset.
+static void pad(FILE *f, unsigned long long &offset, unsigned long long target) {
+    static const char zeros[sectionAlignment] = { 0 };
+
+    while (offset < target) {
+        size_t n = (size_t) min(target - offset, sectionAlignment);
+        fwrite(zeros, 1, n, f);
+        offset += n;
+    }
+}
+
+// Write a database as a packed database file.  The descriptor block
+// comes first so that it can be written while the items are loaded,
+// and the header is written last, once the totals are known.
+bool savePackedDatabase(const char *name, const ImageDatabase &db, unsigned int generation) {
+    FILE *f = fopen(name, "wb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    PackedDatabaseHeader h;
+    memset(&h, 0, sizeof(h));
+    layout(h, 0, 0, 0, 0, generation);
+
+    unsigned long long offset = 0;
+    pad(f, offset, h.descriptors);
+
+    vector<unsigned int> itemOffsets(1, 0);
+    vector<int> ints[FEATURE_SECTION_ANGLES];
+    vector<float> floats[FEATURE_SECTION_DESCRIPTORS - FEATURE_SECTION_ANGLES];
+    vector<unsigned int> nameOffsets(1, 0);
+    string names;
+
+    int dim = -1;
+    int stride = 0;
+    vector<float> row;
+    FeatureSet temp;
+    bool ok = true;
+
+    unsigned int items = 0;
+
+    for (unsigned int i=0; ok && (i<db.size()); i++) {
+        const FeatureSet *features = &db[i].features;
+
+        if (db[i].removed) {
+            continue;
+        }
+
+        if (features->empty() && db.has_feature_source(i)) {
+            if (!db.load_item_features(i, temp)) {
+                printf("couldn't load features for %s\n", db[i].name.c_str());
+                ok = false;
+                break;
+            }
+
+            features = &temp;
+        }
+
+        for (unsigned int j=0; j<features->size(); j++) {
+            const Feature &g = (*features)[j];
+
+            if (dim < 0) {
+                dim = g.data.size();
+                stride = (dim + 7) & ~7;
+                row.assign(stride, 0.0f);
+            }
+
+            if ((int) g.data.size() != dim) {
+                ok = false;
+                break;
+            }
+
+            for (int k=0; k<dim; k++) {
+                row[k] = (float) g.data[k];
+            }
+
+            if (stride > 0) {
+                fwrite(&row[0], sizeof(float), stride, f);
+                offset += 4ULL * stride;
+            }
+
+            ints[FEATURE_SECTION_IDS].push_back(g.id);
+            ints[FEATURE_SECTION_TYPES].push_back(g.type);
+            ints[FEATURE_SECTION_X].push_back(g.x);
+            ints[FEATURE_SECTION_Y].push_back(g.y);
+            floats[FEATURE_SECTION_ANGLES - FEATURE_SECTION_ANGLES].push_back((float) g.angleRadians);
+            floats[FEATURE_SECTION_SCALES - FEATURE_SECTION_ANGLES].push_back((float) g.scale);
+        }
+
+        itemOffsets.push_back(ints[FEATURE_SECTION_IDS].size());
+
+        names += db[i].name;
+        names += '\0';
+        nameOffsets.push_back(names.size());
+        items++;
+    }
+
+    if (!ok) {
+        fclose(f);
+        remove(name);
+        return false;
+    }
+
+    unsigned int count = ints[FEATURE_SECTION_IDS].size();
+    layout(h, items, count, max(dim, 0), names.size(), generation);
+
+    pad(f, offset, h.itemOffsets);
+    fwrite(&itemOffsets[0], sizeof(unsigned int), itemOffsets.size(), f);
+    offset += 4ULL * itemOffsets.size();
+
+    for (int s=0; s<FEATURE_SECTION_DESCRIPTORS; s++) {
+        pad(f, offset, h.keypoints[s]);
+
+        if (count > 0) {
+            if (s < FEATURE_SECTION_ANGLES) {
+                fwrite(&ints[s][0], sizeof(int), count, f);
+            }
+            else {
+                fwrite(&floats[s - FEATURE_SECTION_ANGLES][0], sizeof(float), count, f);
+            }
+        }
+
+        offset += 4ULL * count;
+    }
+
+    pad(f, offset, h.nameOffsets);
+    fwrite(&nameOffsets[0], sizeof(unsigned int), nameOffsets.size(), f);
+    offset += 4ULL * nameOffsets.size();
+
+    pad(f, offset, h.names);
+    fwrite(names.data(), 1, names.size(), f);
+
+    rewind(f);
+    fwrite(&h, sizeof(h), 1, f);
+
+    ok = !ferror(f);
+    return (fclose(f) == 0) && ok;
+}
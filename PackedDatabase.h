@@ -0,0 +1,100 @@
+#ifndef PACKEDDATABASE_H
+#define PACKEDDATABASE_H
+
+#include "FeatureFile.h"
+
+class ImageDatabase;
+
+// The header of a packed database file.  The file holds, in order:
+//   - the descriptors of every item, as one block of float32 rows of
+//     stride elements, zero padded, with the rows of item i at
+//     [itemOffsets[i], itemOffsets[i+1]);
+//   - the item offsets (items+1 uint32 values);
+//   - the keypoint arrays of every feature, one array per attribute,
+//     in the order of the FEATURE_SECTION_* values of FeatureFile.h;
+//   - the name table: items+1 uint32 offsets into a block of
+//     nameBytes bytes of null-terminated image names.
+// Every section starts on a 64-byte boundary.  All values are in the
+// byte order of the machine that wrote the file.  The generation counts
+// the compactions that produced the file, and ties a journal of later
+// changes to it.
+struct PackedDatabaseHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned int items;
+	unsigned int features;
+	unsigned int dim;
+	unsigned int stride;
+	unsigned int nameBytes;
+	unsigned int generation;
+	unsigned long long descriptors;
+	unsigned long long itemOffsets;
+	unsigned long long keypoints[FEATURE_SECTION_DESCRIPTORS];
+	unsigned long long nameOffsets;
+	unsigned long long names;
+	unsigned long long fileSize;
+};
+
+// The PackedDatabase class is a read-only view of a packed database
+// file mapped into memory.  Opening it only maps the file and checks
+// the header and tables; the descriptors are paged in by the operating
+// system as they are used, and processes that map the same file share
+// one copy in the page cache.
+class PackedDatabase {
+private:
+	MappedFile file;
+	const PackedDatabaseHeader *header;
+
+public:
+	// Create a closed database.
+	PackedDatabase();
+
+	// Map a packed database file and check it.
+	bool open(const char *name);
+
+	// Unmap the file.
+	void close();
+
+	// Number of items and of features over all items.
+	int items() const { return (header != NULL) ? header->items : 0; }
+	int features() const { return (header != NULL) ? header->features : 0; }
+
+	// Descriptor length and row stride.
+	int dim() const { return header->dim; }
+	int stride() const { return header->stride; }
+
+	// Number of compactions that produced the file.
+	unsigned int generation() const { return (header != NULL) ? header->generation : 0; }
+
+	// Name of an item.
+	const char *item_name(int i) const;
+
+	// Rows of an item's features.
+	int item_begin(int i) const { return itemOffsets()[i]; }
+	int item_end(int i) const { return itemOffsets()[i+1]; }
+
+	// Copy the features of an item.
+	void get_item_features(int i, FeatureSet &features) const;
+
+	// View the descriptors of every item as a matrix without copying
+	// them.  The matrix offsets give the rows of each item.
+	bool get_matrix(DescriptorMatrix &matrix) const;
+
+private:
+	// Start of a section.
+	const char *at(unsigned long long offset) const { return file.data() + offset; }
+
+	const unsigned int *itemOffsets() const { return (const unsigned int *) at(header->itemOffsets); }
+};
+
+// Check whether a file starts with the packed database magic.
+bool isPackedDatabase(const char *name);
+
+// Write a database as a packed database file.  Items whose features are
+// not resident are loaded one at a time, so the database never has to
+// fit in memory, and removed items are left out.  The descriptors must
+// all have the same length.
+bool savePackedDatabase(const char *name, const ImageDatabase &db, unsigned int generation = 0);
+
+#endif
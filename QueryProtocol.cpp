@@ -0,0 +1,731 @@
+/* QueryProtocol.cpp */
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#include <string.h>
+#include <chrono>
+#include <atomic>
+#include "QueryProtocol.h"
+
+static const char messageMagic[4] = { 'Q', 'R', 'Y', '1' };
+
+// Largest payload accepted, as a guard against reading garbage lengths.
+static const unsigned int maxPayload = 1u << 30;
+
+// Flags of a query.
+enum {
+    QUERY_FLAG_MATCHES = 1,
+    QUERY_FLAG_NAMES = 2,
+    QUERY_FLAG_IMAGE = 4,
+    QUERY_FLAG_DEADLINE = 8
+};
+
+// Flags of query results.
+enum {
+    RESULT_FLAG_PARTIAL = 1
+};
+
+// Create a query request with the defaults of performQuery.
+QueryRequest::QueryRequest() {
+    k = 10;
+    matchType = 1;
+    verifyTop = 0;
+    matches = false;
+    names = false;
+    featureType = 1;
+    descriptorType = 1;
+    deadlineMs = 0;
+}
+
+// Milliseconds since an arbitrary start, for timeouts.
+static long long milliseconds() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Milliseconds left until a deadline, or -1 for no deadline.
+static int remaining(long long deadline) {
+    if (deadline < 0) {
+        return -1;
+    }
+
+    return (int) max(deadline - milliseconds(), 0LL);
+}
+
+#ifndef _WIN32
+
+// Split a TCP address of the form host:port.  Returns false if the
+// address is a Unix socket path instead.
+static bool splitAddress(const char *address, string &host, string &port) {
+    const char *colon = strrchr(address, ':');
+
+    if ((colon == NULL) || (colon[1] == '\0') || (strchr(address, '/') != NULL)) {
+        return false;
+    }
+
+    for (const char *c=colon+1; *c!='\0'; c++) {
+        if ((*c < '0') || (*c > '9')) {
+            return false;
+        }
+    }
+
+    host.assign(address, colon - address);
+    port = colon + 1;
+    return true;
+}
+
+// Fill in the address of a Unix domain socket.
+static bool unixAddress(const char *path, sockaddr_un &a) {
+    if (strlen(path) >= sizeof(a.sun_path)) {
+        return false;
+    }
+
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strcpy(a.sun_path, path);
+    return true;
+}
+
+// Listen on an address.
+int listenSocket(const char *address) {
+    string host, port;
+
+    if (splitAddress(address, host, port)) {
+        addrinfo hints, *info;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &info) != 0) {
+            return -1;
+        }
+
+        int s = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        int on = 1;
+
+        if ((s >= 0) && ((setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+            (bind(s, info->ai_addr, info->ai_addrlen) != 0) || (listen(s, 64) != 0))) {
+            close(s);
+            s = -1;
+        }
+
+        freeaddrinfo(info);
+        return s;
+    }
+
+    sockaddr_un a;
+
+    if (!unixAddress(address, a)) {
+        return -1;
+    }
+
+    unlink(address);
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if ((s >= 0) && ((bind(s, (sockaddr *) &a, sizeof(a)) != 0) || (listen(s, 64) != 0))) {
+        close(s);
+        s = -1;
+    }
+
+    return s;
+}
+
+// Connect a socket without blocking for longer than timeoutMs.
+static bool connectWithin(int s, const sockaddr *a, socklen_t length, int timeoutMs) {
+    int flags = fcntl(s, F_GETFL, 0);
+    fcntl(s, F_SETFL, flags | O_NONBLOCK);
+
+    if (connect(s, a, length) != 0) {
+        if ((errno != EINPROGRESS) && (errno != EAGAIN)) {
+            return false;
+        }
+
+        pollfd p = { s, POLLOUT, 0 };
+        int error = 0;
+        socklen_t size = sizeof(error);
+
+        if ((poll(&p, 1, timeoutMs) != 1) || (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &size) != 0) || (error != 0)) {
+            return false;
+        }
+    }
+
+    fcntl(s, F_SETFL, flags);
+    return true;
+}
+
+// Connect to an address.
+int connectSocket(const char *address, int timeoutMs) {
+    string host, port;
+
+    if (splitAddress(address, host, port)) {
+        addrinfo hints, *info;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &info) != 0) {
+            return -1;
+        }
+
+        int s = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+
+        if ((s >= 0) && !connectWithin(s, info->ai_addr, info->ai_addrlen, timeoutMs)) {
+            close(s);
+            s = -1;
+        }
+
+        freeaddrinfo(info);
+
+        // Queries are small messages that should go out at once.
+        if (s >= 0) {
+            int on = 1;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+
+        return s;
+    }
+
+    sockaddr_un a;
+
+    if (!unixAddress(address, a)) {
+        return -1;
+    }
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if ((s >= 0) && !connectWithin(s, (sockaddr *) &a, sizeof(a), timeoutMs)) {
+        close(s);
+        s = -1;
+    }
+
+    return s;
+}
+
+// Accept a connection on a listening socket.
+int acceptSocket(int listener) {
+    int s = accept(listener, NULL, NULL);
+
+    if (s >= 0) {
+        int on = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    return s;
+}
+
+// Close a socket.
+void closeSocket(int socket) {
+    if (socket >= 0) {
+        close(socket);
+    }
+}
+
+// Write a whole buffer to a socket.
+static bool writeAll(int s, const char *data, size_t n) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+
+    while (n > 0) {
+        ssize_t written = send(s, data, n, flags);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += written;
+        n -= written;
+    }
+
+    return true;
+}
+
+// Read a whole buffer from a socket before a deadline.
+static bool readAll(int s, char *data, size_t n, long long deadline) {
+    while (n > 0) {
+        pollfd p = { s, POLLIN, 0 };
+        int r = poll(&p, 1, remaining(deadline));
+
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+        else if (r == 0) {
+            return false;
+        }
+
+        ssize_t got = recv(s, data, n, 0);
+
+        if (got < 0) {
+            if ((errno == EINTR) || (errno == EAGAIN)) {
+                continue;
+            }
+
+            return false;
+        }
+        else if (got == 0) {
+            return false;
+        }
+
+        data += got;
+        n -= got;
+    }
+
+    return true;
+}
+
+// Append what has arrived on a socket to a buffer.  One read is done,
+// of at most a chunk, so that a client sending a lot can't hold up the
+// others.
+bool receiveAvailable(int socket, vector<char> &buffer) {
+    const size_t chunk = 1 << 16;
+    size_t n = buffer.size();
+    buffer.resize(n + chunk);
+
+    ssize_t got;
+
+    do {
+        got = recv(socket, &buffer[n], chunk, MSG_DONTWAIT);
+    } while ((got < 0) && (errno == EINTR));
+
+    buffer.resize(n + max(got, (ssize_t) 0));
+
+    return (got > 0) || ((got < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)));
+}
+
+// Wait until one of a set of sockets can be read.
+int waitSockets(const vector<int> &sockets, vector<char> &ready, int timeoutMs) {
+    vector<pollfd> p(sockets.size());
+
+    for (unsigned int i=0; i<sockets.size(); i++) {
+        p[i].fd = sockets[i];
+        p[i].events = POLLIN;
+        p[i].revents = 0;
+    }
+
+    int r = p.empty() ? 0 : poll(&p[0], p.size(), timeoutMs);
+
+    if ((r < 0) && (errno != EINTR)) {
+        return -1;
+    }
+
+    ready.assign(sockets.size(), 0);
+
+    for (unsigned int i=0; i<p.size(); i++) {
+        ready[i] = (p[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+    }
+
+    return max(r, 0);
+}
+
+#else
+
+// Sockets are only supported on POSIX systems.
+int listenSocket(const char *address) {
+    return -1;
+}
+
+int connectSocket(const char *address, int timeoutMs) {
+    return -1;
+}
+
+int acceptSocket(int listener) {
+    return -1;
+}
+
+void closeSocket(int socket) {
+}
+
+static bool writeAll(int s, const char *data, size_t n) {
+    return false;
+}
+
+static bool readAll(int s, char *data, size_t n, long long deadline) {
+    return false;
+}
+
+bool receiveAvailable(int socket, vector<char> &buffer) {
+    return false;
+}
+
+int waitSockets(const vector<int> &sockets, vector<char> &ready, int timeoutMs) {
+    return -1;
+}
+
+#endif
+
+// Send a message.  The header and payload go out in one write, so a
+// small message is a single packet.
+bool sendMessage(int socket, unsigned int type, unsigned int id, const vector<char> &payload) {
+    unsigned int header[4];
+    vector<char> buffer(sizeof(header) + payload.size());
+
+    memcpy(header, messageMagic, 4);
+    header[1] = type;
+    header[2] = id;
+    header[3] = payload.size();
+
+    memcpy(&buffer[0], header, sizeof(header));
+
+    if (!payload.empty()) {
+        memcpy(&buffer[sizeof(header)], &payload[0], payload.size());
+    }
+
+    return writeAll(socket, &buffer[0], buffer.size());
+}
+
+// Receive a message.
+bool receiveMessage(int socket, unsigned int &type, unsigned int &id, vector<char> &payload, int timeoutMs) {
+    long long deadline = (timeoutMs < 0) ? -1 : milliseconds() + timeoutMs;
+    unsigned int header[4];
+
+    if (!readAll(socket, (char *) header, sizeof(header), deadline) ||
+        (memcmp(header, messageMagic, 4) != 0) || (header[3] > maxPayload)) {
+        return false;
+    }
+
+    type = header[1];
+    id = header[2];
+    payload.resize(header[3]);
+
+    return payload.empty() || readAll(socket, &payload[0], payload.size(), deadline);
+}
+
+// Take the first message out of a buffer.
+int takeMessage(vector<char> &buffer, unsigned int &type, unsigned int &id, vector<char> &payload) {
+    unsigned int header[4];
+
+    if (buffer.size() < sizeof(header)) {
+        return 0;
+    }
+
+    memcpy(header, &buffer[0], sizeof(header));
+
+    if ((memcmp(header, messageMagic, 4) != 0) || (header[3] > maxPayload)) {
+        return -1;
+    }
+
+    if (buffer.size() - sizeof(header) < header[3]) {
+        return 0;
+    }
+
+    type = header[1];
+    id = header[2];
+    payload.assign(buffer.begin() + sizeof(header), buffer.begin() + sizeof(header) + header[3]);
+    buffer.erase(buffer.begin(), buffer.begin() + sizeof(header) + header[3]);
+
+    return 1;
+}
+
+// Send a query and wait for its results.  Answers to other requests on
+// the same connection are skipped.
+bool remoteQuery(int socket, const QueryRequest &request, vector<QueryResult> &results, vector<string> *names, int timeoutMs, bool *partial) {
+    static atomic<unsigned int> lastId(0);
+
+    unsigned int id = ++lastId;
+    long long deadline = (timeoutMs < 0) ? -1 : milliseconds() + timeoutMs;
+    vector<char> payload;
+
+    encodeQuery(request, payload);
+
+    if (!sendMessage(socket, MESSAGE_QUERY, id, payload)) {
+        return false;
+    }
+
+    while (true) {
+        unsigned int type, answerId;
+
+        if (!receiveMessage(socket, type, answerId, payload, remaining(deadline))) {
+            return false;
+        }
+
+        if (answerId == id) {
+            return (type == MESSAGE_RESULTS) && decodeResults(payload, results, names, partial);
+        }
+    }
+}
+
+// Append a value to a payload.
+template <class T>
+static void put(vector<char> &payload, const T &value) {
+    size_t n = payload.size();
+    payload.resize(n + sizeof(T));
+    memcpy(&payload[n], &value, sizeof(T));
+}
+
+// Read a value from a payload, failing at its end.
+template <class T>
+static bool get(const vector<char> &payload, size_t &position, T &value) {
+    if (payload.size() - position < sizeof(T)) {
+        return false;
+    }
+
+    memcpy(&value, &payload[position], sizeof(T));
+    position += sizeof(T);
+    return true;
+}
+
+// Encode a query.  The features are sent as in a binary feature file,
+// with single precision descriptors.  An image is sent as its float
+// pixels, row by row.
+void encodeQuery(const QueryRequest &request, vector<char> &payload) {
+    const FeatureSet &features = request.features;
+    int dim = features.empty() ? 0 : features[0].data.size();
+    int flags = (request.matches ? QUERY_FLAG_MATCHES : 0) | (request.names ? QUERY_FLAG_NAMES : 0) |
+        (request.has_image() ? QUERY_FLAG_IMAGE : 0) | ((request.deadlineMs > 0) ? QUERY_FLAG_DEADLINE : 0);
+
+    payload.clear();
+    put(payload, (int) request.k);
+    put(payload, (int) request.matchType);
+    put(payload, (int) request.verifyTop);
+    put(payload, flags);
+
+    if (request.deadlineMs > 0) {
+        put(payload, (int) request.deadlineMs);
+    }
+
+    if (request.has_image()) {
+        CFloatImage &image = const_cast<CFloatImage &>(request.image);
+        CShape sh = image.Shape();
+        size_t rowBytes = (size_t) sh.width * sh.nBands * sizeof(float);
+
+        put(payload, (int) request.featureType);
+        put(payload, (int) request.descriptorType);
+        put(payload, sh.width);
+        put(payload, sh.height);
+        put(payload, sh.nBands);
+
+        size_t n = payload.size();
+        payload.resize(n + rowBytes * sh.height);
+
+        for (int y=0; y<sh.height; y++) {
+            memcpy(&payload[n + y * rowBytes], &image.Pixel(0, y, 0), rowBytes);
+        }
+
+        return;
+    }
+
+    put(payload, (int) features.size());
+    put(payload, dim);
+
+    payload.reserve(payload.size() + features.size() * (4 * sizeof(int) + (2 + dim) * sizeof(float)));
+
+    for (unsigned int i=0; i<features.size(); i++) {
+        const Feature &f = features[i];
+
+        put(payload, f.id);
+        put(payload, f.type);
+        put(payload, f.x);
+        put(payload, f.y);
+        put(payload, (float) f.angleRadians);
+        put(payload, (float) f.scale);
+
+        for (int j=0; j<dim; j++) {
+            put(payload, (float) ((j < (int) f.data.size()) ? f.data[j] : 0.0));
+        }
+    }
+}
+
+// Decode a query.
+bool decodeQuery(const vector<char> &payload, QueryRequest &request) {
+    size_t p = 0;
+    int flags, n, dim;
+
+    if (!get(payload, p, request.k) || !get(payload, p, request.matchType) || !get(payload, p, request.verifyTop) ||
+        !get(payload, p, flags)) {
+        return false;
+    }
+
+    // The counts come from the network, so nonsense is rejected here
+    // rather than reaching the matching.
+    if ((request.k < 1) || (request.verifyTop < 0)) {
+        return false;
+    }
+
+    request.matches = (flags & QUERY_FLAG_MATCHES) != 0;
+    request.names = (flags & QUERY_FLAG_NAMES) != 0;
+    request.deadlineMs = 0;
+    request.features.clear();
+
+    if ((flags & QUERY_FLAG_DEADLINE) && !get(payload, p, request.deadlineMs)) {
+        return false;
+    }
+
+    if (flags & QUERY_FLAG_IMAGE) {
+        int width, height, bands;
+
+        if (!get(payload, p, request.featureType) || !get(payload, p, request.descriptorType) ||
+            !get(payload, p, width) || !get(payload, p, height) || !get(payload, p, bands) ||
+            (width <= 0) || (height <= 0) || (bands <= 0) ||
+            ((payload.size() - p) / sizeof(float) / width / bands < (size_t) height)) {
+            return false;
+        }
+
+        size_t rowBytes = (size_t) width * bands * sizeof(float);
+        request.image = CFloatImage(CShape(width, height, bands));
+
+        for (int y=0; y<height; y++) {
+            memcpy(&request.image.Pixel(0, y, 0), &payload[p + y * rowBytes], rowBytes);
+        }
+
+        return true;
+    }
+
+    request.image = CFloatImage();
+
+    if (!get(payload, p, n) || !get(payload, p, dim) || (n < 0) || (dim < 0) ||
+        ((payload.size() - p) / (4 * sizeof(int) + (2 + (size_t) dim) * sizeof(float)) < (size_t) n)) {
+        return false;
+    }
+
+    request.features.resize(n);
+
+    for (int i=0; i<n; i++) {
+        Feature &f = request.features[i];
+        float angle, scale;
+
+        get(payload, p, f.id);
+        get(payload, p, f.type);
+        get(payload, p, f.x);
+        get(payload, p, f.y);
+        get(payload, p, angle);
+        get(payload, p, scale);
+
+        f.angleRadians = angle;
+        f.scale = scale;
+        f.data.resize(dim);
+
+        for (int j=0; j<dim; j++) {
+            float v;
+            get(payload, p, v);
+            f.data[j] = v;
+        }
+    }
+
+    return true;
+}
+
+// Encode query results, followed by their names if there are any and
+// by the result flags.
+void encodeResults(const vector<QueryResult> &results, vector<char> &payload, const vector<string> *names, bool partial) {
+    payload.clear();
+    put(payload, (int) results.size());
+
+    for (unsigned int i=0; i<results.size(); i++) {
+        const QueryResult &r = results[i];
+
+        put(payload, r.index);
+        put(payload, r.score);
+        put(payload, r.inliers);
+        put(payload, (int) r.matches.size());
+
+        for (unsigned int j=0; j<r.matches.size(); j++) {
+            put(payload, r.matches[j].id1);
+            put(payload, r.matches[j].id2);
+            put(payload, r.matches[j].score);
+            put(payload, r.matches[j].second);
+        }
+    }
+
+    int count = (names != NULL) ? names->size() : 0;
+    put(payload, count);
+
+    for (int i=0; i<count; i++) {
+        const string &name = (*names)[i];
+
+        put(payload, (int) name.size());
+        payload.insert(payload.end(), name.begin(), name.end());
+    }
+
+    put(payload, (int) (partial ? RESULT_FLAG_PARTIAL : 0));
+}
+
+// Decode query results.
+bool decodeResults(const vector<char> &payload, vector<QueryResult> &results, vector<string> *names, bool *partial) {
+    size_t p = 0;
+    int n;
+
+    if (!get(payload, p, n) || (n < 0)) {
+        return false;
+    }
+
+    results.clear();
+
+    if (names != NULL) {
+        names->clear();
+    }
+
+    for (int i=0; i<n; i++) {
+        QueryResult r;
+        int matches;
+
+        if (!get(payload, p, r.index) || !get(payload, p, r.score) || !get(payload, p, r.inliers) ||
+            !get(payload, p, matches) || (matches < 0) ||
+            ((payload.size() - p) / (2 * sizeof(int) + 2 * sizeof(double)) < (size_t) matches)) {
+            return false;
+        }
+
+        r.matches.resize(matches);
+
+        for (int j=0; j<matches; j++) {
+            FeatureMatch &m = r.matches[j];
+
+            if (!get(payload, p, m.id1) || !get(payload, p, m.id2) || !get(payload, p, m.score) || !get(payload, p, m.second)) {
+                return false;
+            }
+        }
+
+        results.push_back(r);
+    }
+
+    int count;
+
+    if (!get(payload, p, count) || (count < 0)) {
+        return false;
+    }
+
+    for (int i=0; i<count; i++) {
+        int length;
+
+        if (!get(payload, p, length) || (length < 0) || (payload.size() - p < (size_t) length)) {
+            return false;
+        }
+
+        if (names != NULL) {
+            names->push_back(string(&payload[p], length));
+        }
+
+        p += length;
+    }
+
+    int flags;
+
+    if (!get(payload, p, flags)) {
+        return false;
+    }
+
+    if (partial != NULL) {
+        *partial = (flags & RESULT_FLAG_PARTIAL) != 0;
+    }
+
+    return true;
+}
@@ -0,0 +1,109 @@
+#ifndef QUERYPROTOCOL_H
+#define QUERYPROTOCOL_H
+
+#include <string>
+#include <vector>
+#include "features.h"
+
+// Types of protocol messages.
+enum {
+	MESSAGE_QUERY = 1,
+	MESSAGE_RESULTS = 2,
+	MESSAGE_ERROR = 3,
+	MESSAGE_SHUTDOWN = 4,
+
+	// Sent instead of results when a server is too loaded to answer a
+	// query in time.
+	MESSAGE_BUSY = 5
+};
+
+// A QueryRequest is a query sent to a query server: the query features,
+// or an image for the server to extract them from, and the settings of
+// performQuery.
+struct QueryRequest {
+	int k;
+	int matchType;
+	int verifyTop;
+
+	// Send back the feature matches of each result.
+	bool matches;
+
+	// Send back the image name of each result.
+	bool names;
+
+	FeatureSet features;
+
+	// If the image isn't empty, the features are extracted from it with
+	// the given detector and descriptor types instead.
+	CFloatImage image;
+	int featureType;
+	int descriptorType;
+
+	// Time the server may take over the query, in milliseconds from
+	// when it arrives, or 0 for no limit.  A query out of time is
+	// answered with the best images found so far, flagged as partial.
+	int deadlineMs;
+
+	QueryRequest();
+
+	// Whether the server has to extract the features.
+	bool has_image() const { return image.Shape().width * image.Shape().height * image.Shape().nBands > 0; }
+};
+
+// Every message is a header of four 32-bit words (magic, type, request
+// id and payload length) followed by the payload.  Values are sent in
+// the byte order of the host, so both ends must share it.
+
+// Listen on an address, returning a socket or -1.  An address of the
+// form host:port is a TCP address; anything else is the path of a Unix
+// domain socket, which is replaced if it exists.
+int listenSocket(const char *address);
+
+// Connect to an address, giving up after timeoutMs milliseconds.
+// Returns a socket or -1.
+int connectSocket(const char *address, int timeoutMs);
+
+// Accept a connection on a listening socket.  Returns a socket or -1.
+int acceptSocket(int listener);
+
+// Close a socket.
+void closeSocket(int socket);
+
+// Send a message.
+bool sendMessage(int socket, unsigned int type, unsigned int id, const vector<char> &payload);
+
+// Receive a message, giving up after timeoutMs milliseconds, or never
+// if it is negative.
+bool receiveMessage(int socket, unsigned int &type, unsigned int &id, vector<char> &payload, int timeoutMs);
+
+// Append to a buffer whatever has arrived on a socket, without
+// waiting for more.  Returns false if the connection was closed or
+// failed.
+bool receiveAvailable(int socket, vector<char> &buffer);
+
+// Take the first message out of a buffer filled by receiveAvailable.
+// Returns 1 if a whole message was taken, 0 if it hasn't all arrived
+// yet, or -1 if the buffer doesn't hold a message.
+int takeMessage(vector<char> &buffer, unsigned int &type, unsigned int &id, vector<char> &payload);
+
+// Wait until one of a set of sockets can be read, for at most timeoutMs
+// milliseconds, or forever if it is negative.  ready[i] is set for each
+// socket that can be read or has been closed.  Returns the number of
+// such sockets, or -1 on error.
+int waitSockets(const vector<int> &sockets, vector<char> &ready, int timeoutMs);
+
+// Send a query over a connected socket and wait at most timeoutMs
+// milliseconds for its results, or forever if it is negative.  Fails
+// if the server reports an error or is busy.  partial, if not NULL, is
+// set if the server ran out of time and sent the best results so far.
+bool remoteQuery(int socket, const QueryRequest &request, vector<QueryResult> &results, vector<string> *names, int timeoutMs, bool *partial = NULL);
+
+// Encode and decode the payloads of query and results messages.  The
+// image names of the results are optional, and partial results are
+// flagged.
+void encodeQuery(const QueryRequest &request, vector<char> &payload);
+bool decodeQuery(const vector<char> &payload, QueryRequest &request);
+void encodeResults(const vector<QueryResult> &results, vector<char> &payload, const vector<string> *names = NULL, bool partial = false);
+bool decodeResults(const vector<char> &payload, vector<QueryResult> &results, vector<string> *names = NULL, bool *partial = NULL);
+
+#endif
@@ -0,0 +1,166 @@
+/* QueryResultCache.cpp */
+
+#include <string.h>
+#include "QueryResultCache.h"
+
+// Mix a 64-bit word into a hash.
+static unsigned long long mix(unsigned long long h, unsigned long long word) {
+    h = (h ^ word) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+// Mix a double into a hash by its bits.
+static unsigned long long mixDouble(unsigned long long h, double v) {
+    unsigned long long word;
+    memcpy(&word, &v, sizeof(word));
+    return mix(h, word);
+}
+
+// Estimate the memory used by a cached entry.
+static size_t entryBytes(const vector<QueryResult> &results, const vector<string> &names) {
+    size_t n = sizeof(QueryResult) * results.size();
+
+    for (unsigned int i=0; i<results.size(); i++) {
+        n += sizeof(FeatureMatch) * results[i].matches.size();
+    }
+
+    for (unsigned int i=0; i<names.size(); i++) {
+        n += sizeof(string) + names[i].size();
+    }
+
+    return n;
+}
+
+// Create a cache.
+QueryResultCache::QueryResultCache(size_t budget) {
+    this->budget = budget;
+    bytes = 0;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+}
+
+// Key of a query.  Everything about a feature that can change the
+// results is hashed: the ids and positions appear in the matches and
+// are used by verification, and the descriptors decide the scores.
+unsigned long long QueryResultCache::key(const FeatureSet &features, int matchType, int k, int verifyTop, bool matches, unsigned int version) {
+    unsigned long long h = 0x243F6A8885A308D3ULL;
+
+    h = mix(h, features.size());
+    h = mix(h, (unsigned long long) (unsigned int) matchType << 32 | (unsigned int) k);
+    h = mix(h, (unsigned long long) (unsigned int) verifyTop << 32 | (matches ? 1 : 0));
+    h = mix(h, version);
+
+    for (unsigned int i=0; i<features.size(); i++) {
+        const Feature &f = features[i];
+
+        h = mix(h, (unsigned long long) (unsigned int) f.id << 32 | (unsigned int) f.type);
+        h = mix(h, (unsigned long long) (unsigned int) f.x << 32 | (unsigned int) f.y);
+        h = mixDouble(h, f.angleRadians);
+        h = mixDouble(h, f.scale);
+        h = mix(h, f.data.size());
+
+        for (unsigned int j=0; j<f.data.size(); j++) {
+            h = mixDouble(h, f.data[j]);
+        }
+    }
+
+    // Finish as MurmurHash3 does.
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// Get the results stored under a key, marking them as most recently
+// used.
+bool QueryResultCache::get(unsigned long long key, vector<QueryResult> &results, vector<string> *names) {
+    lock_guard<mutex> guard(lock);
+
+    unordered_map<unsigned long long, Entry>::iterator e = entries.find(key);
+
+    if ((e == entries.end()) || ((names != NULL) && !e->second.hasNames)) {
+        misses++;
+        return false;
+    }
+
+    order.splice(order.begin(), order, e->second.position);
+    hits++;
+
+    results = e->second.results;
+
+    if (names != NULL) {
+        *names = e->second.names;
+    }
+
+    return true;
+}
+
+// Store results and evict the least recently used ones until the cache
+// fits in its budget.  Results too big for the budget aren't stored.
+void QueryResultCache::put(unsigned long long key, const vector<QueryResult> &results, const vector<string> *names) {
+    size_t size = entryBytes(results, (names != NULL) ? *names : vector<string>());
+
+    if (size > budget) {
+        return;
+    }
+
+    lock_guard<mutex> guard(lock);
+
+    unordered_map<unsigned long long, Entry>::iterator old = entries.find(key);
+
+    if (old != entries.end()) {
+        bytes -= old->second.bytes;
+        order.erase(old->second.position);
+        entries.erase(old);
+    }
+
+    order.push_front(key);
+
+    Entry &e = entries[key];
+    e.results = results;
+    e.hasNames = (names != NULL);
+
+    if (names != NULL) {
+        e.names = *names;
+    }
+
+    e.bytes = size;
+    e.position = order.begin();
+    bytes += e.bytes;
+
+    while (bytes > budget) {
+        unordered_map<unsigned long long, Entry>::iterator victim = entries.find(order.back());
+
+        bytes -= victim->second.bytes;
+        entries.erase(victim);
+        order.pop_back();
+        evictions++;
+    }
+}
+
+// Drop every cached result.
+void QueryResultCache::clear() {
+    lock_guard<mutex> guard(lock);
+
+    entries.clear();
+    order.clear();
+    bytes = 0;
+}
+
+// Get the counters.
+QueryResultCacheStats QueryResultCache::stats() const {
+    lock_guard<mutex> guard(lock);
+
+    QueryResultCacheStats s;
+    s.hits = hits;
+    s.misses = misses;
+    s.evictions = evictions;
+    s.bytes = bytes;
+    s.entries = entries.size();
+
+    return s;
+}
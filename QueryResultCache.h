@@ -0,0 +1,78 @@
+#ifndef QUERYRESULTCACHE_H
+#define QUERYRESULTCACHE_H
+
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include "features.h"
+
+// Counters of a query result cache.
+struct QueryResultCacheStats
+{
+	long long hits;
+	long long misses;
+	long long evictions;
+
+	// Bytes and number of results held.
+	size_t bytes;
+	int entries;
+};
+
+// The QueryResultCache class keeps the results of recent queries, so a
+// query repeated against the same database is answered without matching
+// anything.  A query is identified by a key hashing its features, its
+// settings and the version of the database it ran against, so results
+// from an older database are never returned; the cache can also be
+// cleared when the database changes, to free them at once.  The least
+// recently used results are evicted to stay within a byte budget.
+class QueryResultCache {
+private:
+	struct Entry {
+		vector<QueryResult> results;
+		vector<string> names;
+		bool hasNames;
+		size_t bytes;
+		list<unsigned long long>::iterator position;
+	};
+
+	size_t budget;
+	size_t bytes;
+
+	// Cached results, and their order of use, most recent first.
+	unordered_map<unsigned long long, Entry> entries;
+	list<unsigned long long> order;
+
+	long long hits;
+	long long misses;
+	long long evictions;
+
+	mutable mutex lock;
+
+public:
+	// Create a cache holding at most budget bytes of results.
+	QueryResultCache(size_t budget);
+
+	// Key of a query: its features, the settings that change its results,
+	// and the version of the database.
+	static unsigned long long key(const FeatureSet &features, int matchType, int k, int verifyTop, bool matches, unsigned int version);
+
+	// Get the results stored under a key.  If names isn't NULL, results
+	// stored without names count as a miss.
+	bool get(unsigned long long key, vector<QueryResult> &results, vector<string> *names);
+
+	// Store results, and their image names if names isn't NULL.
+	void put(unsigned long long key, const vector<QueryResult> &results, const vector<string> *names);
+
+	// Drop every cached result.  The counters are kept.
+	void clear();
+
+	// Get the counters.
+	QueryResultCacheStats stats() const;
+
+private:
+	// Caches can't be copied.
+	QueryResultCache(const QueryResultCache &);
+	QueryResultCache &operator=(const QueryResultCache &);
+};
+
+#endif
@@ -0,0 +1,636 @@
+/* QueryServer.cpp */
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "QueryServer.h"
+#include "ThreadPool.h"
+#include "ExtractionCache.h"
+#include "DescriptorMatrix.h"
+#include "QueryToken.h"
+#include "QueryResultCache.h"
+
+// How often serve checks whether it has been stopped, in milliseconds.
+static const int stopInterval = 200;
+
+// Weight of the latest batch in the running average of batch times.
+static const double batchTimeWeight = 0.2;
+
+// Current time in milliseconds.
+static double now() {
+    return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Answer queries one at a time, as they arrive.
+BatchOptions::BatchOptions() {
+    maxBatch = 1;
+    windowMs = 0;
+    maxQueue = 256;
+    latencyTargetMs = 0;
+}
+
+// Create a server with no database.
+QueryServer::QueryServer() : sourceSift(false), sourceShard(0), sourceShards(1), cacheBudget(0),
+    batchMs(0), working(false), stopping(false), reloading(false), remoteShutdown(false) {
+}
+
+// Wait for a background reload before any member it uses is destroyed.
+// active itself is destroyed last, so its own wait comes too late.
+QueryServer::~QueryServer() {
+    active.wait();
+}
+
+// Load a database, or one shard of it, and publish it.  If this fails,
+// the database served so far is kept.
+bool QueryServer::load(const char *name, bool sift, int shard, int shards) {
+    shared_ptr<DatabaseSnapshot> loaded(new DatabaseSnapshot());
+
+    if (!build(*loaded, name, sift, shard, shards)) {
+        return false;
+    }
+
+    source = name;
+    sourceSift = sift;
+    sourceShard = shard;
+    sourceShards = shards;
+
+    active.publish(loaded);
+
+    if (recent != NULL) {
+        recent->clear();
+    }
+
+    return true;
+}
+
+// Load the database again in the background.  The new snapshot replaces
+// the old one only if it loads; either way the outcome is reported.
+bool QueryServer::reload() {
+    if (source.empty()) {
+        return false;
+    }
+
+    string name = source;
+    bool sift = sourceSift;
+    int shard = sourceShard;
+    int shards = sourceShards;
+
+    return active.publish_async([this, name, sift, shard, shards](DatabaseSnapshot &snapshot) {
+        return build(snapshot, name, sift, shard, shards);
+    }, [this, name](bool ok) {
+        if (ok) {
+            if (recent != NULL) {
+                recent->clear();
+            }
+
+            shared_ptr<const DatabaseSnapshot> current = active.acquire();
+            printf("reloaded %d images from %s as version %u\n", (int) current->db.size(), name.c_str(), current->version);
+        }
+        else {
+            printf("couldn't reload database %s, still serving the old one\n", name.c_str());
+        }
+
+        fflush(stdout);
+    });
+}
+
+// Load a database, or one shard of it, into a snapshot.  The item list
+// is always read whole, along with the changes in its journal, so that
+// the indices match those of a coordinator that reads the same database
+// file.  The features of the shard are then loaded in parallel; items
+// whose features can't be loaded are reported and left out.  A whole
+// packed database is served straight from the file.  With batching,
+// the descriptors are concatenated too.
+bool QueryServer::build(DatabaseSnapshot &snapshot, const string &name, bool sift, int shard, int shards) const {
+    ImageDatabase all;
+    ImageDatabase &db = snapshot.db;
+    vector<int> &global = snapshot.global;
+
+    if ((shards < 1) || (shard < 0) || (shard >= shards) || !all.load(name.c_str(), sift, false)) {
+        return false;
+    }
+
+    string journal = ImageDatabase::journal_name(name);
+
+    if (!all.replay_journal(journal.c_str())) {
+        printf("couldn't read journal %s\n", journal.c_str());
+        return false;
+    }
+
+    if (all.packed && (shards == 1)) {
+        db = all;
+
+        for (unsigned int i=0; i<db.size(); i++) {
+            global.push_back(i);
+        }
+    }
+    else {
+        for (unsigned int i=shard; i<all.size(); i+=shards) {
+            if (!all[i].removed) {
+                global.push_back(i);
+            }
+        }
+
+        vector<DatabaseItem> items(global.size());
+        vector<char> loaded(global.size(), 0);
+
+        // Items added through the journal already hold their features.
+        ThreadPool::shared().parallel_for(global.size(), [&](int i) {
+            items[i].name = all[global[i]].name;
+            items[i].featureFile = all[global[i]].featureFile;
+
+            if (all.has_feature_source(global[i])) {
+                loaded[i] = all.load_item_features(global[i], items[i].features);
+            }
+            else {
+                items[i].features = all[global[i]].features;
+                loaded[i] = 1;
+            }
+        });
+
+        db.sift = sift;
+        unsigned int kept = 0;
+
+        for (unsigned int i=0; i<items.size(); i++) {
+            if (!loaded[i]) {
+                printf("couldn't load features for %s from %s\n", items[i].name.c_str(), items[i].featureFile.c_str());
+                db.failures.push_back(items[i].featureFile);
+                continue;
+            }
+
+            db.push_back(move(items[i]));
+            global[kept++] = global[i];
+        }
+
+        global.resize(kept);
+    }
+
+    if (cacheBudget > 0) {
+        db.use_cache(cacheBudget);
+    }
+
+    if (batching.maxBatch > 1) {
+        snapshot.matrix.reset(new DescriptorMatrix());
+
+        if (!snapshot.matrix->build(db)) {
+            printf("couldn't build the database matrix, so queries won't be batched\n");
+            snapshot.matrix.reset();
+        }
+    }
+
+    return true;
+}
+
+// Keep the features extracted from query images in a directory.
+void QueryServer::use_extraction_cache(const string &dir, unsigned long long budget) {
+    extraction.reset(new ExtractionCache(dir, budget));
+}
+
+// Keep the results of recent queries.  Results are keyed by the version
+// of the snapshot they came from, and the cache is cleared whenever a
+// new snapshot is published.
+void QueryServer::use_result_cache(size_t budget) {
+    recent.reset(new QueryResultCache(budget));
+}
+
+// Key of a query in the result cache.
+static unsigned long long resultKey(const DatabaseSnapshot &snapshot, const QueryRequest &request) {
+    return QueryResultCache::key(request.features, request.matchType, request.k, request.verifyTop, request.matches, snapshot.version);
+}
+
+// Answer a query against the snapshot being served, through the result
+// cache if there is one.  A deadline counts from now.
+bool QueryServer::answer(QueryRequest &request, vector<QueryResult> &results, vector<string> *names, bool *partial) const {
+    shared_ptr<const DatabaseSnapshot> current = active.acquire();
+    QueryToken token;
+
+    if (request.deadlineMs > 0) {
+        token.set_timeout(request.deadlineMs);
+    }
+
+    if ((current == NULL) || !extract(request)) {
+        return false;
+    }
+
+    unsigned long long key = (recent != NULL) ? resultKey(*current, request) : 0;
+
+    if (partial != NULL) {
+        *partial = false;
+    }
+
+    if ((recent != NULL) && recent->get(key, results, names)) {
+        return true;
+    }
+
+    if (!answer(*current, request, results, names, (request.deadlineMs > 0) ? &token : NULL)) {
+        return false;
+    }
+
+    // Results cut short by a deadline aren't kept, so that the same query
+    // with more time gets the full results.
+    if ((recent != NULL) && !token.partial()) {
+        recent->put(key, results, names);
+    }
+
+    if (partial != NULL) {
+        *partial = token.partial();
+    }
+
+    return true;
+}
+
+// Extract the features of a query image, which is then dropped so that
+// they aren't extracted again.
+bool QueryServer::extract(QueryRequest &request) const {
+    if (!request.has_image()) {
+        return true;
+    }
+
+    bool ok = computeFeaturesCached(request.image, request.features, request.featureType, request.descriptorType, extraction.get());
+    request.image = CFloatImage();
+
+    return ok;
+}
+
+// Answer a query against a snapshot, first extracting its features if it
+// carries an image.
+bool QueryServer::answer(const DatabaseSnapshot &snapshot, QueryRequest &request, vector<QueryResult> &results, vector<string> *names, QueryToken *token) const {
+    if (!extract(request)) {
+        return false;
+    }
+
+    MatchOptions options;
+    options.verifyTop = request.verifyTop;
+    options.matrix = snapshot.matrix.get();
+    options.token = token;
+
+    if (!performQuery(request.features, snapshot.db, results, request.k, request.matchType, &options)) {
+        return false;
+    }
+
+    report(snapshot, request, results, names);
+    return true;
+}
+
+// Turn the results of a query into what the client asked for: database
+// indices, the image names if wanted, and the matches only if wanted.
+void QueryServer::report(const DatabaseSnapshot &snapshot, const QueryRequest &request, vector<QueryResult> &results, vector<string> *names) {
+    if (names != NULL) {
+        names->clear();
+    }
+
+    for (unsigned int i=0; i<results.size(); i++) {
+        if (names != NULL) {
+            names->push_back(snapshot.db[results[i].index].name);
+        }
+
+        results[i].index = snapshot.global[results[i].index];
+
+        if (!request.matches) {
+            results[i].matches.clear();
+        }
+    }
+}
+
+// Listen on an address and answer queries.  This thread receives the
+// queries of all the clients and queues them, and a worker thread
+// answers them in batches, each batch using the whole thread pool.
+bool QueryServer::serve(const char *address) {
+    int listener = listenSocket(address);
+
+    if (listener < 0) {
+        return false;
+    }
+
+    // The listening socket comes first, then the clients.
+    vector<int> sockets(1, listener);
+    vector< shared_ptr<Connection> > connections(1);
+    vector<char> ready;
+
+    stopping = false;
+    thread worker(&QueryServer::process, this);
+
+    while (!stopping) {
+        if (reloading.exchange(false) && !reload()) {
+            printf("couldn't start a reload\n");
+            fflush(stdout);
+        }
+
+        if (waitSockets(sockets, ready, stopInterval) < 0) {
+            break;
+        }
+
+        for (unsigned int i=sockets.size()-1; (i>0) && !stopping; i--) {
+            if (!ready[i]) {
+                continue;
+            }
+
+            // Only what has arrived is read, and only whole messages are
+            // handled, so a client that is slow to send can't stall the
+            // others.
+            bool ok = receiveAvailable(sockets[i], connections[i]->received);
+            unsigned int type, id;
+            vector<char> payload;
+            int taken;
+
+            while (ok && !stopping && ((taken = takeMessage(connections[i]->received, type, id, payload)) != 0)) {
+                if ((taken > 0) && (type == MESSAGE_QUERY)) {
+                    PendingQuery query;
+                    query.connection = connections[i];
+                    query.id = id;
+                    query.arrival = now();
+
+                    bool decoded = decodeQuery(payload, query.request);
+                    payload.clear();
+
+                    if (!decoded) {
+                        reply(*connections[i], MESSAGE_ERROR, id, payload);
+                    }
+                    else if (!admit(query)) {
+                        reply(*connections[i], MESSAGE_BUSY, id, payload);
+                    }
+                }
+                else if ((taken > 0) && (type == MESSAGE_SHUTDOWN)) {
+                    // Unless shutdown is allowed, the client is told it was
+                    // refused and the server keeps running.
+                    if (remoteShutdown) {
+                        stopping = true;
+                    }
+                    else {
+                        reply(*connections[i], MESSAGE_ERROR, id, payload);
+                    }
+                }
+                else {
+                    ok = false;
+                }
+            }
+
+            if (!ok) {
+                // The socket is closed once no queued query refers to it.
+                {
+                    lock_guard<mutex> guard(connections[i]->lock);
+                    connections[i]->open = false;
+                }
+
+                sockets.erase(sockets.begin() + i);
+                connections.erase(connections.begin() + i);
+            }
+        }
+
+        if (ready[0]) {
+            int client = acceptSocket(listener);
+
+            if (client >= 0) {
+                sockets.push_back(client);
+                connections.push_back(make_shared<Connection>(client));
+            }
+        }
+    }
+
+    stopping = true;
+    queued.notify_all();
+    worker.join();
+
+    queue.clear();
+    connections.clear();
+    closeSocket(listener);
+
+    return true;
+}
+
+// Make serve return.
+void QueryServer::stop() {
+    stopping = true;
+}
+
+// Counts of the queries handled so far.
+QueryServerStats QueryServer::statistics() {
+    lock_guard<mutex> guard(queueLock);
+    return stats;
+}
+
+// Queue a query.  It is turned away if the queue is full, or if, with a
+// latency target, the batches ahead of it and its own are predicted to
+// take longer than the target.  Turning queries away at once keeps the
+// latency of the admitted ones bounded when the server is overloaded,
+// and lets clients try elsewhere instead of timing out.
+bool QueryServer::admit(PendingQuery &query) {
+    lock_guard<mutex> guard(queueLock);
+
+    if ((batching.maxQueue > 0) && ((int) queue.size() >= batching.maxQueue)) {
+        stats.rejected++;
+        return false;
+    }
+
+    if (batching.latencyTargetMs > 0) {
+        int batches = queue.size() / max(batching.maxBatch, 1) + (working ? 1 : 0) + 1;
+        double predicted = batching.windowMs + batches * batchMs;
+
+        if (predicted > batching.latencyTargetMs) {
+            stats.rejected++;
+            return false;
+        }
+    }
+
+    queue.push_back(move(query));
+    queued.notify_one();
+    return true;
+}
+
+// Answer queued queries until stopped.  Once a query is waiting, the
+// batch is closed when it is full or when the window since the first
+// query's arrival has passed.  Queries that have already waited past
+// the latency target are dropped with a busy message, since answering
+// them would only delay the queries behind them.
+void QueryServer::process() {
+    unsigned int maxBatch = max(batching.maxBatch, 1);
+
+    while (!stopping) {
+        vector<PendingQuery> batch;
+        vector<PendingQuery> expired;
+
+        {
+            unique_lock<mutex> guard(queueLock);
+            working = false;
+
+            while (!stopping && queue.empty()) {
+                queued.wait_for(guard, chrono::milliseconds(stopInterval));
+            }
+
+            double close = queue.empty() ? 0 : queue.front().arrival + batching.windowMs;
+
+            while (!stopping && (queue.size() < maxBatch) && (now() < close)) {
+                queued.wait_for(guard, chrono::duration<double, milli>(close - now()));
+            }
+
+            if (stopping) {
+                break;
+            }
+
+            double t = now();
+
+            while (!queue.empty() && (batch.size() < maxBatch)) {
+                if ((batching.latencyTargetMs > 0) && (t - queue.front().arrival > batching.latencyTargetMs)) {
+                    expired.push_back(move(queue.front()));
+                    stats.expired++;
+                }
+                else {
+                    batch.push_back(move(queue.front()));
+                }
+
+                queue.pop_front();
+            }
+
+            working = true;
+        }
+
+        vector<char> payload;
+
+        for (unsigned int i=0; i<expired.size(); i++) {
+            reply(*expired[i].connection, MESSAGE_BUSY, expired[i].id, payload);
+        }
+
+        if (batch.empty()) {
+            continue;
+        }
+
+        double start = now();
+        int hits = answer_batch(batch);
+        double took = now() - start;
+
+        lock_guard<mutex> guard(queueLock);
+        batchMs = (stats.batches == 0) ? took : (1 - batchTimeWeight) * batchMs + batchTimeWeight * took;
+        stats.batches++;
+        stats.answered += batch.size();
+        stats.cached += hits;
+    }
+}
+
+// Answer a batch of queries and send their results, returning how many
+// came from the result cache.  The whole batch is answered against one
+// snapshot.  The features of query images are extracted first, and
+// queries found in the result cache need nothing more.  Then the ssd
+// and ratio queries of each match type are ranked together by
+// performBatchQuery, and verified one by one if they ask for it, as
+// performQuery would.  Any other query, or any query of a batch that
+// can't be ranked together, is answered on its own.  So are queries
+// with a deadline, since a shared scan can't stop for one of them;
+// their deadline counts from their arrival.
+int QueryServer::answer_batch(vector<PendingQuery> &batch) {
+    shared_ptr<const DatabaseSnapshot> current = active.acquire();
+    int n = batch.size();
+    vector< vector<QueryResult> > results(n);
+    vector< vector<string> > names(n);
+    vector<unsigned long long> keys(n, 0);
+    vector<char> failed(n, 0);
+    vector<char> cached(n, 0);
+    vector<char> done(n, 0);
+    int hits = 0;
+
+    for (int q=0; q<n; q++) {
+        QueryRequest &request = batch[q].request;
+
+        failed[q] = (current == NULL) || !extract(request);
+
+        if (!failed[q] && (recent != NULL)) {
+            keys[q] = resultKey(*current, request);
+            cached[q] = recent->get(keys[q], results[q], &names[q]);
+            hits += cached[q];
+        }
+    }
+
+    for (int matchType=1; (matchType<=2) && (current != NULL) && (current->matrix != NULL); matchType++) {
+        vector<int> members;
+        int k = 0;
+
+        for (int q=0; q<n; q++) {
+            const QueryRequest &request = batch[q].request;
+
+            if (!failed[q] && !cached[q] && (request.matchType == matchType) && (request.deadlineMs <= 0)) {
+                members.push_back(q);
+                k = max(k, max(request.k, request.verifyTop));
+            }
+        }
+
+        // A single query is answered as well on its own.
+        if (members.size() < 2) {
+            continue;
+        }
+
+        vector<FeatureSet> queries(members.size());
+        vector< vector<QueryResult> > ranked;
+
+        for (unsigned int j=0; j<members.size(); j++) {
+            queries[j].swap(batch[members[j]].request.features);
+        }
+
+        bool ok = performBatchQuery(queries, *current->matrix, ranked, k, matchType);
+
+        for (unsigned int j=0; j<members.size(); j++) {
+            QueryRequest &request = batch[members[j]].request;
+            request.features.swap(queries[j]);
+
+            if (!ok) {
+                continue;
+            }
+
+            vector<QueryResult> &r = results[members[j]];
+            r.swap(ranked[j]);
+
+            if (request.verifyTop > 0) {
+                MatchOptions options;
+                options.verifyTop = request.verifyTop;
+
+                if ((int) r.size() > max(request.k, request.verifyTop)) {
+                    r.resize(max(request.k, request.verifyTop));
+                }
+
+                verifyResults(request.features, current->db, r, matchType, options);
+            }
+
+            if ((int) r.size() > max(request.k, 0)) {
+                r.resize(max(request.k, 0));
+            }
+
+            done[members[j]] = 1;
+        }
+    }
+
+    for (int q=0; q<n; q++) {
+        QueryRequest &request = batch[q].request;
+        QueryToken token;
+        vector<char> payload;
+
+        if (request.deadlineMs > 0) {
+            token.set_timeout(max(request.deadlineMs - (now() - batch[q].arrival), 0.0));
+        }
+
+        if (!cached[q] && done[q]) {
+            report(*current, request, results[q], &names[q]);
+        }
+        else if (!cached[q] && (failed[q] || !answer(*current, request, results[q], &names[q], (request.deadlineMs > 0) ? &token : NULL))) {
+            reply(*batch[q].connection, MESSAGE_ERROR, batch[q].id, payload);
+            continue;
+        }
+
+        if ((recent != NULL) && !cached[q] && !token.partial()) {
+            recent->put(keys[q], results[q], &names[q]);
+        }
+
+        encodeResults(results[q], payload, request.names ? &names[q] : NULL, token.partial());
+        reply(*batch[q].connection, MESSAGE_RESULTS, batch[q].id, payload);
+    }
+
+    return hits;
+}
+
+// Send a message to a client, unless it has gone.  Failures are left
+// for the receiving side of serve to notice.
+void QueryServer::reply(Connection &connection, unsigned int type, unsigned int id, const vector<char> &payload) {
+    lock_guard<mutex> guard(connection.lock);
+
+    if (connection.open) {
+        sendMessage(connection.socket, type, id, payload);
+    }
+}
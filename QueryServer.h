@@ -0,0 +1,225 @@
+#ifndef QUERYSERVER_H
+#define QUERYSERVER_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "DatabaseSnapshot.h"
+#include "QueryProtocol.h"
+
+class ExtractionCache;
+class QueryResultCache;
+class QueryToken;
+
+// Settings of the batching and admission control of a query server.
+struct BatchOptions {
+	// Most queries answered together by one pass over the database.
+	int maxBatch;
+
+	// How long the first query of a batch waits for others to join it,
+	// in milliseconds.
+	int windowMs;
+
+	// Most queries waiting to be answered.  Queries arriving when the
+	// queue is full are turned away with a busy message.
+	int maxQueue;
+
+	// Latency target in milliseconds, or 0 for none.  Queries that are
+	// predicted to be answered later than this are turned away when
+	// they arrive, and queries that have already waited longer are
+	// dropped rather than answered late.
+	int latencyTargetMs;
+
+	BatchOptions();
+};
+
+// Counts of the queries handled by a query server.
+struct QueryServerStats {
+	long long answered;
+	long long batches;
+	long long rejected;
+	long long expired;
+
+	// Queries answered from the result cache.
+	long long cached;
+
+	QueryServerStats() : answered(0), batches(0), rejected(0), expired(0), cached(0) {}
+};
+
+// The QueryServer class answers queries sent over a socket against a
+// database, or against one shard of it.  Shard s of n holds the items
+// whose database index is s modulo n, with their features resident,
+// and results are reported with their index in the whole database, so
+// a coordinator can merge the results of all the shards.  The database
+// is loaded once and stays in memory for as long as the server runs,
+// so a query costs only the matching.  A query may also carry an image,
+// whose features the server extracts before matching.
+//
+// Queries read the database through a snapshot, so a new build of the
+// database can be loaded in the background and swapped in while the
+// server keeps answering; queries already running finish against the
+// snapshot they started with.
+//
+// Queries from all the clients go through one bounded queue.  A worker
+// takes them off in batches, and the ssd and ratio queries of a batch
+// are answered by a single pass over the concatenated descriptors of
+// the database, so the database is read once for the whole batch.
+class QueryServer {
+private:
+	// A client connection.  It stays open while queries from it are
+	// waiting, even if the client has gone, so that its socket isn't
+	// reused by another client before they are answered.
+	struct Connection {
+		int socket;
+		bool open;
+		mutex lock;
+
+		// What has arrived from the client but doesn't yet make up a
+		// whole message.  Only the thread running serve uses it.
+		vector<char> received;
+
+		Connection(int socket) : socket(socket), open(true) {}
+		~Connection() { closeSocket(socket); }
+	};
+
+	// A query waiting to be answered, and when it arrived.
+	struct PendingQuery {
+		shared_ptr<Connection> connection;
+		unsigned int id;
+		QueryRequest request;
+		double arrival;
+	};
+
+	// The database served.
+	ActiveDatabase active;
+
+	// Where the database was loaded from, for reloading it.
+	string source;
+	bool sourceSift;
+	int sourceShard;
+	int sourceShards;
+
+	// Budget of the cache of features that aren't resident.
+	size_t cacheBudget;
+
+	// Cache of the features extracted from query images, or NULL.
+	shared_ptr<ExtractionCache> extraction;
+
+	// Cache of the results of recent queries, or NULL.
+	shared_ptr<QueryResultCache> recent;
+
+	BatchOptions batching;
+	QueryServerStats stats;
+
+	deque<PendingQuery> queue;
+	mutex queueLock;
+	condition_variable queued;
+
+	// Running average of the time taken to answer a batch, in
+	// milliseconds, and whether a batch is being answered.
+	double batchMs;
+	bool working;
+
+	atomic<bool> stopping;
+	atomic<bool> reloading;
+
+	// Whether a shutdown message from a client stops the server.
+	bool remoteShutdown;
+
+public:
+	// Create a server with no database.
+	QueryServer();
+
+	// Wait for a reload that is still running, since it uses the
+	// server's members.
+	~QueryServer();
+
+	// Load a database, or one shard of it, and serve it from now on.
+	bool load(const char *name, bool sift, int shard = 0, int shards = 1);
+
+	// Load the database again from the same file in the background, and
+	// serve it once it has loaded.  Returns false if nothing has been
+	// loaded or a reload is already running.
+	bool reload();
+
+	// Make serve start a reload.  Unlike reload, this is safe to call
+	// from a signal handler.
+	void request_reload() { reloading = true; }
+
+	// Read features that are not resident through an LRU cache holding
+	// at most budget bytes.  This applies to databases loaded later.
+	void use_cache(size_t budget) { cacheBudget = budget; }
+
+	// Keep the features extracted from query images in a directory,
+	// within a budget of bytes, or any amount if it is zero.
+	void use_extraction_cache(const string &dir, unsigned long long budget = 0);
+
+	// Keep the results of recent queries, within a budget of bytes, so
+	// that repeated queries are answered without matching.
+	void use_result_cache(size_t budget);
+
+	// Answer a query.  The result indices are database indices, and
+	// names, if not NULL, receives the image name of each result.  If
+	// the request has a deadline, partial, if not NULL, is set when the
+	// query ran out of time.  The features of an image query are left in
+	// request.features.
+	bool answer(QueryRequest &request, vector<QueryResult> &results, vector<string> *names = NULL, bool *partial = NULL) const;
+
+	// Set how queries are batched and admitted.  Batching needs the
+	// database matrix, which is only built by later loads.
+	void use_batching(const BatchOptions &options) { batching = options; }
+
+	// Counts of the queries handled so far.
+	QueryServerStats statistics();
+
+	// Let a shutdown message from a client stop the server.  Any client
+	// that can connect could then stop it, so this is only meant for
+	// servers run on behalf of a single coordinator.
+	void allow_shutdown(bool allow) { remoteShutdown = allow; }
+
+	// Listen on an address and answer queries until stop is called or,
+	// if allowed, a shutdown message arrives.
+	bool serve(const char *address);
+
+	// Make serve return.  This may be called from any thread.
+	void stop();
+
+	// The snapshot being served, or NULL.
+	shared_ptr<const DatabaseSnapshot> snapshot() const { return active.acquire(); }
+
+private:
+	// Load a database, or one shard of it, into a snapshot.
+	bool build(DatabaseSnapshot &snapshot, const string &name, bool sift, int shard, int shards) const;
+
+	// Queue a query, or turn it away.  Returns false if it was turned
+	// away.
+	bool admit(PendingQuery &query);
+
+	// Answer queued queries until stopped.
+	void process();
+
+	// Answer a batch of queries and send their results, returning how
+	// many came from the result cache.
+	int answer_batch(vector<PendingQuery> &batch);
+
+	// Extract the features of a query image, if it has one.
+	bool extract(QueryRequest &request) const;
+
+	// Answer a query against a snapshot, stopping early if the token,
+	// which may be NULL, expires.
+	bool answer(const DatabaseSnapshot &snapshot, QueryRequest &request, vector<QueryResult> &results, vector<string> *names, QueryToken *token) const;
+
+	// Turn the results of a query into what the client asked for.
+	static void report(const DatabaseSnapshot &snapshot, const QueryRequest &request, vector<QueryResult> &results, vector<string> *names);
+
+	// Send a message to a client, unless it has gone.
+	static void reply(Connection &connection, unsigned int type, unsigned int id, const vector<char> &payload);
+
+	// Servers can't be copied.
+	QueryServer(const QueryServer &);
+	QueryServer &operator=(const QueryServer &);
+};
+
+#endif
@@ -0,0 +1,28 @@
+/* QueryToken.cpp */
+
+#include <chrono>
+#include "QueryToken.h"
+
+// Get the time in seconds from an arbitrary start.
+static double now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Create a token with no deadline.
+QueryToken::QueryToken() : deadline(0), cancelled(false), stopped(false) {
+}
+
+// Set the deadline relative to now.
+void QueryToken::set_timeout(double ms) {
+    deadline = (ms < 0) ? 0 : now() + ms / 1000;
+}
+
+// Make the query stop as soon as it can.
+void QueryToken::cancel() {
+    cancelled = true;
+}
+
+// Whether the query should stop.
+bool QueryToken::expired() const {
+    return cancelled || ((deadline > 0) && (now() >= deadline));
+}
@@ -0,0 +1,50 @@
+#ifndef QUERYTOKEN_H
+#define QUERYTOKEN_H
+
+#include <atomic>
+
+using namespace std;
+
+// The QueryToken class lets a query be stopped before it is done, either
+// when a deadline passes or when another thread cancels it.  A query
+// given a token checks it as it goes, and when it stops early it returns
+// the best results found so far and marks the token as partial.  A token
+// serves one query at a time.
+class QueryToken {
+private:
+	// Deadline in seconds on the steady clock, or 0 for none.
+	double deadline;
+
+	atomic<bool> cancelled;
+	atomic<bool> stopped;
+
+public:
+	// Create a token with no deadline.
+	QueryToken();
+
+	// Set the deadline to ms milliseconds from now, or remove it if ms
+	// is negative.
+	void set_timeout(double ms);
+
+	// Make the query stop as soon as it can.  This may be called from
+	// any thread.
+	void cancel();
+
+	// Whether the query should stop: it has been cancelled or its
+	// deadline has passed.
+	bool expired() const;
+
+	// Note that the query stopped before it was done.
+	void mark_partial() { stopped = true; }
+
+	// Whether the query stopped before it was done, so that its results
+	// are only the best of the part searched.
+	bool partial() const { return stopped; }
+
+private:
+	// Tokens can't be copied.
+	QueryToken(const QueryToken &);
+	QueryToken &operator=(const QueryToken &);
+};
+
+#endif
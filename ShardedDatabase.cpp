@@ -0,0 +1,172 @@
+/* ShardedDatabase.cpp */
+
+#include <algorithm>
+#include <chrono>
+#include "ShardedDatabase.h"
+
+// Create a coordinator with no shards.
+ShardedDatabase::ShardedDatabase() {
+    lastId = 0;
+}
+
+// Close the connections.
+ShardedDatabase::~ShardedDatabase() {
+    for (unsigned int i=0; i<sockets.size(); i++) {
+        disconnect(i);
+    }
+}
+
+// Add the address of a shard.
+void ShardedDatabase::add_shard(const string &address) {
+    addresses.push_back(address);
+    sockets.push_back(-1);
+}
+
+// Connect to the shards that aren't connected.
+int ShardedDatabase::connect(int timeoutMs) {
+    int connected = 0;
+
+    for (unsigned int i=0; i<sockets.size(); i++) {
+        if (sockets[i] < 0) {
+            sockets[i] = connectSocket(addresses[i].c_str(), timeoutMs);
+        }
+
+        if (sockets[i] >= 0) {
+            connected++;
+        }
+    }
+
+    return connected;
+}
+
+// Send a query to every shard and merge the results.  The query goes
+// out to all the shards before any answer is read, so the shards work
+// on it at the same time.  Answers are read as they arrive until every
+// shard has answered or the time is up.  Answers to earlier queries
+// that timed out are read and dropped.
+int ShardedDatabase::query(const QueryRequest &request, vector<QueryResult> &results, int timeoutMs) {
+    long long start = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    vector<char> payload;
+
+    results.clear();
+    connect(timeoutMs);
+    encodeQuery(request, payload);
+
+    unsigned int id = ++lastId;
+    vector<char> waiting(sockets.size(), 0);
+    int pending = 0;
+
+    for (unsigned int i=0; i<sockets.size(); i++) {
+        if (sockets[i] < 0) {
+            continue;
+        }
+
+        if (sendMessage(sockets[i], MESSAGE_QUERY, id, payload)) {
+            waiting[i] = 1;
+            pending++;
+        }
+        else {
+            disconnect(i);
+        }
+    }
+
+    vector< vector<QueryResult> > shardResults(sockets.size());
+    int answered = 0;
+
+    while (pending > 0) {
+        long long now = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        int left = (int) max(start + timeoutMs - now, 0LL);
+
+        vector<int> s;
+        vector<int> shard;
+        vector<char> ready;
+
+        for (unsigned int i=0; i<sockets.size(); i++) {
+            if (waiting[i]) {
+                s.push_back(sockets[i]);
+                shard.push_back(i);
+            }
+        }
+
+        if (waitSockets(s, ready, left) <= 0) {
+            break;
+        }
+
+        for (unsigned int j=0; j<s.size(); j++) {
+            int i = shard[j];
+            unsigned int type, answerId;
+
+            if (!ready[j]) {
+                continue;
+            }
+
+            if (!receiveMessage(sockets[i], type, answerId, payload, max(left, 1))) {
+                disconnect(i);
+                waiting[i] = 0;
+                pending--;
+                continue;
+            }
+
+            if (answerId != id) {
+                continue;
+            }
+
+            waiting[i] = 0;
+            pending--;
+
+            if ((type == MESSAGE_RESULTS) && decodeResults(payload, shardResults[i])) {
+                answered++;
+            }
+        }
+    }
+
+    mergeResults(shardResults, results, request.k);
+    return answered;
+}
+
+// Ask every connected shard to stop and close the connections.
+void ShardedDatabase::shutdown() {
+    vector<char> payload;
+
+    for (unsigned int i=0; i<sockets.size(); i++) {
+        if (sockets[i] >= 0) {
+            sendMessage(sockets[i], MESSAGE_SHUTDOWN, 0, payload);
+            disconnect(i);
+        }
+    }
+}
+
+// Close the connection to a shard.
+void ShardedDatabase::disconnect(int shard) {
+    closeSocket(sockets[shard]);
+    sockets[shard] = -1;
+}
+
+// Order results by inliers, then by score, with ties going to the lower
+// index as in a single database.  Unverified results all have -1
+// inliers, so they are ordered by score alone.
+static bool betterResult(const QueryResult &a, const QueryResult &b) {
+    if (a.inliers != b.inliers) {
+        return a.inliers > b.inliers;
+    }
+
+    if (a.score != b.score) {
+        return a.score > b.score;
+    }
+
+    return a.index < b.index;
+}
+
+// Merge the results of several shards into the k best.  Every shard
+// returns its own k best, so the k best of all of them are among those.
+void mergeResults(const vector< vector<QueryResult> > &shardResults, vector<QueryResult> &results, int k) {
+    results.clear();
+
+    for (unsigned int i=0; i<shardResults.size(); i++) {
+        results.insert(results.end(), shardResults[i].begin(), shardResults[i].end());
+    }
+
+    k = max(min(k, (int) results.size()), 0);
+    partial_sort(results.begin(), results.begin() + k, results.end(), betterResult);
+    results.resize(k);
+}
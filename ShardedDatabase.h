@@ -0,0 +1,63 @@
+#ifndef SHARDEDDATABASE_H
+#define SHARDEDDATABASE_H
+
+#include <string>
+#include "QueryProtocol.h"
+
+// The ShardedDatabase class is the coordinator of a database split into
+// shards, each answered by a query server listening on its own address.
+// A query is sent to every shard at once, and the k best results of
+// each shard that answers in time are merged.  A shard that fails or
+// is too slow is left out of that query's results, and one whose
+// connection broke is reconnected for the next query.
+class ShardedDatabase {
+private:
+	vector<string> addresses;
+
+	// Connection to each shard, or -1.
+	vector<int> sockets;
+
+	// Id of the last query sent, so that late answers to an earlier
+	// query can be told apart.
+	unsigned int lastId;
+
+public:
+	// Create a coordinator with no shards.
+	ShardedDatabase();
+
+	// Close the connections.
+	~ShardedDatabase();
+
+	// Add the address of a shard.
+	void add_shard(const string &address);
+
+	// Number of shards.
+	int shards() const { return addresses.size(); }
+
+	// Connect to the shards that aren't connected, waiting at most
+	// timeoutMs milliseconds for each.  Returns the number connected.
+	int connect(int timeoutMs);
+
+	// Send a query to every shard and merge the k best results, best
+	// first, waiting at most timeoutMs milliseconds for the shards to
+	// answer.  Returns the number of shards that answered, so a result
+	// list from fewer than shards() shards is partial.
+	int query(const QueryRequest &request, vector<QueryResult> &results, int timeoutMs);
+
+	// Ask every connected shard to stop and close the connections.
+	void shutdown();
+
+private:
+	// Close the connection to a shard.
+	void disconnect(int shard);
+
+	// Coordinators can't be copied.
+	ShardedDatabase(const ShardedDatabase &);
+	ShardedDatabase &operator=(const ShardedDatabase &);
+};
+
+// Merge the results of several shards into the k best, best first.
+// Verified results are ordered by inliers, then by score.
+void mergeResults(const vector< vector<QueryResult> > &shardResults, vector<QueryResult> &results, int k);
+
+#endif
@@ -0,0 +1,357 @@
+/* SiftFile.cpp */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#include "SiftFile.h"
+#include "FeatureFile.h"
+#include "DescriptorMatrix.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+
+// Length of a SIFT descriptor, and the number of values per keypoint:
+// row, column, scale and orientation, then the descriptor.
+static const int siftDim = 128;
+static const int siftFields = 4 + siftDim;
+
+// Smallest chunk of a key file parsed by one task.
+static const size_t minChunkBytes = 1 << 18;
+
+// Powers of ten that are exact as doubles.
+static const double powersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Whitespace characters, as a table indexed by character.
+static const struct SpaceTable {
+    bool space[256];
+
+    SpaceTable() {
+        for (int c=0; c<256; c++) {
+            space[c] = (c == ' ') || (c == '\n') || (c == '\r') || (c == '\t') || (c == '\v') || (c == '\f');
+        }
+    }
+} spaceTable;
+
+// Check for a whitespace character.
+static inline bool isSpace(char c) {
+    return spaceTable.space[(unsigned char) c];
+}
+
+// Find the next whitespace-separated token at or after p.  On success
+// the token is [start, p).
+static bool nextToken(const char *&p, const char *end, const char *&start) {
+    while ((p < end) && isSpace(*p)) {
+        p++;
+    }
+
+    if (p == end) {
+        return false;
+    }
+
+    start = p;
+
+    while ((p < end) && !isSpace(*p)) {
+        p++;
+    }
+
+    return true;
+}
+
+// Parse a decimal number that fills [p, end).  A number with at most 15
+// significant digits and no exponent is an exact integer divided by an
+// exact power of ten, so one division rounds it the same way strtod
+// does.  Anything else is handed to strtod.
+static bool parseNumber(const char *p, const char *end, double &value) {
+    const char *q = p;
+    bool negative = false;
+
+    if ((q < end) && ((*q == '-') || (*q == '+'))) {
+        negative = (*q == '-');
+        q++;
+    }
+
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int fraction = 0;
+    bool anyDigits = false;
+    bool point = false;
+
+    for (; q < end; q++) {
+        if ((*q >= '0') && (*q <= '9')) {
+            if ((digits > 0) || (*q != '0')) {
+                digits++;
+            }
+
+            if (digits <= 15) {
+                mantissa = mantissa * 10 + (*q - '0');
+            }
+
+            fraction += point ? 1 : 0;
+            anyDigits = true;
+        }
+        else if ((*q == '.') && !point) {
+            point = true;
+        }
+        else {
+            break;
+        }
+    }
+
+    if ((q == end) && anyDigits && (digits <= 15) && (fraction <= 22)) {
+        value = (fraction == 0) ? (double) mantissa : (double) mantissa / powersOfTen[fraction];
+        value = negative ? -value : value;
+        return true;
+    }
+
+    char buffer[64];
+    size_t length = end - p;
+
+    if ((length == 0) || (length >= sizeof(buffer))) {
+        return false;
+    }
+
+    memcpy(buffer, p, length);
+    buffer[length] = '\0';
+
+    char *stop;
+    value = strtod(buffer, &stop);
+
+    return stop == buffer + length;
+}
+
+// Parse a Lowe-format SIFT key file.  The body is split into chunks at
+// whitespace, and the tokens of each chunk are counted in parallel.
+// The counts give the index of the first value of each chunk, and so
+// the keypoint and field of every value, so the chunks can then be
+// parsed in parallel too.  A keypoint that straddles two chunks is
+// filled in by both.
+bool parseSiftFile(const char *name, FeatureSet *features, DescriptorMatrix *matrix, int numThreads) {
+    DescriptorMatrix temp;
+    MappedFile file;
+
+    if (features != NULL) {
+        features->clear();
+    }
+
+    if (matrix == NULL) {
+        matrix = &temp;
+    }
+
+    if (!file.open(name)) {
+        return false;
+    }
+
+    // Read the number of keypoints and the descriptor length.
+    const char *p = file.data();
+    const char *end = p + file.size();
+    const char *token;
+    double n;
+    double m;
+
+    if (!nextToken(p, end, token) || !parseNumber(token, p, n) || !nextToken(p, end, token) || !parseNumber(token, p, m)) {
+        return false;
+    }
+
+    if ((m != siftDim) || (n < 0) || (n != (int) n) || (n > INT_MAX / siftFields)) {
+        return false;
+    }
+
+    int count = (int) n;
+    long long needed = (long long) count * siftFields;
+
+    // Split the body into chunks that end on whitespace.
+    int threads = (numThreads > 0) ? numThreads : ThreadPool::shared().size() + 1;
+    size_t bytes = end - p;
+    int chunks = (int) min((size_t) threads * 4, max(bytes / minChunkBytes, (size_t) 1));
+
+    vector<const char *> bounds(chunks + 1);
+    bounds[0] = p;
+    bounds[chunks] = end;
+
+    for (int c=1; c<chunks; c++) {
+        const char *b = max(p + bytes * c / chunks, bounds[c-1]);
+
+        while ((b < end) && !isSpace(*b)) {
+            b++;
+        }
+
+        bounds[c] = b;
+    }
+
+    // Count the tokens of each chunk.
+    vector<long long> first(chunks + 1, 0);
+
+    ThreadPool::shared().parallel_for(chunks, [&](int c) {
+        const char *q = bounds[c];
+        const char *t;
+        long long tokens = 0;
+
+        while (nextToken(q, bounds[c+1], t)) {
+            tokens++;
+        }
+
+        first[c+1] = tokens;
+    }, numThreads);
+
+    for (int c=0; c<chunks; c++) {
+        first[c+1] += first[c];
+    }
+
+    if (first[chunks] < needed) {
+        return false;
+    }
+
+    // Parse the values into place.
+    vector<double> keypoints((size_t) count * 4);
+    vector<char> ok(chunks, 1);
+
+    matrix->allocate(count, siftDim);
+
+    ThreadPool::shared().parallel_for(chunks, [&](int c) {
+        const char *q = bounds[c];
+        const char *t;
+        long long i = first[c];
+        int k = (int) (i / siftFields);
+        int field = (int) (i % siftFields);
+        double v;
+
+        while ((i < needed) && nextToken(q, bounds[c+1], t)) {
+            if (!parseNumber(t, q, v)) {
+                ok[c] = 0;
+                break;
+            }
+
+            if (field < 4) {
+                keypoints[(size_t) k * 4 + field] = v;
+            }
+            else {
+                matrix->mutable_row(k)[field - 4] = (float) v;
+            }
+
+            i++;
+
+            if (++field == siftFields) {
+                field = 0;
+                k++;
+            }
+        }
+    }, numThreads);
+
+    for (int c=0; c<chunks; c++) {
+        if (!ok[c]) {
+            matrix->allocate(0, 0);
+            return false;
+        }
+    }
+
+    for (int k=0; k<count; k++) {
+        matrix->ids[k] = k + 1;
+    }
+
+    if (features == NULL) {
+        return true;
+    }
+
+    // Fill in the features the way Feature::read_sift does.
+    features->resize(count);
+
+    for (int k=0; k<count; k++) {
+        Feature &f = (*features)[k];
+        const double *key = &keypoints[(size_t) k * 4];
+        const float *row = matrix->row(k);
+
+        // Let's use type 9 for SIFT features.
+        f.type = 9;
+        f.id = k + 1;
+
+        // They give row first, then column.
+        f.x = (int) (key[1] + 0.5);
+        f.y = (int) (key[0] + 0.5);
+        f.scale = key[2];
+        f.angleRadians = key[3];
+
+        f.data.assign(row, row + siftDim);
+    }
+
+    return true;
+}
+
+// Name of the binary feature file that caches a SIFT key file.
+string siftCacheName(const char *name) {
+    return string(name) + ".fset";
+}
+
+// Get the modification time of a file, or -1 if it doesn't exist.
+static double modificationTime(const char *name) {
+    struct stat s;
+
+    if (stat(name, &s) != 0) {
+        return -1;
+    }
+
+    double time = (double) s.st_mtime;
+
+#ifdef __linux__
+    // Files written within the same second are still told apart.
+    time += s.st_mtim.tv_nsec * 1e-9;
+#endif
+
+    return time;
+}
+
+// Load a SIFT key file, through the binary cache if asked to.  The
+// cache is only used if it is strictly newer than the key file, so a
+// key file rewritten within the clock's resolution of its cache isn't
+// served stale.  The cache is written under a temporary name unique to
+// the process and the call, then renamed, so that another loader never
+// sees a partial file and concurrent loaders don't write into the same
+// one.
+bool loadSiftFeatures(const char *name, FeatureSet &features, bool cache) {
+    if (!cache) {
+        return parseSiftFile(name, &features, NULL);
+    }
+
+    string cacheName = siftCacheName(name);
+    double keyTime = modificationTime(name);
+
+    if ((keyTime >= 0) && (modificationTime(cacheName.c_str()) > keyTime)) {
+        FeatureFile f;
+
+        if (f.open(cacheName.c_str()) && ((f.size() == 0) || (f.dim() == siftDim))) {
+            f.get_features(features);
+            return true;
+        }
+    }
+
+    if (!parseSiftFile(name, &features, NULL)) {
+        return false;
+    }
+
+    static atomic<int> counter(0);
+    char suffix[64];
+
+#ifdef _WIN32
+    sprintf(suffix, ".%d-%d.tmp", (int) _getpid(), (int) counter++);
+#else
+    sprintf(suffix, ".%d-%d.tmp", (int) getpid(), (int) counter++);
+#endif
+
+    string tempName = cacheName + suffix;
+
+    if (!saveFeatureFile(tempName.c_str(), features) || (rename(tempName.c_str(), cacheName.c_str()) != 0)) {
+        remove(tempName.c_str());
+    }
+
+    return true;
+}
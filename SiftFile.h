@@ -0,0 +1,23 @@
+#ifndef SIFTFILE_H
+#define SIFTFILE_H
+
+#include "FeatureSet.h"
+
+class DescriptorMatrix;
+
+// Parse a Lowe-format SIFT key file.  The file is mapped and split into
+// chunks that are parsed in parallel on the shared thread pool, using
+// at most numThreads threads (zero for all of them).  The descriptors
+// are written straight into a matrix; if matrix is NULL a temporary one
+// is used.  If features is not NULL it receives the keypoints too.
+bool parseSiftFile(const char *name, FeatureSet *features, DescriptorMatrix *matrix, int numThreads = 0);
+
+// Name of the binary feature file that caches a SIFT key file.
+string siftCacheName(const char *name);
+
+// Load a SIFT key file.  If cache is true, the features are read from
+// the binary cache file when it is at least as new as the key file, and
+// otherwise the key file is parsed and the cache file written.
+bool loadSiftFeatures(const char *name, FeatureSet &features, bool cache);
+
+#endif
@@ -0,0 +1,141 @@
+/* ThreadPool.cpp */
+
+#include <atomic>
+#include <memory>
+#include "ThreadPool.h"
+
+// Create a pool.
+ThreadPool::ThreadPool(int numThreads) {
+    stopping = false;
+
+    if (numThreads <= 0) {
+        numThreads = thread::hardware_concurrency();
+    }
+
+    if (numThreads <= 0) {
+        numThreads = 1;
+    }
+
+    for (int i=0; i<numThreads; i++) {
+        workers.push_back(thread(&ThreadPool::work, this));
+    }
+}
+
+// Finish the queued tasks and stop the workers.
+ThreadPool::~ThreadPool() {
+    {
+        unique_lock<mutex> guard(lock);
+        stopping = true;
+    }
+
+    wake.notify_all();
+
+    for (unsigned int i=0; i<workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+// Queue a task to run on a worker thread.
+void ThreadPool::run(const function<void()> &task) {
+    {
+        unique_lock<mutex> guard(lock);
+        tasks.push_back(task);
+    }
+
+    wake.notify_one();
+}
+
+// The shared state of one parallel_for call.  Helpers that start after
+// all the work is claimed simply return, so the caller only waits for
+// the indices to complete, not for the helpers to be scheduled.
+struct ParallelForState {
+    function<void(int)> body;
+    int n;
+    atomic<int> next;
+    int done;
+    mutex lock;
+    condition_variable finished;
+
+    ParallelForState(const function<void(int)> &body, int n) : body(body), n(n), next(0), done(0) {}
+
+    // Claim and run indices until none are left.
+    void drain() {
+        int count = 0;
+        int i;
+
+        while ((i = next++) < n) {
+            body(i);
+            count++;
+        }
+
+        if (count > 0) {
+            unique_lock<mutex> guard(lock);
+            done += count;
+
+            if (done == n) {
+                finished.notify_all();
+            }
+        }
+    }
+};
+
+// Run body(i) for every i in [0, n) and wait for completion.
+void ThreadPool::parallel_for(int n, const function<void(int)> &body, int maxThreads) {
+    if (n <= 0) {
+        return;
+    }
+
+    int helpers = size();
+
+    if ((maxThreads > 0) && (maxThreads - 1 < helpers)) {
+        helpers = maxThreads - 1;
+    }
+
+    if (helpers > n - 1) {
+        helpers = n - 1;
+    }
+
+    shared_ptr<ParallelForState> state(new ParallelForState(body, n));
+
+    for (int i=0; i<helpers; i++) {
+        run([state]() { state->drain(); });
+    }
+
+    state->drain();
+
+    unique_lock<mutex> guard(state->lock);
+
+    while (state->done < n) {
+        state->finished.wait(guard);
+    }
+}
+
+// The process-wide pool.
+ThreadPool &ThreadPool::shared() {
+    static ThreadPool pool;
+    return pool;
+}
+
+// Run queued tasks until the pool is stopped.
+void ThreadPool::work() {
+    while (true) {
+        function<void()> task;
+
+        {
+            unique_lock<mutex> guard(lock);
+
+            while (tasks.empty() && !stopping) {
+                wake.wait(guard);
+            }
+
+            if (tasks.empty()) {
+                return;
+            }
+
+            task = tasks.front();
+            tasks.pop_front();
+        }
+
+        task();
+    }
+}
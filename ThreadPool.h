@@ -0,0 +1,52 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+// The ThreadPool class keeps a fixed set of worker threads that run
+// queued tasks.  Most code uses the shared pool rather than creating
+// its own.
+class ThreadPool {
+private:
+	vector<thread> workers;
+	deque< function<void()> > tasks;
+
+	mutex lock;
+	condition_variable wake;
+	bool stopping;
+
+public:
+	// Create a pool.  Zero threads means one per hardware thread.
+	ThreadPool(int numThreads = 0);
+
+	// Finish the queued tasks and stop the workers.
+	~ThreadPool();
+
+	// Number of worker threads.
+	int size() const { return workers.size(); }
+
+	// Queue a task to run on a worker thread.
+	void run(const function<void()> &task);
+
+	// Run body(i) for every i in [0, n), using at most maxThreads
+	// threads (zero for all of them), and wait until all are done.
+	// The calling thread takes part, so this may be called from a
+	// worker thread without deadlocking.
+	void parallel_for(int n, const function<void(int)> &body, int maxThreads = 0);
+
+	// The process-wide pool.
+	static ThreadPool &shared();
+
+private:
+	// The loop run by each worker thread.
+	void work();
+};
+
+#endif
@@ -2,15 +2,35 @@
 
 #include <assert.h>
 #include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <FL/Fl.H>
 #include <FL/Fl_Image.H>
 #include "features.h"
+#include "LSHIndex.h"
+#include "FeatureSetCache.h"
+#include "DescriptorMatrix.h"
+#include "ThreadPool.h"
+#include "MatchPlanner.h"
+#include "QueryToken.h"
 #include "ImageLib/FileIO.h"
 
 #define PI 3.14159265358979323846
 
-// Compute features of an image.
+// Compute features of an image.  The grayscale image used by the
+// detectors and descriptors is converted once and shared by both.
 bool computeFeatures(CFloatImage &image, FeatureSet &features, int featureType, int descriptorType)
+{
+    CFloatImage grayImage = ConvertToGray(image);
+
+    return detectFeatures(image, grayImage, features, featureType) &&
+        describeFeatures(image, grayImage, features, descriptorType);
+}
+
+// Detect the features of an image, given its grayscale version.
+bool detectFeatures(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features, int featureType)
 {
     // TODO: Instead of calling dummyComputeFeatures, implement
     // Harris feature detector.  This step fills in "features"
@@ -20,22 +40,29 @@ bool computeFeatures(CFloatImage &image, FeatureSet &features, int featureType,
         dummyComputeFeatures(image, features);
         break;
     case 2:
-        ComputeHarrisFeatures(image, features);
+        ComputeHarrisFeatures(image, grayImage, features);
         break;
     default:
         return false;
     }
 
+    return true;
+}
+
+// Compute the descriptors of detected features, given the grayscale
+// version of the image.
+bool describeFeatures(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features, int descriptorType)
+{
     // TODO: You will implement two descriptors for this project
     // (see webpage).  This step fills in "features" with
     // descriptors.  The third "custom" descriptor is extra credit.
     switch (descriptorType) {
     case 1:
-        ComputeSimpleDescriptors(image, features);
+        ComputeSimpleDescriptors(image, grayImage, features);
 		//line
         break;
     case 2:
-        ComputeMOPSDescriptors(image, features);
+        ComputeMOPSDescriptors(image, grayImage, features);
         break;
     case 3:
         ComputeCustomDescriptors(image, features);
@@ -53,47 +80,733 @@ bool computeFeatures(CFloatImage &image, FeatureSet &features, int featureType,
     return true;
 }
 
+// Default query options: exhaustive search.
+MatchOptions::MatchOptions() {
+    backend = MATCH_BACKEND_EXHAUSTIVE;
+    plan = MATCH_PLAN_AUTO;
+    approximate = false;
+    lshTables = 8;
+    lshKeyBits = 14;
+    lshProbes = 8;
+    ratioThreshold = 0.8;
+    numThreads = 0;
+    matrix = NULL;
+    index = NULL;
+    neighbours = 10;
+    shortlist = 20;
+    rerank = true;
+    verifyTop = 0;
+    homography = NULL;
+    searchRadius = 10;
+    orientationTolerance = 0;
+    scaleTolerance = 0;
+    token = NULL;
+}
+
+// Create an unverified result.
+QueryResult::QueryResult() {
+    index = -1;
+    score = 0;
+    inliers = -1;
+}
+
+// Fetch the features of a database item, loading them from disk into
+// temp if they are not resident.  With a feature cache, they are taken
+// from the cache instead, and pinned holds them until it is released.
+// Returns NULL if they can't be loaded.
+static const FeatureSet *itemFeatures(const ImageDatabase &db, int i, FeatureSet &temp, shared_ptr<const FeatureSet> &pinned) {
+    if (!db[i].features.empty()) {
+        return &db[i].features;
+    }
+
+    if (!db.has_feature_source(i)) {
+        return NULL;
+    }
+
+    if (db.cache) {
+        pinned = db.cache->get(db, i);
+        return pinned.get();
+    }
+
+    if (!db.load_item_features(i, temp)) {
+        return NULL;
+    }
+
+    return &temp;
+}
+
+// Number of items each ranking worker prefetches ahead of the one it is
+// matching, when the database has a feature cache.
+static const int prefetchDepth = 2;
+
+// A (score, database index) pair.  Higher scores are better, and ties
+// go to the lower index, as in a serial scan.
+typedef pair<double, int> ScoredItem;
+
+static bool betterItem(const ScoredItem &a, const ScoredItem &b) {
+    return (a.first > b.first) || ((a.first == b.first) && (a.second < b.second));
+}
+
+// Add an item to a heap holding the k best items, with the worst of
+// them on top.
+static void pushBounded(vector<ScoredItem> &heap, const ScoredItem &s, int k) {
+    if ((int) heap.size() < k) {
+        heap.push_back(s);
+        push_heap(heap.begin(), heap.end(), betterItem);
+    }
+    else if ((k > 0) && betterItem(s, heap.front())) {
+        pop_heap(heap.begin(), heap.end(), betterItem);
+        heap.back() = s;
+        push_heap(heap.begin(), heap.end(), betterItem);
+    }
+}
+
+// Number of items a ranking worker claims at a time.  Workers claim the
+// items in order, so a query stopped early has matched a prefix of them.
+static const int rankBlock = 4;
+
+// Whether a query should stop, marking its token as partial if so.
+static bool queryExpired(QueryToken *token) {
+    if ((token != NULL) && token->expired()) {
+        token->mark_partial();
+        return true;
+    }
+
+    return false;
+}
+
+// Match the query against a list of database items on the shared thread
+// pool and return the k best, best first.  Each worker reuses a single
+// match vector and keeps its own bounded heap, so scoring an image
+// allocates nothing; only the matches of the final k images are
+// computed again, directly into the results.  The workers claim items
+// in list order, and stop claiming them once the query's token expires.
+static bool rankItems(const FeatureSet &f, const ImageDatabase &db, const vector<int> &items, vector<QueryResult> &results, int k, int matchType, const MatchOptions *options) {
+    ThreadPool &pool = ThreadPool::shared();
+    int numThreads = (options != NULL) ? options->numThreads : 0;
+    QueryToken *token = (options != NULL) ? options->token : NULL;
+    int n = items.size();
+    int workers = min(n, pool.size() + 1);
+
+    vector<ScoredItem> best;
+    mutex bestLock;
+    atomic<int> next(0);
+    atomic<bool> failed(false);
+    atomic<bool> stopped(false);
+
+    pool.parallel_for(workers, [&](int) {
+        vector<FeatureMatch> matches;
+        vector<ScoredItem> local;
+        FeatureSet temp;
+        shared_ptr<const FeatureSet> pinned;
+        double score;
+
+        while (!failed && !stopped) {
+            int begin = next.fetch_add(rankBlock);
+
+            if (begin >= n) {
+                break;
+            }
+
+            int end = min(begin + rankBlock, n);
+
+            for (int i=begin; (i<end) && !failed; i++) {
+                if (queryExpired(token)) {
+                    stopped = true;
+                    break;
+                }
+
+                if (db.cache) {
+                    db.cache->prefetch(db, &items[0] + i + 1, max(min(prefetchDepth, n - i - 1), 0));
+                }
+
+                const FeatureSet *features = itemFeatures(db, items[i], temp, pinned);
+
+                if (features == NULL) {
+                    continue;
+                }
+
+                if (!matchFeatures(f, *features, matches, score, matchType, options)) {
+                    if (queryExpired(token)) {
+                        stopped = true;
+                        break;
+                    }
+
+                    failed = true;
+                    return;
+                }
+
+                pushBounded(local, ScoredItem(score, items[i]), k);
+            }
+        }
+
+        lock_guard<mutex> guard(bestLock);
+
+        for (unsigned int i=0; i<local.size(); i++) {
+            pushBounded(best, local[i], k);
+        }
+    }, numThreads);
+
+    if (failed) {
+        return false;
+    }
+
+    sort(best.begin(), best.end(), betterItem);
+
+    results.clear();
+    results.resize(best.size());
+
+    // The matches of the images found are produced even if the token has
+    // expired, so they are matched without it.
+    MatchOptions finishing;
+
+    if (options != NULL) {
+        finishing = *options;
+        finishing.token = NULL;
+    }
+
+    pool.parallel_for(best.size(), [&](int r) {
+        FeatureSet temp;
+        shared_ptr<const FeatureSet> pinned;
+        double score;
+
+        results[r].index = best[r].second;
+        results[r].score = best[r].first;
+
+        const FeatureSet *features = itemFeatures(db, best[r].second, temp, pinned);
+
+        if (features != NULL) {
+            matchFeatures(f, *features, results[r].matches, score, matchType, (options != NULL) ? &finishing : NULL);
+        }
+    }, numThreads);
+
+    return true;
+}
+
+// Block sizes of the single-pass matrix query, in database rows and
+// query rows per distance tile.
+static const int matrixRowBlock = 64;
+static const int matrixQueryBlock = 32;
+
+// Find, for each query row in [qBegin, qEnd), the best and second best
+// squared distances to the rows of one database item, and the row of
+// the best.  The item's rows are visited a tile at a time and each tile
+// is compared against every query row while it is in cache.
+static void reduceItem(const DescriptorMatrix &query, int qBegin, int qEnd, const DescriptorMatrix &db, int item, float *tile, float *best, float *second, int *bestRow) {
+    for (int i=qBegin; i<qEnd; i++) {
+        best[i] = FLT_MAX;
+        second[i] = FLT_MAX;
+        bestRow[i] = -1;
+    }
+
+    int end = db.offsets[item+1];
+
+    for (int r0=db.offsets[item]; r0<end; r0+=matrixRowBlock) {
+        int r1 = min(r0 + matrixRowBlock, end);
+
+        for (int q0=qBegin; q0<qEnd; q0+=matrixQueryBlock) {
+            int q1 = min(q0 + matrixQueryBlock, qEnd);
+
+            squaredDistanceBlock(query, q0, q1, db, r0, r1, tile, matrixRowBlock);
+
+            for (int i=q0; i<q1; i++) {
+                const float *t = tile + (i-q0)*matrixRowBlock;
+
+                for (int j=r0; j<r1; j++) {
+                    float d = t[j-r0];
+
+                    if (d < best[i]) {
+                        second[i] = best[i];
+                        best[i] = d;
+                        bestRow[i] = j;
+                    }
+                    else if (d < second[i]) {
+                        second[i] = d;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Turn a squared distance from reduceItem into an SSD distance.
+static double reducedDistance(float d) {
+    return (d == FLT_MAX) ? 1e100 : sqrt((double) d);
+}
+
+// Compute the matchFeatures score of query rows [qBegin, qEnd) from
+// their reduction.
+static double reducedScore(int qBegin, int qEnd, const float *best, const float *second, int matchType) {
+    double total = 0;
+
+    for (int i=qBegin; i<qEnd; i++) {
+        if (matchType == 1) {
+            total -= reducedDistance(best[i]);
+        }
+        else {
+            total += reducedDistance(best[i]) / reducedDistance(second[i]);
+        }
+    }
+
+    return total;
+}
+
+// Build the matches of query rows [qBegin, qEnd) from their reduction.
+static void reducedMatches(const DescriptorMatrix &query, int qBegin, int qEnd, const DescriptorMatrix &db, const float *best, const float *second, const int *bestRow, vector<FeatureMatch> &matches) {
+    matches.resize(qEnd - qBegin);
+
+    for (int i=qBegin; i<qEnd; i++) {
+        FeatureMatch &m = matches[i - qBegin];
+
+        m.id1 = query.ids[i];
+        m.id2 = (bestRow[i] < 0) ? 0 : db.ids[bestRow[i]];
+        m.score = -reducedDistance(best[i]);
+        m.second = -reducedDistance(second[i]);
+    }
+}
+
+// Number of items a matrix query worker claims at a time.
+static const int matrixItemBlock = 16;
+
+// Perform a query against a concatenated database matrix.  The worker
+// threads claim blocks of items in order, and each makes a single pass
+// over its items with the query rows resident in cache, reducing the
+// distances item by item.  Once the query's token expires no more items
+// are claimed.
+static bool performMatrixQuery(const FeatureSet &f, const DescriptorMatrix &db, vector<QueryResult> &results, int k, int matchType, const MatchOptions &options) {
+    DescriptorMatrix query;
+
+    if (!query.build(f) || ((query.rows > 0) && (query.dim != db.dim))) {
+        return false;
+    }
+
+    ThreadPool &pool = ThreadPool::shared();
+    int m = query.rows;
+    int n = db.items();
+    int workers = min(n, pool.size() + 1);
+
+    vector<ScoredItem> best;
+    mutex bestLock;
+    atomic<int> next(0);
+
+    pool.parallel_for(workers, [&](int) {
+        vector<float> tile(matrixQueryBlock * matrixRowBlock);
+        vector<float> dBest(m + 1);
+        vector<float> dSecond(m + 1);
+        vector<int> bestRow(m + 1);
+        vector<ScoredItem> local;
+
+        for (int begin=next.fetch_add(matrixItemBlock); (begin<n) && !queryExpired(options.token); begin=next.fetch_add(matrixItemBlock)) {
+            int end = min(begin + matrixItemBlock, n);
+
+            for (int i=begin; i<end; i++) {
+                if (db.is_removed(i)) {
+                    continue;
+                }
+
+                reduceItem(query, 0, m, db, i, &tile[0], &dBest[0], &dSecond[0], &bestRow[0]);
+                pushBounded(local, ScoredItem(reducedScore(0, m, &dBest[0], &dSecond[0], matchType), i), k);
+            }
+        }
+
+        lock_guard<mutex> guard(bestLock);
+
+        for (unsigned int i=0; i<local.size(); i++) {
+            pushBounded(best, local[i], k);
+        }
+    }, options.numThreads);
+
+    sort(best.begin(), best.end(), betterItem);
+
+    results.clear();
+    results.resize(best.size());
+
+    // Produce the matches of the final images only.
+    vector<float> tile(matrixQueryBlock * matrixRowBlock);
+    vector<float> dBest(m + 1);
+    vector<float> dSecond(m + 1);
+    vector<int> bestRow(m + 1);
+
+    for (unsigned int r=0; r<best.size(); r++) {
+        results[r].index = best[r].second;
+        results[r].score = best[r].first;
+
+        reduceItem(query, 0, m, db, results[r].index, &tile[0], &dBest[0], &dSecond[0], &bestRow[0]);
+        reducedMatches(query, 0, m, db, &dBest[0], &dSecond[0], &bestRow[0], results[r].matches);
+    }
+
+    return true;
+}
+
+// Perform a batch of queries against a concatenated database matrix.
+// All the query descriptors are stacked into one matrix, and each tile
+// of database rows is compared against every query while it is in
+// cache, so the database is streamed from memory once per batch rather
+// than once per query.  Only ssd and ratio matching are supported.
+bool performBatchQuery(const vector<FeatureSet> &queries, const DescriptorMatrix &db, vector< vector<QueryResult> > &results, int k, int matchType, const MatchOptions *options) {
+    DescriptorMatrix query;
+
+    results.clear();
+
+    if (((matchType != 1) && (matchType != 2)) || !query.build(queries) ||
+        ((query.rows > 0) && (query.dim != db.dim))) {
+        return false;
+    }
+
+    ThreadPool &pool = ThreadPool::shared();
+    int numThreads = (options != NULL) ? options->numThreads : 0;
+    int numQueries = queries.size();
+    int m = query.rows;
+    int n = db.items();
+    int chunks = min(n, 4 * (pool.size() + 1));
+
+    vector< vector<ScoredItem> > best(numQueries);
+    mutex bestLock;
+
+    pool.parallel_for(chunks, [&](int c) {
+        int begin = (int) ((long long) n * c / chunks);
+        int end = (int) ((long long) n * (c + 1) / chunks);
+
+        vector<float> tile(matrixQueryBlock * matrixRowBlock);
+        vector<float> dBest(m + 1);
+        vector<float> dSecond(m + 1);
+        vector<int> bestRow(m + 1);
+        vector< vector<ScoredItem> > local(numQueries);
+
+        for (int i=begin; i<end; i++) {
+            if (db.is_removed(i)) {
+                continue;
+            }
+
+            reduceItem(query, 0, m, db, i, &tile[0], &dBest[0], &dSecond[0], &bestRow[0]);
+
+            // Split the reduction back into the individual queries.
+            for (int q=0; q<numQueries; q++) {
+                double score = reducedScore(query.offsets[q], query.offsets[q+1], &dBest[0], &dSecond[0], matchType);
+                pushBounded(local[q], ScoredItem(score, i), k);
+            }
+        }
+
+        lock_guard<mutex> guard(bestLock);
+
+        for (int q=0; q<numQueries; q++) {
+            for (unsigned int i=0; i<local[q].size(); i++) {
+                pushBounded(best[q], local[q][i], k);
+            }
+        }
+    }, numThreads);
+
+    results.resize(numQueries);
+
+    // Produce the matches of each query's final images.
+    pool.parallel_for(numQueries, [&](int q) {
+        int q0 = query.offsets[q];
+        int q1 = query.offsets[q+1];
+
+        vector<float> tile(matrixQueryBlock * matrixRowBlock);
+        vector<float> dBest(m + 1);
+        vector<float> dSecond(m + 1);
+        vector<int> bestRow(m + 1);
+
+        sort(best[q].begin(), best[q].end(), betterItem);
+        results[q].resize(best[q].size());
+
+        for (unsigned int r=0; r<best[q].size(); r++) {
+            QueryResult &result = results[q][r];
+
+            result.index = best[q][r].second;
+            result.score = best[q][r].first;
+
+            reduceItem(query, q0, q1, db, result.index, &tile[0], &dBest[0], &dSecond[0], &bestRow[0]);
+            reducedMatches(query, q0, q1, db, &dBest[0], &dSecond[0], &bestRow[0], result.matches);
+        }
+    }, numThreads);
+
+    return true;
+}
+
+// Perform a query using an index to pick the candidate images.  Each
+// query feature votes for the images of its nearest indexed features,
+// and the images with the most votes are either matched exactly or
+// scored from the index distances alone.
+static bool performIndexedQuery(const FeatureSet &f, const ImageDatabase &db, vector<QueryResult> &results, int k, int matchType, const MatchOptions &options) {
+    int n = db.size();
+
+    vector<int> votes(n, 0);
+    vector<int> lastQuery(n, -1);
+    vector< vector<FeatureMatch> > hits(n);
+    vector<IndexCandidate> candidates;
+
+    for (unsigned int i=0; (i<f.size()) && !queryExpired(options.token); i++) {
+        options.index->search(f[i].data, options.neighbours, candidates);
+
+        // The candidates are sorted, so the first hit in an image is
+        // the closest one.
+        for (unsigned int j=0; j<candidates.size(); j++) {
+            int item = candidates[j].item;
+
+            if ((item < 0) || (item >= n) || (lastQuery[item] == (int) i)) {
+                continue;
+            }
+
+            lastQuery[item] = i;
+            votes[item]++;
+
+            FeatureMatch m;
+            m.id1 = f[i].id;
+            m.id2 = candidates[j].id;
+            m.score = -candidates[j].distance;
+            m.second = 0;
+            hits[item].push_back(m);
+        }
+    }
+
+    // Rank the images by votes, then by the summed index scores.
+    vector< pair< pair<int, double>, int > > ranked;
+
+    for (int i=0; i<n; i++) {
+        if (votes[i] > 0) {
+            double score = 0;
+
+            for (unsigned int j=0; j<hits[i].size(); j++) {
+                score += hits[i][j].score;
+            }
+
+            ranked.push_back(make_pair(make_pair(votes[i], score), i));
+        }
+    }
+
+    if (ranked.empty()) {
+        // A query stopped before any votes has simply found nothing.
+        return (options.token != NULL) && options.token->partial();
+    }
+
+    sort(ranked.rbegin(), ranked.rend());
+
+    if ((options.shortlist > 0) && ((int) ranked.size() > options.shortlist)) {
+        ranked.resize(options.shortlist);
+    }
+
+    // Re-rank the shortlist with the full descriptors, in order of
+    // votes.  If the token expires before any image is re-ranked, the
+    // vote ranking is the best answer there is.
+    if (options.rerank && !queryExpired(options.token)) {
+        vector<int> items(ranked.size());
+
+        for (unsigned int r=0; r<ranked.size(); r++) {
+            items[r] = ranked[r].second;
+        }
+
+        if (!rankItems(f, db, items, results, k, matchType, &options)) {
+            return false;
+        }
+
+        if (!results.empty()) {
+            return true;
+        }
+
+        if ((options.token == NULL) || !options.token->partial()) {
+            return false;
+        }
+    }
+
+    results.resize(min(k, (int) ranked.size()));
+
+    for (unsigned int r=0; r<results.size(); r++) {
+        results[r].index = ranked[r].second;
+        results[r].score = ranked[r].first.second;
+        results[r].matches.swap(hits[ranked[r].second]);
+    }
+
+    return true;
+}
+
+// Tell whether the options ask for approximate LSH matching.
+static bool approximateOptions(const MatchOptions &options) {
+    return (options.backend == MATCH_BACKEND_LSH) || (options.plan == MATCH_PLAN_ANN) || options.approximate;
+}
+
+// Get the options used to match single database images.  Training an
+// LSH index over each image would cost more than matching it exactly,
+// so database queries are only approximate through options->index.
+static const MatchOptions *itemOptions(const MatchOptions *options, MatchOptions &exact) {
+    if ((options == NULL) || !approximateOptions(*options)) {
+        return options;
+    }
+
+    exact = *options;
+    exact.backend = MATCH_BACKEND_EXHAUSTIVE;
+    exact.plan = (options->plan == MATCH_PLAN_ANN) ? MATCH_PLAN_AUTO : options->plan;
+    exact.approximate = false;
+
+    return &exact;
+}
+
+// Find the k best matching images in order.  Every image is matched
+// unless the options name an index, in which case only the candidate
+// images it proposes are matched.  If the options hold a concatenated
+// database matrix, ssd and ratio queries are answered with a single
+// pass over it, falling back to per-image matching if the query doesn't
+// fit the matrix.
+static bool rankQuery(const FeatureSet &f, const ImageDatabase &db, vector<QueryResult> &results, int k, int matchType, const MatchOptions *options) {
+    results.clear();
+
+    if ((options != NULL) && (options->index != NULL)) {
+        return performIndexedQuery(f, db, results, k, matchType, *options);
+    }
+
+    if ((options != NULL) && (options->matrix != NULL) && (options->backend == MATCH_BACKEND_EXHAUSTIVE) &&
+        ((matchType == 1) || (matchType == 2)) && performMatrixQuery(f, *options->matrix, results, k, matchType, *options)) {
+        return true;
+    }
+
+    vector<int> items(db.size());
+
+    for (unsigned int i=0; i<db.size(); i++) {
+        items[i] = i;
+    }
+
+    return rankItems(f, db, items, results, k, matchType, options);
+}
+
+// Order verified results by inliers.  The sort is stable, so ties keep
+// their descriptor score order.
+static bool moreInliers(const QueryResult &a, const QueryResult &b) {
+    return a.inliers > b.inliers;
+}
+
+// Verify the matches of query results against a homography and re-rank
+// them by inlier count.  The results are verified in parallel, and
+// results without matches are matched first.
+void verifyResults(const FeatureSet &f, const ImageDatabase &db, vector<QueryResult> &results, int matchType, const MatchOptions &queryOptions) {
+    MatchOptions exact;
+    const MatchOptions &options = *itemOptions(&queryOptions, exact);
+
+    ThreadPool::shared().parallel_for(results.size(), [&](int r) {
+        QueryResult &result = results[r];
+        FeatureSet temp;
+        shared_ptr<const FeatureSet> pinned;
+        double h[9];
+        double score;
+
+        result.inliers = 0;
+
+        const FeatureSet *features = itemFeatures(db, result.index, temp, pinned);
+
+        if (features == NULL) {
+            return;
+        }
+
+        if (result.matches.empty() && !matchFeatures(f, *features, result.matches, score, matchType, &options)) {
+            return;
+        }
+
+        result.inliers = estimateHomography(f, *features, result.matches, h, NULL, options.verification);
+    }, options.numThreads);
+
+    stable_sort(results.begin(), results.end(), moreInliers);
+}
+
+// Perform a query on the database, returning the k best matching images
+// in order.  With verification, the verifyTop best images by descriptor
+// score are re-ranked by inliers, and the k best of those are kept.  An
+// LSH query needs a database index in the options, built once with
+// LSHIndex::build, and matches the images it proposes exactly.
+bool performQuery(const FeatureSet &f, const ImageDatabase &db, vector<QueryResult> &results, int k, int matchType, const MatchOptions *queryOptions) {
+    results.clear();
+
+    if ((queryOptions != NULL) && (queryOptions->backend == MATCH_BACKEND_LSH) && (queryOptions->index == NULL)) {
+        return false;
+    }
+
+    MatchOptions exact;
+    const MatchOptions *options = itemOptions(queryOptions, exact);
+    int verifyTop = (options != NULL) ? options->verifyTop : 0;
+
+    if (!rankQuery(f, db, results, max(k, verifyTop), matchType, options)) {
+        return false;
+    }
+
+    // A query out of time keeps its descriptor ranking unverified.
+    if ((verifyTop > 0) && !queryExpired(options->token)) {
+        verifyResults(f, db, results, matchType, *options);
+    }
+
+    if ((int) results.size() > max(k, 0)) {
+        results.resize(max(k, 0));
+    }
+
+    return true;
+}
+
 // Perform a query on the database.  This simply runs matchFeatures on
 // each image in the database, and returns the feature set of the best
 // matching image.
-bool performQuery(const FeatureSet &f, const ImageDatabase &db, int &bestIndex, vector<FeatureMatch> &bestMatches, double &bestScore, int matchType) {
+bool performQuery(const FeatureSet &f, const ImageDatabase &db, int &bestIndex, vector<FeatureMatch> &bestMatches, double &bestScore, int matchType, const MatchOptions *options) {
+    vector<QueryResult> results;
+
     // Here's a nice low number.
     bestScore = -1e100;
 
-    vector<FeatureMatch> tempMatches;
-    double tempScore;
-
-    for (unsigned int i=0; i<db.size(); i++) {
-        if (!matchFeatures(f, db[i].features, tempMatches, tempScore, matchType)) {
-            return false;
-        }
+    if (!performQuery(f, db, results, 1, matchType, options)) {
+        return false;
+    }
 
-        if (tempScore > bestScore) {
-            bestIndex = i;
-            bestScore = tempScore;
-            bestMatches = tempMatches;
-        }
+    if (!results.empty()) {
+        bestIndex = results[0].index;
+        bestScore = results[0].score;
+        bestMatches.swap(results[0].matches);
     }
 
     return true;
 }
 
 // Match one feature set with another.
-bool matchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType) {
+bool matchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, const MatchOptions *options) {
     // TODO: We have given you the ssd matching function, you must write your own
     // feature matching function for the ratio test.
-        
-    printf("\nMatching features now.......\n");
+
+    if ((options != NULL) && queryExpired(options->token)) {
+        return false;
+    }
+
+    if ((options != NULL) && (options->homography != NULL) && ((matchType == 1) || (matchType == 2))) {
+        return guidedMatchFeatures(f1, f2, matches, totalScore, matchType, options->homography, options->searchRadius);
+    }
+
+    if ((options != NULL) && ((options->orientationTolerance > 0) || (options->scaleTolerance > 0)) &&
+        ((matchType == 1) || (matchType == 2))) {
+        return prunedMatchFeatures(f1, f2, matches, totalScore, matchType, options->orientationTolerance, options->scaleTolerance);
+    }
+
+    // Let the planner pick how to do ssd and ratio matching.
+    if ((matchType == 1) || (matchType == 2)) {
+        MatchPlan plan = planMatch(f1.size(), f2.size(), f1.empty() ? 0 : f1[0].data.size(), matchType, options);
+
+        if (plan.plan == MATCH_PLAN_ANN) {
+            MatchOptions defaults;
+            return lshMatchFeatures(f1, f2, matches, totalScore, matchType, (options != NULL) ? *options : defaults);
+        }
+
+        if ((plan.plan == MATCH_PLAN_BLOCKED) &&
+            blockedMatchFeatures(f1, f2, matches, totalScore, matchType, (options != NULL) ? options->numThreads : 0)) {
+            return true;
+        }
+    }
 
     switch (matchType) {
     case 1:
-        printf("\nssd\n");
         ssdMatchFeatures(f1, f2, matches, totalScore);
         return true;
     case 2:
-		printf("\nration");
         ratioMatchFeatures(f1, f2, matches, totalScore);
         return true;
+    case 3:
+        crossCheckMatchFeatures(f1, f2, matches, totalScore, 0);
+        return true;
+    case 4:
+        crossCheckMatchFeatures(f1, f2, matches, totalScore, (options != NULL) ? options->ratioThreshold : 0.8);
+        return true;
     default:
         return false;
     }
@@ -232,14 +945,21 @@ void ComputeHarrisFeatures(CFloatImage &image, FeatureSet &features)
     //Create grayscale image used for Harris detection
     CFloatImage grayImage=ConvertToGray(image);
 
+    ComputeHarrisFeatures(image, grayImage, features);
+}
+
+// Write the Harris values of each image to harris.tga.
+bool dumpHarrisImage = false;
+
+// Harris feature detector, given the grayscale image.
+void ComputeHarrisFeatures(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features)
+{
     //Create image to store Harris values
     CFloatImage harrisImage(image.Shape().width,image.Shape().height,1);
 	
     //Create image to store local maximum harris values as 1, other pixels 0
     CByteImage harrisMaxImage(image.Shape().width,image.Shape().height,1);
 
-	CByteImage tmp(harrisImage.Shape());
-
     //compute Harris values puts harris values at each pixel position in harrisImage. 
     //You'll need to implement this function.
     computeHarrisValues(grayImage, harrisImage);
@@ -247,11 +967,14 @@ void ComputeHarrisFeatures(CFloatImage &image, FeatureSet &features)
     // Threshold the harris image and compute local maxima.  You'll need to implement this function.
     computeLocalMaxima(harrisImage,harrisMaxImage);
 
-    // Prints out the harris image for debugging purposes
-   
-    convertToByteImage(harrisImage, tmp);
-    WriteFile(tmp, "harris.tga");
-    
+    // Prints out the harris image for debugging purposes.  Only the
+    // interactive tool turns this on; every other caller may run the
+    // detector on several threads at once.
+    if (dumpHarrisImage) {
+        CByteImage tmp(harrisImage.Shape());
+        convertToByteImage(harrisImage, tmp);
+        WriteFile(tmp, "harris.tga");
+    }
 
     // TO DO--------------------------------------------------------------------
     //Loop through feature points in harrisMaxImage and fill in information needed for 
@@ -390,6 +1113,12 @@ void ComputeMOPSDescriptors(CFloatImage &image, FeatureSet &features)
     //Create grayscale image used for Harris detection
     CFloatImage grayImage=ConvertToGray(image);
 
+    ComputeMOPSDescriptors(image, grayImage, features);
+}
+
+// Compute MOPs descriptors, given the grayscale image.
+void ComputeMOPSDescriptors(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features)
+{
 	int w = image.Shape().width;
 	int h = image.Shape().height;
 
@@ -446,6 +1175,12 @@ void ComputeSimpleDescriptors(CFloatImage &image, FeatureSet &features)
 	//Create grayscale image used for Harris detection
     CFloatImage grayImage=ConvertToGray(image);
 
+    ComputeSimpleDescriptors(image, grayImage, features);
+}
+
+// Compute Simple descriptors, given the grayscale image.
+void ComputeSimpleDescriptors(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features)
+{
     vector<Feature>::iterator i = features.begin();
     while (i != features.end()) {
         Feature &f = *i;
@@ -511,8 +1246,6 @@ void ssdMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<Feature
         matches[i].score = -dBest;
         totalScore += matches[i].score;
     }
-    printf("score:%f\n",totalScore);
-
 }
 
 // TODO: Write this function to perform ratio feature matching.  
@@ -541,7 +1274,7 @@ void ratioMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<Featu
     for (int i=0; i<m; i++) {
         dBest = 1e100;
         idBest = 0;
-        double second_best=0;
+        double second_best=1e100;
         for (int j=0; j<n; j++) {
             d = distanceSSD(f1[i].data, f2[j].data);
 
@@ -552,6 +1285,9 @@ void ratioMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<Featu
             	idBest = f2[j].id;
 
             }
+            else if (d < second_best) {
+            	second_best = d;
+            }
         }
 
         matches[i].id1 = f1[i].id;
@@ -566,12 +1302,586 @@ void ratioMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<Featu
 
     for (int i=0; i<m; i++) {
     totalScore += matches[i].score/matches[i].second;
-    printf("score:%f\n",totalScore);
+    }
+
+}
+
 
+// Perform ssd or ratio feature matching using an LSH index over the
+// second feature set.  Only the candidates returned by the index are
+// compared with the SSD distance, so the matches are approximate.  The
+// index is trained on every call, which only pays off for one-off
+// matching of two large feature sets; database queries use a single
+// index over the whole database instead.
+bool lshMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, const MatchOptions &options) {
+    if ((matchType != 1) && (matchType != 2)) {
+        return false;
     }
 
+    // Build the index over the second feature set.
+    vector<float> samples;
+    int dim = f2.empty() ? 0 : f2[0].data.size();
+
+    for (unsigned int j=0; j<f2.size(); j++) {
+        if ((int) f2[j].data.size() == dim) {
+            samples.insert(samples.end(), f2[j].data.begin(), f2[j].data.end());
+        }
+    }
+
+    LSHIndex index;
+    index.probes = options.lshProbes;
+
+    if (!index.train(samples, dim, options.lshTables, options.lshKeyBits)) {
+        return matchFeatures(f1, f2, matches, totalScore, matchType);
+    }
+
+    index.add(0, f2);
+
+    int m = f1.size();
+    int n = f2.size();
+
+    matches.resize(m);
+    totalScore = 0;
+
+    vector<IndexCandidate> candidates;
+
+    for (int i=0; i<m; i++) {
+        double dBest = 1e100;
+        double dSecond = 1e100;
+        int idBest = 0;
+
+        index.search(f1[i].data, options.neighbours, candidates);
+
+        for (unsigned int c=0; c<candidates.size(); c++) {
+            int j = candidates[c].id - 1;
+
+            if ((j < 0) || (j >= n)) {
+                continue;
+            }
+
+            double d = distanceSSD(f1[i].data, f2[j].data);
+
+            if (d < dBest) {
+                dSecond = dBest;
+                dBest = d;
+                idBest = f2[j].id;
+            }
+            else if (d < dSecond) {
+                dSecond = d;
+            }
+        }
+
+        matches[i].id1 = f1[i].id;
+        matches[i].id2 = idBest;
+        matches[i].score = -dBest;
+        matches[i].second = -dSecond;
+
+        if (matchType == 1) {
+            totalScore += matches[i].score;
+        }
+        else {
+            totalScore += matches[i].score / matches[i].second;
+        }
+    }
+
+    return true;
+}
+
+// Perform feature matching guided by a homography.  The features of f2
+// are bucketed by position in a uniform grid whose cells are about the
+// search radius across, and each feature of f1 is projected into f2
+// with the homography and compared only against the features of the
+// cells around its projection that lie within the radius.  Features of
+// f1 with no candidate in range are left unmatched.  Only ssd and ratio
+// matching are supported.
+bool guidedMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, const double h[9], double radius) {
+    int m = f1.size();
+    int n = f2.size();
+
+    matches.clear();
+    totalScore = 0;
+
+    if (((matchType != 1) && (matchType != 2)) || (radius <= 0)) {
+        return false;
+    }
+
+    if ((m == 0) || (n == 0)) {
+        return true;
+    }
+
+    // Size the grid to the extent of f2, coarsening it if the cells
+    // would far outnumber the features.
+    int minX = f2[0].x, maxX = f2[0].x;
+    int minY = f2[0].y, maxY = f2[0].y;
+
+    for (int j=1; j<n; j++) {
+        minX = min(minX, f2[j].x);
+        maxX = max(maxX, f2[j].x);
+        minY = min(minY, f2[j].y);
+        maxY = max(maxY, f2[j].y);
+    }
+
+    double cell = max(radius, 1.0);
+    int cols, rows;
+
+    for (;;) {
+        cols = (int) ((maxX - minX) / cell) + 1;
+        rows = (int) ((maxY - minY) / cell) + 1;
+
+        if ((double) cols * rows <= 4.0 * n + 16) {
+            break;
+        }
+
+        cell *= 2;
+    }
+
+    // Counting sort of the features into their cells: the features of
+    // cell c are cellItems[cellStart[c] .. cellStart[c+1]).
+    vector<int> cellOf(n);
+    vector<int> cellStart(cols * rows + 1, 0);
+    vector<int> cellItems(n);
+
+    for (int j=0; j<n; j++) {
+        int cx = (int) ((f2[j].x - minX) / cell);
+        int cy = (int) ((f2[j].y - minY) / cell);
+        cellOf[j] = cy * cols + cx;
+        cellStart[cellOf[j] + 1]++;
+    }
+
+    for (int c=0; c<cols*rows; c++) {
+        cellStart[c+1] += cellStart[c];
+    }
+
+    vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+
+    for (int j=0; j<n; j++) {
+        cellItems[fill[cellOf[j]]++] = j;
+    }
+
+    // Project all of f1 at once.
+    vector<float> x(m), y(m), px(m), py(m);
+
+    for (int i=0; i<m; i++) {
+        x[i] = (float) f1[i].x;
+        y[i] = (float) f1[i].y;
+    }
+
+    applyHomography(h, &x[0], &y[0], m, &px[0], &py[0]);
+
+    double r2 = radius * radius;
+
+    for (int i=0; i<m; i++) {
+        // Skip points the homography sends to infinity or off the grid.
+        if (!(fabs(px[i]) < 1e7) || !(fabs(py[i]) < 1e7)) {
+            continue;
+        }
+
+        int cx0 = max((int) floor((px[i] - radius - minX) / cell), 0);
+        int cx1 = min((int) floor((px[i] + radius - minX) / cell), cols - 1);
+        int cy0 = max((int) floor((py[i] - radius - minY) / cell), 0);
+        int cy1 = min((int) floor((py[i] + radius - minY) / cell), rows - 1);
+
+        double dBest = 1e100;
+        double dSecond = 1e100;
+        int idBest = 0;
+
+        for (int cy=cy0; cy<=cy1; cy++) {
+            for (int cx=cx0; cx<=cx1; cx++) {
+                int c = cy * cols + cx;
+
+                for (int k=cellStart[c]; k<cellStart[c+1]; k++) {
+                    const Feature &g = f2[cellItems[k]];
+                    double dx = g.x - px[i];
+                    double dy = g.y - py[i];
+
+                    if (dx*dx + dy*dy > r2) {
+                        continue;
+                    }
+
+                    double d = distanceSSD(f1[i].data, g.data);
+
+                    if (d < dBest) {
+                        dSecond = dBest;
+                        dBest = d;
+                        idBest = g.id;
+                    }
+                    else if (d < dSecond) {
+                        dSecond = d;
+                    }
+                }
+            }
+        }
+
+        if (idBest == 0) {
+            continue;
+        }
+
+        FeatureMatch match;
+        match.id1 = f1[i].id;
+        match.id2 = idBest;
+        match.score = -dBest;
+        match.second = -dSecond;
+        matches.push_back(match);
+
+        if (matchType == 1) {
+            totalScore += match.score;
+        }
+        else {
+            totalScore += match.score / match.second;
+        }
+    }
+
+    return true;
 }
 
+// Largest number of orientation or scale bins used by pruned matching.
+static const int maxPruningBins = 64;
+
+// Find the orientation bin of an angle, with bins of the given width
+// covering [0, 2 pi).
+static int orientationBin(double angle, double width, int bins) {
+    double a = fmod(angle, 2 * PI);
+
+    if (a < 0) {
+        a += 2 * PI;
+    }
+
+    return min((int) (a / width), bins - 1);
+}
+
+// Compute the difference between two angles, in [0, pi].
+static double angleDifference(double a, double b) {
+    double d = fabs(fmod(a - b, 2 * PI));
+    return (d > PI) ? 2 * PI - d : d;
+}
+
+// Perform feature matching that only compares features of compatible
+// orientation and scale.  The features of f2 are sorted into bins of
+// orientation and log scale as wide as the tolerances, so each feature
+// of f1 only visits the bins within tolerance of its own.  A tolerance
+// of 0 turns off pruning along that axis, and scaleTolerance is the
+// largest allowed ratio of the larger scale to the smaller.  Features
+// of f1 with no compatible feature are left unmatched.  Only ssd and
+// ratio matching are supported.
+bool prunedMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, double orientationTolerance, double scaleTolerance) {
+    int m = f1.size();
+    int n = f2.size();
+
+    matches.clear();
+    totalScore = 0;
+
+    if ((matchType != 1) && (matchType != 2)) {
+        return false;
+    }
+
+    if ((m == 0) || (n == 0)) {
+        return true;
+    }
+
+    bool pruneAngle = (orientationTolerance > 0) && (orientationTolerance < PI);
+    bool pruneScale = (scaleTolerance > 1);
+
+    // Orientation bins cover the circle; scale bins cover the range of
+    // log scales in f2.
+    double angleWidth = 2 * PI;
+    int angleBins = 1;
+
+    if (pruneAngle) {
+        angleBins = min(max((int) (2 * PI / orientationTolerance), 1), maxPruningBins);
+        angleWidth = 2 * PI / angleBins;
+    }
+
+    double logTolerance = pruneScale ? log(scaleTolerance) : 0;
+    double minLog = 0, maxLog = 0;
+    int scaleBins = 1;
+
+    vector<double> logScale2(n);
+
+    for (int j=0; j<n; j++) {
+        logScale2[j] = log(max(f2[j].scale, 1e-6));
+        minLog = (j == 0) ? logScale2[j] : min(minLog, logScale2[j]);
+        maxLog = (j == 0) ? logScale2[j] : max(maxLog, logScale2[j]);
+    }
+
+    if (pruneScale) {
+        scaleBins = min((int) ((maxLog - minLog) / logTolerance) + 1, maxPruningBins);
+    }
+
+    double scaleWidth = pruneScale ? max((maxLog - minLog) / scaleBins, logTolerance) : 1;
+
+    // Counting sort of f2 into the bins.
+    vector<int> binOf(n);
+    vector<int> binStart(angleBins * scaleBins + 1, 0);
+    vector<int> binItems(n);
+
+    for (int j=0; j<n; j++) {
+        int a = pruneAngle ? orientationBin(f2[j].angleRadians, angleWidth, angleBins) : 0;
+        int b = pruneScale ? min((int) ((logScale2[j] - minLog) / scaleWidth), scaleBins - 1) : 0;
+        binOf[j] = b * angleBins + a;
+        binStart[binOf[j] + 1]++;
+    }
+
+    for (int c=0; c<angleBins*scaleBins; c++) {
+        binStart[c+1] += binStart[c];
+    }
+
+    vector<int> fill(binStart.begin(), binStart.end() - 1);
+
+    for (int j=0; j<n; j++) {
+        binItems[fill[binOf[j]]++] = j;
+    }
+
+    // The neighbouring orientation bins that can hold a compatible
+    // feature, each visited once even when the span wraps around.
+    int angleSpan = pruneAngle ? min((int) ceil(orientationTolerance / angleWidth), angleBins / 2) : 0;
+
+    for (int i=0; i<m; i++) {
+        const Feature &f = f1[i];
+        double logScale = log(max(f.scale, 1e-6));
+        int a0 = pruneAngle ? orientationBin(f.angleRadians, angleWidth, angleBins) : 0;
+        int b0 = 0, b1 = 0;
+
+        if (pruneScale) {
+            b0 = max((int) floor((logScale - logTolerance - minLog) / scaleWidth), 0);
+            b1 = min((int) floor((logScale + logTolerance - minLog) / scaleWidth), scaleBins - 1);
+        }
+
+        double dBest = 1e100;
+        double dSecond = 1e100;
+        int idBest = 0;
+
+        for (int b=b0; b<=b1; b++) {
+            for (int da=-angleSpan; da<=angleSpan; da++) {
+                if (da + angleSpan >= angleBins) {
+                    break;
+                }
+
+                int c = b * angleBins + (a0 + da + angleBins) % angleBins;
+
+                for (int k=binStart[c]; k<binStart[c+1]; k++) {
+                    int j = binItems[k];
+
+                    if ((pruneAngle && (angleDifference(f.angleRadians, f2[j].angleRadians) > orientationTolerance)) ||
+                        (pruneScale && (fabs(logScale - logScale2[j]) > logTolerance))) {
+                        continue;
+                    }
+
+                    double d = distanceSSD(f.data, f2[j].data);
+
+                    if (d < dBest) {
+                        dSecond = dBest;
+                        dBest = d;
+                        idBest = f2[j].id;
+                    }
+                    else if (d < dSecond) {
+                        dSecond = d;
+                    }
+                }
+            }
+        }
+
+        if (idBest == 0) {
+            continue;
+        }
+
+        FeatureMatch match;
+        match.id1 = f.id;
+        match.id2 = idBest;
+        match.score = -dBest;
+        match.second = -dSecond;
+        matches.push_back(match);
+
+        if (matchType == 1) {
+            totalScore += match.score;
+        }
+        else {
+            totalScore += match.score / match.second;
+        }
+    }
+
+    return true;
+}
+
+// Reduce the squared distances between rows [a0, a1) of a and all the
+// rows of b: for each row of a, its best and second best distances and
+// the row of b of the best, and, if colBest is not NULL, for each row of
+// b its best distance and the row of a.  The distances are computed a
+// tile at a time, so the rows of a stay in cache while b streams
+// through.  The column results are only complete if [a0, a1) covers a.
+static void reduceRows(const DescriptorMatrix &a, int a0, int a1, const DescriptorMatrix &b, float *rowBest, float *rowSecond, int *rowArg, float *colBest, int *colArg) {
+    vector<float> tile(matrixQueryBlock * matrixRowBlock);
+
+    for (int i=a0; i<a1; i++) {
+        rowBest[i] = FLT_MAX;
+        rowSecond[i] = FLT_MAX;
+        rowArg[i] = -1;
+    }
+
+    for (int r0=0; r0<b.rows; r0+=matrixRowBlock) {
+        int r1 = min(r0 + matrixRowBlock, b.rows);
+
+        for (int q0=a0; q0<a1; q0+=matrixQueryBlock) {
+            int q1 = min(q0 + matrixQueryBlock, a1);
+
+            squaredDistanceBlock(a, q0, q1, b, r0, r1, &tile[0], matrixRowBlock);
+
+            for (int i=q0; i<q1; i++) {
+                const float *t = &tile[(i-q0)*matrixRowBlock];
+
+                for (int j=r0; j<r1; j++) {
+                    float d = t[j-r0];
+
+                    if (d < rowBest[i]) {
+                        rowSecond[i] = rowBest[i];
+                        rowBest[i] = d;
+                        rowArg[i] = j;
+                    }
+                    else if (d < rowSecond[i]) {
+                        rowSecond[i] = d;
+                    }
+
+                    if ((colBest != NULL) && (d < colBest[j])) {
+                        colBest[j] = d;
+                        colArg[j] = i;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Perform ssd or ratio feature matching with blocked distance
+// computation.  The descriptors are packed into two matrices and the
+// rows of f1 are split among the worker threads, each of which reduces
+// its rows against f2 with the SIMD distance kernel.  The results are
+// those of ssdMatchFeatures and ratioMatchFeatures, up to float
+// rounding.  Fails if the descriptors can't be packed.
+bool blockedMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, int numThreads) {
+    DescriptorMatrix a;
+    DescriptorMatrix b;
+
+    if (((matchType != 1) && (matchType != 2)) || !a.build(f1) || !b.build(f2) ||
+        ((a.rows > 0) && (b.rows > 0) && (a.dim != b.dim))) {
+        return false;
+    }
+
+    int m = a.rows;
+
+    vector<float> rowBest(m + 1);
+    vector<float> rowSecond(m + 1);
+    vector<int> rowArg(m + 1);
+
+    int chunks = (m + matrixQueryBlock - 1) / matrixQueryBlock;
+
+    ThreadPool::shared().parallel_for(chunks, [&](int c) {
+        reduceRows(a, c * matrixQueryBlock, min((c + 1) * matrixQueryBlock, m), b,
+                   &rowBest[0], &rowSecond[0], &rowArg[0], NULL, NULL);
+    }, numThreads);
+
+    matches.resize(m);
+    totalScore = 0;
+
+    for (int i=0; i<m; i++) {
+        matches[i].id1 = f1[i].id;
+        matches[i].id2 = (rowArg[i] < 0) ? 0 : b.ids[rowArg[i]];
+        matches[i].score = -reducedDistance(rowBest[i]);
+        matches[i].second = -reducedDistance(rowSecond[i]);
+
+        if (matchType == 1) {
+            totalScore += matches[i].score;
+        }
+        else {
+            totalScore += matches[i].score / matches[i].second;
+        }
+    }
+
+    return true;
+}
+
+// Perform mutual nearest neighbour (cross-check) matching.  A pair of
+// features is matched only if each is the other's closest feature.  The
+// distances are computed once, while tracking the best and second best
+// of every row and the best of every column, so this costs one pass
+// instead of matching in both directions.  If ratioThreshold is
+// positive, mutual matches whose best to second best distance ratio
+// exceeds it are dropped as well.
+void crossCheckMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, double ratioThreshold) {
+    int m = f1.size();
+    int n = f2.size();
+
+    matches.clear();
+    totalScore = 0;
+
+    if ((m == 0) || (n == 0)) {
+        return;
+    }
+
+    vector<float> rowBest(m, FLT_MAX);
+    vector<float> rowSecond(m, FLT_MAX);
+    vector<int> rowArg(m, -1);
+    vector<float> colBest(n, FLT_MAX);
+    vector<int> colArg(n, -1);
+
+    DescriptorMatrix a;
+    DescriptorMatrix b;
+
+    if (a.build(f1) && b.build(f2) && (a.dim == b.dim)) {
+        reduceRows(a, 0, m, b, &rowBest[0], &rowSecond[0], &rowArg[0], &colBest[0], &colArg[0]);
+    }
+    else {
+        // The descriptor lengths differ, so fall back to the scalar
+        // distance, which handles that case.
+        for (int i=0; i<m; i++) {
+            for (int j=0; j<n; j++) {
+                double dd = distanceSSD(f1[i].data, f2[j].data);
+                float d = (float) min(dd * dd, (double) FLT_MAX);
+
+                if (d < rowBest[i]) {
+                    rowSecond[i] = rowBest[i];
+                    rowBest[i] = d;
+                    rowArg[i] = j;
+                }
+                else if (d < rowSecond[i]) {
+                    rowSecond[i] = d;
+                }
+
+                if (d < colBest[j]) {
+                    colBest[j] = d;
+                    colArg[j] = i;
+                }
+            }
+        }
+    }
+
+    for (int i=0; i<m; i++) {
+        int j = rowArg[i];
+
+        if ((j < 0) || (colArg[j] != i)) {
+            continue;
+        }
+
+        double dBest = reducedDistance(rowBest[i]);
+        double dSecond = reducedDistance(rowSecond[i]);
+
+        if ((ratioThreshold > 0) && (dBest >= ratioThreshold * dSecond)) {
+            continue;
+        }
+
+        FeatureMatch match;
+        match.id1 = f1[i].id;
+        match.id2 = f2[j].id;
+        match.score = -dBest;
+        match.second = -dSecond;
+        matches.push_back(match);
+
+        if (ratioThreshold > 0) {
+            totalScore += match.score / match.second;
+        }
+        else {
+            totalScore += match.score;
+        }
+    }
+}
 
 // Convert Fl_Image to CFloatImage.
 bool convertImage(const Fl_Image *image, CFloatImage &convertedImage) {
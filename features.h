@@ -3,8 +3,12 @@
 
 #include "ImageLib/ImageLib.h"
 #include "ImageDatabase.h"
+#include "Homography.h"
 
 class Fl_Image;
+class DescriptorIndex;
+class DescriptorMatrix;
+class QueryToken;
 
 //5x5 Gaussian
 const double gaussian5x5[25] = {0.003663, 0.014652,  0.025641,  0.014652,  0.003663, 
@@ -29,6 +33,111 @@ struct ROCPoint
 	double falseRate;
 };
 
+// Matcher backends for MatchOptions::backend.
+enum {
+	MATCH_BACKEND_EXHAUSTIVE = 0,
+	MATCH_BACKEND_LSH = 1
+};
+
+// Matching plans for MatchOptions::plan: let the planner choose, scalar
+// loops, blocked SIMD distance matrices, or an LSH index.
+enum {
+	MATCH_PLAN_AUTO = 0,
+	MATCH_PLAN_BRUTE = 1,
+	MATCH_PLAN_BLOCKED = 2,
+	MATCH_PLAN_ANN = 3
+};
+
+// MatchOptions holds optional settings for matchFeatures and
+// performQuery.  Passing NULL gives the default exhaustive behaviour.
+struct MatchOptions
+{
+	// Backend used by matchFeatures to find candidate matches.  An LSH
+	// performQuery needs index to be set to an LSHIndex over the
+	// database.
+	int backend;
+
+	// Plan used by ssd and ratio matching, or MATCH_PLAN_AUTO to pick
+	// the plan with the lowest predicted cost.
+	int plan;
+
+	// Let the planner pick the approximate LSH plan when matching an
+	// image pair.
+	bool approximate;
+
+	// Number of hash tables, key bits and extra probes per table used
+	// by the LSH backend.
+	int lshTables;
+	int lshKeyBits;
+	int lshProbes;
+
+	// Largest best to second best distance ratio kept by mutual ratio
+	// matching (match type 4).
+	double ratioThreshold;
+
+	// Number of threads used by performQuery, or 0 for all cores.
+	int numThreads;
+
+	// Concatenated descriptors of the database, or NULL.  When set,
+	// ssd and ratio queries make a single pass over this matrix.
+	const DescriptorMatrix *matrix;
+
+	// Index used to generate candidate database images, or NULL to
+	// match against every image.
+	const DescriptorIndex *index;
+
+	// Number of index neighbours retrieved for each query feature.
+	// This is also the number of LSH candidates compared exactly.
+	int neighbours;
+
+	// Number of candidate images kept from the index votes.
+	int shortlist;
+
+	// Re-rank the shortlist by matching the full descriptors, loading
+	// them from disk if they are not resident.
+	bool rerank;
+
+	// Number of top images re-ranked by the number of matches
+	// consistent with a homography, or 0 for no verification.
+	int verifyTop;
+
+	// Settings of the homography estimation used for verification.
+	HomographyOptions verification;
+
+	// Known or predicted homography from the first feature set to the
+	// second, or NULL.  When set, ssd and ratio matching only compare
+	// features that it maps to within searchRadius pixels of each other.
+	const double *homography;
+	double searchRadius;
+
+	// Largest orientation difference (radians) and ratio of scales of
+	// the features compared by ssd and ratio matching, or 0 to compare
+	// features of every orientation or scale.
+	double orientationTolerance;
+	double scaleTolerance;
+
+	// Token that stops a query early, or NULL.  A query stopped by its
+	// deadline or by cancellation returns the best images among those
+	// it got to, and marks the token as partial.
+	QueryToken *token;
+
+	MatchOptions();
+};
+
+// A QueryResult is one of the ranked database images returned by
+// performQuery, with its score and feature matches.  If the image was
+// geometrically verified, inliers is the number of matches consistent
+// with the estimated homography; otherwise it is -1.
+struct QueryResult
+{
+	int index;
+	double score;
+	int inliers;
+	vector<FeatureMatch> matches;
+
+	QueryResult();
+};
+
 
 // Compute harris values of an image.
 void computeHarrisValues(CFloatImage &srcImage,CFloatImage &destImage);
@@ -39,11 +148,37 @@ void computeLocalMaxima(CFloatImage &srcImage,CByteImage &destImage);
 // Compute features of an image.
 bool computeFeatures(CFloatImage &image, FeatureSet &features, int featureType, int descriptorType);
 
-// Perform a query on the database.
-bool performQuery(const FeatureSet &f1, const ImageDatabase &db, int &bestIndex, vector<FeatureMatch> &bestMatches, double &bestScore, int matchType);
+// The two steps of computeFeatures, for callers that run them apart.
+// Both take the grayscale version of the image as well, so it is only
+// converted once; describeFeatures also numbers the features in order.
+bool detectFeatures(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features, int featureType);
+bool describeFeatures(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features, int descriptorType);
 
-// Match one feature set with another.
-bool matchFeatures(const FeatureSet &f, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType);
+// Perform a query on the database.
+bool performQuery(const FeatureSet &f1, const ImageDatabase &db, int &bestIndex, vector<FeatureMatch> &bestMatches, double &bestScore, int matchType, const MatchOptions *options = NULL);
+
+// Perform a query on the database, returning the k best images in order.
+// If options->verifyTop is set, that many top images are verified and
+// re-ranked by their homography inliers before the k best are kept.
+// With options->token, images are matched in order of priority (index
+// votes, or database order without an index) until the token expires.
+// The LSH backend fails without options->index, and single images are
+// always matched exactly rather than through a per-image LSH index.
+bool performQuery(const FeatureSet &f1, const ImageDatabase &db, vector<QueryResult> &results, int k, int matchType, const MatchOptions *options = NULL);
+
+// Perform a batch of queries against a concatenated database matrix,
+// returning the k best images for each query in order.
+bool performBatchQuery(const vector<FeatureSet> &queries, const DescriptorMatrix &db, vector< vector<QueryResult> > &results, int k, int matchType, const MatchOptions *options = NULL);
+
+// Verify the matches of query results against a homography and re-rank
+// them by inlier count, best first.
+void verifyResults(const FeatureSet &f, const ImageDatabase &db, vector<QueryResult> &results, int matchType, const MatchOptions &options);
+
+// Match one feature set with another.  The match types are 1 (ssd),
+// 2 (ratio), 3 (mutual nearest neighbours) and 4 (mutual nearest
+// neighbours passing the ratio test).  If options->token has already
+// expired, nothing is matched and false is returned.
+bool matchFeatures(const FeatureSet &f, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, const MatchOptions *options = NULL);
 
 // Add ROC curve data to the data vector
 void addRocData(const FeatureSet &f1, const FeatureSet &f2, const vector<FeatureMatch> &matches, double h[9],vector<bool> &isMatch,double threshold,double &maxD);
@@ -54,14 +189,21 @@ double evaluateMatch(const FeatureSet &f1, const FeatureSet &f2, const vector<Fe
 // Silly example feature detector
 void dummyComputeFeatures(CFloatImage &image, FeatureSet &features);
 
+// Whether the Harris detector writes the Harris values of each image to
+// harris.tga, for debugging.  Off by default.
+extern bool dumpHarrisImage;
+
 // Harris feature detector
 void ComputeHarrisFeatures(CFloatImage &image, FeatureSet &features);
+void ComputeHarrisFeatures(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features);
 
 // Compute Simple descriptors
 void ComputeSimpleDescriptors(CFloatImage &image, FeatureSet &features);
+void ComputeSimpleDescriptors(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features);
 
 // Compute MOPS descriptors
 void ComputeMOPSDescriptors(CFloatImage &image, FeatureSet &features);
+void ComputeMOPSDescriptors(CFloatImage &image, CFloatImage &grayImage, FeatureSet &features);
 
 // Compute Custom descriptors
 void ComputeCustomDescriptors(CFloatImage &image, FeatureSet &features);
@@ -72,6 +214,24 @@ void ssdMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<Feature
 // Perform ratio feature matching.  You must implement this.
 void ratioMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore);
 
+// Perform ssd or ratio feature matching with blocked distance matrices.
+bool blockedMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, int numThreads);
+
+// Perform mutual nearest neighbour matching, optionally with a ratio test.
+void crossCheckMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, double ratioThreshold);
+
+// Perform ssd or ratio feature matching guided by a homography.
+bool guidedMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, const double h[9], double radius);
+
+// Perform ssd or ratio feature matching between features of compatible
+// orientation and scale.
+bool prunedMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, double orientationTolerance, double scaleTolerance);
+
+// Perform ssd or ratio feature matching against LSH candidates.  This
+// trains an index over f2 on every call, so it is meant for one-off
+// matching of an image pair, not for matching database images.
+bool lshMatchFeatures(const FeatureSet &f1, const FeatureSet &f2, vector<FeatureMatch> &matches, double &totalScore, int matchType, const MatchOptions &options);
+
 // Convert Fl_Image to CFloatImage.
 bool convertImage(const Fl_Image *image, CFloatImage &convertedImage);
 